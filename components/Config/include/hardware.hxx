@@ -314,6 +314,18 @@ GPIO_PIN(OLCB_DCC_ENABLE, GpioOutputSafeLow, CONFIG_DCC_OLCB_ENABLE_PIN);
 typedef DummyPin OLCB_DCC_ENABLE_Pin;
 #endif //  CONFIG_DCC_OLCB_ENABLE_PIN
 
+#if CONFIG_PROG_TRACK_SIGNAL_ENABLED
+/// PROG track DCC signal pin.
+GPIO_PIN(PROG_DCC_SIGNAL, GpioOutputSafeLow, CONFIG_PROG_TRACK_SIGNAL_PIN);
+#else
+/// Fake PROG track DCC signal pin since it is shared with the OPS track.
+typedef DummyPin PROG_DCC_SIGNAL_Pin;
+#endif // CONFIG_PROG_TRACK_SIGNAL_ENABLED
+
+/// PROG track RailCom detector enable pin, RailCom is not supported on the
+/// PROG track but the API requires a pin to be declared regardless.
+typedef DummyPin PROG_RAILCOM_TRIGGER_Pin;
+
 /// OpenLCB RailCom detector enable pin.
 /// For the ESP32CSPCB this is shared with OPS as a single unified detector
 /// however the API requires a pin to be declared regardless.
@@ -431,7 +443,7 @@ typedef GpioInitializer<OLED_RESET_Pin, RAILCOM_TRIGGER_Pin, RAILCOM_SHORT_Pin,
                         OPS_CURRENT_SENSE_Pin, PROG_CURRENT_SENSE_Pin,
                         THERMAL_SENSOR_Pin, BOOTLOADER_BUTTON_Pin,
                         OLCB_DCC_ENABLE_Pin, OLCB_RAILCOM_TRIGGER_Pin,
-                        I2C_ADC_ALERT_Pin> GpioInit;
+                        I2C_ADC_ALERT_Pin, PROG_DCC_SIGNAL_Pin> GpioInit;
 
 /// RailCom hardware definition
 struct RailComHwDefs
@@ -513,7 +525,8 @@ struct RailComHwDefs
 
   /// Number of microseconds to wait for railcom data on channel 2.
   static constexpr uint32_t RAILCOM_MAX_READ_DELAY_CH_2 =
-    454 - RAILCOM_MAX_READ_DELAY_CH_1 - RAILCOM_STOP_DELAY_USEC;
+    454 - RAILCOM_START_PHASE1_DELAY_USEC - RAILCOM_START_PHASE2_DELAY_USEC -
+    RAILCOM_MAX_READ_DELAY_CH_1;
 }; // RailComHwDefs
 
 struct DccHwDefs
@@ -617,12 +630,75 @@ struct DccHwDefs
                     RailComHwDefs::RAILCOM_START_PHASE1_DELAY_USEC,
                     RailComHwDefs::RAILCOM_START_PHASE2_DELAY_USEC,
                     RailComHwDefs::RAILCOM_STOP_DELAY_USEC>;
+#if CONFIG_PROG_TRACK_SIGNAL_ENABLED
+  /// PROG track booster output.
+  using ProgBoosterOutput =
+    DccOutputHwReal<DccOutput::PGM, PROG_ENABLE_Pin, PROG_RAILCOM_TRIGGER_Pin,
+                    0, 0, 0>;
+#else
   /// Fake output hardware for program track.
   using ProgBoosterOutput = DccOutputHwDummy<DccOutput::PGM>;
+#endif // CONFIG_PROG_TRACK_SIGNAL_ENABLED
   /// OpenLCB Booster output.
   using OpenLCBBoosterOutput =
     DccOutputHwReal<DccOutput::LCC, OLCB_DCC_ENABLE_Pin,
                     OLCB_RAILCOM_TRIGGER_Pin, 0, 0, 0>;
 }; // DccHwDefs
 
+#if CONFIG_PROG_TRACK_SIGNAL_ENABLED
+/// PROG track DCC signal definition, used when the PROG track has a dedicated
+/// signal pin.
+struct ProgDccHwDefs
+{
+  /// DCC signal output pin.
+  using DCC_SIGNAL_Pin = ::PROG_DCC_SIGNAL_Pin;
+  static constexpr gpio_num_t DCC_SIGNAL_PIN_NUM =
+    (gpio_num_t)CONFIG_PROG_TRACK_SIGNAL_PIN;
+
+  /// The number of preamble bits to send exclusive of end of packet '1' bit,
+  /// all packets on the PROG track use the service mode preamble.
+  static constexpr uint32_t DCC_PREAMBLE_BITS = CONFIG_PROG_DCC_PREAMBLE_BITS;
+
+  /// The number of preamble bits to send exclusive of end of packet '1' bit
+  /// for service mode DCC packets.
+  static constexpr uint32_t DCC_SERVICE_MODE_PREAMBLE_BITS =
+    CONFIG_PROG_DCC_PREAMBLE_BITS;
+
+  /// Number of RMT ticks for each half of the RMT encoded ZERO bit.
+  static constexpr uint8_t DCC_ZERO_RMT_TICKS =
+    DccHwDefs::DCC_ZERO_RMT_TICKS;
+
+  /// Number of RMT ticks for each half of the RMT encoded ONE bit.
+  static constexpr uint8_t DCC_ONE_RMT_TICKS = DccHwDefs::DCC_ONE_RMT_TICKS;
+
+  /// RMT Channel to use for the DCC Signal output.
+  ///
+  /// NOTE: The OPS track RMT channel may use the memory blocks of the next
+  /// two channels so this must be at least three channels after it.
+  static const rmt_channel_t RMT_CHANNEL = RMT_CHANNEL_3;
+
+  /// Visual name of the DCC Wave pattern.
+  static constexpr const char * const RMT_WAVE_FMT = DccHwDefs::RMT_WAVE_FMT;
+
+  /// Voltage to output on the signal pin for the first half of the DCC signal
+  /// wave pattern.
+  static constexpr uint8_t RMT_DCC_FIRST_HALF = DccHwDefs::RMT_DCC_FIRST_HALF;
+
+  /// Voltage to output on the signal pin for the second half of the DCC
+  /// signal wave pattern.
+  static constexpr uint8_t RMT_DCC_SECOND_HALF =
+    DccHwDefs::RMT_DCC_SECOND_HALF;
+
+  /// RMT Clock configuration.
+  static constexpr rmt_source_clk_t RMT_CLOCK_SOURCE =
+    DccHwDefs::RMT_CLOCK_SOURCE;
+
+  /// Number of outgoing DCC packets to allow in the queue.
+  static const size_t PACKET_Q_SIZE = CONFIG_PACKET_QUEUE_SIZE;
+
+  /// PROG track booster output.
+  using BoosterOutput = DccHwDefs::ProgBoosterOutput;
+}; // ProgDccHwDefs
+#endif // CONFIG_PROG_TRACK_SIGNAL_ENABLED
+
 #endif // HARDWARE_HXX_
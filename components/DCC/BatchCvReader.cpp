@@ -0,0 +1,221 @@
+/**********************************************************************
+ESP32 COMMAND STATION
+
+COPYRIGHT (c) 2021 Mike Dunston
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see http://www.gnu.org/licenses
+**********************************************************************/
+
+#include "BatchCvReader.hxx"
+
+#include <inttypes.h>
+#include <utils/logging.h>
+
+namespace esp32cs
+{
+
+/// Common default values from NMRA S-9.2.2, these are used as guesses when
+/// neither the request nor a previous read provides one.
+static const std::map<uint16_t, uint8_t> DEFAULT_CV_VALUES =
+{
+  {1, 3},   // Primary address
+  {19, 0},  // Consist address
+  {29, 6}   // Configuration: 28/128 speed steps, analog enabled
+};
+
+/// Maximum CV number that can be accessed in direct mode.
+static constexpr uint16_t MAX_CV_NUMBER = 1024;
+
+StateFlowBase::Action BatchCvReader::entry()
+{
+  if (request()->cvs.empty())
+  {
+    return return_ok();
+  }
+  LOG(INFO, "[BatchCV] Reading %zu CV(s)", request()->cvs.size());
+  index_ = 0;
+  pending_ = false;
+  return invoke_subflow_and_wait(backend_, STATE(service_mode_entered),
+                                 ProgrammingTrackRequest::ENTER_SERVICE_MODE);
+}
+
+StateFlowBase::Action BatchCvReader::service_mode_entered()
+{
+  auto b = get_buffer_deleter(full_allocation_result(backend_));
+  if (!start_cv())
+  {
+    return invoke_subflow_and_wait(backend_, STATE(service_mode_exited),
+                                   ProgrammingTrackRequest::EXIT_SERVICE_MODE);
+  }
+  return call_immediately(STATE(send_window));
+}
+
+StateFlowBase::Action BatchCvReader::send_window()
+{
+  return invoke_subflow_and_wait(backend_, STATE(window_done),
+                                 ProgrammingTrackRequest::SEND_RESET,
+                                 RESET_COUNT);
+}
+
+StateFlowBase::Action BatchCvReader::window_done()
+{
+  auto b = get_buffer_deleter(full_allocation_result(backend_));
+  if (pending_)
+  {
+    // the reset packets are the ACK window for the previous verify operation
+    // as well as the lead-in for the next one.
+    ack_ |= b->data()->hasAck_;
+    pending_ = false;
+    if (!process_result())
+    {
+      return invoke_subflow_and_wait(backend_, STATE(service_mode_exited),
+                                     ProgrammingTrackRequest::EXIT_SERVICE_MODE);
+    }
+  }
+  return call_immediately(STATE(send_verify));
+}
+
+StateFlowBase::Action BatchCvReader::send_verify()
+{
+  // direct mode packets use zero based CV numbers.
+  const unsigned cv_number = request()->cvs[index_] - 1;
+  dcc::Packet pkt;
+  if (verify_ == Verify::BIT)
+  {
+    pkt.set_dcc_svc_verify_bit(cv_number, bit_, true);
+  }
+  else
+  {
+    pkt.set_dcc_svc_verify_byte(cv_number, value_);
+  }
+  request()->operations++;
+  return invoke_subflow_and_wait(backend_, STATE(verify_done),
+                                 ProgrammingTrackRequest::SEND_PROGRAMMING_PACKET,
+                                 pkt, VERIFY_COUNT);
+}
+
+StateFlowBase::Action BatchCvReader::verify_done()
+{
+  auto b = get_buffer_deleter(full_allocation_result(backend_));
+  ack_ = b->data()->hasAck_;
+  pending_ = true;
+  return call_immediately(STATE(send_window));
+}
+
+StateFlowBase::Action BatchCvReader::service_mode_exited()
+{
+  auto b = get_buffer_deleter(full_allocation_result(backend_));
+  LOG(INFO, "[BatchCV] Read %zu CV(s) using %" PRIu32 " operations, %" PRIu32
+      " matched the expected value", request()->cvs.size(),
+      request()->operations, request()->guessed);
+  return return_ok();
+}
+
+bool BatchCvReader::start_cv()
+{
+  while (index_ < request()->cvs.size())
+  {
+    const uint16_t cv = request()->cvs[index_];
+    if (cv == 0 || cv > MAX_CV_NUMBER)
+    {
+      LOG_ERROR("[BatchCV] CV %d is not valid, skipping", cv);
+      finish_cv(BatchCvReadRequest::READ_FAILED);
+      continue;
+    }
+    attempts_ = 0;
+    // guesses provided by the request take precedence over values from a
+    // previous read which take precedence over the common default values.
+    const std::map<uint16_t, uint8_t> *sources[] =
+    {
+      &request()->guesses, &lastValues_, &DEFAULT_CV_VALUES
+    };
+    for (auto source : sources)
+    {
+      auto guess = source->find(cv);
+      if (guess != source->end())
+      {
+        verify_ = Verify::GUESS;
+        value_ = guess->second;
+        return true;
+      }
+    }
+    verify_ = Verify::BIT;
+    bit_ = 0;
+    value_ = 0;
+    return true;
+  }
+  return false;
+}
+
+bool BatchCvReader::process_result()
+{
+  switch (verify_)
+  {
+    case Verify::GUESS:
+      if (ack_)
+      {
+        request()->guessed++;
+        finish_cv(value_);
+        return start_cv();
+      }
+      verify_ = Verify::BIT;
+      bit_ = 0;
+      value_ = 0;
+      return true;
+    case Verify::BIT:
+      if (ack_)
+      {
+        value_ |= (1 << bit_);
+      }
+      if (++bit_ > 7)
+      {
+        verify_ = Verify::BYTE;
+      }
+      return true;
+    case Verify::BYTE:
+    default:
+      if (ack_)
+      {
+        finish_cv(value_);
+        return start_cv();
+      }
+      if (++attempts_ < MAX_ATTEMPTS)
+      {
+        LOG(WARNING, "[BatchCV] CV %d verify of %d failed, retrying",
+            request()->cvs[index_], value_);
+        verify_ = Verify::BIT;
+        bit_ = 0;
+        value_ = 0;
+        return true;
+      }
+      LOG_ERROR("[BatchCV] Unable to read CV %d", request()->cvs[index_]);
+      finish_cv(BatchCvReadRequest::READ_FAILED);
+      return start_cv();
+  }
+}
+
+void BatchCvReader::finish_cv(int16_t value)
+{
+  const uint16_t cv = request()->cvs[index_];
+  request()->values[index_] = value;
+  if (value != BatchCvReadRequest::READ_FAILED)
+  {
+    lastValues_[cv] = value;
+  }
+  if (request()->progress)
+  {
+    request()->progress(request(), index_);
+  }
+  index_++;
+}
+
+} // namespace esp32cs
\ No newline at end of file
@@ -20,13 +20,18 @@ COPYRIGHT (c) 2020-2021 Mike Dunston
 #if !CONFIG_RAILCOM_DISABLED
 #include "Esp32RailComDriver.hxx"
 #endif 
+#include "BatchCvReader.hxx"
 #include "PrioritizedUpdateLoop.hxx"
+#include "RailComDecoder.hxx"
 #include "TrackOutputDescriptor.hxx"
 #include "TrackPowerHandler.hxx"
+#include "TrackUtilization.hxx"
 #include <hardware.hxx>
 
 #include <AccessoryDecoderDatabase.hxx>
+#include <algorithm>
 #include <AllTrainNodes.hxx>
+#include <atomic>
 #include <dcc/DccOutput.hxx>
 #include <dcc/LocalTrackIf.hxx>
 #include <dcc/ProgrammingTrackBackend.hxx>
@@ -43,6 +48,7 @@ COPYRIGHT (c) 2020-2021 Mike Dunston
 #include <executor/PoolToQueueFlow.hxx>
 #include <freertos_drivers/arduino/DummyGPIO.hxx>
 #include <freertos_drivers/esp32/Esp32Gpio.hxx>
+#include <inttypes.h>
 #include <map>
 #include <openlcb/EventHandlerTemplates.hxx>
 #include <openlcb/MemoryConfig.hxx>
@@ -56,10 +62,29 @@ COPYRIGHT (c) 2020-2021 Mike Dunston
 #include <UlpAdc.hxx>
 #include <utils/GpioInitializer.hxx>
 #include <utils/logging.h>
+#include <utils/StringPrintf.hxx>
 
 namespace esp32cs
 {
 
+#if CONFIG_PROG_TRACK_SIGNAL_ENABLED
+/// Enables the PROG track output, the OPS track output is not modified since
+/// the PROG track has a dedicated signal generator.
+static void enable_programming_track()
+{
+  DccHwDefs::ProgBoosterOutput::clear_disable_reason(
+    DccOutput::DisableReason::PGM_TRACK_LOCKOUT);
+  esp32cs::start_prog_ack_detection();
+}
+
+/// Disables the PROG track output.
+static void disable_programming_track()
+{
+  esp32cs::stop_prog_ack_detection();
+  DccHwDefs::ProgBoosterOutput::set_disable_reason(
+    DccOutput::DisableReason::PGM_TRACK_LOCKOUT);
+}
+#else
 /// Disables the OPS track output and enables the PROG track output.
 static void enable_programming_track()
 {
@@ -69,11 +94,13 @@ static void enable_programming_track()
     DccOutput::DisableReason::PGM_TRACK_LOCKOUT);
 
   PROG_ENABLE_Pin::set(true);
+  esp32cs::start_prog_ack_detection();
 }
 
 /// Disables the PROG track output and enables the OPS track output.
 static void disable_programming_track()
 {
+  esp32cs::stop_prog_ack_detection();
   PROG_ENABLE_Pin::set(false);
 
   DccHwDefs::InternalBoosterOutput::clear_disable_reason(
@@ -81,6 +108,62 @@ static void disable_programming_track()
   DccHwDefs::OpenLCBBoosterOutput::clear_disable_reason(
     DccOutput::DisableReason::PGM_TRACK_LOCKOUT);
 }
+#endif // CONFIG_PROG_TRACK_SIGNAL_ENABLED
+
+/// Routes packet sources to the @ref PrioritizedUpdateLoop for the track
+/// output they should be sent to. When the PROG track has a dedicated signal
+/// generator the service mode packet source is sent to the PROG track update
+/// loop, all other packet sources are sent to the OPS track update loop.
+class TrackUpdateRouter : private dcc::UpdateLoopBase
+{
+public:
+  /// Constructor.
+  ///
+  /// @param ops is the OPS track @ref PrioritizedUpdateLoop.
+  /// @param prog is the PROG track @ref PrioritizedUpdateLoop, nullptr if the
+  /// PROG track shares the OPS track signal.
+  TrackUpdateRouter(PrioritizedUpdateLoop *ops, PrioritizedUpdateLoop *prog)
+    : ops_(ops), prog_(prog)
+  {
+  }
+
+  bool add_refresh_source(dcc::PacketSource *source,
+                          unsigned priority) override
+  {
+    if (prog_ && priority == dcc::UpdateLoopBase::PROGRAMMING_PRIORITY)
+    {
+      return prog_->add_refresh_source(source, priority);
+    }
+    return ops_->add_refresh_source(source, priority);
+  }
+
+  void remove_refresh_source(dcc::PacketSource *source) override
+  {
+    // the update loops will ignore sources that are not registered with them.
+    ops_->remove_refresh_source(source);
+    if (prog_)
+    {
+      prog_->remove_refresh_source(source);
+    }
+  }
+
+  void notify_update(dcc::PacketSource *source, unsigned code) override
+  {
+    // the update loops will ignore sources that are not registered with them.
+    ops_->notify_update(source, code);
+    if (prog_)
+    {
+      prog_->notify_update(source, code);
+    }
+  }
+
+private:
+  /// OPS track @ref PrioritizedUpdateLoop.
+  PrioritizedUpdateLoop *ops_;
+
+  /// PROG track @ref PrioritizedUpdateLoop.
+  PrioritizedUpdateLoop *prog_;
+};
 
 // TODO: move this into TrainSearchProtocol
 class EStopPacketSource : public dcc::NonTrainPacketSource,
@@ -170,29 +253,67 @@ static uninitialized<dcc::RailcomHubFlow> railcom_hub;
 #if CONFIG_RAILCOM_DUMP_PACKETS
 static uninitialized<dcc::RailcomPrintfFlow> railcom_dumper;
 #endif // CONFIG_RAILCOM_DUMP_PACKETS
+#if CONFIG_RAILCOM_FULL
+static uninitialized<esp32cs::RailComDecoder> railcom_decoder;
+#endif // CONFIG_RAILCOM_FULL
 static esp32cs::Esp32RailComDriver<RailComHwDefs, DccHwDefs::InternalBoosterOutput, DccHwDefs::OpenLCBBoosterOutput> railComDriver;
 #endif // CONFIG_RAILCOM_DISABLED
 static esp32cs::RMTTrackDevice<DccHwDefs, DccHwDefs::InternalBoosterOutput, DccHwDefs::OpenLCBBoosterOutput> track(&railComDriver);
 static uninitialized<dcc::LocalTrackIf> track_interface;
 static uninitialized<esp32cs::PrioritizedUpdateLoop> track_update_loop;
 static uninitialized<PoolToQueueFlow<Buffer<dcc::Packet>>> track_flow;
+#if CONFIG_PROG_TRACK_SIGNAL_ENABLED
+static NoRailcomDriver progRailComDriver;
+static esp32cs::RMTTrackDevice<ProgDccHwDefs, ProgDccHwDefs::BoosterOutput, ProgDccHwDefs::BoosterOutput> prog_track(&progRailComDriver, false);
+static uninitialized<dcc::LocalTrackIf> prog_track_interface;
+static uninitialized<esp32cs::PrioritizedUpdateLoop> prog_update_loop;
+static uninitialized<PoolToQueueFlow<Buffer<dcc::Packet>>> prog_track_flow;
+#endif // CONFIG_PROG_TRACK_SIGNAL_ENABLED
+static uninitialized<TrackUpdateRouter> track_update_router;
 static uninitialized<TrackPowerBit<DccHwDefs::InternalBoosterOutput, DccHwDefs::OpenLCBBoosterOutput>> track_power;
 static uninitialized<openlcb::BitEventConsumer> track_power_consumer;
 static uninitialized<EStopPacketSource> estop_packet_source;
 static uninitialized<openlcb::BitEventConsumer> estop_consumer;
 static uninitialized<ProgrammingTrackBackend> prog_backend;
+static uninitialized<esp32cs::BatchCvReader> batch_cv_reader;
 static uninitialized<esp32cs::AccessoryDecoderDB> accessory_db;
+static uninitialized<esp32cs::TrackUtilization> track_utilization;
 
 #if CONFIG_OPS_TRACK_ENABLED
+/// @return true if the OPS output is disabled due to a short.
+static inline bool is_ops_shorted()
+{
+  return DccHwDefs::InternalBoosterOutput::outputDisableReasons_ &
+    (uint8_t)DccOutput::DisableReason::SHORTED;
+}
+
+/// Monitors the OPS track load level and produces the short and H-Bridge
+/// shutdown events. The flow is woken by the ULP when a short is detected or
+/// the load crosses the warning thresholds. Events are rate limited, when the
+/// level changes more than once before the next event can be produced only
+/// the most severe level will be produced.
 class TrackMonitorFlow : public StateFlowBase, public DefaultConfigUpdateListener
 {
 public:
+  /// OPS track load level.
+  enum class Level : uint8_t
+  {
+    /// Load is below the warning threshold.
+    NORMAL,
+    /// Load has exceeded the warning threshold.
+    WARNING,
+    /// Short has been detected.
+    SHORT,
+    /// Load has exceeded the H-Bridge shutdown threshold.
+    SHUTDOWN
+  };
+
   TrackMonitorFlow(Service *service, const TrackOutputConfig &cfg)
     : StateFlowBase(service), cfg_(cfg)
   {
     auto status = Singleton<StatusDisplay>::instance();
     status->track_power("Track: Off");
-    start_flow(STATE(sleep));
+    start_flow(STATE(wait_for_change));
   }
 
   UpdateAction apply_configuration(int fd, bool initial_load,
@@ -214,44 +335,38 @@ public:
     CDI_FACTORY_RESET(cfg_.advanced().prog_preamble_bits);
   }
 
-private:
-  StateFlowTimer timer_{this};
-  TrackOutputConfig cfg_;
-  openlcb::EventId shortEvent_;
-  openlcb::EventId shutdownEvent_;
-  static constexpr uint64_t INTERVAL = SEC_TO_NSEC(15);
+  /// ULP level callback.
+  ///
+  /// @param arg is the @ref TrackMonitorFlow to notify.
+  ///
+  /// NOTE: This is called from an ISR context!
+  static void level_changed_from_isr(void *arg)
+  {
+    TrackMonitorFlow *flow = static_cast<TrackMonitorFlow *>(arg);
+    if (!flow->pending_.exchange(true))
+    {
+      flow->notify_from_isr();
+    }
+  }
 
-  Action check()
+  /// Wakes up the flow to re-evaluate the OPS track level.
+  ///
+  /// NOTE: This must be called on the executor of the flow.
+  void level_changed()
   {
-    auto status = Singleton<StatusDisplay>::instance();
-    uint16_t last_reading = esp32cs::get_last_ops_reading();
-    uint16_t short_limit = esp32cs::get_ops_short_threshold();
-    uint16_t shutdown_limit = esp32cs::get_ops_shutdown_threshold();
-    uint16_t warn_limit = esp32cs::get_ops_warning_threshold();
-    uint8_t disable_reason =
-      DccHwDefs::InternalBoosterOutput::outputDisableReasons_;
-    bool was_shorted =
-      (disable_reason & (uint8_t)DccOutput::DisableReason::SHORTED);
-
-    // If the last reading is under the short limit and the output is diabled
-    // due to the short condition, clear it.
-    if (was_shorted && last_reading < short_limit)
+    if (!pending_.exchange(true))
     {
-      DccHwDefs::InternalBoosterOutput::clear_disable_reason(
-        DccOutput::DisableReason::SHORTED);
+      notify();
     }
+  }
 
-    if (last_reading > short_limit)
+  /// Updates the status display with the current OPS track state.
+  void update_display()
+  {
+    auto status = Singleton<StatusDisplay>::instance();
+    if (level_ >= Level::SHORT)
     {
       status->track_power("Track: Short!");
-      if (last_reading < shutdown_limit)
-      {
-        Singleton<esp32cs::EventBroadcastHelper>::instance()->send_event(shortEvent_);
-      }
-      else
-      {
-        Singleton<esp32cs::EventBroadcastHelper>::instance()->send_event(shutdownEvent_);
-      }
     }
     else if (estop_packet_source->is_enabled())
     {
@@ -259,25 +374,257 @@ private:
     }
     else if (DccHwDefs::InternalBoosterOutput::should_be_enabled())
     {
-      LOG(INFO, "[Track] Usage: %d/%d, %d mA", last_reading, short_limit,
-          esp32cs::get_ops_load());
       status->track_power("Track: %d mA%c", esp32cs::get_ops_load(),
-                          last_reading > warn_limit ? '!' : ' ');
+                          level_ == Level::WARNING ? '!' : ' ');
     }
     else
     {
       status->track_power("Track: Off");
     }
-    return call_immediately(STATE(sleep));
   }
 
-  Action sleep()
+private:
+  /// Minimum time between events.
+  static constexpr uint64_t EVENT_INTERVAL =
+    MSEC_TO_NSEC(CONFIG_OPS_EVENT_MIN_INTERVAL_MS);
+
+  /// Interval for checking if a short has cleared after the output has been
+  /// re-enabled, the ULP does not wake up for this.
+  static constexpr uint64_t CLEAR_INTERVAL = MSEC_TO_NSEC(100);
+
+  StateFlowTimer timer_{this};
+  TrackOutputConfig cfg_;
+  openlcb::EventId shortEvent_;
+  openlcb::EventId shutdownEvent_;
+
+  /// Set when the flow has been (or will be) woken up, this starts as true
+  /// so the ISR does not notify the flow until it is waiting.
+  std::atomic<bool> pending_{true};
+
+  /// Current OPS track load level.
+  Level level_{Level::NORMAL};
+
+  /// ULP short counter when the level was last evaluated.
+  uint32_t shortCount_{0};
+
+  /// Level of the event waiting to be produced, @ref Level::NORMAL if there
+  /// is no pending event.
+  Level eventLevel_{Level::NORMAL};
+
+  /// Earliest time the next event can be produced.
+  long long nextEventTime_{0};
+
+  /// @return the current OPS track load level.
+  Level evaluate()
+  {
+    if (is_ops_shorted() || shortCount_ != esp32cs::get_ops_short_count())
+    {
+      return esp32cs::get_last_ops_short_reading() >=
+        esp32cs::get_ops_shutdown_threshold() ? Level::SHUTDOWN : Level::SHORT;
+    }
+    if (level_ >= Level::SHORT &&
+        DccHwDefs::InternalBoosterOutput::should_be_enabled() &&
+        esp32cs::get_last_ops_reading() >=
+          esp32cs::get_ops_short_clear_threshold())
+    {
+      // the output has been re-enabled but the load has not dropped below
+      // the short clear threshold yet.
+      return level_;
+    }
+    return esp32cs::is_ops_warning_active() ? Level::WARNING : Level::NORMAL;
+  }
+
+  Action wait_for_change()
   {
-      return sleep_and_call(&timer_, INTERVAL, STATE(check));
+    if (level_ >= Level::SHORT && !is_ops_shorted())
+    {
+      return sleep_and_call(&timer_, CLEAR_INTERVAL, STATE(update));
+    }
+    pending_.store(false);
+    // the level may have changed before pending_ was cleared, claim it
+    // unless the ISR has already done so.
+    if ((evaluate() != level_ ||
+         shortCount_ != esp32cs::get_ops_short_count()) &&
+        !pending_.exchange(true))
+    {
+      return call_immediately(STATE(update));
+    }
+    return wait_and_call(STATE(update));
+  }
+
+  Action update()
+  {
+    Level level = evaluate();
+    uint32_t short_count = esp32cs::get_ops_short_count();
+    if (level >= Level::SHORT &&
+        (level > level_ || short_count != shortCount_))
+    {
+      eventLevel_ = std::max(eventLevel_, level);
+    }
+    if (level != level_)
+    {
+      LOG(INFO, "[Track] OPS level changed from %d to %d", (int)level_,
+          (int)level);
+      level_ = level;
+      update_display();
+    }
+    shortCount_ = short_count;
+    if (eventLevel_ != Level::NORMAL)
+    {
+      long long now = os_get_time_monotonic();
+      if (now < nextEventTime_)
+      {
+        // any further changes before the event is produced will be
+        // coalesced into it.
+        return sleep_and_call(&timer_, nextEventTime_ - now, STATE(update));
+      }
+      Singleton<esp32cs::EventBroadcastHelper>::instance()->send_event(
+        eventLevel_ == Level::SHUTDOWN ? shutdownEvent_ : shortEvent_);
+      eventLevel_ = Level::NORMAL;
+      nextEventTime_ = now + EVENT_INTERVAL;
+    }
+    return call_immediately(STATE(wait_for_change));
   }
 };
 
 static uninitialized<TrackMonitorFlow> track_monitor;
+
+/// Periodically refreshes the OPS track load on the status display, all
+/// other changes are reported by @ref TrackMonitorFlow as they happen.
+class TrackLoadDisplayFlow : public StateFlowBase
+{
+public:
+  /// Constructor.
+  ///
+  /// @param service is the @ref Service to execute on.
+  /// @param monitor is the @ref TrackMonitorFlow to refresh.
+  TrackLoadDisplayFlow(Service *service, TrackMonitorFlow *monitor)
+    : StateFlowBase(service), monitor_(monitor)
+  {
+    start_flow(STATE(sleep));
+  }
+
+private:
+  static constexpr uint64_t INTERVAL = SEC_TO_NSEC(15);
+  StateFlowTimer timer_{this};
+  TrackMonitorFlow *monitor_;
+
+  Action sleep()
+  {
+    return sleep_and_call(&timer_, INTERVAL, STATE(refresh));
+  }
+
+  Action refresh()
+  {
+    if (DccHwDefs::InternalBoosterOutput::should_be_enabled())
+    {
+      LOG(INFO, "[Track] Usage: %d/%d, %d mA", esp32cs::get_last_ops_reading(),
+          esp32cs::get_ops_short_threshold(), esp32cs::get_ops_load());
+    }
+    monitor_->update_display();
+    return call_immediately(STATE(sleep));
+  }
+};
+
+static uninitialized<TrackLoadDisplayFlow> track_load_display;
+
+/// Re-enables the OPS track output after the ULP has detected a short. While
+/// the short persists the delay between attempts is doubled (up to the
+/// configured maximum) to limit the stress on the H-Bridge, the delay is
+/// reset once the output has remained enabled for the stable period.
+class ShortRecoveryFlow : public StateFlowBase
+{
+public:
+  /// Constructor.
+  ///
+  /// @param service is the @ref Service to execute on.
+  ShortRecoveryFlow(Service *service) : StateFlowBase(service)
+  {
+    start_flow(STATE(wait_for_short));
+  }
+
+  /// ULP short callback.
+  ///
+  /// @param arg is the @ref ShortRecoveryFlow to notify.
+  ///
+  /// NOTE: This is called from an ISR context!
+  static void short_detected_from_isr(void *arg)
+  {
+    ShortRecoveryFlow *flow = static_cast<ShortRecoveryFlow *>(arg);
+    // only the first short will wake up the flow, subsequent shorts are
+    // detected via the ULP short counter.
+    if (!flow->pending_.exchange(true))
+    {
+      flow->notify_from_isr();
+    }
+  }
+
+private:
+  /// Initial delay before re-enabling the output.
+  static constexpr uint32_t INITIAL_DELAY_MSEC =
+    CONFIG_OPS_SHORT_RETRY_INITIAL_MS;
+
+  /// Maximum delay before re-enabling the output.
+  static constexpr uint32_t MAX_DELAY_MSEC = CONFIG_OPS_SHORT_RETRY_MAX_MS;
+
+  /// Time the output must remain enabled before the delay is reset.
+  static constexpr uint32_t STABLE_MSEC = CONFIG_OPS_SHORT_RETRY_STABLE_MS;
+
+  StateFlowTimer timer_{this};
+
+  /// Set when the flow has been (or will be) woken up for a short, this
+  /// starts as true so the ISR does not notify the flow until it is waiting.
+  std::atomic<bool> pending_{true};
+
+  /// Delay before the next attempt to re-enable the output.
+  uint32_t delayMsec_{INITIAL_DELAY_MSEC};
+
+  /// ULP short counter when the output was last re-enabled.
+  uint32_t shortCount_{0};
+
+  Action wait_for_short()
+  {
+    pending_.store(false);
+    // a short may have been detected before pending_ was cleared, claim it
+    // unless the ISR has already done so.
+    if (is_ops_shorted() && !pending_.exchange(true))
+    {
+      return call_immediately(STATE(short_detected));
+    }
+    return wait_and_call(STATE(short_detected));
+  }
+
+  Action short_detected()
+  {
+    LOG_ERROR("[Track] OPS short detected, re-enabling output in %" PRIu32
+              "ms", delayMsec_);
+    return sleep_and_call(&timer_, MSEC_TO_NSEC(delayMsec_), STATE(retry));
+  }
+
+  Action retry()
+  {
+    shortCount_ = esp32cs::get_ops_short_count();
+    esp32cs::release_ops_short_cutoff();
+    DccHwDefs::InternalBoosterOutput::clear_disable_reason(
+      DccOutput::DisableReason::SHORTED);
+    track_monitor->level_changed();
+    delayMsec_ = std::min(delayMsec_ << 1, MAX_DELAY_MSEC);
+    return sleep_and_call(&timer_, MSEC_TO_NSEC(STABLE_MSEC), STATE(stable));
+  }
+
+  Action stable()
+  {
+    if (is_ops_shorted() || shortCount_ != esp32cs::get_ops_short_count())
+    {
+      return call_immediately(STATE(short_detected));
+    }
+    LOG(INFO, "[Track] OPS output has recovered from short");
+    delayMsec_ = INITIAL_DELAY_MSEC;
+    return call_immediately(STATE(wait_for_short));
+  }
+};
+
+static uninitialized<ShortRecoveryFlow> short_recovery;
 #endif // CONFIG_OPS_TRACK_ENABLED
 
 /// ESP32 VFS ::write() impl for the RMTTrackDevice.
@@ -329,6 +676,57 @@ static int dcc_vfs_ioctl(int fd, int cmd, va_list args)
   return track.ioctl(fd, cmd, args);
 }
 
+#if CONFIG_PROG_TRACK_SIGNAL_ENABLED
+/// ESP32 VFS ::write() impl for the PROG track RMTTrackDevice.
+///
+/// @param fd is the file descriptor being written to.
+/// @param data is the data to write.
+/// @param size is the size of data.
+/// @returns number of bytes written.
+static ssize_t prog_vfs_write(int fd, const void *data, size_t size)
+{
+  return prog_track.write(fd, data, size);
+}
+
+/// ESP32 VFS ::open() impl for the PROG track RMTTrackDevice
+///
+/// @param path is the file location to be opened.
+/// @param flags is not used.
+/// @param mode is not used.
+///
+/// @returns file descriptor for the opened file location.
+static int prog_vfs_open(const char *path, int flags, int mode)
+{
+  int fd = ProgDccHwDefs::RMT_CHANNEL;
+  LOG(INFO, "[Prog:%d] Connecting track interface", fd);
+  return fd;
+}
+
+/// ESP32 VFS ::close() impl for the PROG track RMTTrackDevice.
+///
+/// @param fd is the file descriptor to close.
+///
+/// @returns the status of the close() operation, only returns zero.
+static int prog_vfs_close(int fd)
+{
+  LOG(INFO, "[Prog:%d] Disconnecting track interface", fd);
+  return 0;
+}
+
+/// ESP32 VFS ::ioctl() impl for the PROG track RMTTrackDevice.
+///
+/// @param fd is the file descriptor to operate on.
+/// @param cmd is the ioctl command to execute.
+/// @param args are the arguments to ioctl.
+///
+/// @returns the result of the ioctl command, zero on success, non-zero will
+/// set errno.
+static int prog_vfs_ioctl(int fd, int cmd, va_list args)
+{
+  return prog_track.ioctl(fd, cmd, args);
+}
+#endif // CONFIG_PROG_TRACK_SIGNAL_ENABLED
+
 /// RMT transmit complete callback.
 ///
 /// @param channel is the RMT channel that has completed transmission.
@@ -342,6 +740,12 @@ static void rmt_tx_callback(rmt_channel_t channel, void *ctx)
   {
     track.rmt_transmit_complete();
   }
+#if CONFIG_PROG_TRACK_SIGNAL_ENABLED
+  else if (channel == ProgDccHwDefs::RMT_CHANNEL)
+  {
+    prog_track.rmt_transmit_complete();
+  }
+#endif // CONFIG_PROG_TRACK_SIGNAL_ENABLED
 }
 
 /// Initializes the ESP32 VFS adapter for the DCC track interface and the short
@@ -365,10 +769,27 @@ void init_dcc(openlcb::Node *node, Service *svc, const TrackOutputConfig &cfg)
   LOG(INFO, "[Track] Registering %s VFS interface", CONFIG_DCC_VFS_MOUNT_POINT);
   ESP_ERROR_CHECK(esp_vfs_register(CONFIG_DCC_VFS_MOUNT_POINT, &vfs, nullptr));
 
+#if CONFIG_PROG_TRACK_SIGNAL_ENABLED
+  // register the PROG track VFS handler, this uses a separate packet queue
+  // and RMT channel from the OPS track.
+  vfs.ioctl = prog_vfs_ioctl;
+  vfs.open = prog_vfs_open;
+  vfs.close = prog_vfs_close;
+  vfs.write = prog_vfs_write;
+  LOG(INFO, "[Prog] Registering %s VFS interface",
+      CONFIG_DCC_PROG_VFS_MOUNT_POINT);
+  ESP_ERROR_CHECK(
+    esp_vfs_register(CONFIG_DCC_PROG_VFS_MOUNT_POINT, &vfs, nullptr));
+#endif // CONFIG_PROG_TRACK_SIGNAL_ENABLED
+
   // Connect our callback into the RMT so we can queue up the next packet for
   // transmission when needed.
   rmt_register_tx_end_callback(rmt_tx_callback, nullptr);
 
+  // Start the track utilization tracking before the signal generator so that
+  // all packets are recorded.
+  track_utilization.emplace(svc);
+
   // Initialize the RMT signal generator.
   track.hw_init();
 
@@ -380,12 +801,40 @@ void init_dcc(openlcb::Node *node, Service *svc, const TrackOutputConfig &cfg)
   track_flow.emplace(svc, track_interface->pool(),
                      track_update_loop.operator->());
 
+#if CONFIG_PROG_TRACK_SIGNAL_ENABLED
+  // Initialize the PROG track signal generator and attach a dedicated DCC
+  // update loop to it for service mode packets.
+  prog_track.hw_init();
+  prog_track_interface.emplace(svc, CONFIG_DCC_PACKET_POOL_SIZE);
+  prog_track_interface->set_fd(
+    open(CONFIG_DCC_PROG_VFS_MOUNT_POINT, O_WRONLY));
+  prog_update_loop.emplace(svc, prog_track_interface.operator->(), false);
+  prog_track_flow.emplace(svc, prog_track_interface->pool(),
+                          prog_update_loop.operator->());
+  track_update_router.emplace(track_update_loop.operator->(),
+                              prog_update_loop.operator->());
+
+  // the PROG track output is only enabled while in service mode.
+  DccHwDefs::ProgBoosterOutput::set_disable_reason(
+    DccOutput::DisableReason::PGM_TRACK_LOCKOUT);
+  DccHwDefs::ProgBoosterOutput::clear_disable_reason(
+    DccOutput::DisableReason::INITIALIZATION_PENDING);
+#else
+  track_update_router.emplace(track_update_loop.operator->(), nullptr);
+#endif // CONFIG_PROG_TRACK_SIGNAL_ENABLED
+
 #if !CONFIG_RAILCOM_DISABLED
   railcom_hub.emplace(svc);
   railComDriver.hw_init(railcom_hub.operator->());
 #if CONFIG_RAILCOM_DUMP_PACKETS
   railcom_dumper.emplace(railcom_hub.operator->());
 #endif
+#if CONFIG_RAILCOM_FULL
+  railcom_decoder.emplace();
+  railcom_hub->register_port(railcom_decoder.operator->());
+  Singleton<commandstation::AllTrainNodes>::instance()->set_railcom_state(
+    railcom_decoder.operator->());
+#endif // CONFIG_RAILCOM_FULL
 #endif // !CONFIG_RAILCOM_DISABLED
   track_power.emplace(node);
   track_power_consumer.emplace(track_power.operator->());
@@ -394,10 +843,17 @@ void init_dcc(openlcb::Node *node, Service *svc, const TrackOutputConfig &cfg)
 #if CONFIG_PROG_TRACK_ENABLED
   prog_backend.emplace(svc, enable_programming_track,
                        disable_programming_track);
+  batch_cv_reader.emplace(svc, prog_backend.operator->());
 #endif
   accessory_db.emplace(node, svc, track_interface.operator->());
 #if CONFIG_OPS_TRACK_ENABLED
   track_monitor.emplace(svc, cfg);
+  track_load_display.emplace(svc, track_monitor.operator->());
+  esp32cs::set_ops_level_callback(TrackMonitorFlow::level_changed_from_isr,
+                                  track_monitor.operator->());
+  short_recovery.emplace(svc);
+  esp32cs::set_ops_short_callback(ShortRecoveryFlow::short_detected_from_isr,
+                                  short_recovery.operator->());
 #endif // CONFIG_OPS_TRACK_ENABLED
 
   // Clear the initialization pending flag
@@ -418,12 +874,89 @@ void init_dcc(openlcb::Node *node, Service *svc, const TrackOutputConfig &cfg)
 #endif // CONFIG_ENERGIZE_TRACK_ON_STARTUP
 }
 
+void log_railcom_timing()
+{
+#if !CONFIG_RAILCOM_DISABLED
+  railComDriver.log_timing(true);
+  LOG(INFO,
+      "[RailCom] UART ISR last:%" PRIu32 "ns max:%" PRIu32 "ns, feedback:%"
+      PRIu32 " overruns:%" PRIu32,
+      railComDriver.isr_last_nsec(), railComDriver.isr_max_nsec(true),
+      railComDriver.feedback_count(), railComDriver.overruns());
+#endif // !CONFIG_RAILCOM_DISABLED
+}
+
+/// Logs the TX complete ISR timing and packet queue counters of a DCC signal.
+///
+/// @param name is the name of the DCC signal.
+/// @param device is the @ref RMTTrackDevice generating the DCC signal.
+template <class TrackDevice>
+static void log_signal_diagnostics(const char *name, TrackDevice &device)
+{
+  LOG(INFO,
+      "[DCC-%s] TX ISR count:%" PRIu32 " last:%" PRIu32 "ns max:%" PRIu32
+      "ns, packets merged:%" PRIu32 " dropped:%" PRIu32 " underruns:%"
+      PRIu32,
+      name, device.isr_count(), device.isr_last_nsec(),
+      device.isr_max_nsec(true), device.merged_packets(),
+      device.dropped_packets(), device.encode_underruns());
+}
+
+/// @return TX complete ISR timing and packet queue counters of a DCC signal
+/// in json format.
+///
+/// @param device is the @ref RMTTrackDevice generating the DCC signal.
+template <class TrackDevice>
+static std::string signal_diagnostics_json(TrackDevice &device)
+{
+  return StringPrintf(
+    "{\"isr\":{\"count\":%" PRIu32 ",\"last\":%" PRIu32 ",\"max\":%"
+    PRIu32 "},\"merged\":%" PRIu32 ",\"dropped\":%" PRIu32
+    ",\"underruns\":%" PRIu32 "}",
+    device.isr_count(), device.isr_last_nsec(), device.isr_max_nsec(),
+    device.merged_packets(), device.dropped_packets(),
+    device.encode_underruns());
+}
+
+void log_signal_diagnostics()
+{
+  log_signal_diagnostics("OPS", track);
+#if CONFIG_PROG_TRACK_SIGNAL_ENABLED
+  log_signal_diagnostics("PROG", prog_track);
+#endif // CONFIG_PROG_TRACK_SIGNAL_ENABLED
+}
+
+std::string signal_diagnostics_json()
+{
+  std::string json = "{\"ops\":" + signal_diagnostics_json(track);
+#if CONFIG_PROG_TRACK_SIGNAL_ENABLED
+  json += ",\"prog\":" + signal_diagnostics_json(prog_track);
+#endif // CONFIG_PROG_TRACK_SIGNAL_ENABLED
+#if !CONFIG_RAILCOM_DISABLED
+  json += StringPrintf(
+    ",\"railcom\":{\"isr\":{\"last\":%" PRIu32 ",\"max\":%" PRIu32
+    "},\"feedback\":%" PRIu32 ",\"overruns\":%" PRIu32 ",\"skipped\":%"
+    PRIu32 "}",
+    railComDriver.isr_last_nsec(), railComDriver.isr_max_nsec(),
+    railComDriver.feedback_count(), railComDriver.overruns(),
+    railComDriver.skipped_cutouts());
+#endif // !CONFIG_RAILCOM_DISABLED
+  json += "}";
+  return json;
+}
+
 void shutdown_dcc()
 {
   // disconnect the RMT TX complete callback so that no more DCC packets will
   // be sent to the tracks.
   rmt_register_tx_end_callback(nullptr, nullptr);
 
+#if CONFIG_OPS_TRACK_ENABLED
+  // disconnect the ULP short callback, the short cut-off pin remains active.
+  esp32cs::set_ops_short_callback(nullptr, nullptr);
+  esp32cs::set_ops_level_callback(nullptr, nullptr);
+#endif // CONFIG_OPS_TRACK_ENABLED
+
   // TODO: disable RMT driver?
   // TODO: disable VFS?
 
@@ -432,6 +965,10 @@ void shutdown_dcc()
         DccOutput::DisableReason::INITIALIZATION_PENDING);
   DccHwDefs::OpenLCBBoosterOutput::set_disable_reason(
         DccOutput::DisableReason::INITIALIZATION_PENDING);
+#if CONFIG_PROG_TRACK_SIGNAL_ENABLED
+  DccHwDefs::ProgBoosterOutput::set_disable_reason(
+        DccOutput::DisableReason::INITIALIZATION_PENDING);
+#endif // CONFIG_PROG_TRACK_SIGNAL_ENABLED
 }
 
 } // namespace esp32cs
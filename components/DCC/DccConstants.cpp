@@ -15,11 +15,19 @@ COPYRIGHT (c) 2020-2021 Mike Dunston
   along with this program.  If not, see http://www.gnu.org/licenses
 **********************************************************************/
 
+#include "sdkconfig.h"
+
 #include <utils/constants.hxx>
 
 namespace esp32cs
 {
 
-DEFAULT_CONST(min_refresh_delay_ms, 10);
+DEFAULT_CONST(min_refresh_delay_ms, CONFIG_DCC_MIN_REFRESH_DELAY_MS);
+DEFAULT_CONST(function_refresh_delay_ms, CONFIG_DCC_FUNCTION_REFRESH_DELAY_MS);
+
+#if CONFIG_DCC_ADAPTIVE_REFRESH
+DEFAULT_CONST(idle_refresh_delay_ms, CONFIG_DCC_IDLE_REFRESH_DELAY_MS);
+DEFAULT_CONST(active_refresh_hold_ms, CONFIG_DCC_ACTIVE_REFRESH_HOLD_MS);
+#endif // CONFIG_DCC_ADAPTIVE_REFRESH
 
 } // namespace esp32cs
\ No newline at end of file
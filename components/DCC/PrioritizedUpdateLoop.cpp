@@ -16,13 +16,21 @@ COPYRIGHT (c) 2020-2021 Mike Dunston
 **********************************************************************/
 
 #include "PrioritizedUpdateLoop.hxx"
+#include "TrackUtilization.hxx"
 
 #include <algorithm>
 #include <dcc/PacketSource.hxx>
 #include <esp_timer.h>
+#include <functional>
 #include <inttypes.h>
 #include <utils/constants.hxx>
 
+#if CONFIG_DCC_UPDATE_LOOP_STATS
+#include "CpuCycleCount.hxx"
+#include <string.h>
+#include <utils/logging.h>
+#endif // CONFIG_DCC_UPDATE_LOOP_STATS
+
 namespace esp32cs
 {
 
@@ -31,29 +39,105 @@ using dcc::PacketFlowInterface;
 using dcc::UpdateLoopBase;
 
 DECLARE_CONST(min_refresh_delay_ms);
+DECLARE_CONST(function_refresh_delay_ms);
+#if CONFIG_DCC_ADAPTIVE_REFRESH
+DECLARE_CONST(idle_refresh_delay_ms);
+DECLARE_CONST(active_refresh_hold_ms);
+#endif // CONFIG_DCC_ADAPTIVE_REFRESH
+
+#if CONFIG_ESP_TIMER_IMPL_TG0_LAC
+#include <soc/timer_group_reg.h>
+#define LACT_MODULE     0
+#define TICKS_PER_US    2
+#define COUNT_LO_REG    (TIMG_LACTLO_REG(LACT_MODULE))
+#define COUNT_HI_REG    (TIMG_LACTHI_REG(LACT_MODULE))
+typedef struct
+{
+  union
+  {
+    struct
+    {
+      uint32_t lo;
+      uint32_t hi;
+    };
+    uint64_t val;
+  };
+} timer_64b_reg_t;
+
+uint64_t get_current_time()
+{
+  timer_64b_reg_t result;
+  result.lo = REG_READ(COUNT_LO_REG);
+  result.hi = REG_READ(COUNT_HI_REG);
+  return result.val / TICKS_PER_US;
+}
+#elif CONFIG_IDF_TARGET_ESP32
+uint64_t get_current_time() __attribute__((alias("esp_timer_get_time")));
+#elif CONFIG_IDF_TARGET_ESP32S3
+#define get_current_time esp_timer_get_time
+#endif
 
-struct UpdateRequest
+#if CONFIG_DCC_ADAPTIVE_REFRESH
+/// Checks if a DCC packet is a multi-function decoder speed packet.
+///
+/// @param packet is the DCC packet to check.
+/// @param moving will be set to true if the speed is not stop or e-stop.
+/// @return true if the packet is a speed packet.
+static bool parse_speed_packet(const dcc::Packet &packet, bool *moving)
 {
-  void reset(PacketSource *source, unsigned code)
+  uint8_t index;
+  if (packet.dlc < 3 || packet.packet_header.send_long_preamble)
+  {
+    return false;
+  }
+  else if (packet.payload[0] >= 1 && packet.payload[0] <= 127)
+  {
+    // short address
+    index = 1;
+  }
+  else if (packet.payload[0] >= 192 && packet.payload[0] <= 231)
   {
-    this->source = source;
-    this->code = code;
+    // long address
+    index = 2;
   }
-  PacketSource *source;
-  unsigned code;
-};
+  else
+  {
+    return false;
+  }
+
+  const uint8_t instruction = packet.payload[index];
+  if ((instruction & 0xC0) == 0x40)
+  {
+    // 14/28 speed steps, the lowest speed bit is ignored as both stop and
+    // e-stop have the upper three speed bits as zero.
+    *moving = (instruction & 0x0E) != 0;
+    return true;
+  }
+  else if (instruction == 0x3F && packet.dlc > index + 2)
+  {
+    // 128 speed steps, zero is stop and one is e-stop.
+    *moving = (packet.payload[index + 1] & 0x7F) > 1;
+    return true;
+  }
+  return false;
+}
+#endif // CONFIG_DCC_ADAPTIVE_REFRESH
 
 PrioritizedUpdateLoop::PrioritizedUpdateLoop(Service *service,
-                                             PacketFlowInterface *track)
+                                             PacketFlowInterface *track,
+                                             bool ops_track)
   : StateFlow<Buffer<dcc::Packet>, QList<1>>(service),
-    track_(track)
+    track_(track), opsTrack_(ops_track)
 {
 }
 
 PrioritizedUpdateLoop::~PrioritizedUpdateLoop()
 {
   sources_.clear();
-  metrics_.clear();
+  freeSlots_.clear();
+  slotIndex_.clear();
+  refreshHeap_.clear();
+  updateHeap_.clear();
 }
 
 bool PrioritizedUpdateLoop::add_refresh_source(PacketSource *source,
@@ -61,24 +145,57 @@ bool PrioritizedUpdateLoop::add_refresh_source(PacketSource *source,
 {
   SpinlockHolder lock(&lock_);
 
-  // record the new packet source
-  sources_.push_back(source);
+  // record the new packet source, reusing a previously released slot if one
+  // is available.
+  uint16_t slot;
+  if (!freeSlots_.empty())
+  {
+    slot = freeSlots_.back();
+    freeSlots_.pop_back();
+  }
+  else
+  {
+    HASSERT(sources_.size() < NO_EXCLUSIVE_SOURCE);
+    slot = sources_.size();
+    sources_.emplace_back();
+  }
+  slotIndex_[source] = slot;
 
-  // seed the tracking metrics
-  auto &metrics = metrics_[source];
-  metrics.priority = priority;
-  metrics.last_packet = 0;
+  // seed the tracking metrics, a zero refresh time places the new source at
+  // the front of the refresh heap.
+  auto &entry = sources_[slot];
+  entry.source = source;
+  entry.priority = priority;
+  entry.next_refresh = 0;
+  entry.active_classes = DEFAULT_REFRESH_CLASSES;
+  for (uint8_t index = 0; index < REFRESH_CLASS_COUNT; index++)
+  {
+    entry.class_due[index] = 0;
+  }
+#if CONFIG_DCC_UPDATE_LOOP_STATS
+  entry.last_sent = 0;
+#endif // CONFIG_DCC_UPDATE_LOOP_STATS
+#if CONFIG_DCC_ADAPTIVE_REFRESH
+  // new sources are considered active so they will be refreshed at the
+  // minimum refresh delay initially.
+  entry.last_update = get_current_time();
+  entry.refresh_delay = MSEC_TO_USEC(config_min_refresh_delay_ms());
+  entry.moving = false;
+#endif // CONFIG_DCC_ADAPTIVE_REFRESH
+  entry.heap_index = refreshHeap_.size();
+  refreshHeap_.push_back(slot);
+  heap_sift_up(entry.heap_index);
 
   if (priority > UpdateLoopBase::EXCLUSIVE_MIN_PRIORITY)
   {
     unsigned highest_priority = 0;
     if (exclusiveIndex_ != NO_EXCLUSIVE_SOURCE)
     {
-      highest_priority = metrics_[sources_[exclusiveIndex_]].priority;
+      highest_priority = sources_[exclusiveIndex_].priority;
     }
     if (priority > highest_priority)
     {
-      exclusiveIndex_ = sources_.size() - 1;
+      exclusiveIndex_ = slot;
     }
     else
     {
@@ -95,84 +212,307 @@ bool PrioritizedUpdateLoop::add_refresh_source(PacketSource *source,
 void PrioritizedUpdateLoop::remove_refresh_source(PacketSource *source)
 {
   SpinlockHolder lock(&lock_);
-  sources_.erase(
-    std::remove(sources_.begin(), sources_.end(), source), sources_.end());
-  metrics_.erase(source);
+  auto it = slotIndex_.find(source);
+  if (it == slotIndex_.end())
+  {
+    return;
+  }
+  uint16_t slot = it->second;
+  slotIndex_.erase(it);
+
+  // remove the source from the refresh heap by moving the last heap entry
+  // into its position and restoring the heap property.
+  auto &entry = sources_[slot];
+  size_t index = entry.heap_index;
+  size_t last = refreshHeap_.size() - 1;
+  if (index != last)
+  {
+    heap_swap(index, last);
+  }
+  refreshHeap_.pop_back();
+  if (index < refreshHeap_.size())
+  {
+    uint16_t moved = refreshHeap_[index];
+    heap_sift_up(index);
+    heap_sift_down(sources_[moved].heap_index);
+  }
+  entry.source = nullptr;
+  entry.heap_index = NOT_IN_HEAP;
+  freeSlots_.push_back(slot);
+
+  // NOTE: pending updates for this source will be discarded when they reach
+  // the front of the update heap since the slot will no longer match.
 
   // if there are no packet sources there can't be an exclusive so exit early.
-  if (sources_.empty())
+  if (slotIndex_.empty())
   {
     exclusiveIndex_ = NO_EXCLUSIVE_SOURCE;
+    updateHeap_.clear();
     return;
   }
 
-  // recalculate for packet priority based on exclusive sources
-  unsigned highest_priority = UpdateLoopBase::EXCLUSIVE_MIN_PRIORITY;
-  unsigned highest_priority_index = NO_EXCLUSIVE_SOURCE;
-  for (size_t index = 0; index < sources_.size(); index++)
+  // recalculate for packet priority based on exclusive sources, this is only
+  // needed when the exclusive source itself is being removed.
+  if (exclusiveIndex_ == slot)
   {
-    const auto &packet_source = sources_[index];
-    if (metrics_[packet_source].priority > highest_priority)
+    unsigned highest_priority = UpdateLoopBase::EXCLUSIVE_MIN_PRIORITY;
+    exclusiveIndex_ = NO_EXCLUSIVE_SOURCE;
+    for (size_t index = 0; index < sources_.size(); index++)
     {
-      highest_priority = metrics_[packet_source].priority;
-      highest_priority_index = index;
+      const auto &packet_source = sources_[index];
+      if (packet_source.source &&
+          packet_source.priority > highest_priority)
+      {
+        highest_priority = packet_source.priority;
+        exclusiveIndex_ = index;
+      }
     }
   }
-  exclusiveIndex_ = highest_priority_index;
 }
 
 void PrioritizedUpdateLoop::notify_update(PacketSource* source, unsigned code)
 {
-  // prepare the high priority update before we lock the queue
-  Buffer<UpdateRequest> *buf;
-  mainBufferPool->alloc(&buf, nullptr);
-  HASSERT(buf);
-  buf->data()->reset(source, code);
-
-  // lock the queue and insert the new update packet for processing
   SpinlockHolder lock(&lock_);
-  updateSources_.insert(buf, 0);
+  auto it = slotIndex_.find(source);
+  if (it == slotIndex_.end())
+  {
+    // update source is not registered, discard the update.
+    return;
+  }
+
+  // the update is considered ready immediately, if the source has been sent a
+  // packet too recently it will be deferred when it reaches the front of the
+  // update heap.
+  PendingUpdate update;
+  update.ready = 0;
+  update.sequence = updateSequence_++;
+  update.slot = it->second;
+  update.source = source;
+  update.code = code;
+#if CONFIG_DCC_UPDATE_LOOP_STATS
+  update.notified = get_current_time();
+#endif // CONFIG_DCC_UPDATE_LOOP_STATS
+  updateHeap_.push_back(update);
+  std::push_heap(updateHeap_.begin(), updateHeap_.end(),
+                 std::greater<PendingUpdate>());
+
+#if CONFIG_DCC_ADAPTIVE_REFRESH
+  // restore the minimum refresh delay for the source, if the refresh delay
+  // had been extended the next refresh is moved back to be based on the
+  // minimum delay so that the update is not deferred.
+  auto &entry = sources_[update.slot];
+  const uint32_t min_delay = MSEC_TO_USEC(config_min_refresh_delay_ms());
+  entry.last_update = get_current_time();
+  if (entry.refresh_delay > min_delay)
+  {
+    entry.next_refresh -= entry.refresh_delay - min_delay;
+    entry.refresh_delay = min_delay;
+    heap_sift_up(entry.heap_index);
+  }
+#endif // CONFIG_DCC_ADAPTIVE_REFRESH
 }
 
-#if CONFIG_ESP_TIMER_IMPL_TG0_LAC
-#include <soc/timer_group_reg.h>
-#define LACT_MODULE     0
-#define TICKS_PER_US    2
-#define COUNT_LO_REG    (TIMG_LACTLO_REG(LACT_MODULE))
-#define COUNT_HI_REG    (TIMG_LACTHI_REG(LACT_MODULE))
-typedef struct
+void PrioritizedUpdateLoop::heap_swap(size_t a, size_t b)
 {
-  union
+  std::swap(refreshHeap_[a], refreshHeap_[b]);
+  sources_[refreshHeap_[a]].heap_index = a;
+  sources_[refreshHeap_[b]].heap_index = b;
+}
+
+void PrioritizedUpdateLoop::heap_sift_up(size_t index)
+{
+  while (index > 0)
   {
-    struct
+    size_t parent = (index - 1) >> 1;
+    if (sources_[refreshHeap_[parent]].next_refresh <=
+        sources_[refreshHeap_[index]].next_refresh)
     {
-      uint32_t lo;
-      uint32_t hi;
-    };
-    uint64_t val;
-  };
-} timer_64b_reg_t;
+      break;
+    }
+    heap_swap(index, parent);
+    index = parent;
+  }
+}
 
-uint64_t get_current_time()
+void PrioritizedUpdateLoop::heap_sift_down(size_t index)
 {
-  timer_64b_reg_t result;
-  result.lo = REG_READ(COUNT_LO_REG);
-  result.hi = REG_READ(COUNT_HI_REG);
-  return result.val / TICKS_PER_US;
+  const size_t count = refreshHeap_.size();
+  while (true)
+  {
+    size_t smallest = index;
+    size_t left = (index << 1) + 1;
+    size_t right = left + 1;
+    if (left < count &&
+        sources_[refreshHeap_[left]].next_refresh <
+        sources_[refreshHeap_[smallest]].next_refresh)
+    {
+      smallest = left;
+    }
+    if (right < count &&
+        sources_[refreshHeap_[right]].next_refresh <
+        sources_[refreshHeap_[smallest]].next_refresh)
+    {
+      smallest = right;
+    }
+    if (smallest == index)
+    {
+      break;
+    }
+    heap_swap(index, smallest);
+    index = smallest;
+  }
 }
-#elif CONFIG_IDF_TARGET_ESP32
-uint64_t get_current_time() __attribute__((alias("esp_timer_get_time")));
-#elif CONFIG_IDF_TARGET_ESP32S3
-#define get_current_time esp_timer_get_time
-#endif
+
+void PrioritizedUpdateLoop::reschedule(uint16_t slot, uint64_t next_refresh)
+{
+  auto &entry = sources_[slot];
+  // the next refresh time only ever moves forward so the entry can only move
+  // towards the leaves of the heap.
+  entry.next_refresh = next_refresh;
+  heap_sift_down(entry.heap_index);
+}
+
+constexpr unsigned PrioritizedUpdateLoop::REFRESH_CLASSES[];
+
+uint8_t PrioritizedUpdateLoop::refresh_class(unsigned code)
+{
+  for (uint8_t index = 0; index < REFRESH_CLASS_COUNT; index++)
+  {
+    if (REFRESH_CLASSES[index] == code)
+    {
+      return index;
+    }
+  }
+  return REFRESH_CLASS_COUNT;
+}
+
+uint8_t PrioritizedUpdateLoop::next_refresh_class(const RefreshSource &entry)
+{
+  uint8_t next = SPEED_REFRESH_CLASS;
+  for (uint8_t index = 0; index < REFRESH_CLASS_COUNT; index++)
+  {
+    if ((entry.active_classes & (1 << index)) &&
+        entry.class_due[index] < entry.class_due[next])
+    {
+      next = index;
+    }
+  }
+  return next;
+}
+
+void PrioritizedUpdateLoop::schedule_refresh(uint16_t slot,
+                                             uint8_t refresh_class,
+                                             uint64_t now,
+                                             uint32_t speed_delay)
+{
+  auto &entry = sources_[slot];
+  if (refresh_class < REFRESH_CLASS_COUNT)
+  {
+    // function groups are refreshed less frequently than speed, once a
+    // function group has been sent it will be included in the refresh.
+    uint32_t delay = speed_delay;
+    if (refresh_class != SPEED_REFRESH_CLASS)
+    {
+      delay = std::max<uint32_t>(delay,
+        MSEC_TO_USEC(config_function_refresh_delay_ms()));
+    }
+    entry.active_classes |= (1 << refresh_class);
+    entry.class_due[refresh_class] = now + delay;
+  }
+
+  // the source is next due when its earliest refresh class is due but no
+  // sooner than the minimum refresh delay.
+  uint64_t next_refresh = entry.class_due[next_refresh_class(entry)];
+  reschedule(slot, std::max<uint64_t>(next_refresh,
+    now + MSEC_TO_USEC(config_min_refresh_delay_ms())));
+}
+
+#if CONFIG_DCC_ADAPTIVE_REFRESH
+uint32_t PrioritizedUpdateLoop::next_refresh_delay(RefreshSource &entry,
+                                                   uint64_t now,
+                                                   uint32_t min_delay)
+{
+  if (entry.moving ||
+      now - entry.last_update < MSEC_TO_USEC(config_active_refresh_hold_ms()))
+  {
+    entry.refresh_delay = min_delay;
+  }
+  else
+  {
+    entry.refresh_delay =
+      std::min<uint32_t>(entry.refresh_delay * 2,
+                         MSEC_TO_USEC(config_idle_refresh_delay_ms()));
+  }
+  return entry.refresh_delay;
+}
+#endif // CONFIG_DCC_ADAPTIVE_REFRESH
+
+#if CONFIG_DCC_UPDATE_LOOP_STATS
+constexpr uint16_t PrioritizedUpdateLoop::REFRESH_INTERVAL_LIMITS[];
+
+void PrioritizedUpdateLoop::record_refresh(RefreshSource &entry, uint64_t now)
+{
+  if (entry.last_sent)
+  {
+    uint64_t interval_ms = (now - entry.last_sent) / 1000ULL;
+    size_t bucket = 0;
+    while (bucket < REFRESH_INTERVAL_BUCKETS - 1 &&
+           interval_ms >= REFRESH_INTERVAL_LIMITS[bucket])
+    {
+      bucket++;
+    }
+    stats_.refresh_interval[bucket]++;
+  }
+  entry.last_sent = now;
+}
+
+void PrioritizedUpdateLoop::record_entry(uint32_t start_cycles, uint64_t now)
+{
+  uint32_t entry_ns = cycles_to_nsec(get_cycle_count() - start_cycles);
+  stats_.packets++;
+  stats_.entry_ns += entry_ns;
+  stats_.entry_max_ns = std::max(stats_.entry_max_ns, entry_ns);
+
+  if (statsStart_ == 0)
+  {
+    statsStart_ = now;
+  }
+  else if (now - statsStart_ >= STATS_REPORT_INTERVAL_USEC)
+  {
+    LOG(INFO,
+        "[DCC-Loop] sources:%zu, packets:%" PRIu32 " (idle:%" PRIu32
+        ", updates:%" PRIu32 "), entry:%" PRIu32 "/%" PRIu32 " ns (avg/max), "
+        "latency:%" PRIu32 "/%" PRIu32 " us (avg/max)",
+        slotIndex_.size(), stats_.packets, stats_.idle, stats_.updates,
+        (uint32_t)(stats_.entry_ns / stats_.packets), stats_.entry_max_ns,
+        stats_.updates ? (uint32_t)(stats_.latency_us / stats_.updates) : 0,
+        stats_.latency_max_us);
+    LOG(INFO,
+        "[DCC-Loop] refresh interval (ms) <10:%" PRIu32 " <20:%" PRIu32
+        " <50:%" PRIu32 " <100:%" PRIu32 " <200:%" PRIu32 " <500:%" PRIu32
+        " <1000:%" PRIu32 " >=1000:%" PRIu32,
+        stats_.refresh_interval[0], stats_.refresh_interval[1],
+        stats_.refresh_interval[2], stats_.refresh_interval[3],
+        stats_.refresh_interval[4], stats_.refresh_interval[5],
+        stats_.refresh_interval[6], stats_.refresh_interval[7]);
+    memset(&stats_, 0, sizeof(Statistics));
+    statsStart_ = now;
+  }
+}
+#endif // CONFIG_DCC_UPDATE_LOOP_STATS
 
 StateFlowBase::Action PrioritizedUpdateLoop::entry()
 {
+#if CONFIG_DCC_UPDATE_LOOP_STATS
+  uint32_t start_cycles = get_cycle_count();
+#endif // CONFIG_DCC_UPDATE_LOOP_STATS
   dcc::PacketSource *source = nullptr;
   uint64_t now = get_current_time();
-  uint64_t min_refresh_time =
-    now - MSEC_TO_USEC(config_min_refresh_delay_ms());
+  uint32_t refresh_delay = MSEC_TO_USEC(config_min_refresh_delay_ms());
   unsigned code = 0;
+  TrackPacketType type = TrackPacketType::REFRESH;
+  uint16_t slot = NO_EXCLUSIVE_SOURCE;
+  uint8_t refresh_class = REFRESH_CLASS_COUNT;
 
   {
     SpinlockHolder lock(&lock_);
@@ -180,59 +520,94 @@ StateFlowBase::Action PrioritizedUpdateLoop::entry()
     // there is a priority update to send out.
     if (exclusiveIndex_ != NO_EXCLUSIVE_SOURCE)
     {
-      source = sources_[exclusiveIndex_];
+      slot = exclusiveIndex_;
+      type = TrackPacketType::PRIORITY;
     }
-    else if (updateSources_.pending())
+    else
     {
-      Buffer<UpdateRequest> *update =
-        static_cast<Buffer<UpdateRequest>*>(updateSources_.next().item);
-      code = update->data()->code;
-      const auto &update_source = update->data()->source;
+      while (!updateHeap_.empty() && updateHeap_.front().ready <= now)
+      {
+        std::pop_heap(updateHeap_.begin(), updateHeap_.end(),
+                      std::greater<PendingUpdate>());
+        PendingUpdate update = updateHeap_.back();
+        updateHeap_.pop_back();
+        const auto &entry = sources_[update.slot];
+        if (entry.source != update.source)
+        {
+          // priority update source has disappeared, discard and find another
+          // packet source.
+          continue;
+        }
+        else if (entry.next_refresh > now)
+        {
+          // we sent a packet to this source within the minimum refresh window
+          // defer this update until the source is ready.
+          update.ready = entry.next_refresh;
+          updateHeap_.push_back(update);
+          std::push_heap(updateHeap_.begin(), updateHeap_.end(),
+                         std::greater<PendingUpdate>());
+          continue;
+        }
+        // all checks have been validated, we can use this high priority
+        // source for the next packet.
+        slot = update.slot;
+        code = update.code;
+        type = TrackPacketType::PRIORITY;
+        refresh_class = PrioritizedUpdateLoop::refresh_class(code);
+#if CONFIG_DCC_UPDATE_LOOP_STATS
+        uint32_t latency = now - update.notified;
+        stats_.updates++;
+        stats_.latency_us += latency;
+        stats_.latency_max_us = std::max(stats_.latency_max_us, latency);
+#endif // CONFIG_DCC_UPDATE_LOOP_STATS
+        break;
+      }
 
-      auto metrics = metrics_.find(update_source);
-      if (metrics == metrics_.end())
+      // no priority updates or exclusive sources available, use the source
+      // that has waited the longest if it is due for a refresh.
+      if (slot == NO_EXCLUSIVE_SOURCE && !refreshHeap_.empty() &&
+          sources_[refreshHeap_.front()].next_refresh <= now)
       {
-        // priority update source has disappeared, discard and find another
-        // packet source.
-        update->unref();
+        // request the packet class that has waited the longest.
+        slot = refreshHeap_.front();
+        refresh_class = next_refresh_class(sources_[slot]);
+        code = REFRESH_CLASSES[refresh_class];
       }
-      else if (metrics->second.last_packet > min_refresh_time)
+    }
+
+    if (slot != NO_EXCLUSIVE_SOURCE)
+    {
+      source = sources_[slot].source;
+#if CONFIG_DCC_UPDATE_LOOP_STATS
+      record_refresh(sources_[slot], now);
+#endif // CONFIG_DCC_UPDATE_LOOP_STATS
+
+#if CONFIG_DCC_ADAPTIVE_REFRESH
+      if (type == TrackPacketType::REFRESH &&
+          refresh_class == SPEED_REFRESH_CLASS)
+      {
+        refresh_delay =
+          next_refresh_delay(sources_[slot], now, refresh_delay);
+      }
+      else if (type == TrackPacketType::REFRESH)
       {
-        // we sent a packet to this source within the minimum refresh window
-        // send this source back to the queue.
-        updateSources_.insert(update, 0);
+        // function group refresh, keep the current speed refresh delay.
+        refresh_delay = sources_[slot].refresh_delay;
       }
       else
       {
-        // all checks have been validated, we can use this high priority source
-        // for the next packet.
-        source = update_source;
+        sources_[slot].refresh_delay = refresh_delay;
       }
-    }
-  }
-
-  if (!source && !sources_.empty())
-  {
-    // default to general refresh.
-    code = 0;
+#endif // CONFIG_DCC_ADAPTIVE_REFRESH
 
-    // no priority updates or exclusive sources available, scan all registered
-    // sources to find the one that has not been updated recently.
-    size_t index = 0;
-    while (index++ < sources_.size() && !source)
-    {
+      // track that we have sent a packet to this source recently
+      if (slot == exclusiveIndex_)
       {
-        SpinlockHolder lock(&lock_);
-        if (nextIndex_ >= sources_.size())
-        {
-          nextIndex_ = 0;
-        }
-        source = sources_[nextIndex_++];
+        reschedule(slot, now + refresh_delay);
       }
-      if (metrics_[source].last_packet > min_refresh_time)
+      else
       {
-        // source is not yet ready for refresh.
-        source = nullptr;
+        schedule_refresh(slot, refresh_class, now, refresh_delay);
       }
     }
   }
@@ -242,16 +617,49 @@ StateFlowBase::Action PrioritizedUpdateLoop::entry()
     //ets_printf("%" PRIu64 ": source:%p, code:%d\n", now, source, code);
     // we have a new source, get the next packet from the source
     source->get_next_packet(code, message()->data());
-
-    // track that we have sent a packet to this source recently
-    metrics_[source].last_packet = now;
+    if (type == TrackPacketType::REFRESH)
+    {
+      // the source treats any code other than REFRESH as a user action and
+      // requests repeats, background refresh packets are sent only once.
+      message()->data()->packet_header.rept_count = 0;
+    }
+#if CONFIG_DCC_ADAPTIVE_REFRESH
+    // track if the source is moving based on the speed packets it generates.
+    bool moving;
+    if (parse_speed_packet(*message()->data(), &moving))
+    {
+      SpinlockHolder lock(&lock_);
+      if (sources_[slot].source == source)
+      {
+        sources_[slot].moving = moving;
+      }
+    }
+#endif // CONFIG_DCC_ADAPTIVE_REFRESH
   }
   else
   {
     //ets_printf("%" PRIu64 ": IDLE\n", now);
     // no packet source generated a packet, convert the packet to idle.
     message()->data()->set_dcc_idle();
+    type = TrackPacketType::IDLE;
+  }
+
+  // the packet is recorded by the track device when it is transmitted, mark
+  // the background refresh packets so they can be attributed correctly.
+  TrackUtilization::set_refresh_packet(message()->data(),
+                                       type == TrackPacketType::REFRESH);
+  if (!source && opsTrack_ && Singleton<TrackUtilization>::exists())
+  {
+    Singleton<TrackUtilization>::instance()->record_idle_fallback();
+  }
+
+#if CONFIG_DCC_UPDATE_LOOP_STATS
+  if (!source)
+  {
+    stats_.idle++;
   }
+  record_entry(start_cycles, now);
+#endif // CONFIG_DCC_UPDATE_LOOP_STATS
 
   // transfer the packet to the track interface
   track_->send(transfer_message());
@@ -0,0 +1,287 @@
+/**********************************************************************
+ESP32 COMMAND STATION
+
+COPYRIGHT (c) 2021 Mike Dunston
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see http://www.gnu.org/licenses
+**********************************************************************/
+
+#include "RailComDecoder.hxx"
+
+#include <dcc/RailCom.hxx>
+#include <esp_timer.h>
+#include <inttypes.h>
+#include <string.h>
+#include <utils/StringPrintf.hxx>
+
+namespace esp32cs
+{
+
+using commandstation::RailComDecoderState;
+
+/// @return the current time in milliseconds.
+static inline uint32_t now_msec()
+{
+  return esp_timer_get_time() / 1000ULL;
+}
+
+uintptr_t RailComDecoder::feedback_key(const dcc::Packet &packet)
+{
+  // address byte(s), instruction and checksum are required at a minimum.
+  if (packet.packet_header.is_marklin || packet.dlc < 3)
+  {
+    return 0;
+  }
+  uint8_t index = 0;
+  uintptr_t key = KEY_MARKER;
+  const uint8_t first = packet.payload[index++];
+  if (first > 0 && first < 128)
+  {
+    key |= first;
+  }
+  else if (first >= 192 && first <= 231 && packet.dlc >= 4)
+  {
+    key |= KEY_LONG_ADDRESS | ((first & 0x3F) << 8) | packet.payload[index++];
+  }
+  else
+  {
+    // broadcast, idle, accessory or reserved address, no feedback will be
+    // attributed to a decoder.
+    return 0;
+  }
+  // POM verify byte (read) instruction: 1110-01VV VVVV-VVVV DDDD-DDDD
+  const uint8_t instruction = packet.payload[index];
+  if ((instruction & 0xFC) == 0xE4 && packet.dlc >= index + 4)
+  {
+    const uintptr_t cv = ((instruction & 0x03) << 8) | packet.payload[index + 1];
+    key |= KEY_POM_READ | (cv << KEY_CV_SHIFT);
+  }
+  return key;
+}
+
+void RailComDecoder::send(Buffer<dcc::RailcomHubData> *b, unsigned priority)
+{
+  const uint32_t now = now_msec();
+  decode_ch1(*b->data(), now);
+  decode_ch2(*b->data(), now);
+  b->unref();
+}
+
+bool RailComDecoder::get_state(uint16_t address, bool long_address,
+                               RailComDecoderState *state)
+{
+  OSMutexLock l(&lock_);
+  for (size_t index = 0; index < TABLE_SIZE; index++)
+  {
+    if (table_[index].address == address &&
+        table_[index].long_address == long_address)
+    {
+      *state = table_[index];
+      return true;
+    }
+  }
+  return false;
+}
+
+size_t RailComDecoder::get_states(RailComDecoderState *states, size_t max)
+{
+  size_t count = 0;
+  OSMutexLock l(&lock_);
+  for (size_t index = 0; index < TABLE_SIZE && count < max; index++)
+  {
+    if (table_[index].address)
+    {
+      states[count++] = table_[index];
+    }
+  }
+  return count;
+}
+
+std::string RailComDecoder::to_json()
+{
+  RailComDecoderState states[TABLE_SIZE];
+  size_t count = get_states(states, TABLE_SIZE);
+  const uint32_t now = now_msec();
+  std::string json =
+    StringPrintf("{\"invalid\":%" PRIu32 ",\"decoders\":[",
+                 invalidCount_.load(std::memory_order_relaxed));
+  for (size_t index = 0; index < count; index++)
+  {
+    const RailComDecoderState &state = states[index];
+    if (index)
+    {
+      json.append(",");
+    }
+    json.append(
+      StringPrintf("{\"addr\":%d,\"long\":%s,\"age\":%" PRIu32,
+                   state.address, state.long_address ? "true" : "false",
+                   now - state.last_seen_msec));
+    if (state.speed_kmh != RailComDecoderState::UNKNOWN_VALUE)
+    {
+      json.append(StringPrintf(",\"speed\":%d", state.speed_kmh));
+    }
+    if (state.pom_cv != RailComDecoderState::UNKNOWN_VALUE)
+    {
+      json.append(
+        StringPrintf(",\"pom\":{\"cv\":%d,\"value\":%d,\"age\":%" PRIu32 "}",
+                     state.pom_cv, state.pom_value, now - state.pom_msec));
+    }
+    json.append("}");
+  }
+  json.append("]}");
+  return json;
+}
+
+void RailComDecoder::decode_ch1(const dcc::Feedback &fb, uint32_t now)
+{
+  bool high_received = false;
+  // channel 1 carries a single 12 bit datagram, anything else is either
+  // empty or the result of multiple decoders transmitting at the same time.
+  if (fb.ch1Size == 2)
+  {
+    const uint8_t first = dcc::railcom_decode[fb.ch1Data[0]];
+    const uint8_t second = dcc::railcom_decode[fb.ch1Data[1]];
+    if (first > MAX_DATA_VALUE || second > MAX_DATA_VALUE)
+    {
+      invalidCount_.fetch_add(1, std::memory_order_relaxed);
+    }
+    else
+    {
+      const uint8_t id = first >> 2;
+      const uint8_t value = ((first & 0x03) << 6) | second;
+      if (id == ID_ADR_HIGH)
+      {
+        adrHigh_ = value;
+        high_received = true;
+      }
+      else if (id == ID_ADR_LOW && adrHighValid_)
+      {
+        // decoders alternate between ADR_HIGH and ADR_LOW in consecutive
+        // cut-outs, only pair them when they were received back-to-back.
+        if (adrHigh_ == 0 && value > 0 && value < 128)
+        {
+          OSMutexLock l(&lock_);
+          touch(value, false, now);
+        }
+        else if ((adrHigh_ & 0xC0) == 0x80)
+        {
+          OSMutexLock l(&lock_);
+          touch(((adrHigh_ & 0x3F) << 8) | value, true, now);
+        }
+        // consist addresses are not tracked.
+      }
+    }
+  }
+  adrHighValid_ = high_received;
+}
+
+void RailComDecoder::decode_ch2(const dcc::Feedback &fb, uint32_t now)
+{
+  if (!fb.ch2Size || (fb.feedbackKey & KEY_MARKER_MASK) != KEY_MARKER)
+  {
+    return;
+  }
+  uint8_t data[sizeof(fb.ch2Data)];
+  uint8_t count = 0;
+  for (uint8_t index = 0; index < fb.ch2Size; index++)
+  {
+    const uint8_t value = dcc::railcom_decode[fb.ch2Data[index]];
+    if (value == dcc::RailcomDefs::INV)
+    {
+      invalidCount_.fetch_add(1, std::memory_order_relaxed);
+      return;
+    }
+    else if (value <= MAX_DATA_VALUE)
+    {
+      data[count++] = value;
+    }
+    // ACK, NACK and BUSY carry no data but do indicate a decoder responded.
+  }
+
+  OSMutexLock l(&lock_);
+  RailComDecoderState *state =
+    touch(fb.feedbackKey & KEY_ADDRESS_MASK,
+          fb.feedbackKey & KEY_LONG_ADDRESS, now);
+  uint8_t index = 0;
+  while (index + 1 < count)
+  {
+    const uint8_t id = data[index] >> 2;
+    const uint8_t value = ((data[index] & 0x03) << 6) | data[index + 1];
+    if (id == ID_POM)
+    {
+      if (fb.feedbackKey & KEY_POM_READ)
+      {
+        state->pom_cv = ((fb.feedbackKey >> KEY_CV_SHIFT) & KEY_CV_MASK) + 1;
+        state->pom_value = value;
+        state->pom_msec = now;
+      }
+      index += 2;
+    }
+    else if (id == ID_DYN && index + 2 < count)
+    {
+      const uint8_t subindex = data[index + 2];
+      if (subindex == DYN_SPEED_LOW)
+      {
+        state->speed_kmh = value;
+      }
+      else if (subindex == DYN_SPEED_HIGH)
+      {
+        state->speed_kmh = value + 256;
+      }
+      index += 3;
+    }
+    else
+    {
+      // unsupported datagram, the length of the remaining data can not be
+      // determined.
+      break;
+    }
+  }
+}
+
+RailComDecoderState *RailComDecoder::touch(uint16_t address,
+                                           bool long_address, uint32_t now)
+{
+  RailComDecoderState *oldest = &table_[0];
+  for (size_t index = 0; index < TABLE_SIZE; index++)
+  {
+    RailComDecoderState *entry = &table_[index];
+    if (entry->address == address && entry->long_address == long_address)
+    {
+      entry->last_seen_msec = now;
+      return entry;
+    }
+    if (!entry->address)
+    {
+      // unused entries are always preferred over replacing a decoder.
+      if (oldest->address)
+      {
+        oldest = entry;
+      }
+    }
+    else if (oldest->address &&
+             (now - entry->last_seen_msec) > (now - oldest->last_seen_msec))
+    {
+      oldest = entry;
+    }
+  }
+  oldest->address = address;
+  oldest->long_address = long_address;
+  oldest->last_seen_msec = now;
+  oldest->speed_kmh = RailComDecoderState::UNKNOWN_VALUE;
+  oldest->pom_cv = RailComDecoderState::UNKNOWN_VALUE;
+  oldest->pom_value = 0;
+  oldest->pom_msec = 0;
+  return oldest;
+}
+
+} // namespace esp32cs
\ No newline at end of file
@@ -0,0 +1,171 @@
+/**********************************************************************
+ESP32 COMMAND STATION
+
+COPYRIGHT (c) 2021 Mike Dunston
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see http://www.gnu.org/licenses
+**********************************************************************/
+
+#include "TrackUtilization.hxx"
+
+#include "sdkconfig.h"
+#include <algorithm>
+#include <esp_timer.h>
+#include <inttypes.h>
+#include <string.h>
+#include <utils/constants.hxx>
+#include <utils/logging.h>
+#include <utils/StringPrintf.hxx>
+
+namespace esp32cs
+{
+
+/// Names used for each @ref TrackPacketType in the json and log output.
+static constexpr const char * const PACKET_TYPE_NAMES[] =
+{
+  "priority",
+  "refresh",
+  "idle",
+  "accessory",
+  "service"
+};
+
+static_assert(sizeof(PACKET_TYPE_NAMES) / sizeof(PACKET_TYPE_NAMES[0]) ==
+                TrackUtilization::TYPE_COUNT,
+              "PACKET_TYPE_NAMES must have one entry per TrackPacketType");
+
+/// @return the current time in milliseconds.
+static inline uint32_t now_msec()
+{
+  return esp_timer_get_time() / 1000ULL;
+}
+
+uint8_t TrackUtilization::Usage::utilization() const
+{
+  if (window_msec == 0)
+  {
+    return 0;
+  }
+  uint64_t busy_usec = 0;
+  for (size_t type = 0; type < TYPE_COUNT; type++)
+  {
+    if (type != (size_t)TrackPacketType::IDLE)
+    {
+      busy_usec += bit_time_usec[type];
+    }
+  }
+  return std::min<uint64_t>(busy_usec / window_msec / 10, 100);
+}
+
+TrackUtilization::TrackUtilization(Service *service) : StateFlowBase(service)
+{
+  for (size_t type = 0; type < TYPE_COUNT; type++)
+  {
+    totals_.packets[type] = 0;
+    totals_.bit_time_usec[type] = 0;
+  }
+  totals_.idle_fallback = 0;
+  start_flow(STATE(sample));
+}
+
+void TrackUtilization::record(TrackPacketType type, uint32_t bit_time_usec,
+                              uint32_t count)
+{
+  const size_t index = (size_t)type;
+  totals_.packets[index].fetch_add(count, std::memory_order_relaxed);
+  totals_.bit_time_usec[index].fetch_add(bit_time_usec * count,
+                                         std::memory_order_relaxed);
+}
+
+TrackUtilization::Usage TrackUtilization::get_usage()
+{
+  Usage usage;
+  memset(&usage, 0, sizeof(Usage));
+
+  OSMutexLock l(&lock_);
+  if (sampleCount_ < 2)
+  {
+    return usage;
+  }
+  // the newest sample is the one before nextSample_ and the oldest is the
+  // first valid sample after it.
+  const size_t slots = WINDOW_SECONDS + 1;
+  const Sample &newest = samples_[(nextSample_ + slots - 1) % slots];
+  const Sample &oldest = samples_[(nextSample_ + slots - sampleCount_) % slots];
+  for (size_t type = 0; type < TYPE_COUNT; type++)
+  {
+    usage.packets[type] = newest.packets[type] - oldest.packets[type];
+    usage.bit_time_usec[type] =
+      newest.bit_time_usec[type] - oldest.bit_time_usec[type];
+  }
+  usage.idle_fallback = newest.idle_fallback - oldest.idle_fallback;
+  usage.window_msec = newest.timestamp_msec - oldest.timestamp_msec;
+  return usage;
+}
+
+std::string TrackUtilization::to_json()
+{
+  Usage usage = get_usage();
+  std::string json =
+    StringPrintf("{\"window\":%" PRIu32 ",\"usage\":%d,\"fallback\":%" PRIu32,
+                 usage.window_msec, usage.utilization(), usage.idle_fallback);
+  for (size_t type = 0; type < TYPE_COUNT; type++)
+  {
+    json.append(
+      StringPrintf(",\"%s\":{\"pkts\":%" PRIu32 ",\"us\":%" PRIu32 "}",
+                   PACKET_TYPE_NAMES[type], usage.packets[type],
+                   usage.bit_time_usec[type]));
+  }
+  json.append("}");
+  return json;
+}
+
+void TrackUtilization::log_usage()
+{
+  Usage usage = get_usage();
+  LOG(INFO,
+      "[DCC-Usage] %d%% over %" PRIu32 "ms, packets priority:%" PRIu32
+      " refresh:%" PRIu32 " idle:%" PRIu32 " (fallback:%" PRIu32 ") "
+      "accessory:%" PRIu32 " service:%" PRIu32,
+      usage.utilization(), usage.window_msec,
+      usage.packets[(size_t)TrackPacketType::PRIORITY],
+      usage.packets[(size_t)TrackPacketType::REFRESH],
+      usage.packets[(size_t)TrackPacketType::IDLE], usage.idle_fallback,
+      usage.packets[(size_t)TrackPacketType::ACCESSORY],
+      usage.packets[(size_t)TrackPacketType::SERVICE_MODE]);
+}
+
+StateFlowBase::Action TrackUtilization::sample()
+{
+  if (shutdown_)
+  {
+    return exit();
+  }
+  {
+    OSMutexLock l(&lock_);
+    Sample &entry = samples_[nextSample_];
+    for (size_t type = 0; type < TYPE_COUNT; type++)
+    {
+      entry.packets[type] =
+        totals_.packets[type].load(std::memory_order_relaxed);
+      entry.bit_time_usec[type] =
+        totals_.bit_time_usec[type].load(std::memory_order_relaxed);
+    }
+    entry.idle_fallback = totals_.idle_fallback.load(std::memory_order_relaxed);
+    entry.timestamp_msec = now_msec();
+    nextSample_ = (nextSample_ + 1) % (WINDOW_SECONDS + 1);
+    sampleCount_ = std::min(sampleCount_ + 1, WINDOW_SECONDS + 1);
+  }
+  return sleep_and_call(&timer_, SEC_TO_NSEC(1), STATE(sample));
+}
+
+} // namespace esp32cs
\ No newline at end of file
@@ -0,0 +1,181 @@
+/**********************************************************************
+ESP32 COMMAND STATION
+
+COPYRIGHT (c) 2021 Mike Dunston
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see http://www.gnu.org/licenses
+**********************************************************************/
+
+#ifndef BATCH_CV_READER_HXX_
+#define BATCH_CV_READER_HXX_
+
+#include <dcc/Packet.hxx>
+#include <dcc/ProgrammingTrackBackend.hxx>
+#include <executor/CallableFlow.hxx>
+#include <functional>
+#include <map>
+#include <utils/Singleton.hxx>
+#include <vector>
+
+namespace esp32cs
+{
+
+/// Request to read one or more CVs from the decoder on the PROG track.
+struct BatchCvReadRequest : public CallableFlowRequestBase
+{
+  /// Value reported for a CV that could not be read.
+  static constexpr int16_t READ_FAILED = -1;
+
+  /// Callback invoked after each CV has been read.
+  ///
+  /// @param request is the request being processed.
+  /// @param index is the index of the CV in @ref cvs that was read.
+  typedef std::function<void(BatchCvReadRequest *request, size_t index)>
+    ProgressCallback;
+
+  /// Sets up a request to read a list of CVs.
+  ///
+  /// @param cvs are the CV numbers (1-1024) to read.
+  /// @param guesses are the expected values of CVs, these will be verified
+  /// before falling back to a bit-wise read.
+  /// @param progress is invoked after each CV has been read, can be nullptr.
+  void reset(std::vector<uint16_t> cvs, std::map<uint16_t, uint8_t> guesses,
+             ProgressCallback progress)
+  {
+    reset_base();
+    this->cvs = std::move(cvs);
+    this->guesses = std::move(guesses);
+    this->progress = progress;
+    values.assign(this->cvs.size(), READ_FAILED);
+    operations = 0;
+    guessed = 0;
+  }
+
+  /// CV numbers to read.
+  std::vector<uint16_t> cvs;
+
+  /// Expected values of CVs.
+  std::map<uint16_t, uint8_t> guesses;
+
+  /// Callback invoked after each CV has been read.
+  ProgressCallback progress;
+
+  /// Value read for each entry in @ref cvs or @ref READ_FAILED.
+  std::vector<int16_t> values;
+
+  /// Number of verify operations sent to the decoder.
+  uint32_t operations;
+
+  /// Number of CVs that matched the guessed value.
+  uint32_t guessed;
+};
+
+/// Reads a batch of CVs from the decoder on the PROG track using direct mode
+/// verify operations.
+///
+/// The PROG track remains in service mode for the entire batch. Each verify
+/// operation is preceded by a burst of reset packets which also serves as the
+/// ACK window of the previous verify operation, this allows the next verify
+/// packet to follow immediately rather than waiting for a dedicated recovery
+/// period. When a value is known or likely for a CV it will be verified with
+/// a single byte verify before falling back to eight bit verify operations
+/// and a final byte verify.
+class BatchCvReader : public CallableFlow<BatchCvReadRequest>,
+                      public Singleton<BatchCvReader>
+{
+public:
+  /// Constructor.
+  ///
+  /// @param service is the @ref Service to execute on.
+  /// @param backend is the @ref ProgrammingTrackBackend to use.
+  BatchCvReader(Service *service, ProgrammingTrackBackend *backend)
+    : CallableFlow<BatchCvReadRequest>(service), backend_(backend)
+  {
+  }
+
+private:
+  /// Number of reset packets sent before each verify operation.
+  static constexpr unsigned RESET_COUNT = 6;
+
+  /// Number of times each verify packet is sent.
+  static constexpr unsigned VERIFY_COUNT = 5;
+
+  /// Number of attempts for a bit-wise read before the CV is reported as
+  /// failed.
+  static constexpr uint8_t MAX_ATTEMPTS = 2;
+
+  /// Type of verify operation.
+  enum class Verify : uint8_t
+  {
+    /// Byte verify of a guessed value.
+    GUESS,
+    /// Bit verify (bit is one).
+    BIT,
+    /// Byte verify of the value assembled from the bit verify operations.
+    BYTE
+  };
+
+  /// @ref ProgrammingTrackBackend to use.
+  ProgrammingTrackBackend *backend_;
+
+  /// Values read by previous requests, these are used as guesses when the
+  /// request does not provide one.
+  std::map<uint16_t, uint8_t> lastValues_;
+
+  /// Index of the CV currently being read.
+  size_t index_;
+
+  /// Current verify operation.
+  Verify verify_;
+
+  /// Bit being verified when @ref verify_ is @ref Verify::BIT.
+  uint8_t bit_;
+
+  /// Value being verified or assembled.
+  uint8_t value_;
+
+  /// Number of bit-wise read attempts for the current CV.
+  uint8_t attempts_;
+
+  /// True when a verify operation is waiting for its ACK window.
+  bool pending_;
+
+  /// True when an ACK was received for the pending verify operation.
+  bool ack_;
+
+  Action entry() override;
+  Action service_mode_entered();
+  Action send_window();
+  Action window_done();
+  Action send_verify();
+  Action verify_done();
+  Action service_mode_exited();
+
+  /// Starts reading the CV at @ref index_, invalid CVs are skipped.
+  ///
+  /// @return true if there is a CV to read.
+  bool start_cv();
+
+  /// Processes the result of the pending verify operation.
+  ///
+  /// @return true if there are more verify operations to perform.
+  bool process_result();
+
+  /// Records the value of the CV at @ref index_ and advances to the next CV.
+  ///
+  /// @param value is the value of the CV or @ref READ_FAILED.
+  void finish_cv(int16_t value);
+};
+
+} // namespace esp32cs
+
+#endif // BATCH_CV_READER_HXX_
\ No newline at end of file
@@ -18,6 +18,7 @@ COPYRIGHT (c) 2021 Mike Dunston
 #include "TrackOutputDescriptor.hxx"
 
 #include <executor/Service.hxx>
+#include <string>
 
 namespace openlcb
 {
@@ -32,4 +33,15 @@ void init_dcc(openlcb::Node *node, Service *service,
 
 void shutdown_dcc();
 
+/// Logs the measured RailCom cut-out phase timing, UART ISR timing and
+/// feedback counters, this is a no-op when RailCom is disabled.
+void log_railcom_timing();
+
+/// Logs the DCC signal generation diagnostics and resets the maximum ISR
+/// time.
+void log_signal_diagnostics();
+
+/// @return DCC signal generation and RailCom diagnostics in json format.
+std::string signal_diagnostics_json();
+
 } // namespace esp32cs
\ No newline at end of file
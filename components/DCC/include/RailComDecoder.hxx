@@ -0,0 +1,189 @@
+/**********************************************************************
+ESP32 COMMAND STATION
+
+COPYRIGHT (c) 2021 Mike Dunston
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see http://www.gnu.org/licenses
+**********************************************************************/
+
+#ifndef RAILCOM_DECODER_HXX_
+#define RAILCOM_DECODER_HXX_
+
+#include "sdkconfig.h"
+#include <atomic>
+#include <dcc/Packet.hxx>
+#include <dcc/RailcomHub.hxx>
+#include <os/OS.hxx>
+#include <RailComStateInterface.hxx>
+#include <string>
+#include <string.h>
+#include <utils/Singleton.hxx>
+
+#ifndef CONFIG_RAILCOM_DECODER_TABLE_SIZE
+#define CONFIG_RAILCOM_DECODER_TABLE_SIZE 32
+#endif
+
+namespace esp32cs
+{
+
+/// Decodes the 4/8 encoded RailCom feedback received from the track and
+/// retains the most recent detection, speed and POM read-back data for each
+/// decoder.
+///
+/// Channel 1 address broadcasts are used for detection of decoders on the
+/// track. Channel 2 data is attributed to the decoder that was addressed by
+/// the DCC packet that preceded the cut-out, this is identified via the
+/// feedback key generated by @ref feedback_key.
+class RailComDecoder : public dcc::RailcomHubPortInterface,
+                       public commandstation::RailComStateInterface,
+                       public Singleton<RailComDecoder>
+{
+public:
+  /// Number of decoders that feedback will be retained for.
+  static constexpr size_t TABLE_SIZE = CONFIG_RAILCOM_DECODER_TABLE_SIZE;
+
+  /// Constructor.
+  RailComDecoder()
+  {
+    memset(table_, 0, sizeof(table_));
+  }
+
+  /// Generates the feedback key for a DCC packet.
+  ///
+  /// @param packet is the DCC packet that will be sent to the track.
+  /// @return feedback key identifying the decoder (and CV for a POM read)
+  /// addressed by the packet or zero if the packet is not addressed to a
+  /// multi-function decoder.
+  ///
+  /// NOTE: This is safe to call from an ISR.
+  static uintptr_t feedback_key(const dcc::Packet &packet);
+
+  /// Processes a RailCom feedback packet received from the track.
+  ///
+  /// @param b is the buffer holding the feedback packet, this will be
+  /// released before returning.
+  /// @param priority is not used.
+  void send(Buffer<dcc::RailcomHubData> *b, unsigned priority) override;
+
+  /// Retrieves the RailCom feedback for a single decoder.
+  ///
+  /// @param address is the DCC address of the decoder.
+  /// @param long_address should be true when @param address is a long
+  /// address.
+  /// @param state will receive the feedback for the decoder.
+  /// @return true if feedback has been received from the decoder.
+  bool get_state(uint16_t address, bool long_address,
+                 commandstation::RailComDecoderState *state) override;
+
+  /// Retrieves the RailCom feedback for all known decoders.
+  ///
+  /// @param states will receive the feedback for each decoder.
+  /// @param max is the number of entries available in @param states.
+  /// @return the number of entries populated in @param states.
+  size_t get_states(commandstation::RailComDecoderState *states,
+                    size_t max) override;
+
+  /// @return the RailCom feedback for all known decoders in json format.
+  std::string to_json();
+
+private:
+  /// Marker used to identify feedback keys generated by @ref feedback_key.
+  static constexpr uintptr_t KEY_MARKER = 0xE0000000;
+
+  /// Mask used to validate @ref KEY_MARKER.
+  static constexpr uintptr_t KEY_MARKER_MASK = 0xE0000000;
+
+  /// Flag set in the feedback key when the packet is a POM CV read.
+  static constexpr uintptr_t KEY_POM_READ = 0x10000000;
+
+  /// Bit offset of the CV number in the feedback key.
+  static constexpr uint8_t KEY_CV_SHIFT = 16;
+
+  /// Mask for the CV number in the feedback key (after shifting).
+  static constexpr uintptr_t KEY_CV_MASK = 0x3FF;
+
+  /// Flag set in the feedback key when the packet used a long address.
+  static constexpr uintptr_t KEY_LONG_ADDRESS = 0x8000;
+
+  /// Mask for the DCC address in the feedback key.
+  static constexpr uintptr_t KEY_ADDRESS_MASK = 0x3FFF;
+
+  /// Decoded value that marks the end of the usable data.
+  static constexpr uint8_t MAX_DATA_VALUE = 0x3F;
+
+  /// RailCom mobile decoder datagram identifiers.
+  enum DatagramId : uint8_t
+  {
+    /// POM CV read-back.
+    ID_POM = 0,
+
+    /// High byte of the decoder address.
+    ID_ADR_HIGH = 1,
+
+    /// Low byte of the decoder address.
+    ID_ADR_LOW = 2,
+
+    /// Dynamic decoder state.
+    ID_DYN = 7,
+  };
+
+  /// Dynamic state sub-index for speed (0-255 km/h).
+  static constexpr uint8_t DYN_SPEED_LOW = 0;
+
+  /// Dynamic state sub-index for speed (256-511 km/h).
+  static constexpr uint8_t DYN_SPEED_HIGH = 1;
+
+  /// Decodes the channel 1 address broadcast.
+  ///
+  /// @param fb is the feedback to process.
+  /// @param now is the current time in milliseconds.
+  void decode_ch1(const dcc::Feedback &fb, uint32_t now);
+
+  /// Decodes the channel 2 datagrams for the addressed decoder.
+  ///
+  /// @param fb is the feedback to process.
+  /// @param now is the current time in milliseconds.
+  void decode_ch2(const dcc::Feedback &fb, uint32_t now);
+
+  /// Locates (or allocates) the table entry for a decoder and marks it as
+  /// having been seen.
+  ///
+  /// @param address is the DCC address of the decoder.
+  /// @param long_address should be true when @param address is a long
+  /// address.
+  /// @param now is the current time in milliseconds.
+  /// @return the table entry for the decoder.
+  ///
+  /// NOTE: @ref lock_ must be held by the caller.
+  commandstation::RailComDecoderState *touch(uint16_t address,
+                                             bool long_address, uint32_t now);
+
+  /// Table of decoders that feedback has been received from, entries with an
+  /// address of zero are unused.
+  commandstation::RailComDecoderState table_[TABLE_SIZE];
+
+  /// Lock protecting @ref table_.
+  OSMutex lock_;
+
+  /// Last channel 1 ADR_HIGH value received.
+  uint8_t adrHigh_{0};
+
+  /// True when @ref adrHigh_ was received in the previous cut-out.
+  bool adrHighValid_{false};
+
+  /// Number of feedback packets that contained invalid 4/8 encoded data.
+  std::atomic<uint32_t> invalidCount_{0};
+};
+
+} // namespace esp32cs
+
+#endif // RAILCOM_DECODER_HXX_
\ No newline at end of file
@@ -0,0 +1,229 @@
+/**********************************************************************
+ESP32 COMMAND STATION
+
+COPYRIGHT (c) 2021 Mike Dunston
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see http://www.gnu.org/licenses
+**********************************************************************/
+
+#ifndef TRACK_UTILIZATION_HXX_
+#define TRACK_UTILIZATION_HXX_
+
+#include <atomic>
+#include <dcc/Packet.hxx>
+#include <executor/Service.hxx>
+#include <executor/StateFlow.hxx>
+#include <os/OS.hxx>
+#include <string>
+#include <utils/Singleton.hxx>
+
+namespace esp32cs
+{
+
+/// Categories of DCC packets tracked by @ref TrackUtilization.
+enum class TrackPacketType : uint8_t
+{
+  /// Packets generated in response to a locomotive update or by an exclusive
+  /// packet source.
+  PRIORITY,
+
+  /// Packets generated as part of the background locomotive refresh.
+  REFRESH,
+
+  /// Idle packets sent when no other packet was available.
+  IDLE,
+
+  /// Accessory decoder packets.
+  ACCESSORY,
+
+  /// Service mode (programming track) packets.
+  SERVICE_MODE,
+
+  /// Number of packet types, this must be the last entry.
+  MAX_TYPES
+};
+
+/// Tracks the number of DCC packets and the time spent transmitting them on
+/// the track for each @ref TrackPacketType. Totals are sampled every second to
+/// provide usage over a rolling window.
+///
+/// Packets are recorded by the track device as they are encoded for
+/// transmission. Only the OPS track update loop knows whether a packet is a
+/// priority or refresh packet, it marks the background refresh packets via
+/// @ref set_refresh_packet and the track device determines the
+/// @ref TrackPacketType from the packet via @ref packet_type.
+class TrackUtilization : public StateFlowBase,
+                         public Singleton<TrackUtilization>
+{
+public:
+  /// Number of packet types that are tracked.
+  static constexpr size_t TYPE_COUNT = (size_t)TrackPacketType::MAX_TYPES;
+
+  /// Number of seconds covered by the rolling window.
+  static constexpr size_t WINDOW_SECONDS = 10;
+
+  /// Track usage over the rolling window.
+  struct Usage
+  {
+    /// Number of packets sent for each @ref TrackPacketType.
+    uint32_t packets[TYPE_COUNT];
+
+    /// Number of microseconds spent sending each @ref TrackPacketType.
+    uint32_t bit_time_usec[TYPE_COUNT];
+
+    /// Number of times the update loop had no packet to send and generated an
+    /// idle packet instead.
+    uint32_t idle_fallback;
+
+    /// Number of milliseconds covered by this usage data.
+    uint32_t window_msec;
+
+    /// @return percentage of the window that was spent sending packets other
+    /// than idle packets.
+    uint8_t utilization() const;
+  };
+
+  /// Constructor.
+  ///
+  /// @param service is the @ref Service to use for the periodic sampling.
+  TrackUtilization(Service *service);
+
+  /// Records a DCC packet being sent to the track.
+  ///
+  /// @param type is the @ref TrackPacketType of the packet.
+  /// @param bit_time_usec is the time required to transmit a single copy of
+  /// the packet.
+  /// @param count is the number of times the packet will be transmitted.
+  ///
+  /// NOTE: This is safe to call from an ISR.
+  void record(TrackPacketType type, uint32_t bit_time_usec, uint32_t count);
+
+  /// Marks a packet as being generated by the background refresh.
+  ///
+  /// @param packet is the DCC packet to mark.
+  /// @param refresh should be true for background refresh packets.
+  ///
+  /// NOTE: This uses the reserved bit of the packet header which is not
+  /// used by the track interface.
+  static void set_refresh_packet(dcc::Packet *packet, bool refresh)
+  {
+    packet->packet_header.reserved = refresh ? 1 : 0;
+  }
+
+  /// @param packet is the DCC packet to check.
+  /// @return the @ref TrackPacketType of the packet.
+  static TrackPacketType packet_type(const dcc::Packet &packet)
+  {
+    if (packet.packet_header.send_long_preamble)
+    {
+      return TrackPacketType::SERVICE_MODE;
+    }
+    else if (packet.dlc && packet.payload[0] == 0xFF)
+    {
+      return TrackPacketType::IDLE;
+    }
+    else if (packet.dlc && packet.payload[0] >= 128 &&
+             packet.payload[0] <= 191)
+    {
+      return TrackPacketType::ACCESSORY;
+    }
+    else if (packet.packet_header.reserved)
+    {
+      return TrackPacketType::REFRESH;
+    }
+    return TrackPacketType::PRIORITY;
+  }
+
+  /// Records that the update loop generated an idle packet due to having no
+  /// other packet to send.
+  void record_idle_fallback()
+  {
+    totals_.idle_fallback.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  /// @return @ref Usage for the rolling window.
+  Usage get_usage();
+
+  /// @return @ref Usage for the rolling window in json format.
+  std::string to_json();
+
+  /// Logs the @ref Usage for the rolling window.
+  void log_usage();
+
+  /// Stops the periodic sampling.
+  void stop()
+  {
+    shutdown_ = true;
+    set_terminated();
+    timer_.ensure_triggered();
+  }
+
+private:
+  /// Running totals, these are updated from ISR and task context.
+  struct Totals
+  {
+    /// Number of packets sent for each @ref TrackPacketType.
+    std::atomic<uint32_t> packets[TYPE_COUNT];
+
+    /// Number of microseconds spent sending each @ref TrackPacketType.
+    std::atomic<uint32_t> bit_time_usec[TYPE_COUNT];
+
+    /// Number of idle packets generated by the update loop.
+    std::atomic<uint32_t> idle_fallback;
+  };
+
+  /// Copy of @ref Totals taken at a point in time.
+  struct Sample
+  {
+    /// Number of packets sent for each @ref TrackPacketType.
+    uint32_t packets[TYPE_COUNT];
+
+    /// Number of microseconds spent sending each @ref TrackPacketType.
+    uint32_t bit_time_usec[TYPE_COUNT];
+
+    /// Number of idle packets generated by the update loop.
+    uint32_t idle_fallback;
+
+    /// Time the sample was taken in milliseconds.
+    uint32_t timestamp_msec;
+  };
+
+  /// Running totals since startup.
+  Totals totals_;
+
+  /// Samples of @ref totals_ taken once per second, the oldest entry is
+  /// replaced by each new sample.
+  Sample samples_[WINDOW_SECONDS + 1];
+
+  /// Index into @ref samples_ where the next sample will be stored.
+  size_t nextSample_{0};
+
+  /// Number of valid entries in @ref samples_.
+  size_t sampleCount_{0};
+
+  /// Lock protecting @ref samples_.
+  OSMutex lock_;
+
+  /// @ref StateFlowTimer used for periodic wakeup.
+  StateFlowTimer timer_{this};
+
+  /// Internal flag to track if a shutdown request has been requested.
+  bool shutdown_{false};
+
+  /// Records a sample of @ref totals_ and sleeps until the next sample is
+  /// due.
+  Action sample();
+};
+
+} // namespace esp32cs
+
+#endif // TRACK_UTILIZATION_HXX_
\ No newline at end of file
@@ -0,0 +1,61 @@
+/**********************************************************************
+ESP32 COMMAND STATION
+
+COPYRIGHT (c) 2021 Mike Dunston
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see http://www.gnu.org/licenses
+**********************************************************************/
+
+#ifndef CPU_CYCLE_COUNT_HXX_
+#define CPU_CYCLE_COUNT_HXX_
+
+#include "sdkconfig.h"
+#include <esp_idf_version.h>
+#include <stdint.h>
+
+#if ESP_IDF_VERSION_MAJOR >= 5
+#include <esp_cpu.h>
+#include <esp_private/esp_clk.h>
+#else
+#include <hal/cpu_hal.h>
+#if CONFIG_IDF_TARGET_ESP32
+#include <esp32/clk.h>
+#elif CONFIG_IDF_TARGET_ESP32S3
+#include <esp32s3/clk.h>
+#endif
+#endif // IDF v5+
+
+namespace esp32cs
+{
+
+/// @return the current CPU cycle count, this is safe to call from an ISR.
+static inline uint32_t get_cycle_count()
+{
+#if ESP_IDF_VERSION_MAJOR >= 5
+  return esp_cpu_get_cycle_count();
+#else
+  return cpu_hal_get_cycle_count();
+#endif // IDF v5+
+}
+
+/// Converts a number of CPU cycles to nanoseconds.
+///
+/// @param cycles is the number of CPU cycles to convert.
+/// @return the number of nanoseconds for the CPU cycles.
+static inline uint32_t cycles_to_nsec(uint32_t cycles)
+{
+  return (cycles * 1000ULL) / (esp_clk_cpu_freq() / 1000000);
+}
+
+} // namespace esp32cs
+
+#endif // CPU_CYCLE_COUNT_HXX_
\ No newline at end of file
@@ -18,9 +18,14 @@ COPYRIGHT (c) 2020 Mike Dunston
 #ifndef ESP32_RAILCOM_DRIVER_HXX_
 #define ESP32_RAILCOM_DRIVER_HXX_
 
+#include "CpuCycleCount.hxx"
+#include "RailComCutout.hxx"
+#include <algorithm>
+#include <atomic>
 #include <dcc/RailCom.hxx>
 #include <dcc/RailcomHub.hxx>
 #include <esp_intr_alloc.h>
+#include <executor/StateFlow.hxx>
 
 #include <esp_rom_gpio.h>
 #if ESP_IDF_VERSION_MAJOR >= 5
@@ -33,6 +38,7 @@ COPYRIGHT (c) 2020 Mike Dunston
 #include <freertos_drivers/arduino/DeviceBuffer.hxx>
 #include <freertos_drivers/arduino/RailcomDriver.hxx>
 #include <hal/uart_types.h>
+#include <inttypes.h>
 #include <os/Gpio.hxx>
 #include <soc/dport_reg.h>
 #include <soc/gpio_periph.h>
@@ -52,12 +58,97 @@ static void esp32_railcom_uart_isr(void *param);
 
 static portMUX_TYPE esp32_uart_mux = portMUX_INITIALIZER_UNLOCKED;
 static portMUX_TYPE esp32_timer_mux = portMUX_INITIALIZER_UNLOCKED;
+static portMUX_TYPE esp32_feedback_mux = portMUX_INITIALIZER_UNLOCKED;
 
 static constexpr uint32_t ESP32_UART_CLEAR_ALL_INTERRUPTS = 0xFFFFFFFF;
 static constexpr uint32_t ESP32_UART_DISABLE_ALL_INTERRUPTS = 0x00000000;
 static constexpr uint32_t ESP32_UART_RX_INTERRUPT_BITS =
   UART_RXFIFO_FULL_INT_ENA | UART_RXFIFO_TOUT_INT_ENA;
 
+/// Delivers RailCom feedback collected by @ref Esp32RailComDriver to the
+/// @ref dcc::RailcomHubFlow. The driver wakes this flow once per cut-out that
+/// produced feedback and all pending feedback is delivered in one pass.
+class Esp32RailComFeedbackFlow : public StateFlowBase
+{
+public:
+  /// Constructor.
+  ///
+  /// @param service is the @ref Service to execute this flow on.
+  /// @param buffer is the @ref DeviceBuffer holding pending feedback.
+  /// @param hub is the @ref dcc::RailcomHubFlow to deliver feedback to.
+  Esp32RailComFeedbackFlow(Service *service,
+                           DeviceBuffer<dcc::RailcomHubData> *buffer,
+                           dcc::RailcomHubFlow *hub)
+    : StateFlowBase(service), buffer_(buffer), hub_(hub)
+  {
+    start_flow(STATE(deliver));
+  }
+
+  /// Wakes up the flow to deliver pending feedback.
+  ///
+  /// NOTE: This is safe to call from an ISR.
+  void notify_feedback_from_isr()
+  {
+    if (!pending_.exchange(true))
+    {
+      notify_from_isr();
+    }
+  }
+
+  /// @return the number of feedback entries delivered to the hub.
+  uint32_t delivered()
+  {
+    return deliveredCount_;
+  }
+
+private:
+  /// @ref DeviceBuffer holding pending feedback.
+  DeviceBuffer<dcc::RailcomHubData> *buffer_;
+
+  /// @ref dcc::RailcomHubFlow to deliver feedback to.
+  dcc::RailcomHubFlow *hub_;
+
+  /// Set when a wakeup of this flow is pending, this starts as true so that
+  /// no wakeup is requested before the flow has started.
+  std::atomic<bool> pending_{true};
+
+  /// Number of feedback entries delivered to the hub.
+  uint32_t deliveredCount_{0};
+
+  /// Delivers all pending feedback to the hub and waits for more.
+  Action deliver()
+  {
+    pending_.store(false);
+    while (true)
+    {
+      dcc::RailcomHubData *entry = nullptr;
+      portENTER_CRITICAL_SAFE(&esp32_feedback_mux);
+      size_t count = buffer_->data_read_pointer(&entry);
+      portEXIT_CRITICAL_SAFE(&esp32_feedback_mux);
+      if (!count)
+      {
+        break;
+      }
+      auto *b = hub_->alloc();
+      b->data()->reset(entry->feedbackKey);
+      for (uint8_t idx = 0; idx < entry->ch1Size; idx++)
+      {
+        b->data()->add_ch1_data(entry->ch1Data[idx]);
+      }
+      for (uint8_t idx = 0; idx < entry->ch2Size; idx++)
+      {
+        b->data()->add_ch2_data(entry->ch2Data[idx]);
+      }
+      portENTER_CRITICAL_SAFE(&esp32_feedback_mux);
+      buffer_->consume(1);
+      portEXIT_CRITICAL_SAFE(&esp32_feedback_mux);
+      hub_->send(b);
+      deliveredCount_++;
+    }
+    return wait_and_call(STATE(deliver));
+  }
+};
+
 template <class HW, class DCC_BOOSTER, class OLCB_DCC_BOOSTER>
 class Esp32RailComDriver : public RailcomDriver
 {
@@ -70,6 +161,9 @@ public:
   void hw_init(dcc::RailcomHubFlow *hubFlow)
   {
     railComHubFlow_ = hubFlow;
+    feedbackFlow_ = new Esp32RailComFeedbackFlow(hubFlow->service(),
+                                                 railComFeedbackBuffer_,
+                                                 hubFlow);
 
 #if CONFIG_RAILCOM_FULL
     HW::hw_init();
@@ -118,30 +212,16 @@ public:
     // NOOP
   }
 
+  /// Starts the RailCom cut-out, this is called from the RMT TX complete ISR
+  /// after the final bit of the packet has been sent.
+  ///
+  /// NOTE: The booster outputs are disabled before returning, all remaining
+  /// cut-out phases are driven by the hardware timer so no time is spent
+  /// waiting within the ISR.
   void start_cutout() override
   {
-    ets_delay_us(DCC_BOOSTER::start_railcom_cutout_phase1() +
-                 OLCB_DCC_BOOSTER::start_railcom_cutout_phase1());
-
-#if CONFIG_RAILCOM_FULL
-    portENTER_CRITICAL_SAFE(&esp32_uart_mux);
-    // flush the uart queue of any pending data
-    rx_to_buf(nullptr, 0);
-
-    // clear all pending interrupts and enable default RX interrupts.
-    SET_PERI_REG_MASK(UART_INT_CLR_REG(HW::UART), ESP32_UART_RX_INTERRUPT_BITS);
-    SET_PERI_REG_MASK(UART_INT_ENA_REG(HW::UART), ESP32_UART_RX_INTERRUPT_BITS);
-    portEXIT_CRITICAL_SAFE(&esp32_uart_mux);
-#endif // CONFIG_RAILCOM_FULL
-
-    // enable the RailCom detector
-    ets_delay_us(DCC_BOOSTER::start_railcom_cutout_phase2() + 
-                 OLCB_DCC_BOOSTER::start_railcom_cutout_phase2());
-
     portENTER_CRITICAL_SAFE(&esp32_timer_mux);
-    // set our phase and start the timer
-    railcomPhase_ = RailComPhase::CUTOUT_PHASE1;
-    start_timer(HW::RAILCOM_MAX_READ_DELAY_CH_1);
+    cutout_.start();
     portEXIT_CRITICAL_SAFE(&esp32_timer_mux);
   }
 
@@ -155,28 +235,21 @@ public:
     // NO OP
   }
 
+  /// Ends the RailCom receive window and commits any feedback that was
+  /// received during the cut-out. The booster outputs will be re-enabled by
+  /// the timer once the detector has been disabled.
   void end_cutout() override
   {
 #if CONFIG_RAILCOM_FULL
     portENTER_CRITICAL_SAFE(&esp32_uart_mux);
-    // disable the UART RX interrupts
+    // disable the UART RX interrupts and collect any data that arrived
+    // since the last RX interrupt.
     HW::UART_BASE->int_clr.val = ESP32_UART_CLEAR_ALL_INTERRUPTS;
     HW::UART_BASE->int_ena.val = ESP32_UART_DISABLE_ALL_INTERRUPTS;
+    rx_to_feedback(activeFeedback_);
     portEXIT_CRITICAL_SAFE(&esp32_uart_mux);
 #endif // CONFIG_RAILCOM_FULL
-    // disable the RailCom detector
-    ets_delay_us(DCC_BOOSTER::stop_railcom_cutout_phase1() +
-                 OLCB_DCC_BOOSTER::stop_railcom_cutout_phase1());
-    DCC_BOOSTER::stop_railcom_cutout_phase2();
-    OLCB_DCC_BOOSTER::stop_railcom_cutout_phase2();
-    if (DCC_BOOSTER::should_be_enabled())
-    {
-      DCC_BOOSTER::enable_output();
-    }
-    if (OLCB_DCC_BOOSTER::should_be_enabled())
-    {
-      OLCB_DCC_BOOSTER::enable_output();
-    }
+    commit_feedback();
   }
 
   void set_feedback_key(uint32_t key) override
@@ -189,72 +262,224 @@ public:
     portENTER_CRITICAL_SAFE(&esp32_timer_mux);
     // clear the interrupt status register for our timer
     HW::TIMER_BASE->int_clr_timers.val = BIT(HW::TIMER_IDX);
+    cutout_.tick();
+    portEXIT_CRITICAL_SAFE(&esp32_timer_mux);
+  }
+
+  typedef typename RailComCutout<Esp32RailComDriver>::Phase RailComPhase;
+
+  RailComPhase railcom_phase()
+  {
+    return cutout_.phase();
+  }
+
+  /// UART RX interrupt handler, drains the UART FIFO into the feedback slot
+  /// for the current cut-out.
+  void uart_isr()
+  {
+    uint32_t start_cycles = get_cycle_count();
+    portENTER_CRITICAL_SAFE(&esp32_uart_mux);
+    rx_to_feedback(activeFeedback_);
+    // clear interrupt status
+    HW::UART_BASE->int_clr.val = ESP32_UART_CLEAR_ALL_INTERRUPTS;
+    portEXIT_CRITICAL_SAFE(&esp32_uart_mux);
+    uint32_t cycles = get_cycle_count() - start_cycles;
+    isrCycles_ = cycles;
+    isrMaxCycles_ = std::max(isrMaxCycles_, cycles);
+  }
+
+  /// @return the number of nanoseconds spent in the most recent UART ISR.
+  uint32_t isr_last_nsec()
+  {
+    return cycles_to_nsec(isrCycles_);
+  }
 
-    if (railcomPhase_ == RailComPhase::CUTOUT_PHASE1)
+  /// @return the maximum number of nanoseconds spent in the UART ISR.
+  ///
+  /// @param reset when true the maximum will be reset.
+  uint32_t isr_max_nsec(bool reset = false)
+  {
+    uint32_t cycles = isrMaxCycles_;
+    if (reset)
     {
-      middle_cutout();
+      isrMaxCycles_ = 0;
+    }
+    return cycles_to_nsec(cycles);
+  }
+
+  /// @return the number of cut-outs with feedback that was discarded, either
+  /// due to the feedback queue being full or receiving more data than the
+  /// RailCom channel can hold.
+  uint32_t overruns()
+  {
+    return overrunCount_;
+  }
+
+  /// @return the number of cut-outs that produced feedback.
+  uint32_t feedback_count()
+  {
+    return feedbackCount_;
+  }
 
-      railcomPhase_ = RailComPhase::CUTOUT_PHASE2;
-      start_timer(HW::RAILCOM_MAX_READ_DELAY_CH_2);
+  /// @return the number of cut-outs that were skipped due to the previous
+  /// cut-out still being active.
+  uint32_t skipped_cutouts()
+  {
+    return cutout_.skipped();
+  }
+
+  /// Logs the measured cut-out phase timing.
+  ///
+  /// @param reset when true the timing statistics will be reset.
+  void log_timing(bool reset = false)
+  {
+    typedef RailComCutout<Esp32RailComDriver> Cutout;
+    uint32_t min[Cutout::BOUNDARY_COUNT];
+    uint32_t avg[Cutout::BOUNDARY_COUNT];
+    uint32_t max[Cutout::BOUNDARY_COUNT];
+    portENTER_CRITICAL_SAFE(&esp32_timer_mux);
+    for (uint8_t idx = 0; idx < Cutout::BOUNDARY_COUNT; idx++)
+    {
+      const auto &timing = cutout_.timing((typename Cutout::Boundary)idx);
+      min[idx] = timing.count ? timing.min : 0;
+      avg[idx] = timing.count ? timing.total / timing.count : 0;
+      max[idx] = timing.max;
     }
-    else if (railcomPhase_ == RailComPhase::CUTOUT_PHASE2)
+    if (reset)
     {
-      end_cutout();
-      railcomPhase_ = RailComPhase::PRE_CUTOUT;
+      cutout_.reset_timing();
     }
     portEXIT_CRITICAL_SAFE(&esp32_timer_mux);
+    for (uint8_t idx = 0; idx < Cutout::BOUNDARY_COUNT; idx++)
+    {
+      min[idx] = cycles_to_nsec(min[idx]) / 1000;
+      avg[idx] = cycles_to_nsec(avg[idx]) / 1000;
+      max[idx] = cycles_to_nsec(max[idx]) / 1000;
+    }
+    LOG(INFO,
+        "[RailCom] Cut-out timing (usec min/avg/max) ch1-start:%" PRIu32 "/%"
+        PRIu32 "/%" PRIu32 " ch1-end:%" PRIu32 "/%" PRIu32 "/%" PRIu32
+        " (limit:%" PRIu32 ") ch2-end:%" PRIu32 "/%" PRIu32 "/%" PRIu32
+        " (limit:%" PRIu32 ") end:%" PRIu32 "/%" PRIu32 "/%" PRIu32
+        " (limit:%" PRIu32 "), skipped:%" PRIu32,
+        min[Cutout::CH1_START], avg[Cutout::CH1_START], max[Cutout::CH1_START],
+        min[Cutout::CH1_END], avg[Cutout::CH1_END], max[Cutout::CH1_END],
+        RailComTimingLimits::CH1_END_USEC,
+        min[Cutout::CH2_END], avg[Cutout::CH2_END], max[Cutout::CH2_END],
+        RailComTimingLimits::CH2_END_USEC,
+        min[Cutout::CUTOUT_END], avg[Cutout::CUTOUT_END],
+        max[Cutout::CUTOUT_END], RailComTimingLimits::CUTOUT_END_USEC,
+        cutout_.skipped());
+  }
+
+private:
+  friend class RailComCutout<Esp32RailComDriver>;
+
+  static_assert(RailComTimingLimits::valid<HW>(),
+                "RailCom cut-out timing is outside of the NMRA S-9.3.2 limits");
+
+  /// @ref RailComCutout HAL: disables the booster outputs.
+  ///
+  /// @return number of microseconds to wait before enabling the detector.
+  uint32_t cutout_start_phase1()
+  {
+    return DCC_BOOSTER::start_railcom_cutout_phase1() +
+           OLCB_DCC_BOOSTER::start_railcom_cutout_phase1();
   }
 
-  typedef enum : uint8_t
+  /// @ref RailComCutout HAL: enables the RailCom detector.
+  ///
+  /// @return number of microseconds to wait before the channel 1 window.
+  uint32_t cutout_start_phase2()
   {
-    PRE_CUTOUT,
-    CUTOUT_PHASE1,
-    CUTOUT_PHASE2
-  } RailComPhase;
+    return DCC_BOOSTER::start_railcom_cutout_phase2() +
+           OLCB_DCC_BOOSTER::start_railcom_cutout_phase2();
+  }
 
-  RailComPhase railcom_phase()
+  /// @ref RailComCutout HAL: disables the RailCom detector.
+  ///
+  /// @return number of microseconds to wait before re-enabling the booster
+  /// outputs.
+  uint32_t cutout_stop_phase1()
   {
-    return railcomPhase_;
+    return DCC_BOOSTER::stop_railcom_cutout_phase1() +
+           OLCB_DCC_BOOSTER::stop_railcom_cutout_phase1();
   }
 
-  dcc::RailcomHubData *railcom_buffer()
+  /// @ref RailComCutout HAL: re-enables the booster outputs.
+  void cutout_stop_phase2()
   {
-    dcc::RailcomHubData *data = nullptr;
-    if (railComFeedbackBuffer_->data_write_pointer(&data) > 0)
+    DCC_BOOSTER::stop_railcom_cutout_phase2();
+    OLCB_DCC_BOOSTER::stop_railcom_cutout_phase2();
+    if (DCC_BOOSTER::should_be_enabled())
+    {
+      DCC_BOOSTER::enable_output();
+    }
+    if (OLCB_DCC_BOOSTER::should_be_enabled())
     {
-      data->reset(railcomFeedbackKey_);
+      OLCB_DCC_BOOSTER::enable_output();
     }
-    return data;
   }
 
-  void advance_railcom_buffer()
+  /// @ref RailComCutout HAL: channel 1 window has closed.
+  void receive_middle()
   {
-    railComFeedbackBuffer_->advance(1);
-    railComFeedbackBuffer_->signal_condition_from_isr();
+    middle_cutout();
   }
 
-  size_t rx_to_buf(uint8_t *buf, size_t max_len)
+  /// @ref RailComCutout HAL: channel 2 window has closed.
+  void receive_end()
   {
-    size_t rx_bytes = 0;
-#if CONFIG_RAILCOM_FULL
-    // NOTE: Due to a hardware issue when flushing the RX FIFO it is necessary
-    // to read the FIFO until the RX count is zero *AND* read/write addresses
-    // in the RX buffer are the same.
-    while(HW::UART_BASE->status.rxfifo_cnt ||
-          (HW::UART_BASE->mem_rx_status.wr_addr !=
-           HW::UART_BASE->mem_rx_status.rd_addr))
+    end_cutout();
+  }
+
+  /// @ref RailComCutout HAL: starts the hardware timer.
+  ///
+  /// @param usec is the number of microseconds until the timer expires.
+  void timer_start(uint32_t usec)
+  {
+    start_timer(usec);
+  }
+
+  /// @ref RailComCutout HAL: timestamp for the timing statistics.
+  ///
+  /// @return the current CPU cycle count.
+  uint32_t timestamp()
+  {
+    return get_cycle_count();
+  }
+
+  /// @ref RailComCutout HAL: reserves the feedback slot for the cut-out and
+  /// enables the UART RX interrupts.
+  void receive_start()
+  {
+    // reserve the feedback slot for this cut-out, the UART data will be
+    // written directly into it and it will be committed by end_cutout().
+    activeFeedback_ = nullptr;
+    portENTER_CRITICAL_SAFE(&esp32_feedback_mux);
+    if (railComFeedbackBuffer_->data_write_pointer(&activeFeedback_) > 0)
     {
-      uint8_t ch = HW::UART_BASE->fifo.rw_byte;
-      if (rx_bytes < max_len)
-      {
-        buf[rx_bytes++] = ch;
-      }
+      activeFeedback_->reset(railcomFeedbackKey_);
     }
+    else
+    {
+      activeFeedback_ = nullptr;
+      overrunCount_++;
+    }
+    portEXIT_CRITICAL_SAFE(&esp32_feedback_mux);
+
+#if CONFIG_RAILCOM_FULL
+    portENTER_CRITICAL_SAFE(&esp32_uart_mux);
+    // flush the uart queue of any pending data
+    rx_to_feedback(nullptr);
+
+    // clear all pending interrupts and enable default RX interrupts.
+    SET_PERI_REG_MASK(UART_INT_CLR_REG(HW::UART), ESP32_UART_RX_INTERRUPT_BITS);
+    SET_PERI_REG_MASK(UART_INT_ENA_REG(HW::UART), ESP32_UART_RX_INTERRUPT_BITS);
+    portEXIT_CRITICAL_SAFE(&esp32_uart_mux);
 #endif // CONFIG_RAILCOM_FULL
-    return rx_bytes;
   }
 
-private:
   void configure_timer(bool reload, uint16_t divider, bool enable, bool count_up, uint64_t alarm, bool alarm_en)
   {
     portENTER_CRITICAL_SAFE(&esp32_timer_mux);
@@ -348,11 +573,102 @@ private:
 #endif
   }
 
+  /// Reads all pending data from the UART FIFO into the feedback slot.
+  ///
+  /// @param feedback is the feedback slot to add the data to, when nullptr
+  /// the data will be discarded.
+  ///
+  /// NOTE: Due to a hardware issue when flushing the RX FIFO it is necessary
+  /// to read the FIFO until the RX count is zero *AND* read/write addresses
+  /// in the RX buffer are the same.
+  void rx_to_feedback(dcc::RailcomHubData *feedback)
+  {
+#if CONFIG_RAILCOM_FULL
+    bool overrun = false;
+    while(HW::UART_BASE->status.rxfifo_cnt ||
+          (HW::UART_BASE->mem_rx_status.wr_addr !=
+           HW::UART_BASE->mem_rx_status.rd_addr))
+    {
+      uint8_t ch = HW::UART_BASE->fifo.rw_byte;
+      if (!feedback)
+      {
+        continue;
+      }
+      else if (cutout_.phase() == RailComPhase::CUTOUT_PHASE1)
+      {
+        if (feedback->ch1Size < sizeof(feedback->ch1Data))
+        {
+          feedback->add_ch1_data(ch);
+        }
+        else
+        {
+          overrun = true;
+        }
+      }
+      else if (feedback->ch2Size < sizeof(feedback->ch2Data))
+      {
+        feedback->add_ch2_data(ch);
+      }
+      else
+      {
+        overrun = true;
+      }
+    }
+    if (overrun)
+    {
+      overrunCount_++;
+    }
+#endif // CONFIG_RAILCOM_FULL
+  }
+
+  /// Commits the feedback slot for the current cut-out and wakes up the
+  /// @ref Esp32RailComFeedbackFlow, cut-outs without data are discarded.
+  void commit_feedback()
+  {
+    dcc::RailcomHubData *feedback = activeFeedback_;
+    activeFeedback_ = nullptr;
+    if (!feedback || (!feedback->ch1Size && !feedback->ch2Size))
+    {
+      return;
+    }
+    portENTER_CRITICAL_SAFE(&esp32_feedback_mux);
+    railComFeedbackBuffer_->advance(1);
+    portEXIT_CRITICAL_SAFE(&esp32_feedback_mux);
+    feedbackCount_++;
+    if (feedbackFlow_)
+    {
+      feedbackFlow_->notify_feedback_from_isr();
+    }
+  }
+
   uintptr_t railcomFeedbackKey_{0}; 
   dcc::RailcomHubFlow *railComHubFlow_;
   DeviceBuffer<dcc::RailcomHubData> *railComFeedbackBuffer_;
-  RailComPhase railcomPhase_{RailComPhase::PRE_CUTOUT};
+
+  /// Sequencer for the cut-out phases.
+  RailComCutout<Esp32RailComDriver> cutout_{this,
+                                            HW::RAILCOM_MAX_READ_DELAY_CH_1,
+                                            HW::RAILCOM_MAX_READ_DELAY_CH_2};
   bool enabled_{false};
+
+  /// Feedback slot in @ref railComFeedbackBuffer_ for the current cut-out,
+  /// nullptr when there is no cut-out active or the buffer is full.
+  dcc::RailcomHubData *activeFeedback_{nullptr};
+
+  /// Flow delivering feedback to @ref railComHubFlow_.
+  Esp32RailComFeedbackFlow *feedbackFlow_{nullptr};
+
+  /// Number of CPU cycles spent in the most recent UART ISR.
+  uint32_t isrCycles_{0};
+
+  /// Maximum number of CPU cycles spent in the UART ISR.
+  uint32_t isrMaxCycles_{0};
+
+  /// Number of cut-outs with discarded feedback.
+  uint32_t overrunCount_{0};
+
+  /// Number of cut-outs that produced feedback.
+  uint32_t feedbackCount_{0};
 };
 
 template <class HW, class DCC_BOOSTER, class OLCB_DCC_BOOSTER>
@@ -366,31 +682,9 @@ static void esp32_railcom_timer_tick(void *param)
 template <class HW, class DCC_BOOSTER, class OLCB_DCC_BOOSTER>
 static void esp32_railcom_uart_isr(void *param)
 {
-  portENTER_CRITICAL_SAFE(&esp32_uart_mux);
   Esp32RailComDriver<HW, DCC_BOOSTER, OLCB_DCC_BOOSTER> *driver =
     reinterpret_cast<Esp32RailComDriver<HW, DCC_BOOSTER, OLCB_DCC_BOOSTER> *>(param);
-  dcc::RailcomHubData *fb = driver->railcom_buffer();
-  uint8_t rx_buf[6] = {0, 0, 0, 0, 0, 0};
-  size_t rx_bytes = driver->rx_to_buf(rx_buf, 6);
-  if (fb)
-  {
-    for (size_t idx = 0; idx < rx_bytes; idx++)
-    {
-      if (driver->railcom_phase() ==
-          Esp32RailComDriver<HW, DCC_BOOSTER, OLCB_DCC_BOOSTER>::RailComPhase::CUTOUT_PHASE1)
-      {
-        fb->add_ch1_data(rx_buf[idx]);
-      }
-      else
-      {
-        fb->add_ch2_data(rx_buf[idx]);
-      }
-    }
-    driver->advance_railcom_buffer();
-  }
-  // clear interrupt status
-  HW::UART_BASE->int_clr.val = ESP32_UART_CLEAR_ALL_INTERRUPTS;
-  portEXIT_CRITICAL_SAFE(&esp32_uart_mux);
+  driver->uart_isr();
 }
 
 } // namespace esp32cs
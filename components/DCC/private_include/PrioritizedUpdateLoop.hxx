@@ -18,10 +18,15 @@ COPYRIGHT (c) 2020-2021 Mike Dunston
 #ifndef PRIORITIZED_UPDATE_LOOP_HXX_
 #define PRIORITIZED_UPDATE_LOOP_HXX_
 
+#include "sdkconfig.h"
+
+#include <dcc/Loco.hxx>
 #include <dcc/PacketFlowInterface.hxx>
 #include <dcc/UpdateLoop.hxx>
 #include <executor/StateFlow.hxx>
 #include <Spinlock.hxx>
+#include <unordered_map>
+#include <vector>
 
 namespace esp32cs
 {
@@ -33,15 +38,34 @@ namespace esp32cs
 /// or updating speed step) it will be sent ahead of other background refresh
 /// packets. Similarly an e-stop packet source will be given highest priority
 /// and suppress any other packets being sent.
-class PrioritizedUpdateLoop : public StateFlow<Buffer<dcc::Packet>, QList<1>>,
-                              private dcc::UpdateLoopBase
+///
+/// Background refresh packets are requested from each packet source by
+/// packet class (speed and each function group, see
+/// @ref dcc::DccTrainUpdateCode) with function groups using a longer refresh
+/// delay than speed. Function groups above F4 are only refreshed after they
+/// have been updated at least once.
+///
+/// When CONFIG_DCC_ADAPTIVE_REFRESH is enabled locomotives that are stopped
+/// and have not been updated recently will have their background refresh
+/// delay doubled on each refresh up to the configured idle refresh delay, any
+/// update will restore the minimum refresh delay.
+///
+/// NOTE: This does not register itself as the @ref dcc::UpdateLoopBase
+/// instance, this allows a separate instance to be used for the OPS and PROG
+/// track outputs. Packet sources are routed to the correct instance by the
+/// DCC signal initialization code.
+class PrioritizedUpdateLoop : public StateFlow<Buffer<dcc::Packet>, QList<1>>
 {
 public:
   /// Constructor.
   ///
   /// @param service is the service to attach this stateflow to.
   /// @param track is the outbound track interface to send packets to.
-  PrioritizedUpdateLoop(Service *service, dcc::PacketFlowInterface *track);
+  /// @param ops_track should be true when @param track is the OPS track
+  /// output, when false idle packets generated due to having no other packet
+  /// to send will not be recorded with @ref TrackUtilization.
+  PrioritizedUpdateLoop(Service *service, dcc::PacketFlowInterface *track,
+                        bool ops_track = true);
 
   /// Destructor.
   ~PrioritizedUpdateLoop();
@@ -51,12 +75,12 @@ public:
   /// @param source is the packet source to add.
   /// @param priority is the priority to send the packet(s) out with.
   /// @return true if the packet source was added, false otherwise.
-  bool add_refresh_source(dcc::PacketSource *source, unsigned priority) override;
+  bool add_refresh_source(dcc::PacketSource *source, unsigned priority);
 
   /// Deletes a packet refresh source.
   ///
   /// @param source is the packet source to be removed.
-  void remove_refresh_source(dcc::PacketSource *source) override;
+  void remove_refresh_source(dcc::PacketSource *source);
 
   /// Notification hook for a packet source to inform the update loop that
   /// something has been updated and needs to be sent out at higher priority.
@@ -64,7 +88,7 @@ public:
   /// @param source is the packet source being updated.
   /// @param code is the type of update, see @ref dcc::DccTrainUpdateCode for
   /// supported values.
-  void notify_update(dcc::PacketSource *source, unsigned code) override;
+  void notify_update(dcc::PacketSource *source, unsigned code);
 
   /// Entry point of the @ref StateFlow which will generate the next packet
   /// to be sent to the track.
@@ -74,42 +98,278 @@ private:
   /// Flag to indicate that we have no high priority packet source.
   static constexpr uint16_t NO_EXCLUSIVE_SOURCE = 0x7FF;
 
-  /// Tracking metrics for the update source.
-  struct Metrics
+  /// Flag to indicate that a @ref RefreshSource is not in @ref refreshHeap_.
+  static constexpr uint16_t NOT_IN_HEAP = 0xFFFF;
+
+  /// Number of entries in @ref REFRESH_CLASSES.
+  static constexpr uint8_t REFRESH_CLASS_COUNT = 6;
+
+  /// Update codes that are used for background refresh packets, the index
+  /// into this array is used as the refresh class.
+  static constexpr unsigned REFRESH_CLASSES[REFRESH_CLASS_COUNT] =
+  {
+    dcc::DccTrainUpdateCode::SPEED,
+    dcc::DccTrainUpdateCode::FUNCTION0,
+    dcc::DccTrainUpdateCode::FUNCTION5,
+    dcc::DccTrainUpdateCode::FUNCTION9,
+    dcc::DccTrainUpdateCode::FUNCTION13,
+    dcc::DccTrainUpdateCode::FUNCTION21
+  };
+
+  /// Refresh class used for speed packets.
+  static constexpr uint8_t SPEED_REFRESH_CLASS = 0;
+
+  /// Refresh classes that are refreshed for all packet sources, speed and
+  /// F0-F4 are always refreshed as the headlight is commonly enabled when a
+  /// locomotive is created.
+  static constexpr uint8_t DEFAULT_REFRESH_CLASSES = 0x03;
+
+  /// Tracking metrics for a registered @ref dcc::PacketSource.
+  struct RefreshSource
   {
-    /// OS timestamp of when the last packet was sent to this source. This is
-    /// used to suppress sending a packet from this packet source too quickly.
-    uint64_t last_packet;
+    /// Packet source to ask for packets, nullptr when this slot is unused.
+    dcc::PacketSource *source;
+
+    /// OS timestamp (usec) of the earliest time that this source can have
+    /// another packet sent to the track. This is used to suppress sending a
+    /// packet from this packet source too quickly and is also used as the
+    /// sort key for @ref refreshHeap_.
+    uint64_t next_refresh;
 
     /// Priority of this packet source.
     unsigned priority;
+
+    /// Index of this source in @ref refreshHeap_.
+    uint16_t heap_index;
+
+    /// Bit mask of the @ref REFRESH_CLASSES that are refreshed for this
+    /// source.
+    uint8_t active_classes;
+
+    /// OS timestamp (usec) of when each of the @ref REFRESH_CLASSES is due
+    /// for a refresh.
+    uint64_t class_due[REFRESH_CLASS_COUNT];
+
+#if CONFIG_DCC_UPDATE_LOOP_STATS
+    /// OS timestamp (usec) of when the last packet was sent to this source.
+    uint64_t last_sent;
+#endif // CONFIG_DCC_UPDATE_LOOP_STATS
+
+#if CONFIG_DCC_ADAPTIVE_REFRESH
+    /// OS timestamp (usec) of when this source last reported an update.
+    uint64_t last_update;
+
+    /// Current number of microseconds between background refresh packets.
+    uint32_t refresh_delay;
+
+    /// True when the last speed packet from this source was non-zero.
+    bool moving;
+#endif // CONFIG_DCC_ADAPTIVE_REFRESH
+  };
+
+  /// Priority update that has been reported via @ref notify_update but has
+  /// not yet been sent to the track.
+  struct PendingUpdate
+  {
+    /// OS timestamp (usec) of the earliest time that this update can be sent.
+    uint64_t ready;
+
+    /// Sequence number of the update, used to keep updates for sources that
+    /// are ready at the same time in FIFO order.
+    uint32_t sequence;
+
+    /// Index into @ref sources_ for the source that reported the update.
+    uint16_t slot;
+
+    /// Packet source that reported the update, used to validate that
+    /// @ref slot has not been reassigned to another source.
+    dcc::PacketSource *source;
+
+    /// Update code to pass to the packet source.
+    unsigned code;
+
+#if CONFIG_DCC_UPDATE_LOOP_STATS
+    /// OS timestamp (usec) of when the update was reported.
+    uint64_t notified;
+#endif // CONFIG_DCC_UPDATE_LOOP_STATS
+
+    /// Ordering used for the min-heap of @ref PendingUpdate.
+    ///
+    /// @param other is the other @ref PendingUpdate to compare against.
+    /// @return true if this update should be sent after the other update.
+    bool operator>(const PendingUpdate &other) const
+    {
+      if (ready != other.ready)
+      {
+        return ready > other.ready;
+      }
+      return (int32_t)(sequence - other.sequence) > 0;
+    }
   };
 
   /// Track interface to send packets to.
   dcc::PacketFlowInterface *track_;
 
-  /// Packet sources to ask about refreshing data periodically.
-  std::vector<dcc::PacketSource *> sources_;
+  /// True when @ref track_ is the OPS track output.
+  const bool opsTrack_;
+
+  /// Storage for all registered packet sources, entries are reused after a
+  /// packet source has been removed.
+  std::vector<RefreshSource> sources_;
+
+  /// Indices of unused entries in @ref sources_.
+  std::vector<uint16_t> freeSlots_;
+
+  /// Lookup of packet source to index in @ref sources_, only used when adding
+  /// or removing sources and when a priority update has been reported.
+  std::unordered_map<dcc::PacketSource *, uint16_t> slotIndex_;
 
-  /// Tracking metrics for each registered @ref dcc::PacketSource.
-  std::map<dcc::PacketSource *, Metrics> metrics_;
+  /// Min-heap of indices into @ref sources_ ordered by
+  /// @ref RefreshSource::next_refresh. The first entry is the packet source
+  /// that has waited the longest for a background refresh.
+  std::vector<uint16_t> refreshHeap_;
 
-  /// Queue of packet sources that have reported an update that needs to be
-  /// sent out to the track interface. This will have higher priority than all
-  /// background update packet sources but lower priority than exclusive packet
-  /// sources.
-  QList<1> updateSources_;
+  /// Min-heap of priority updates ordered by @ref PendingUpdate::ready. These
+  /// have higher priority than all background update packet sources but lower
+  /// priority than exclusive packet sources.
+  std::vector<PendingUpdate> updateHeap_;
 
-  /// Offset in the @ref sources_ vector for the next loco to send.
-  uint16_t nextIndex_{0};
+  /// Sequence number to assign to the next @ref PendingUpdate.
+  uint32_t updateSequence_{0};
 
   /// Index into @ref sources_ for the highest priority packet source
   /// that is generating packets.
   uint16_t exclusiveIndex_{NO_EXCLUSIVE_SOURCE};
 
-  /// Lock used to protect @ref sources_, @ref metrics_ and
-  /// @ref updateSources_.
+  /// Lock used to protect @ref sources_, @ref freeSlots_, @ref slotIndex_,
+  /// @ref refreshHeap_ and @ref updateHeap_.
   Spinlock lock_;
+
+#if CONFIG_DCC_UPDATE_LOOP_STATS
+  /// Number of buckets in @ref Statistics::refresh_interval.
+  static constexpr size_t REFRESH_INTERVAL_BUCKETS = 8;
+
+  /// Upper bound (msec) of each bucket in @ref Statistics::refresh_interval,
+  /// the last bucket collects everything above the previous bucket.
+  static constexpr uint16_t REFRESH_INTERVAL_LIMITS[REFRESH_INTERVAL_BUCKETS] =
+  {
+    10, 20, 50, 100, 200, 500, 1000, UINT16_MAX
+  };
+
+  /// Number of microseconds between statistics reports.
+  static constexpr uint64_t STATS_REPORT_INTERVAL_USEC = 10000000ULL;
+
+  /// Scheduler statistics collected since the last report.
+  struct Statistics
+  {
+    /// Number of packets generated.
+    uint32_t packets;
+
+    /// Number of idle packets generated.
+    uint32_t idle;
+
+    /// Number of priority updates sent to the track.
+    uint32_t updates;
+
+    /// Total number of nanoseconds spent in @ref entry.
+    uint64_t entry_ns;
+
+    /// Maximum number of nanoseconds spent in a single call to @ref entry.
+    uint32_t entry_max_ns;
+
+    /// Total number of microseconds between a priority update being
+    /// reported and the resulting packet being generated.
+    uint64_t latency_us;
+
+    /// Maximum number of microseconds between a priority update being
+    /// reported and the resulting packet being generated.
+    uint32_t latency_max_us;
+
+    /// Histogram of the time between packets for the same source, bucketed
+    /// by @ref REFRESH_INTERVAL_LIMITS.
+    uint32_t refresh_interval[REFRESH_INTERVAL_BUCKETS];
+  };
+
+  /// Statistics collected since @ref statsStart_.
+  Statistics stats_{};
+
+  /// OS timestamp (usec) of when @ref stats_ was last reset.
+  uint64_t statsStart_{0};
+
+  /// Records the time between packets sent to a packet source.
+  ///
+  /// @param entry is the packet source being sent a packet.
+  /// @param now is the current OS timestamp (usec).
+  void record_refresh(RefreshSource &entry, uint64_t now);
+
+  /// Records the cost of the current call to @ref entry and periodically
+  /// reports the collected statistics.
+  ///
+  /// @param start_cycles is the CPU cycle count when @ref entry started.
+  /// @param now is the current OS timestamp (usec).
+  void record_entry(uint32_t start_cycles, uint64_t now);
+#endif // CONFIG_DCC_UPDATE_LOOP_STATS
+
+  /// Swaps two entries in @ref refreshHeap_ and updates their heap indices.
+  ///
+  /// @param a is the first heap index.
+  /// @param b is the second heap index.
+  void heap_swap(size_t a, size_t b);
+
+  /// Moves an entry in @ref refreshHeap_ towards the root until the heap
+  /// property is restored.
+  ///
+  /// @param index is the heap index to move.
+  void heap_sift_up(size_t index);
+
+  /// Moves an entry in @ref refreshHeap_ towards the leaves until the heap
+  /// property is restored.
+  ///
+  /// @param index is the heap index to move.
+  void heap_sift_down(size_t index);
+
+  /// Records that a packet has been sent to the track for a packet source
+  /// and re-orders @ref refreshHeap_ based on the next refresh time.
+  ///
+  /// @param slot is the index into @ref sources_.
+  /// @param next_refresh is the earliest time the source can be sent another
+  /// packet.
+  void reschedule(uint16_t slot, uint64_t next_refresh);
+
+  /// Converts an update code to a refresh class.
+  ///
+  /// @param code is the update code, see @ref dcc::DccTrainUpdateCode.
+  /// @return index into @ref REFRESH_CLASSES or @ref REFRESH_CLASS_COUNT if
+  /// the update code is not used for background refresh.
+  static uint8_t refresh_class(unsigned code);
+
+  /// @return the active refresh class of @param entry which has waited the
+  /// longest for a refresh.
+  static uint8_t next_refresh_class(const RefreshSource &entry);
+
+  /// Records that a packet has been sent to the track for a packet source and
+  /// schedules the next refresh based on the refresh class due next.
+  ///
+  /// @param slot is the index into @ref sources_.
+  /// @param refresh_class is the refresh class of the packet that was sent,
+  /// @ref REFRESH_CLASS_COUNT if not a refresh class.
+  /// @param now is the current OS timestamp (usec).
+  /// @param speed_delay is the number of microseconds until the next speed
+  /// packet refresh.
+  void schedule_refresh(uint16_t slot, uint8_t refresh_class, uint64_t now,
+                        uint32_t speed_delay);
+
+#if CONFIG_DCC_ADAPTIVE_REFRESH
+  /// Calculates the delay until the next background refresh for a packet
+  /// source.
+  ///
+  /// @param entry is the packet source being sent a refresh packet.
+  /// @param now is the current OS timestamp (usec).
+  /// @param min_delay is the minimum refresh delay (usec).
+  /// @return number of microseconds until the next refresh.
+  uint32_t next_refresh_delay(RefreshSource &entry, uint64_t now,
+                              uint32_t min_delay);
+#endif // CONFIG_DCC_ADAPTIVE_REFRESH
 };
 
 } // namespace esp32cs
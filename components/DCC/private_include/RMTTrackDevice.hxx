@@ -19,15 +19,22 @@ COPYRIGHT (c) 2019-2021 Mike Dunston
 #define _RMT_TRACK_DEVICE_H_
 
 #include "sdkconfig.h"
+#include "CpuCycleCount.hxx"
+#include <atomic>
 #include <can_ioctl.h>
 #include <dcc/DccDebug.hxx>
 #include <dcc/Packet.hxx>
 #include <driver/rmt.h>
 #include <executor/Notifiable.hxx>
 #include <freertos/FreeRTOS.h>
-#include <freertos/queue.h>
+#include <freertos/task.h>
 #include <freertos_drivers/arduino/RailcomDriver.hxx>
+#include <RailComDecoder.hxx>
+#include <soc/soc.h>
 #include <soc/soc_caps.h>
+#include <SpscRing.hxx>
+#include <string.h>
+#include <TrackUtilization.hxx>
 #include <utils/logging.h>
 #include <utils/macros.h>
 
@@ -70,7 +77,11 @@ public:
   ///
   /// @param railcomDriver @ref RailcomDriver instance to use for cut-out
   /// generation.
-  RMTTrackDevice(RailcomDriver *railcomDriver) : railcomDriver_(railcomDriver)
+  /// @param opsTrack should be true when this device generates the OPS track
+  /// signal, when false only service mode packets will be recorded with
+  /// @ref TrackUtilization.
+  RMTTrackDevice(RailcomDriver *railcomDriver, bool opsTrack = true)
+    : railcomDriver_(railcomDriver), opsTrack_(opsTrack)
   {
   }
 
@@ -79,18 +90,6 @@ public:
   /// RMT peripheral and to start generating the DCC signal.
   void hw_init()
   {
-    // allocate buffer space for the packet queue items.
-    packetQueueBuf_ =
-      heap_caps_calloc(HW::PACKET_Q_SIZE, sizeof(dcc::Packet),
-                       RMT_MALLOC_CAPS);
-    HASSERT(packetQueueBuf_ != nullptr);
-
-    // create the packet queue using the pre-allocated memory.
-    packetQueueHandle_ =
-      xQueueCreateStatic(HW::PACKET_Q_SIZE, sizeof(dcc::Packet)
-                      , (uint8_t*)packetQueueBuf_, &packetQueue_);
-    HASSERT(packetQueueHandle_ != NULL);
-
     // calculate the maximum number of bits that can be transmitted in a single
     // dcc packet, with the current configuration the maximum number of bits
     // for a single dcc packet is 192 while using up to 50 preamble bits.
@@ -125,6 +124,21 @@ public:
       rmt_driver_install(HW::RMT_CHANNEL, 0 /* rx count */, RMT_ISR_FLAGS));
     ESP_ERROR_CHECK(rmt_set_source_clk(HW::RMT_CHANNEL, HW::RMT_CLOCK_SOURCE));
 
+    // the idle packet is sent when there is no packet ready to be sent, it is
+    // encoded once so that it can be sent without any encoding work.
+    idlePreambleBits_ = encode_packet(idlePacket_, &idleBuffer_);
+    txPacket_ = &idleBuffer_;
+
+#if CONFIG_DCC_RMT_ENCODE_AHEAD
+    // the encoder task runs on the same core as the RMT ISR which is
+    // allocated on the core calling rmt_driver_install above.
+    HASSERT(xTaskCreatePinnedToCore(encode_task, "DCC-Encoder",
+                                    ENCODE_TASK_STACK, this,
+                                    ENCODE_TASK_PRIORITY, &encodeTask_,
+                                    xPortGetCoreID()) == pdPASS);
+    xTaskNotifyGive(encodeTask_);
+#endif // CONFIG_DCC_RMT_ENCODE_AHEAD
+
     LOG(INFO, "[DCC-RMT-%d] Starting signal generator", HW::RMT_CHANNEL);
     // send one bit to kickstart the signal, remaining data will come from the
     // packet queue. We intentionally do not wait for the RMT TX complete here.
@@ -136,17 +150,18 @@ public:
   {
     LOG(INFO, "[DCC-RMT-%d] Shutting down signal generator", HW::RMT_CHANNEL);
     rmt_driver_uninstall(HW::RMT_CHANNEL);
-    if (packetQueueHandle_)
-    {
-      vQueueDelete(packetQueueHandle_);
-    }
-    if (packetQueueBuf_)
+#if CONFIG_DCC_RMT_ENCODE_AHEAD
+    if (encodeTask_)
     {
-      free(packetQueueBuf_);
+      vTaskDelete(encodeTask_);
     }
+#endif // CONFIG_DCC_RMT_ENCODE_AHEAD
   }
 
   /// VFS interface helper
+  ///
+  /// NOTE: This is expected to be called only from the @ref LocalTrackIf
+  /// flow as the packet queue only supports a single producer.
   ssize_t write(int fd, const void * data, size_t size)
   {
     if (size != sizeof(dcc::Packet))
@@ -159,7 +174,7 @@ public:
     if (sourcePacket->packet_header.is_marklin)
     {
       // drop Marklin packets.
-      return 1;
+      return drop_packet();
     }
     if (sourcePacket->dlc > MAX_DCC_DLC_LEN)
     {
@@ -167,28 +182,37 @@ public:
       LOG_ERROR("[DCC-RMT-%d] Dropping DCC packet that is too long: %s\n",
                 HW::RMT_CHANNEL,
                 dcc::packet_to_string(*sourcePacket, true).c_str());
-      return 1;
+      return drop_packet();
     }
 #if !CONFIG_PROG_TRACK_ENABLED
     if (sourcePacket->packet_header.send_long_preamble)
     {
       // If the packet looks like a programming track packet, drop it since as
       // only short preamble packets will be accepted for TX.
-      return 1;
+      return drop_packet();
     }
-#elif !CONFIG_OPS_TRACK_ENABLED
-    // force long preamble for all packets.
-    sourcePacket->packet_header.send_long_preamble = 1;
 #endif // !CONFIG_PROG_TRACK_ENABLED
-    if (xQueueSendToBack(packetQueueHandle_, sourcePacket
-                      , MAX_PACKET_QUEUE_WAIT_TIME) == pdTRUE)
+    QueuedPacket *queued = packetQueue_.reserve();
+    if (queued == nullptr)
     {
-      return 1;
+      // packet queue is full!
+      errno = ENOSPC;
+      return -1;
     }
-
-    // packet queue is full!
-    errno = ENOSPC;
-    return -1;
+    queued->packet = *sourcePacket;
+#if CONFIG_PROG_TRACK_ENABLED && !CONFIG_OPS_TRACK_ENABLED
+    // force long preamble for all packets.
+    queued->packet.packet_header.send_long_preamble = 1;
+#endif // CONFIG_PROG_TRACK_ENABLED && !CONFIG_OPS_TRACK_ENABLED
+    queued->type = TrackUtilization::packet_type(queued->packet);
+#if CONFIG_DCC_COALESCE_PACKETS
+    queued->key = coalesce_key(queued->packet);
+#else
+    queued->key = 0;
+#endif // CONFIG_DCC_COALESCE_PACKETS
+    queued->superseded = false;
+    packetQueue_.commit();
+    return 1;
   }
 
   /// VFS interface helper
@@ -202,9 +226,19 @@ public:
       HASSERT(n);
       // if there is no space available in the queue, stash the notifiable
       // handle so we can wake it up later.
-      if (!uxQueueSpacesAvailable(packetQueueHandle_))
+      if (packetQueue_.full())
       {
-        std::swap(n, notifiable_);
+        n = notifiable_.exchange(n);
+        // if the ISR consumed a packet before the notifiable was stashed it
+        // will not have been woken up, reclaim it so it can be notified now.
+        if (!packetQueue_.full())
+        {
+          Notifiable *pending = notifiable_.exchange(nullptr);
+          if (pending)
+          {
+            pending->notify();
+          }
+        }
       }
       if (n)
       {
@@ -220,10 +254,50 @@ public:
 
   /// RMT callback for transmit completion. This will be called via the ISR
   /// context but not from an IRAM restricted context.
+  ///
+  /// NOTE: When CONFIG_DCC_RMT_ENCODE_AHEAD is enabled the next packet is
+  /// encoded by a dedicated task while the current packet is being
+  /// transmitted and this only needs to swap buffers before restarting the
+  /// transmission. If the task has not finished encoding the next packet the
+  /// pre-encoded idle packet is sent instead.
   void rmt_transmit_complete()
   {
+    uint32_t start_cycles = get_cycle_count();
+#if CONFIG_DCC_RMT_ENCODE_AHEAD
     BaseType_t woken = pdFALSE;
-    encode_next_packet(&woken);
+#endif // CONFIG_DCC_RMT_ENCODE_AHEAD
+
+    // the cut-out follows the packet that has just been sent, its key is
+    // latched by the RailCom driver when the receive window opens.
+    railcomDriver_->set_feedback_key(txPacket_->feedback_key);
+    if (--txPacket_->repeat < 0)
+    {
+      // current packet has been sent the requested number of times, switch
+      // to the next packet.
+#if CONFIG_DCC_RMT_ENCODE_AHEAD
+      if (nextReady_.load(std::memory_order_acquire))
+      {
+        txPacket_ = &buffers_[encodeBuffer_];
+        encodeBuffer_ ^= 1;
+        nextReady_.store(false, std::memory_order_release);
+      }
+      else
+      {
+        txPacket_ = &idleBuffer_;
+        idleBuffer_.repeat = 0;
+        encodeUnderruns_++;
+        record_utilization(TrackPacketType::IDLE, idlePacket_,
+                           idlePreambleBits_, 0);
+      }
+      // wake up the encoder task to prepare the following packet.
+      vTaskNotifyGiveFromISR(encodeTask_, &woken);
+#else
+      encode_next_packet(&buffers_[encodeBuffer_]);
+      txPacket_ = &buffers_[encodeBuffer_];
+      encodeBuffer_ ^= 1;
+#endif // CONFIG_DCC_RMT_ENCODE_AHEAD
+    }
+    EncodedPacket *current = txPacket_;
     if (DCC_BOOSTER::need_railcom_cutout())
     {
       railcomDriver_->start_cutout();
@@ -243,15 +317,74 @@ public:
 
     // NOTE: This is not using rmt_write_items as it is not safe within an ISR
     // context which this callback is invoked from.
-    rmt_fill_tx_items(HW::RMT_CHANNEL, packet_, pktLength_, 0);
+    rmt_fill_tx_items(HW::RMT_CHANNEL, current->items, current->length, 0);
 
     // start the transmit using the rmt_tx_start method which is ISR safe as of
     // IDF v4.1.
     rmt_tx_start(HW::RMT_CHANNEL, true);
 
-    // if we need to wake up another task we can safely do it after sending the
-    // packet off to be transmitted.
-    portYIELD_FROM_ISR(woken);
+    // record how long it took to prepare and start the transmission.
+    uint32_t cycles = get_cycle_count() - start_cycles;
+    isrCycles_ = cycles;
+    isrMaxCycles_ = std::max(isrMaxCycles_, cycles);
+    isrCount_++;
+
+#if CONFIG_DCC_RMT_ENCODE_AHEAD
+    if (woken == pdTRUE)
+    {
+      portYIELD_FROM_ISR();
+    }
+#endif // CONFIG_DCC_RMT_ENCODE_AHEAD
+  }
+
+  /// @return the number of times the TX complete ISR has been invoked.
+  uint32_t isr_count()
+  {
+    return isrCount_;
+  }
+
+  /// @return the number of nanoseconds spent in the most recent TX complete
+  /// ISR.
+  uint32_t isr_last_nsec()
+  {
+    return cycles_to_nsec(isrCycles_);
+  }
+
+  /// @return the maximum number of nanoseconds spent in the TX complete ISR.
+  ///
+  /// @param reset when true the maximum will be reset.
+  uint32_t isr_max_nsec(bool reset = false)
+  {
+    uint32_t cycles = isrMaxCycles_;
+    if (reset)
+    {
+      isrMaxCycles_ = 0;
+    }
+    return cycles_to_nsec(cycles);
+  }
+
+  /// @return the number of queued packets that were replaced by a newer packet
+  /// for the same decoder before being transmitted.
+  uint32_t merged_packets()
+  {
+    return mergedCount_;
+  }
+
+  /// @return the number of packets that were discarded rather than queued.
+  uint32_t dropped_packets()
+  {
+    return droppedCount_;
+  }
+
+  /// @return the number of times an idle packet was sent because the next
+  /// packet had not been encoded in time.
+  uint32_t encode_underruns()
+  {
+#if CONFIG_DCC_RMT_ENCODE_AHEAD
+    return encodeUnderruns_;
+#else
+    return 0;
+#endif // CONFIG_DCC_RMT_ENCODE_AHEAD
   }
 
 private:
@@ -280,11 +413,6 @@ private:
     SOC_RMT_CHANNEL_MEM_WORDS * MAX_RMT_MEMORY_BLOCKS;
 #endif
 
-  /// malloc() capabilities to use for the DCC packet queue. This is configured
-  /// to use internal 8-bit capable memory only.
-  static constexpr uint32_t RMT_MALLOC_CAPS = MALLOC_CAP_INTERNAL |
-                                              MALLOC_CAP_8BIT;
-
   /// Declare ISR flags for the RMT driver ISR.
   ///
   /// NOTE: ESP_INTR_FLAG_IRAM is *NOT* included in this bitmask so that we do
@@ -315,117 +443,456 @@ private:
   static constexpr uint8_t DCC_RMT_MAX_ONE_BIT_SPREAD =
     61 - HW::DCC_ONE_RMT_TICKS + 1;
 
+  /// Encodes a single DCC bit half-wave pair as a raw RMT item value.
+  ///
+  /// @param ticks is the number of RMT ticks for each half of the bit.
+  /// @return the RMT item value for the bit.
+  static constexpr uint32_t encode_rmt_bit(uint32_t ticks)
+  {
+    return (ticks & 0x7FFF) |
+           ((uint32_t)(HW::RMT_DCC_FIRST_HALF & 1) << 15) |
+           ((ticks & 0x7FFF) << 16) |
+           ((uint32_t)(HW::RMT_DCC_SECOND_HALF & 1) << 31);
+  }
+
+  /// DCC ZERO bit pre-encoded as a raw RMT item value.
+  static constexpr uint32_t DCC_RMT_ZERO_VAL =
+    encode_rmt_bit(HW::DCC_ZERO_RMT_TICKS);
+
+  /// DCC ONE bit pre-encoded as a raw RMT item value.
+  static constexpr uint32_t DCC_RMT_ONE_VAL =
+    encode_rmt_bit(HW::DCC_ONE_RMT_TICKS);
+
+  /// Maximum number of preamble bits that will be sent for any packet.
+  static constexpr uint32_t MAX_PREAMBLE_BITS =
+    HW::DCC_SERVICE_MODE_PREAMBLE_BITS > HW::DCC_PREAMBLE_BITS ?
+      HW::DCC_SERVICE_MODE_PREAMBLE_BITS : HW::DCC_PREAMBLE_BITS;
+
+  /// Number of packet bits encoded by each entry in @ref NibbleTable.
+  static constexpr uint8_t BITS_PER_NIBBLE = 4;
+
+  /// Pre-encoded RMT items for every possible four bit value, most
+  /// significant bit first. Each data byte is encoded as two lookups into this
+  /// table which keeps the table small enough (256 bytes) to remain in cache
+  /// rather than a 256 entry byte table (8kB).
+  struct NibbleTable
+  {
+    uint32_t items[16][BITS_PER_NIBBLE];
+  };
+
+  /// Pre-encoded RMT items for the longest preamble, shorter preambles use
+  /// the leading portion of this block.
+  struct PreambleBlock
+  {
+    uint32_t items[MAX_PREAMBLE_BITS];
+  };
+
+  /// @return @ref NibbleTable populated for the configured bit timing.
+  static constexpr NibbleTable build_nibble_table()
+  {
+    NibbleTable table{};
+    for (uint8_t nibble = 0; nibble < 16; nibble++)
+    {
+      for (uint8_t bit = 0; bit < BITS_PER_NIBBLE; bit++)
+      {
+        table.items[nibble][bit] =
+          (nibble & (0x08 >> bit)) ? DCC_RMT_ONE_VAL : DCC_RMT_ZERO_VAL;
+      }
+    }
+    return table;
+  }
+
+  /// @return @ref PreambleBlock populated for the configured bit timing.
+  static constexpr PreambleBlock build_preamble_block()
+  {
+    PreambleBlock block{};
+    for (uint32_t bit = 0; bit < MAX_PREAMBLE_BITS; bit++)
+    {
+      block.items[bit] = DCC_RMT_ONE_VAL;
+    }
+    return block;
+  }
+
+  /// Pre-encoded RMT items for all four bit values.
+  static constexpr NibbleTable DCC_RMT_NIBBLES = build_nibble_table();
+
+  /// Pre-encoded RMT items for the packet preamble.
+  static constexpr PreambleBlock DCC_RMT_PREAMBLE = build_preamble_block();
+
+  static_assert(sizeof(rmt_item32_t) == sizeof(uint32_t),
+                "rmt_item32_t must be a single 32 bit value");
+
   /// DCC ZERO bit pre-encoded in RMT format.
   static rmt_item32_t DCC_RMT_ZERO_BIT;
 
   /// DCC ONE bit pre-encoded in RMT format.
   static rmt_item32_t DCC_RMT_ONE_BIT;
 
-  /// Maximum amount of time to wait for the packet queue to have space
-  /// available for another packet before giving up. Currently configured to
-  /// not wait.
-  static constexpr BaseType_t MAX_PACKET_QUEUE_WAIT_TIME = 0;
-
   /// @ref RailcomDriver instance to use for possibly generating the RailCom
   /// cut-out period.
   RailcomDriver *railcomDriver_;
 
-  /// Queue to use for DCC packets that are pending encoding for delivery.
-  StaticQueue_t packetQueue_;
-  
-  /// Handle to @ref packetQueue_.
-  QueueHandle_t packetQueueHandle_{nullptr};
+  /// True when this device generates the OPS track signal.
+  const bool opsTrack_;
+
+  /// DCC packet pending encoding for delivery.
+  struct QueuedPacket
+  {
+    /// DCC packet to be transmitted.
+    dcc::Packet packet;
+
+    /// Identifies the decoder address and instruction group of the packet,
+    /// zero if the packet can not be merged with other packets.
+    uint32_t key;
 
-  /// Memory block used for @ref packetQueue_.
-  void *packetQueueBuf_{nullptr};
+    /// When true a newer copy of this packet has already been transmitted in
+    /// place of an earlier packet and this packet should be skipped.
+    bool superseded;
+
+    /// @ref TrackPacketType used when recording the packet with
+    /// @ref TrackUtilization.
+    TrackPacketType type;
+  };
+
+  /// Queue to use for DCC packets that are pending encoding for delivery.
+  SpscRing<QueuedPacket, HW::PACKET_Q_SIZE> packetQueue_;
 
   /// Notifiable to use when there is space available in @ref packetQueue_.
-  Notifiable* notifiable_{nullptr};
+  std::atomic<Notifiable *> notifiable_{nullptr};
 
-  /// Number of repeats of the current packet to send.
-  int8_t pktRepeatCount_{0};
-  
-  /// Number of encoded bits in the current packet.
-  uint32_t pktLength_{0};
+  /// Idle packet to transmit when @ref packetQueue_ is empty.
+  const dcc::Packet idlePacket_{dcc::Packet::DCC_IDLE()};
 
-  /// Encoded bits of the current packet.
-  rmt_item32_t packet_[MAX_RMT_ENCODED_BITS];
+  /// DCC packet encoded in RMT format.
+  struct EncodedPacket
+  {
+    /// Encoded bits of the packet.
+    rmt_item32_t items[MAX_RMT_ENCODED_BITS];
 
-  /// Encodes the next DCC packet for transmission by the RMT peripheral.
-  ///
-  /// @param woken will be set to pdTRUE if the ISR should transfer control to
-  /// another task.
+    /// Number of encoded bits in the packet.
+    uint32_t length{0};
+
+    /// Number of repeats of the packet remaining to be sent.
+    int8_t repeat{0};
+
+    /// RailCom feedback key for the packet.
+    uintptr_t feedback_key{0};
+  };
+
+  /// Encoded packets, one is being transmitted while the other holds the next
+  /// packet to transmit.
+  EncodedPacket buffers_[2];
+
+  /// Pre-encoded copy of @ref idlePacket_.
+  EncodedPacket idleBuffer_;
+
+  /// Number of preamble bits used for @ref idleBuffer_.
+  uint32_t idlePreambleBits_{0};
+
+  /// Packet currently being transmitted.
+  EncodedPacket *txPacket_{nullptr};
+
+  /// Index into @ref buffers_ for the next packet to be encoded.
+  uint8_t encodeBuffer_{0};
+
+#if CONFIG_DCC_RMT_ENCODE_AHEAD
+  /// Stack size (bytes) for the encoder task.
+  static constexpr uint32_t ENCODE_TASK_STACK = 2048;
+
+  /// Priority of the encoder task, this is above all other tasks so that the
+  /// next packet is encoded well before the current packet has been sent.
+  static constexpr UBaseType_t ENCODE_TASK_PRIORITY = configMAX_PRIORITIES - 1;
+
+  /// When true the entry in @ref buffers_ at @ref encodeBuffer_ contains the
+  /// next packet to transmit. This is set by the encoder task and cleared by
+  /// the TX complete ISR after switching to the packet.
+  std::atomic<bool> nextReady_{false};
+
+  /// Task that encodes the next packet while the current packet is being
+  /// transmitted.
+  TaskHandle_t encodeTask_{nullptr};
+
+  /// Number of times @ref idleBuffer_ was sent because the next packet had
+  /// not been encoded in time.
+  uint32_t encodeUnderruns_{0};
+
+  /// Encoder task entry point.
   ///
-  /// NOTE: this will only encode the next packet if the current packet has
-  /// reached the required number of repeats.
-  void encode_next_packet(BaseType_t *woken)
+  /// @param arg is the @ref RMTTrackDevice instance.
+  static void encode_task(void *arg)
   {
-    // Bit mask constants used as part of the packet translation layer.
-    const uint8_t PACKET_BIT_MASK[] =
+    RMTTrackDevice *device = static_cast<RMTTrackDevice *>(arg);
+    while (true)
     {
-      0x80, 0x40, 0x20, 0x10, //
-      0x08, 0x04, 0x02, 0x01  //
-    };
+      ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+      // the ISR only switches buffers once the packet is ready, until then
+      // the buffer at encodeBuffer_ is owned by this task.
+      if (!device->nextReady_.load(std::memory_order_acquire))
+      {
+        device->encode_next_packet(&device->buffers_[device->encodeBuffer_]);
+        device->nextReady_.store(true, std::memory_order_release);
+      }
+    }
+  }
+#endif // CONFIG_DCC_RMT_ENCODE_AHEAD
+
+  /// Number of CPU cycles spent in the most recent TX complete ISR.
+  uint32_t isrCycles_{0};
+
+  /// Maximum number of CPU cycles spent in the TX complete ISR.
+  uint32_t isrMaxCycles_{0};
+
+  /// Number of times the TX complete ISR has been invoked.
+  uint32_t isrCount_{0};
+
+  /// Number of queued packets that were replaced by a newer packet.
+  uint32_t mergedCount_{0};
+
+  /// Number of packets that were discarded by @ref write.
+  uint32_t droppedCount_{0};
+
+  /// Number of RMT clock ticks per microsecond for the configured clock
+  /// source.
+  static constexpr uint32_t RMT_SOURCE_TICKS_PER_USEC =
+    (HW::RMT_CLOCK_SOURCE == RMT_BASECLK_APB ? APB_CLK_FREQ : REF_CLK_FREQ) /
+    1000000;
+
+  /// Number of microseconds required to transmit a DCC ZERO bit.
+  static constexpr uint32_t DCC_ZERO_BIT_USEC =
+    (2 * HW::DCC_ZERO_RMT_TICKS * CONFIG_DCC_RMT_CLOCK_DIVIDER) /
+    RMT_SOURCE_TICKS_PER_USEC;
+
+  /// Number of microseconds required to transmit a DCC ONE bit.
+  static constexpr uint32_t DCC_ONE_BIT_USEC =
+    (2 * HW::DCC_ONE_RMT_TICKS * CONFIG_DCC_RMT_CLOCK_DIVIDER) /
+    RMT_SOURCE_TICKS_PER_USEC;
+
+  /// Discards a packet that can not be sent to the track.
+  ///
+  /// @return the number of packets consumed for @ref write.
+  ssize_t drop_packet()
+  {
+    droppedCount_++;
+    return 1;
+  }
 
-    // Check if we need to encode the next packet or if we still have at least
-    // one repeat left of the current packet.
-    if (--pktRepeatCount_ >= 0)
+  /// Records a packet that has been encoded for transmission with the
+  /// @ref TrackUtilization instance.
+  ///
+  /// @param type is the @ref TrackPacketType of the packet.
+  /// @param packet is the DCC packet that has been encoded.
+  /// @param preamble_bits is the number of preamble bits sent before the
+  /// packet.
+  /// @param repeat is the number of times the packet will be repeated.
+  void record_utilization(TrackPacketType type, const dcc::Packet &packet,
+                          uint32_t preamble_bits, int8_t repeat)
+  {
+    // idle packets are not recorded for the PROG track so that they are not
+    // counted as OPS track usage.
+    if ((!opsTrack_ && type != TrackPacketType::SERVICE_MODE) ||
+        !Singleton<TrackUtilization>::exists())
     {
       return;
     }
-    // attempt to fetch a packet from the queue or use an idle packet.
-    Notifiable* n = nullptr;
-    dcc::Packet packet{dcc::Packet::DCC_IDLE()};
-    
-    if (xQueueReceiveFromISR(packetQueueHandle_, &packet, woken))
+    // the packet is sent as the preamble, a start bit, eight bits and a
+    // separator (or end bit) for each byte and a trailing ONE bit, the time
+    // is calculated from the packet rather than the encoded items. The EMC
+    // spreading adjustment (if enabled) is not included.
+    uint32_t bits = preamble_bits + 1 + (packet.dlc * 9) + 1;
+    uint32_t ones = preamble_bits + 2;
+    for (uint8_t idx = 0; idx < packet.dlc; idx++)
+    {
+      ones += __builtin_popcount(packet.payload[idx]);
+    }
+    Singleton<TrackUtilization>::instance()->record(type,
+      (ones * DCC_ONE_BIT_USEC) + ((bits - ones) * DCC_ZERO_BIT_USEC),
+      repeat + 1);
+  }
+
+#if CONFIG_DCC_COALESCE_PACKETS
+  /// Calculates the key used to identify packets that can replace one
+  /// another.
+  ///
+  /// @param packet is the DCC packet to calculate the key for.
+  /// @return the key for the packet, zero if the packet should never be
+  /// replaced by a newer packet.
+  ///
+  /// NOTE: Only multi-function decoder speed and function packets will be
+  /// assigned a key, accessory packets are not included as the activate and
+  /// deactivate packets for an output must both be sent.
+  static uint32_t coalesce_key(const dcc::Packet &packet)
+  {
+    if (packet.packet_header.send_long_preamble || packet.dlc < 3)
+    {
+      return 0;
+    }
+    uint32_t address;
+    uint8_t instruction;
+    if (packet.payload[0] >= 1 && packet.payload[0] <= 127)
+    {
+      // short address
+      address = packet.payload[0];
+      instruction = packet.payload[1];
+    }
+    else if (packet.payload[0] >= 192 && packet.payload[0] <= 231 &&
+             packet.dlc >= 4)
+    {
+      // long address, offset so it does not overlap with short addresses.
+      address = (((packet.payload[0] & 0x3F) << 8) | packet.payload[1]) +
+                0x100;
+      instruction = packet.payload[2];
+    }
+    else
+    {
+      // broadcast, accessory and idle packets.
+      return 0;
+    }
+
+    uint8_t group;
+    if ((instruction & 0xC0) == 0x40 || instruction == 0x3F)
+    {
+      // 14/28 speed step or 128 speed step packets.
+      group = 0x40;
+    }
+    else if ((instruction & 0xE0) == 0x80)
+    {
+      // F0-F4
+      group = 0x80;
+    }
+    else if ((instruction & 0xE0) == 0xA0)
+    {
+      // F5-F8 or F9-F12
+      group = instruction & 0xF0;
+    }
+    else if (instruction == 0xDE || instruction == 0xDF)
+    {
+      // F13-F20 or F21-F28
+      group = instruction;
+    }
+    else
+    {
+      // all other instructions are sent as-is.
+      return 0;
+    }
+    return (address << 8) | group;
+  }
+#endif // CONFIG_DCC_COALESCE_PACKETS
+
+  /// Encodes the next DCC packet for transmission by the RMT peripheral.
+  ///
+  /// @param target is the @ref EncodedPacket to encode the packet into.
+  void encode_next_packet(EncodedPacket *target)
+  {
+    // attempt to fetch a packet from the queue or use an idle packet, the
+    // packet is encoded directly from the queue slot.
+    bool released = false;
+    QueuedPacket *queued = packetQueue_.front();
+    while (queued && queued->superseded)
+    {
+      // a newer copy of this packet has already been sent, discard it.
+      packetQueue_.pop();
+      released = true;
+      queued = packetQueue_.front();
+    }
+    const dcc::Packet *next = &idlePacket_;
+    TrackPacketType type = TrackPacketType::IDLE;
+    if (queued)
+    {
+      next = &queued->packet;
+      type = queued->type;
+#if CONFIG_DCC_COALESCE_PACKETS
+      // if there are newer packets for the same decoder and instruction group
+      // send the newest one in place of this packet.
+      QueuedPacket *newer;
+      for (uint32_t offset = 1;
+           queued->key && (newer = packetQueue_.peek(offset)) != nullptr;
+           offset++)
+      {
+        if (!newer->superseded && newer->key == queued->key)
+        {
+          next = &newer->packet;
+          type = newer->type;
+          newer->superseded = true;
+          mergedCount_++;
+        }
+      }
+#endif // CONFIG_DCC_COALESCE_PACKETS
+    }
+    const dcc::Packet &packet = *next;
+    uint32_t preamble_bits = encode_packet(packet, target);
+
+    // record the packet now that it is known which packet will be sent, this
+    // excludes packets that were superseded by a newer packet.
+    record_utilization(type, packet, preamble_bits, target->repeat);
+
+    if (queued)
     {
-      // since we removed a packet from the queue, swap the notifiable handle
-      // so it can be woken up if needed.
-      std::swap(n, notifiable_);
+      // release the queue slot.
+      packetQueue_.pop();
+      released = true;
     }
-    if (n)
+    if (released)
     {
-      n->notify_from_isr();
+      // wake up the writer if it is waiting for space to be available.
+      Notifiable *n = notifiable_.exchange(nullptr);
+      if (n)
+      {
+#if CONFIG_DCC_RMT_ENCODE_AHEAD
+        n->notify();
+#else
+        n->notify_from_isr();
+#endif // CONFIG_DCC_RMT_ENCODE_AHEAD
+      }
     }
+  }
 
+  /// Encodes a DCC packet for transmission by the RMT peripheral.
+  ///
+  /// @param packet is the DCC packet to encode.
+  /// @param target is the @ref EncodedPacket to encode the packet into.
+  /// @return the number of preamble bits used for the packet.
+  uint32_t encode_packet(const dcc::Packet &packet, EncodedPacket *target)
+  {
 #if !CONFIG_OPS_TRACK_ENABLED
-    uint32_t preableBitCount = HW::DCC_SERVICE_MODE_PREAMBLE_BITS;
+    uint32_t preamble_bits = HW::DCC_SERVICE_MODE_PREAMBLE_BITS;
 #else
-    uint32_t preableBitCount = HW::DCC_PREAMBLE_BITS;
+    uint32_t preamble_bits = HW::DCC_PREAMBLE_BITS;
 #if CONFIG_PROG_TRACK_ENABLED
     if (packet.packet_header.send_long_preamble)
     {
-      preableBitCount = HW::DCC_SERVICE_MODE_PREAMBLE_BITS;
+      preamble_bits = HW::DCC_SERVICE_MODE_PREAMBLE_BITS;
     }
 #endif // CONFIG_PROG_TRACK_ENABLED
 #endif // !CONFIG_OPS_TRACK_ENABLED
+    rmt_item32_t *encoded = target->items;
+    uint32_t &length = target->length;
+    uint32_t *items = reinterpret_cast<uint32_t *>(encoded);
     // encode the preamble bits
-    for (pktLength_ = 0; pktLength_ < preableBitCount; pktLength_++)
-    {
-      packet_[pktLength_].val = DCC_RMT_ONE_BIT.val;
-    }
+    memcpy(items, DCC_RMT_PREAMBLE.items, preamble_bits * sizeof(uint32_t));
+    length = preamble_bits;
     // start of payload marker
-    packet_[pktLength_++].val = DCC_RMT_ZERO_BIT.val;
+    items[length++] = DCC_RMT_ZERO_VAL;
     // encode the packet bits
     for (uint8_t dlc = 0; dlc < packet.dlc; dlc++)
     {
-      for(uint8_t bit = 0; bit < 8; bit++)
-      {
-        packet_[pktLength_++].val =
-          packet.payload[dlc] & PACKET_BIT_MASK[bit] ?
-            DCC_RMT_ONE_BIT.val : DCC_RMT_ZERO_BIT.val;
-      }
+      memcpy(&items[length], DCC_RMT_NIBBLES.items[packet.payload[dlc] >> 4],
+             BITS_PER_NIBBLE * sizeof(uint32_t));
+      length += BITS_PER_NIBBLE;
+      memcpy(&items[length],
+             DCC_RMT_NIBBLES.items[packet.payload[dlc] & 0x0F],
+             BITS_PER_NIBBLE * sizeof(uint32_t));
+      length += BITS_PER_NIBBLE;
       // end of byte marker
-      packet_[pktLength_++].val = DCC_RMT_ZERO_BIT.val;
+      items[length++] = DCC_RMT_ZERO_VAL;
     }
     // set the last bit of the encoded payload to be an end of packet marker
-    packet_[pktLength_ - 1].val = DCC_RMT_ONE_BIT.val;
+    items[length - 1] = DCC_RMT_ONE_VAL;
     // add an extra ONE bit to the end to prevent mangling of the last bit by
     // the RMT
-    packet_[pktLength_++].val = DCC_RMT_ONE_BIT.val;
+    items[length++] = DCC_RMT_ONE_VAL;
     // Add marker to the end of the DCC packet data to allow the RMT to know it
     // can stop transmitting at this point.
-    packet_[pktLength_++].val = 0;
+    items[length++] = 0;
 
 #if CONFIG_DCC_RMT_EMC_SPREAD
     // If the EMC spectrum spreading option is enabled, modify the DCC bit time
@@ -436,34 +903,53 @@ private:
     // The first bit of the preamble is skipped as is the last entry in the
     // packet which is an end-of-packet marker for the RMT peripheral and is
     // not transmitted to the rails.
-    for (uint8_t idx = 1 idx < pktLength_; idx++)
+    for (uint8_t idx = 1; idx < length; idx++)
     {
-      if (packet_[idx].val == packet_[idx - 1].val)
+      if (encoded[idx].val == encoded[idx - 1].val)
       {
-        if (packet_[idx - 1].val == DCC_RMT_ZERO_BIT.val)
+        if (encoded[idx - 1].val == DCC_RMT_ZERO_VAL)
         {
-          packet_[idx - 1].duration0 += (idx % DCC_RMT_MAX_ZERO_BIT_SPREAD);
-          packet_[idx - 1].duration1 += (idx % DCC_RMT_MAX_ZERO_BIT_SPREAD);
+          encoded[idx - 1].duration0 += (idx % DCC_RMT_MAX_ZERO_BIT_SPREAD);
+          encoded[idx - 1].duration1 += (idx % DCC_RMT_MAX_ZERO_BIT_SPREAD);
         }
         else
         {
-          packet_[idx - 1].duration0 += (idx % DCC_RMT_MAX_ONE_BIT_SPREAD);
-          packet_[idx - 1].duration1 += (idx % DCC_RMT_MAX_ONE_BIT_SPREAD);
+          encoded[idx - 1].duration0 += (idx % DCC_RMT_MAX_ONE_BIT_SPREAD);
+          encoded[idx - 1].duration1 += (idx % DCC_RMT_MAX_ONE_BIT_SPREAD);
         }
       }
     }
 #endif // CONFIG_DCC_RMT_EMC_SPREAD
 
-    // record the repeat count.
-    pktRepeatCount_ = packet.packet_header.rept_count;
+    // record the repeat count and feedback key, the latter will be sent to the
+    // RailCom driver when the packet is transmitted.
+    target->repeat = packet.packet_header.rept_count;
+    target->feedback_key = packet.feedback_key;
+#if CONFIG_RAILCOM_FULL
+    if (!target->feedback_key && opsTrack_)
+    {
+      // packets without a feedback key of their own are keyed by the decoder
+      // address so the channel 2 response can be attributed to it.
+      target->feedback_key = RailComDecoder::feedback_key(packet);
+    }
+#endif // CONFIG_RAILCOM_FULL
 
-    // Send the feedback key to the RailCom driver instance.
-    railcomDriver_->set_feedback_key(packet.feedback_key);
+    return preamble_bits;
   }
 
   DISALLOW_COPY_AND_ASSIGN(RMTTrackDevice);
 };
 
+/// Pre-encoded RMT items for all four bit values.
+template<class HW, class DCC_BOOSTER, class OLCB_DCC_BOOSTER>
+constexpr typename RMTTrackDevice<HW, DCC_BOOSTER, OLCB_DCC_BOOSTER>::NibbleTable
+  RMTTrackDevice<HW, DCC_BOOSTER, OLCB_DCC_BOOSTER>::DCC_RMT_NIBBLES;
+
+/// Pre-encoded RMT items for the packet preamble.
+template<class HW, class DCC_BOOSTER, class OLCB_DCC_BOOSTER>
+constexpr typename RMTTrackDevice<HW, DCC_BOOSTER, OLCB_DCC_BOOSTER>::PreambleBlock
+  RMTTrackDevice<HW, DCC_BOOSTER, OLCB_DCC_BOOSTER>::DCC_RMT_PREAMBLE;
+
 /// DCC ZERO bit pre-encoded in RMT format.
 template<class HW, class DCC_BOOSTER, class OLCB_DCC_BOOSTER>
 rmt_item32_t RMTTrackDevice<HW, DCC_BOOSTER, OLCB_DCC_BOOSTER>::DCC_RMT_ZERO_BIT =
@@ -0,0 +1,281 @@
+/**********************************************************************
+ESP32 COMMAND STATION
+
+COPYRIGHT (c) 2021 Mike Dunston
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see http://www.gnu.org/licenses
+**********************************************************************/
+
+#ifndef RAILCOM_CUTOUT_HXX_
+#define RAILCOM_CUTOUT_HXX_
+
+#include <stdint.h>
+
+namespace esp32cs
+{
+
+/// RailCom cut-out timing limits from NMRA S-9.3.2, all values are in
+/// microseconds from the start of the cut-out.
+struct RailComTimingLimits
+{
+  /// Latest time the channel 1 window may end.
+  static constexpr uint32_t CH1_END_USEC = 177;
+
+  /// Earliest time the channel 2 window may start.
+  static constexpr uint32_t CH2_START_USEC = 193;
+
+  /// Latest time the channel 2 window may end.
+  static constexpr uint32_t CH2_END_USEC = 454;
+
+  /// Latest time the cut-out may end.
+  static constexpr uint32_t CUTOUT_END_USEC = 488;
+
+  /// Validates the cut-out timing of a RailCom hardware definition.
+  ///
+  /// @param HW is the RailCom hardware definition to validate.
+  /// @return true if the channel windows are within the limits.
+  template <class HW> static constexpr bool valid()
+  {
+    return (HW::RAILCOM_START_PHASE1_DELAY_USEC +
+            HW::RAILCOM_START_PHASE2_DELAY_USEC +
+            HW::RAILCOM_MAX_READ_DELAY_CH_1) <= CH1_END_USEC &&
+           (HW::RAILCOM_START_PHASE1_DELAY_USEC +
+            HW::RAILCOM_START_PHASE2_DELAY_USEC +
+            HW::RAILCOM_MAX_READ_DELAY_CH_1 +
+            HW::RAILCOM_MAX_READ_DELAY_CH_2) <= CH2_END_USEC &&
+           (HW::RAILCOM_START_PHASE1_DELAY_USEC +
+            HW::RAILCOM_START_PHASE2_DELAY_USEC +
+            HW::RAILCOM_MAX_READ_DELAY_CH_1 +
+            HW::RAILCOM_MAX_READ_DELAY_CH_2 +
+            HW::RAILCOM_STOP_DELAY_USEC) <= CUTOUT_END_USEC;
+  }
+};
+
+/// Sequences the phases of a RailCom cut-out without any dependency on the
+/// underlying hardware. All hardware access is delegated to the HAL which
+/// must provide the following methods:
+///
+/// uint32_t cutout_start_phase1() - disables the booster outputs and returns
+///   the number of microseconds to wait before starting the detector.
+/// uint32_t cutout_start_phase2() - enables the detector and returns the
+///   number of microseconds to wait before the channel 1 window opens.
+/// uint32_t cutout_stop_phase1() - disables the detector and returns the
+///   number of microseconds to wait before re-enabling the booster outputs.
+/// void cutout_stop_phase2() - re-enables the booster outputs.
+/// void receive_start() - prepares to receive data for the cut-out.
+/// void receive_middle() - channel 1 window has closed.
+/// void receive_end() - channel 2 window has closed.
+/// void timer_start(uint32_t usec) - calls @ref tick after the requested
+///   number of microseconds.
+/// uint32_t timestamp() - free running timestamp used for timing statistics.
+///
+/// @param HAL is the hardware abstraction used for the cut-out.
+template <class HAL> class RailComCutout
+{
+public:
+  /// Phases of the cut-out.
+  enum class Phase : uint8_t
+  {
+    /// No cut-out is active.
+    PRE_CUTOUT,
+    /// Booster outputs have been disabled, waiting to enable the detector.
+    CUTOUT_START,
+    /// Detector is enabled and receiving channel 1 data.
+    CUTOUT_PHASE1,
+    /// Detector is enabled and receiving channel 2 data.
+    CUTOUT_PHASE2,
+    /// Detector has been disabled, waiting to re-enable the booster outputs.
+    CUTOUT_STOP
+  };
+
+  /// Phase boundaries that timing statistics are collected for.
+  enum Boundary : uint8_t
+  {
+    /// Channel 1 window opened.
+    CH1_START,
+    /// Channel 1 window closed.
+    CH1_END,
+    /// Channel 2 window closed.
+    CH2_END,
+    /// Booster outputs re-enabled.
+    CUTOUT_END,
+    /// Number of boundaries, this must be the last entry.
+    BOUNDARY_COUNT
+  };
+
+  /// Timing statistics for a phase boundary, all values are in @ref HAL
+  /// timestamp units relative to the start of the cut-out.
+  struct Timing
+  {
+    /// Most recent time.
+    uint32_t last;
+    /// Minimum time.
+    uint32_t min;
+    /// Maximum time.
+    uint32_t max;
+    /// Sum of all times, used to calculate the average.
+    uint64_t total;
+    /// Number of samples.
+    uint32_t count;
+  };
+
+  /// Constructor.
+  ///
+  /// @param hal is the @ref HAL instance to use.
+  /// @param ch1_usec is the channel 1 window duration in microseconds.
+  /// @param ch2_usec is the channel 2 window duration in microseconds.
+  RailComCutout(HAL *hal, uint32_t ch1_usec, uint32_t ch2_usec)
+    : hal_(hal), ch1Usec_(ch1_usec), ch2Usec_(ch2_usec)
+  {
+    reset_timing();
+  }
+
+  /// Starts a cut-out.
+  ///
+  /// @return false if the previous cut-out is still active, in which case
+  /// the request is ignored.
+  bool start()
+  {
+    if (phase_ != Phase::PRE_CUTOUT)
+    {
+      skipped_++;
+      return false;
+    }
+    startTime_ = hal_->timestamp();
+    phase_ = Phase::CUTOUT_START;
+    uint32_t delay = hal_->cutout_start_phase1();
+    if (delay)
+    {
+      hal_->timer_start(delay);
+    }
+    else
+    {
+      tick();
+    }
+    return true;
+  }
+
+  /// Runs the phase transitions until one requires a delay or the cut-out
+  /// has completed, this should be called when the @ref HAL timer expires.
+  void tick()
+  {
+    uint32_t delay = 0;
+    while (!delay && phase_ != Phase::PRE_CUTOUT)
+    {
+      switch (phase_)
+      {
+        case Phase::CUTOUT_START:
+          hal_->receive_start();
+          delay = hal_->cutout_start_phase2();
+          record(CH1_START);
+          delay += ch1Usec_;
+          phase_ = Phase::CUTOUT_PHASE1;
+          break;
+        case Phase::CUTOUT_PHASE1:
+          record(CH1_END);
+          hal_->receive_middle();
+          delay = ch2Usec_;
+          phase_ = Phase::CUTOUT_PHASE2;
+          break;
+        case Phase::CUTOUT_PHASE2:
+          record(CH2_END);
+          hal_->receive_end();
+          delay = hal_->cutout_stop_phase1();
+          phase_ = Phase::CUTOUT_STOP;
+          break;
+        case Phase::CUTOUT_STOP:
+        default:
+          hal_->cutout_stop_phase2();
+          record(CUTOUT_END);
+          phase_ = Phase::PRE_CUTOUT;
+          break;
+      }
+    }
+    if (delay)
+    {
+      hal_->timer_start(delay);
+    }
+  }
+
+  /// @return the current @ref Phase.
+  Phase phase() const
+  {
+    return phase_;
+  }
+
+  /// @return the number of cut-outs that were skipped due to the previous
+  /// cut-out still being active.
+  uint32_t skipped() const
+  {
+    return skipped_;
+  }
+
+  /// @return the timing statistics for a phase boundary.
+  ///
+  /// @param boundary is the @ref Boundary to retrieve.
+  const Timing &timing(Boundary boundary) const
+  {
+    return timing_[boundary];
+  }
+
+  /// Resets all timing statistics.
+  void reset_timing()
+  {
+    for (uint8_t idx = 0; idx < BOUNDARY_COUNT; idx++)
+    {
+      timing_[idx].last = 0;
+      timing_[idx].min = UINT32_MAX;
+      timing_[idx].max = 0;
+      timing_[idx].total = 0;
+      timing_[idx].count = 0;
+    }
+  }
+
+private:
+  /// @ref HAL instance to use.
+  HAL *hal_;
+
+  /// Duration of the channel 1 window in microseconds.
+  const uint32_t ch1Usec_;
+
+  /// Duration of the channel 2 window in microseconds.
+  const uint32_t ch2Usec_;
+
+  /// Current @ref Phase.
+  Phase phase_{Phase::PRE_CUTOUT};
+
+  /// @ref HAL timestamp of the start of the active cut-out.
+  uint32_t startTime_{0};
+
+  /// Number of cut-outs that were skipped.
+  uint32_t skipped_{0};
+
+  /// Timing statistics for each @ref Boundary.
+  Timing timing_[BOUNDARY_COUNT];
+
+  /// Records the time of a phase boundary for the active cut-out.
+  ///
+  /// @param boundary is the @ref Boundary that has been reached.
+  void record(Boundary boundary)
+  {
+    Timing &entry = timing_[boundary];
+    entry.last = hal_->timestamp() - startTime_;
+    entry.min = entry.last < entry.min ? entry.last : entry.min;
+    entry.max = entry.last > entry.max ? entry.last : entry.max;
+    entry.total += entry.last;
+    entry.count++;
+  }
+};
+
+} // namespace esp32cs
+
+#endif // RAILCOM_CUTOUT_HXX_
\ No newline at end of file
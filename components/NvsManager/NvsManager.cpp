@@ -183,14 +183,25 @@ namespace esp32cs
           "WPA2_WPA3_PSK",
           "Unsupported"};
 
-  static inline void persist_configuration()
+  static inline esp_err_t persist_configuration()
   {
     nvs_handle_t nvs;
-    ESP_ERROR_CHECK(nvs_open(NVS_NAMESPACE, NVS_READWRITE, &nvs));
-    ESP_ERROR_CHECK(
-        nvs_set_blob(nvs, NVS_CFG_KEY, &nvsConfig, sizeof(node_config_t)));
-    ESP_ERROR_CHECK(nvs_commit(nvs));
-    nvs_close(nvs);
+    esp_err_t res = nvs_open(NVS_NAMESPACE, NVS_READWRITE, &nvs);
+    if (res == ESP_OK)
+    {
+      res = nvs_set_blob(nvs, NVS_CFG_KEY, &nvsConfig, sizeof(node_config_t));
+      if (res == ESP_OK)
+      {
+        res = nvs_commit(nvs);
+      }
+      nvs_close(nvs);
+    }
+    if (res != ESP_OK)
+    {
+      LOG_ERROR("[NVS] Unable to persist configuration: %s",
+                esp_err_to_name(res));
+    }
+    return res;
   }
 
   static inline void reset_nvs_config_to_defaults()
@@ -456,7 +467,7 @@ namespace esp32cs
   void NvsManager::set_led_brightness(uint8_t level)
   {
     nvsConfig.led_brightness = level;
-    persist_configuration();
+    ESP_ERROR_CHECK(persist_configuration());
   }
 
   void NvsManager::restart_fast_clock()
@@ -484,7 +495,7 @@ namespace esp32cs
       nvsConfig.fastclock_day = current_time.tm_mday;
       nvsConfig.fastclock_hour = current_time.tm_hour;
       nvsConfig.fastclock_minute = current_time.tm_min;
-      persist_configuration();
+      ESP_ERROR_CHECK(persist_configuration());
     }
   }
   bool NvsManager::memory_spaces_modified()
@@ -567,7 +578,7 @@ namespace esp32cs
   void NvsManager::node_id(uint64_t node_id)
   {
     nvsConfig.node_id = node_id;
-    persist_configuration();
+    ESP_ERROR_CHECK(persist_configuration());
     force_factory_reset();
   }
 
@@ -625,6 +636,25 @@ namespace esp32cs
   {
     return nvsConfig.timezone;
   }
+
+  CurrentSenseCalibration NvsManager::ops_calibration()
+  {
+    return nvsConfig.ops_calibration;
+  }
+
+  esp_err_t NvsManager::ops_calibration(
+    const CurrentSenseCalibration &calibration)
+  {
+    CurrentSenseCalibration previous = nvsConfig.ops_calibration;
+    nvsConfig.ops_calibration = calibration;
+    esp_err_t res = persist_configuration();
+    if (res != ESP_OK)
+    {
+      // keep the in-memory configuration consistent with NVS.
+      nvsConfig.ops_calibration = previous;
+    }
+    return res;
+  }
 } // namespace esp32cs
 
 extern "C"
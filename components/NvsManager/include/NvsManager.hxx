@@ -19,7 +19,9 @@ COPYRIGHT (c) 2017-2021 Mike Dunston
 #define NVS_MANAGER_H_
 
 #include "sdkconfig.h"
+#include <esp_err.h>
 #include <esp_wifi_types.h>
+#include <stdint.h>
 #include <string>
 #include <utils/Singleton.hxx>
 
@@ -36,6 +38,16 @@ namespace openmrn_arduino
 namespace esp32cs
 {
 
+/// Two-point calibration for a current sense input.
+struct CurrentSenseCalibration
+{
+  /// ADC reading for each calibration point.
+  uint16_t reading[2];
+
+  /// Measured current (mA) for each calibration point.
+  uint32_t milliamps[2];
+};
+
 class NvsManager : public Singleton<NvsManager>
 {
 public:
@@ -67,6 +79,17 @@ public:
   bool sntp_enabled();
   const char *sntp_server();
   const char *timezone();
+
+  /// @return the OPS track current sense calibration, all fields will be
+  /// zero when the calibration has not been recorded.
+  CurrentSenseCalibration ops_calibration();
+
+  /// Persists the OPS track current sense calibration.
+  ///
+  /// @param calibration is the calibration to persist.
+  /// @return ESP_OK if the calibration has been persisted, otherwise the
+  /// error from NVS.
+  esp_err_t ops_calibration(const CurrentSenseCalibration &calibration);
 };
 
 } // namespace esp32cs
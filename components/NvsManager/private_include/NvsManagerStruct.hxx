@@ -18,6 +18,7 @@ COPYRIGHT (c) 2017-2021 Mike Dunston
 #ifndef NVS_STRUCT_HXX_
 #define NVS_STRUCT_HXX_
 
+#include "NvsManager.hxx"
 #include <esp_wifi_types.h>
 
 namespace esp32cs
@@ -47,7 +48,8 @@ namespace esp32cs
         bool fastclock_enabled;
         bool realtimeclock_enabled;
         uint64_t realtimeclock_id;
-        uint8_t reserved[20];
+        CurrentSenseCalibration ops_calibration;
+        uint8_t reserved[8];
     } node_config_t;
 
 } // namespace esp32cs
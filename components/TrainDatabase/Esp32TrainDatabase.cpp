@@ -17,6 +17,7 @@ COPYRIGHT (c) 2019-2021 Mike Dunston
 
 #include "TrainDatabase.h"
 
+#include <algorithm>
 #include <AllTrainNodes.hxx>
 #include <CDIXMLGenerator.hxx>
 #include <cJSON.h>
@@ -32,7 +33,10 @@ using commandstation::DccMode;
 using commandstation::AllTrainNodes;
 using openlcb::TractionDefs;
 
+static constexpr const char * TRAIN_DB_FILE = "/fs/trains.bin";
+static constexpr const char * TRAIN_DB_JOURNAL_FILE = "/fs/trains.jnl";
 static constexpr const char * TRAIN_DB_JSON_FILE = "/fs/trains.json";
+static constexpr const char * TRAIN_DB_JSON_IMPORTED_FILE = "/fs/trains.json.bak";
 static constexpr const char * PERSISTED_TRAIN_CDI = "/fs/train.xml";
 static constexpr const char * TEMP_TRAIN_CDI = "/fs/tmptrain.xml";
 
@@ -48,109 +52,219 @@ void validate_temp_train_cdi()
   CDIXMLGenerator::create_config_descriptor_xml(temp_train_cfg, TEMP_TRAIN_CDI, nullptr);
 }
 
+/// Imports the roster from the JSON file.
+///
+/// @param roster will receive the roster entries.
+/// @return true if the JSON file was imported.
+static bool import_json_roster(std::vector<Esp32PersistentTrainData> *roster)
+{
+  LOG(INFO, "[TrainDB] Importing %s...", TRAIN_DB_JSON_FILE);
+  auto json = read_file_to_string(TRAIN_DB_JSON_FILE);
+  cJSON *root = cJSON_ParseWithLength(json.c_str(), json.length());
+  bool imported = cJSON_IsArray(root);
+  if (imported)
+  {
+    cJSON *entry;
+    cJSON_ArrayForEach(entry, root)
+    {
+      cJSON *mode = cJSON_GetObjectItem(entry, "mode");
+      Esp32PersistentTrainData data(
+        cJSON_GetObjectItem(entry, "addr")->valueint,
+        cJSON_GetObjectItem(entry, "name")->valuestring,
+        cJSON_GetObjectItem(entry, "desc")->valuestring,
+        static_cast<DccMode>(cJSON_GetObjectItem(mode, "type")->valueint),
+        cJSON_IsTrue(cJSON_GetObjectItem(entry, "idle")));
+      cJSON *functions = cJSON_GetObjectItem(entry, "fn");
+      if (cJSON_IsArray(functions))
+      { 
+        cJSON *function;
+        cJSON_ArrayForEach(function, functions)
+        {
+          uint8_t id = cJSON_GetObjectItem(function, "id")->valueint;
+          Symbols type =
+            static_cast<Symbols>(
+              cJSON_GetObjectItem(function, "type")->valueint);
+          LOG(CONFIG_ROSTER_LOG_LEVEL,
+              "[TrainDB:%d] function: %d -> %d", data.address, id, type);
+          data.functions[id] = type;
+        }
+      }
+      roster->push_back(std::move(data));
+    }
+  }
+  else
+  {
+    LOG_ERROR("[TrainDB] %s is corrupt and will not be imported!",
+              TRAIN_DB_JSON_FILE);
+  }
+  cJSON_Delete(root);
+  return imported;
+}
+
 Esp32TrainDatabase::Esp32TrainDatabase(openlcb::SimpleStackBase *stack,
                                        Service *service)
+  : rosterFile_(TRAIN_DB_FILE, TRAIN_DB_JOURNAL_FILE)
 {
   LOG(INFO, "[TrainDB] Refreshing train CDI files...");
   validate_train_cdi();
   validate_temp_train_cdi();
   trainCdiFile_.emplace(PERSISTED_TRAIN_CDI);
   tempTrainCdiFile_.emplace(TEMP_TRAIN_CDI);
+  std::vector<Esp32PersistentTrainData> roster;
   struct stat statbuf;
-  if (!stat(TRAIN_DB_JSON_FILE, &statbuf))
+  if (!stat(TRAIN_DB_JSON_FILE, &statbuf) && import_json_roster(&roster))
   {
-    LOG(INFO, "[TrainDB] Loading %s...", TRAIN_DB_JSON_FILE);
-    auto roster = read_file_to_string(TRAIN_DB_JSON_FILE);
-    cJSON *root = cJSON_ParseWithLength(roster.c_str(), roster.length());
-    if (cJSON_IsArray(root))
+    // the JSON file replaces the persistent roster, it is renamed so that it
+    // is only imported once.
+    if (rosterFile_.compact(roster))
     {
-      cJSON *entry;
-      cJSON_ArrayForEach(entry, root)
+      unlink(TRAIN_DB_JSON_IMPORTED_FILE);
+      rename(TRAIN_DB_JSON_FILE, TRAIN_DB_JSON_IMPORTED_FILE);
+    }
+  }
+  else if (rosterFile_.load(
+    [&roster](Esp32PersistentTrainData &&data)
+    {
+      auto ent = std::find_if(roster.begin(), roster.end(),
+        [&data](const auto &train)
+        {
+          return train.address == data.address;
+        });
+      if (ent != roster.end())
       {
-        cJSON *mode = cJSON_GetObjectItem(entry, "mode");
-        Esp32PersistentTrainData data(
-          cJSON_GetObjectItem(entry, "addr")->valueint,
-          cJSON_GetObjectItem(entry, "name")->valuestring,
-          cJSON_GetObjectItem(entry, "desc")->valuestring,
-          static_cast<DccMode>(cJSON_GetObjectItem(mode, "type")->valueint),
-          cJSON_IsTrue(cJSON_GetObjectItem(entry, "idle")));
-        cJSON *functions = cJSON_GetObjectItem(entry, "fn");
-        if (cJSON_IsArray(functions))
-        { 
-          cJSON *function;
-          cJSON_ArrayForEach(function, functions)
-          {
-            uint8_t id = cJSON_GetObjectItem(function, "id")->valueint;
-            Symbols type =
-              static_cast<Symbols>(
-                cJSON_GetObjectItem(function, "type")->valueint);
-            LOG(CONFIG_ROSTER_LOG_LEVEL,
-                "[TrainDB:%d] function: %d -> %d", data.address, id, type);
-            data.functions[id] = type;
-          }
-        }
-        auto train = std::make_shared<Esp32TrainDbEntry>(data, this);
-        train->reset_dirty();
-        LOG(CONFIG_ROSTER_LOG_LEVEL,
-            "[TrainDB-%zu] Registering %s, name:%s, desc:%s, idle:%s",
-            trains_.size(), train->identifier().c_str(),
-            train->get_train_name().c_str(),
-            train->get_train_description().c_str(),
-            train->is_auto_idle() ? "On" : "Off");
-        stack->executor()->add(new CallbackExecutable([train]()
+        *ent = std::move(data);
+      }
+      else
+      {
+        roster.push_back(std::move(data));
+      }
+    },
+    [&roster](uint16_t address)
+    {
+      auto ent = std::find_if(roster.begin(), roster.end(),
+        [address](const auto &train)
         {
-          auto trainMgr = Singleton<AllTrainNodes>::instance();
-          if (train->is_auto_idle())
-          {
-            // allocate the node and retrieve the train instance so that it
-            // will be idling and ready-to-use.
-            trainMgr->get_train_impl(train->get_legacy_drive_mode(),
-                                     train->get_legacy_address());
-          }
-          else
-          {
-            // allocate the node only so it shows up in OpenLCB node list. The
-            // train instance will be created upon first usage.
-            trainMgr->allocate_node(train->get_legacy_drive_mode(),
-                                    train->get_legacy_address());
-          }
-        }));
-        trains_.emplace_back(train);
+          return train.address == address;
+        });
+      if (ent != roster.end())
+      {
+        roster.erase(ent);
       }
-    }
-    else
+    }))
+  {
+    if (rosterFile_.needs_compaction())
     {
-      LOG_ERROR("[TrainDB] Persistent storage is corrupt and will not be loaded!");
+      rosterFile_.compact(roster);
     }
-    cJSON_Delete(root);
   }
   else
   {
     LOG(WARNING, "[TrainDB] %s does not exist, skipping loading.",
-        TRAIN_DB_JSON_FILE);
+        TRAIN_DB_FILE);
+  }
+
+  for (auto &data : roster)
+  {
+    auto train = std::make_shared<Esp32TrainDbEntry>(data, this);
+    train->reset_dirty();
+    LOG(CONFIG_ROSTER_LOG_LEVEL,
+        "[TrainDB-%zu] Registering %s, name:%s, desc:%s, idle:%s",
+        trains_.size(), train->identifier().c_str(),
+        train->get_train_name().c_str(),
+        train->get_train_description().c_str(),
+        train->is_auto_idle() ? "On" : "Off");
+    stack->executor()->add(new CallbackExecutable([train]()
+    {
+      auto trainMgr = Singleton<AllTrainNodes>::instance();
+      if (train->is_auto_idle())
+      {
+        // allocate the node and retrieve the train instance so that it
+        // will be idling and ready-to-use.
+        trainMgr->get_train_impl(train->get_legacy_drive_mode(),
+                                 train->get_legacy_address());
+      }
+      else
+      {
+        // allocate the node only so it shows up in OpenLCB node list. The
+        // train instance will be created upon first usage.
+        trainMgr->allocate_node(train->get_legacy_drive_mode(),
+                                train->get_legacy_address());
+      }
+    }));
+    trains_.emplace_back(train);
   }
 
   LOG(INFO, "[TrainDB] Found %d persistent roster entries.", trains_.size());
+  invalidate_index();
 
   persistFlow_.emplace(service,
                        SEC_TO_NSEC(CONFIG_ROSTER_PERSISTENCE_INTERVAL_SEC),
                        std::bind(&Esp32TrainDatabase::persist, this));
 }
 
-#define FIND_TRAIN(id)                                    \
-  std::find_if(trains_.begin(), trains_.end(),            \
-    [id](const auto &train)                               \
-    {                                                     \
-      return train->get_legacy_address() == id;           \
-    })
-
-#define FIND_TRAIN_HINT(id, id2)                          \
-  std::find_if(trains_.begin(), trains_.end(),            \
-    [id,id2](const auto &train)                           \
-    {                                                     \
-      return train->get_traction_node() == id ||          \
-             train->get_legacy_address() == id2;          \
-    })
+Esp32TrainDatabase::TrainIterator Esp32TrainDatabase::find_train(
+  unsigned address)
+{
+  refresh_index();
+  if (address > UINT16_MAX)
+  {
+    return trains_.end();
+  }
+  auto ent = std::lower_bound(addressIndex_.begin(), addressIndex_.end(),
+                              std::make_pair((uint16_t)address, (size_t)0));
+  if (ent != addressIndex_.end() && ent->first == address)
+  {
+    return trains_.begin() + ent->second;
+  }
+  return trains_.end();
+}
+
+Esp32TrainDatabase::TrainIterator Esp32TrainDatabase::find_train(
+  openlcb::NodeID node_id, unsigned address)
+{
+  auto by_address = find_train(address);
+  auto ent = std::lower_bound(nodeIndex_.begin(), nodeIndex_.end(),
+                              std::make_pair(node_id, (size_t)0));
+  if (ent != nodeIndex_.end() && ent->first == node_id)
+  {
+    // return the first matching entry to be consistent with a linear search.
+    return std::min(by_address, trains_.begin() + ent->second);
+  }
+  return by_address;
+}
+
+void Esp32TrainDatabase::add_to_index()
+{
+  const size_t index = trains_.size() - 1;
+  auto address = std::make_pair(trains_[index]->get_legacy_address(), index);
+  addressIndex_.insert(
+    std::upper_bound(addressIndex_.begin(), addressIndex_.end(), address),
+    address);
+  auto node_id = std::make_pair(trains_[index]->get_traction_node(), index);
+  nodeIndex_.insert(
+    std::upper_bound(nodeIndex_.begin(), nodeIndex_.end(), node_id), node_id);
+}
+
+void Esp32TrainDatabase::refresh_index()
+{
+  if (!indexStale_.exchange(false))
+  {
+    return;
+  }
+  LOG(CONFIG_ROSTER_LOG_LEVEL, "[TrainDB] Rebuilding index (%zu entries)",
+      trains_.size());
+  addressIndex_.clear();
+  nodeIndex_.clear();
+  addressIndex_.reserve(trains_.size());
+  nodeIndex_.reserve(trains_.size());
+  for (size_t index = 0; index < trains_.size(); index++)
+  {
+    addressIndex_.emplace_back(trains_[index]->get_legacy_address(), index);
+    nodeIndex_.emplace_back(trains_[index]->get_traction_node(), index);
+  }
+  std::sort(addressIndex_.begin(), addressIndex_.end());
+  std::sort(nodeIndex_.begin(), nodeIndex_.end());
+}
 
 std::shared_ptr<TrainDbEntry> Esp32TrainDatabase::create_or_update(
   uint16_t address, string name, string description, DccMode mode, bool idle)
@@ -158,7 +272,7 @@ std::shared_ptr<TrainDbEntry> Esp32TrainDatabase::create_or_update(
   OSMutexLock lock(&mux_);
   LOG(CONFIG_ROSTER_LOG_LEVEL,
       "[TrainDB] Searching for roster entry for address: %u", address);
-  auto entry = FIND_TRAIN(address);
+  auto entry = find_train(address);
   if (entry != trains_.end())
   {
     LOG(INFO, "[TrainDB] Found existing entry:%s.", (*entry)->identifier().c_str());
@@ -172,6 +286,8 @@ std::shared_ptr<TrainDbEntry> Esp32TrainDatabase::create_or_update(
   trains_.emplace_back(
     new Esp32TrainDbEntry(
       Esp32PersistentTrainData(address, name, description, mode, idle), this));
+  add_to_index();
+  notify_entry_updated(index, trains_[index].get());
   LOG(CONFIG_ROSTER_LOG_LEVEL,
       "[TrainDB] No entry was found, created new entry:%s.",
       trains_[index]->identifier().c_str());
@@ -180,7 +296,8 @@ std::shared_ptr<TrainDbEntry> Esp32TrainDatabase::create_or_update(
 
 int Esp32TrainDatabase::get_index(unsigned address)
 {
-  auto ent = FIND_TRAIN(address);
+  OSMutexLock lock(&mux_);
+  auto ent = find_train(address);
   if (ent != trains_.end())
   {
     return std::distance(trains_.begin(), ent);
@@ -199,7 +316,8 @@ bool Esp32TrainDatabase::is_train_id_known(openlcb::NodeID train_id)
   if (TractionDefs::legacy_address_from_train_node_id(train_id, &type, &addr))
   {
     // only search with the address and discard the drive type (for now)
-    auto ent = FIND_TRAIN(addr);
+    OSMutexLock lock(&mux_);
+    auto ent = find_train(addr);
     return ent != trains_.end();
   }
   return false;
@@ -208,15 +326,41 @@ bool Esp32TrainDatabase::is_train_id_known(openlcb::NodeID train_id)
 void Esp32TrainDatabase::delete_entry(uint16_t address)
 {
   OSMutexLock lock(&mux_);
-  auto entry = FIND_TRAIN(address);
+  auto entry = find_train(address);
   if (entry != trains_.end())
   {
     LOG(CONFIG_ROSTER_LOG_LEVEL,
         "[TrainDB] Removing persistent entry for address %u", address);
+    if ((*entry)->is_persisted())
+    {
+      removedAddresses_.push_back(address);
+    }
     trains_.erase(entry);
+    // positions of the remaining entries have changed.
+    invalidate_index();
+    notify_entries_reset();
     // Remove the locomotive from the train node/instance manager
     Singleton<AllTrainNodes>::instance()->remove_train_impl(address);
-    entryDeleted_ = true;
+  }
+}
+
+void Esp32TrainDatabase::address_released(uint16_t address)
+{
+  OSMutexLock lock(&mux_);
+  removedAddresses_.push_back(address);
+}
+
+void Esp32TrainDatabase::entry_modified(Esp32TrainDbEntry *entry)
+{
+  OSMutexLock lock(&mux_);
+  auto ent = std::find_if(trains_.begin(), trains_.end(),
+    [entry](const auto &train)
+    {
+      return train.get() == entry;
+    });
+  if (ent != trains_.end())
+  {
+    notify_entry_updated(std::distance(trains_.begin(), ent), entry);
   }
 }
 
@@ -230,7 +374,7 @@ std::shared_ptr<TrainDbEntry> Esp32TrainDatabase::get_entry(unsigned train_id)
     return trains_[train_id];
   }
   // check if the train_id is a locomotive address that we know of
-  auto entry = FIND_TRAIN(train_id);
+  auto entry = find_train(train_id);
   if (entry != trains_.end())
   {
     return *entry;
@@ -245,7 +389,7 @@ std::shared_ptr<TrainDbEntry> Esp32TrainDatabase::find_entry(openlcb::NodeID nod
   LOG(CONFIG_ROSTER_LOG_LEVEL,
       "[TrainDB] Searching for Train Node:%s, Hint:%u",
       esp32cs::node_id_to_string(node_id).c_str(), hint);
-  auto entry = FIND_TRAIN_HINT(node_id, hint);
+  auto entry = find_train(node_id, hint);
   if (entry != trains_.end())
   {
     LOG(CONFIG_ROSTER_LOG_LEVEL, "[TrainDB] Found existing entry: %s."
@@ -266,7 +410,7 @@ unsigned Esp32TrainDatabase::add_dynamic_entry(uint16_t address, DccMode mode)
   LOG(CONFIG_ROSTER_LOG_LEVEL, "[TrainDB] Searching for loco %d", address);
 
   // prevent duplicate entries in the roster
-  auto ent = FIND_TRAIN(address);
+  auto ent = find_train(address);
   if (ent != trains_.end())
   {
     index = std::distance(trains_.begin(), ent);
@@ -289,6 +433,8 @@ unsigned Esp32TrainDatabase::add_dynamic_entry(uint16_t address, DccMode mode)
       new Esp32TrainDbEntry(
         Esp32PersistentTrainData(address, std::to_string(address),
                                  std::to_string(address), mode), this));
+    add_to_index();
+    notify_entry_updated(index, trains_[index].get());
 #else
     LOG(INFO
       , "[TrainDB] Adding temporary roster entry for locomotive %d."
@@ -300,6 +446,8 @@ unsigned Esp32TrainDatabase::add_dynamic_entry(uint16_t address, DccMode mode)
       new Esp32TrainDbEntry(
         Esp32PersistentTrainData(address, std::to_string(address),
                                  std::to_string(address), mode), this, false));
+    add_to_index();
+    notify_entry_updated(index, trains_[index].get());
 #endif
   }
   return index;
@@ -310,7 +458,7 @@ void Esp32TrainDatabase::set_train_name(uint16_t address, std::string name)
   OSMutexLock lock(&mux_);
   LOG(CONFIG_ROSTER_LOG_LEVEL, "[TrainDB] Searching for train with address %d",
       address);
-  auto entry = FIND_TRAIN(address);
+  auto entry = find_train(address);
   if (entry != trains_.end())
   {
     (*entry)->set_train_name(name);
@@ -326,7 +474,7 @@ void Esp32TrainDatabase::set_train_description(uint16_t address, std::string des
   OSMutexLock lock(&mux_);
   LOG(CONFIG_ROSTER_LOG_LEVEL,
       "[TrainDB] Searching for train with address %u", address);
-  auto entry = FIND_TRAIN(address);
+  auto entry = find_train(address);
   if (entry != trains_.end())
   {
     (*entry)->set_train_description(description);
@@ -342,7 +490,7 @@ void Esp32TrainDatabase::set_train_auto_idle(uint16_t address, bool idle)
   OSMutexLock lock(&mux_);
   LOG(CONFIG_ROSTER_LOG_LEVEL,
       "[TrainDB] Searching for train with address %u", address);
-  auto entry = FIND_TRAIN(address);
+  auto entry = find_train(address);
   if (entry != trains_.end())
   {
     (*entry)->set_auto_idle(idle);
@@ -359,7 +507,7 @@ void Esp32TrainDatabase::set_train_function_label(uint16_t address, uint8_t fn_i
   OSMutexLock lock(&mux_);
   LOG(CONFIG_ROSTER_LOG_LEVEL, "[TrainDB] Searching for train with address %u",
       address);
-  auto entry = FIND_TRAIN(address);
+  auto entry = find_train(address);
   if (entry != trains_.end())
   {
     (*entry)->set_function_label(fn_id, label);
@@ -376,7 +524,7 @@ void Esp32TrainDatabase::set_train_drive_mode(uint16_t address, commandstation::
   OSMutexLock lock(&mux_);
   LOG(CONFIG_ROSTER_LOG_LEVEL, "[TrainDB] Searching for train with address %u",
       address);
-  auto entry = FIND_TRAIN(address);
+  auto entry = find_train(address);
   if (entry != trains_.end())
   {
     (*entry)->set_legacy_drive_mode(mode);
@@ -413,7 +561,7 @@ string Esp32TrainDatabase::get_entry_as_json(uint16_t address, bool readable)
 string Esp32TrainDatabase::get_entry_as_json_locked(uint16_t address, bool readable)
 {
   std::string serialized = "{}";
-  auto entry = FIND_TRAIN(address);
+  auto entry = find_train(address);
   if (entry != trains_.end())
   {
     serialized = (*entry)->to_json(readable);
@@ -423,41 +571,75 @@ string Esp32TrainDatabase::get_entry_as_json_locked(uint16_t address, bool reada
 
 void Esp32TrainDatabase::persist()
 {
-  OSMutexLock lock(&mux_);
   LOG(CONFIG_ROSTER_LOG_LEVEL,
       "[TrainDB] Checking if roster needs to be persisted...");
-  auto ent = std::find_if(trains_.begin(), trains_.end(),
-    [](const auto &train)
-    {
-      return train->is_dirty() && train->is_persisted();
-    });
-  if (ent != trains_.end() || entryDeleted_)
+  std::vector<uint16_t> removed;
+  std::vector<Esp32PersistentTrainData> updated;
+  std::vector<std::shared_ptr<Esp32TrainDbEntry>> modified;
   {
-    LOG(CONFIG_ROSTER_LOG_LEVEL,
-        "[TrainDB] At least one entry requires persistence.");
-    std::string serialized = "[";
-    size_t count = 0;
+    OSMutexLock lock(&mux_);
+    removed.swap(removedAddresses_);
     for (auto entry : trains_)
     {
-      if (entry->is_persisted())
+      if (entry->is_dirty() && entry->is_persisted())
       {
-        if (count)
-        {
-          serialized += ",";
-        }
-        serialized += entry->to_json(false);
-        count++;
+        updated.push_back(entry->get_data());
+        modified.push_back(entry);
       }
       entry->reset_dirty();
     }
-    serialized += "]";
-    write_string_to_file(TRAIN_DB_JSON_FILE, serialized);
-    LOG(INFO, "[TrainDB] Persisted %zu roster entries.", count);
-    entryDeleted_ = false;
   }
-  else
+  // a previous write may have failed, in which case the snapshot needs to be
+  // rewritten even if nothing has been modified since.
+  if (removed.empty() && updated.empty() && !rosterFile_.needs_compaction())
   {
     LOG(CONFIG_ROSTER_LOG_LEVEL, "[TrainDB] No entries require persistence");
+    return;
+  }
+
+  // only the modified entries are written, the file I/O happens without
+  // holding mux_ so that lookups are not blocked.
+  bool persisted = rosterFile_.append(removed, updated);
+  if (persisted)
+  {
+    LOG(INFO, "[TrainDB] Persisted %zu roster change(s).",
+        removed.size() + updated.size());
+  }
+
+  if (rosterFile_.needs_compaction())
+  {
+    std::vector<Esp32PersistentTrainData> roster;
+    {
+      OSMutexLock lock(&mux_);
+      for (auto entry : trains_)
+      {
+        if (entry->is_persisted())
+        {
+          roster.push_back(entry->get_data());
+        }
+      }
+    }
+    LOG(CONFIG_ROSTER_LOG_LEVEL, "[TrainDB] Compacting roster (%zu entries)",
+        roster.size());
+    // the snapshot contains the complete roster, including any changes that
+    // could not be written to the journal.
+    persisted |= rosterFile_.compact(roster);
+  }
+
+  if (!persisted)
+  {
+    // the changes have not been written, restore them so that they are
+    // retried on the next check. The removed addresses are placed ahead of
+    // any that have been removed since so that the order is preserved.
+    LOG_ERROR("[TrainDB] Unable to persist %zu roster change(s), will retry.",
+              removed.size() + updated.size());
+    OSMutexLock lock(&mux_);
+    removedAddresses_.insert(removedAddresses_.begin(), removed.begin(),
+                             removed.end());
+    for (auto entry : modified)
+    {
+      entry->reset_dirty(true);
+    }
   }
 }
 
@@ -107,6 +107,7 @@ void Esp32TrainDbEntry::set_train_name(string name)
     LOG(INFO, "[Train:%d] Setting name:%s", data_.address, name.c_str());
     data_.name = std::move(name);
     dirty_ = true;
+    db_->entry_modified(this);
   }
 }
 
@@ -132,8 +133,14 @@ void Esp32TrainDbEntry::set_legacy_address(uint16_t address)
   if (data_.address != address)
   {
     LOG(INFO, "[Train:%d] Updating address to:%d", data_.address, address);
+    if (persist_)
+    {
+      db_->address_released(data_.address);
+    }
     data_.address = address;
     dirty_ = true;
+    db_->invalidate_index();
+    db_->entry_modified(this);
   }
 }
 
@@ -144,6 +151,8 @@ void Esp32TrainDbEntry::set_legacy_drive_mode(DccMode mode)
     LOG(INFO, "[Train:%d] Updating drive mode to:%d", data_.address, mode);
     data_.mode = mode;
     dirty_ = true;
+    db_->invalidate_index();
+    db_->entry_modified(this);
   }
 }
 
@@ -0,0 +1,544 @@
+/**********************************************************************
+ESP32 COMMAND STATION
+
+COPYRIGHT (c) 2021 Mike Dunston
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see http://www.gnu.org/licenses
+**********************************************************************/
+
+#include "TrainRosterFile.h"
+#include "TrainDatabase.h"
+
+#include <algorithm>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <utils/logging.h>
+
+namespace esp32cs
+{
+
+/// Identifies a roster snapshot file ("ECSR").
+static constexpr uint32_t SNAPSHOT_MAGIC = 0x52534345;
+
+/// Version of the snapshot and journal record format.
+static constexpr uint16_t SNAPSHOT_VERSION = 2;
+
+/// Minimum size of the journal before the snapshot will be rewritten.
+static constexpr size_t COMPACTION_MIN_JOURNAL_BYTES = 4096;
+
+/// Flag set in @ref RosterRecord::flags when the entry is automatically
+/// idled at startup.
+static constexpr uint8_t RECORD_FLAG_AUTO_IDLE = 0x01;
+
+/// Header at the start of the snapshot file, it is followed by the string
+/// table and then @ref count instances of @ref RosterRecord.
+struct SnapshotHeader
+{
+  /// Must be @ref SNAPSHOT_MAGIC.
+  uint32_t magic;
+
+  /// Must be @ref SNAPSHOT_VERSION.
+  uint16_t version;
+
+  /// Must be sizeof(@ref RosterRecord).
+  uint16_t recordSize;
+
+  /// Number of records.
+  uint32_t count;
+
+  /// Size of the string table.
+  uint32_t stringsSize;
+
+  /// Incremented each time the snapshot is rewritten, journal records with
+  /// an older generation have already been applied to the snapshot.
+  uint32_t generation;
+};
+static_assert(sizeof(SnapshotHeader) == 20, "SnapshotHeader size mismatch");
+
+/// Fixed-size record for a roster entry.
+struct RosterRecord
+{
+  /// Offset of the name in the string table, unused in the journal.
+  uint32_t nameOffset;
+
+  /// Offset of the description in the string table, unused in the journal.
+  uint32_t descOffset;
+
+  /// Legacy address of the entry.
+  uint16_t address;
+
+  /// Drive mode of the entry.
+  uint8_t mode;
+
+  /// Combination of RECORD_FLAG_* values.
+  uint8_t flags;
+
+  /// Length of the name.
+  uint8_t nameLength;
+
+  /// Length of the description.
+  uint8_t descLength;
+
+  /// Function labels.
+  uint8_t functions[DCC_MAX_FN];
+
+  /// Unused, always zero.
+  uint8_t reserved[1];
+};
+static_assert(sizeof(RosterRecord) == 44, "RosterRecord size mismatch");
+
+/// Journal record types.
+enum JournalType : uint8_t
+{
+  /// Entry has been added or modified.
+  JOURNAL_UPSERT = 1,
+
+  /// Entry has been removed, only the address of the record is used.
+  JOURNAL_REMOVE = 2
+};
+
+/// Header of a journal record, it is followed by a @ref RosterRecord, the
+/// name and the description.
+struct JournalHeader
+{
+  /// @ref JournalType of the record.
+  uint8_t type;
+
+  /// Unused, always zero.
+  uint8_t reserved;
+
+  /// Fletcher-16 checksum of the type, generation, record and strings.
+  uint16_t checksum;
+
+  /// Generation of the snapshot that the record was appended to.
+  uint32_t generation;
+};
+static_assert(sizeof(JournalHeader) == 8, "JournalHeader size mismatch");
+
+/// Calculates a Fletcher-16 checksum.
+class Fletcher16
+{
+public:
+  /// Adds data to the checksum.
+  ///
+  /// @param data is the data to add.
+  /// @param length is the number of bytes to add.
+  void update(const void *data, size_t length)
+  {
+    const uint8_t *bytes = static_cast<const uint8_t *>(data);
+    for (size_t idx = 0; idx < length; idx++)
+    {
+      sum1_ = (sum1_ + bytes[idx]) % 255;
+      sum2_ = (sum2_ + sum1_) % 255;
+    }
+  }
+
+  /// @return the checksum of the data added so far.
+  uint16_t value() const
+  {
+    return (sum2_ << 8) | sum1_;
+  }
+
+private:
+  uint16_t sum1_{0};
+  uint16_t sum2_{0};
+};
+
+/// Creates a record for a roster entry.
+///
+/// @param data is the roster entry.
+/// @param name_offset is the offset of the name in the string table.
+/// @param desc_offset is the offset of the description in the string table.
+/// @return the record for @param data.
+static RosterRecord encode_record(const Esp32PersistentTrainData &data,
+                                  uint32_t name_offset, uint32_t desc_offset)
+{
+  RosterRecord record;
+  memset(&record, 0, sizeof(RosterRecord));
+  record.nameOffset = name_offset;
+  record.descOffset = desc_offset;
+  record.address = data.address;
+  record.mode = data.mode;
+  record.flags = data.automatic_idle ? RECORD_FLAG_AUTO_IDLE : 0;
+  record.nameLength = std::min(data.name.length(), (size_t)UINT8_MAX);
+  record.descLength = std::min(data.description.length(), (size_t)UINT8_MAX);
+  for (size_t idx = 0; idx < DCC_MAX_FN && idx < data.functions.size(); idx++)
+  {
+    record.functions[idx] = data.functions[idx];
+  }
+  return record;
+}
+
+/// Creates a roster entry from a record.
+///
+/// @param record is the record to convert.
+/// @param name is the name of the entry (@ref RosterRecord::nameLength).
+/// @param desc is the description of the entry
+/// (@ref RosterRecord::descLength).
+/// @return the roster entry.
+static Esp32PersistentTrainData decode_record(const RosterRecord &record,
+                                              const char *name,
+                                              const char *desc)
+{
+  Esp32PersistentTrainData data(record.address,
+                                std::string(name, record.nameLength),
+                                std::string(desc, record.descLength),
+                                static_cast<DccMode>(record.mode),
+                                record.flags & RECORD_FLAG_AUTO_IDLE);
+  for (size_t idx = 0; idx < DCC_MAX_FN && idx < data.functions.size(); idx++)
+  {
+    data.functions[idx] = static_cast<Symbols>(record.functions[idx]);
+  }
+  return data;
+}
+
+/// Writes a journal record.
+///
+/// @param f is the journal file.
+/// @param type is the @ref JournalType of the record.
+/// @param generation is the generation of the current snapshot.
+/// @param record is the record to write.
+/// @param name is the name of the entry.
+/// @param desc is the description of the entry.
+/// @return the number of bytes written or zero if the write failed.
+static size_t write_journal_record(FILE *f, JournalType type,
+                                   uint32_t generation,
+                                   const RosterRecord &record,
+                                   const std::string &name,
+                                   const std::string &desc)
+{
+  JournalHeader header;
+  memset(&header, 0, sizeof(JournalHeader));
+  header.type = type;
+  header.generation = generation;
+  Fletcher16 checksum;
+  checksum.update(&header.type, sizeof(header.type));
+  checksum.update(&header.generation, sizeof(header.generation));
+  checksum.update(&record, sizeof(RosterRecord));
+  checksum.update(name.data(), record.nameLength);
+  checksum.update(desc.data(), record.descLength);
+  header.checksum = checksum.value();
+
+  // assemble the complete record so it is written with a single call.
+  std::string buffer;
+  buffer.reserve(sizeof(JournalHeader) + sizeof(RosterRecord) +
+                 record.nameLength + record.descLength);
+  buffer.append(reinterpret_cast<const char *>(&header), sizeof(JournalHeader));
+  buffer.append(reinterpret_cast<const char *>(&record), sizeof(RosterRecord));
+  buffer.append(name.data(), record.nameLength);
+  buffer.append(desc.data(), record.descLength);
+  if (fwrite(buffer.data(), buffer.length(), 1, f) != 1)
+  {
+    return 0;
+  }
+  return buffer.length();
+}
+
+bool TrainRosterFile::load(UpsertCallback upsert, RemoveCallback remove)
+{
+  struct stat statbuf;
+  std::string temp_path = std::string(snapshotPath_) + ".tmp";
+  bool found = false;
+  snapshotBytes_ = 0;
+  journalBytes_ = 0;
+  generation_ = 0;
+  compactionRequired_ = false;
+
+  // a snapshot that was completely written but not yet renamed when the
+  // previous compaction was interrupted.
+  if (stat(snapshotPath_, &statbuf) && !stat(temp_path.c_str(), &statbuf))
+  {
+    LOG(WARNING, "[TrainDB] Recovering roster snapshot from %s",
+        temp_path.c_str());
+    rename(temp_path.c_str(), snapshotPath_);
+  }
+
+  FILE *f = fopen(snapshotPath_, "rb");
+  if (f)
+  {
+    found = true;
+    SnapshotHeader header;
+    // the sizes in the header are validated against the file size before
+    // anything is allocated so that a corrupted header can not trigger a
+    // large allocation.
+    if (fread(&header, sizeof(SnapshotHeader), 1, f) != 1 ||
+        header.magic != SNAPSHOT_MAGIC ||
+        header.version != SNAPSHOT_VERSION ||
+        header.recordSize != sizeof(RosterRecord) ||
+        stat(snapshotPath_, &statbuf) ||
+        (uint64_t)statbuf.st_size !=
+          sizeof(SnapshotHeader) + (uint64_t)header.stringsSize +
+          ((uint64_t)header.count * sizeof(RosterRecord)))
+    {
+      LOG_ERROR("[TrainDB] %s is not a valid roster snapshot!", snapshotPath_);
+      compactionRequired_ = true;
+    }
+    else
+    {
+      // the string table is the only variable size part of the snapshot, the
+      // records are streamed one at a time.
+      std::string strings(header.stringsSize, '\0');
+      if (header.stringsSize &&
+          fread(&strings[0], header.stringsSize, 1, f) != 1)
+      {
+        LOG_ERROR("[TrainDB] Unable to read roster string table!");
+        compactionRequired_ = true;
+        header.count = 0;
+      }
+      for (uint32_t idx = 0; idx < header.count; idx++)
+      {
+        RosterRecord record;
+        if (fread(&record, sizeof(RosterRecord), 1, f) != 1 ||
+            record.nameOffset > strings.size() ||
+            record.nameLength > strings.size() - record.nameOffset ||
+            record.descOffset > strings.size() ||
+            record.descLength > strings.size() - record.descOffset)
+        {
+          LOG_ERROR("[TrainDB] Roster snapshot record %" PRIu32 " is invalid!",
+                    idx);
+          compactionRequired_ = true;
+          break;
+        }
+        upsert(decode_record(record, strings.data() + record.nameOffset,
+                             strings.data() + record.descOffset));
+      }
+      snapshotBytes_ = sizeof(SnapshotHeader) + header.stringsSize +
+                       (header.count * sizeof(RosterRecord));
+      generation_ = header.generation;
+    }
+    fclose(f);
+  }
+
+  f = fopen(journalPath_, "rb");
+  if (f)
+  {
+    found = true;
+    size_t count = 0;
+    size_t stale = 0;
+    const uint32_t snapshot_generation = generation_;
+    JournalHeader header;
+    RosterRecord record;
+    char strings[UINT8_MAX * 2];
+    while (fread(&header, sizeof(JournalHeader), 1, f) == 1)
+    {
+      size_t length = 0;
+      bool valid = fread(&record, sizeof(RosterRecord), 1, f) == 1;
+      if (valid)
+      {
+        length = record.nameLength + record.descLength;
+        valid = !length || fread(strings, length, 1, f) == 1;
+      }
+      if (valid)
+      {
+        Fletcher16 checksum;
+        checksum.update(&header.type, sizeof(header.type));
+        checksum.update(&header.generation, sizeof(header.generation));
+        checksum.update(&record, sizeof(RosterRecord));
+        checksum.update(strings, length);
+        valid = checksum.value() == header.checksum;
+      }
+      if (!valid)
+      {
+        // later appends would follow the invalid record, rewrite the
+        // snapshot so the journal is discarded.
+        LOG(WARNING,
+            "[TrainDB] Discarding incomplete roster journal record at offset "
+            "%zu", journalBytes_);
+        compactionRequired_ = true;
+        break;
+      }
+      journalBytes_ += sizeof(JournalHeader) + sizeof(RosterRecord) + length;
+      if (header.generation < snapshot_generation)
+      {
+        // the journal was not removed after the snapshot was rewritten, the
+        // record has already been applied to the snapshot.
+        stale++;
+        continue;
+      }
+      // the snapshot may be invalid, the next snapshot must be newer than
+      // any record that has been replayed.
+      generation_ = std::max(generation_, header.generation);
+      if (header.type == JOURNAL_UPSERT)
+      {
+        upsert(decode_record(record, strings, strings + record.nameLength));
+      }
+      else if (header.type == JOURNAL_REMOVE)
+      {
+        remove(record.address);
+      }
+      count++;
+    }
+    // a partially written record header is not detected by the loop above.
+    if (!compactionRequired_ && !fseek(f, 0, SEEK_END) &&
+        (size_t)ftell(f) != journalBytes_)
+    {
+      LOG(WARNING,
+          "[TrainDB] Discarding incomplete roster journal record at offset "
+          "%zu", journalBytes_);
+      compactionRequired_ = true;
+    }
+    fclose(f);
+    if (stale)
+    {
+      LOG(WARNING,
+          "[TrainDB] Skipped %zu roster journal record(s) older than the "
+          "snapshot", stale);
+      compactionRequired_ = true;
+    }
+    LOG(CONFIG_ROSTER_LOG_LEVEL,
+        "[TrainDB] Replayed %zu roster journal record(s)", count);
+  }
+  return found;
+}
+
+bool TrainRosterFile::append(const std::vector<uint16_t> &removed,
+                             const std::vector<Esp32PersistentTrainData> &updated)
+{
+  if (removed.empty() && updated.empty())
+  {
+    return true;
+  }
+  FILE *f = fopen(journalPath_, "ab");
+  if (!f)
+  {
+    LOG_ERROR("[TrainDB] Unable to open %s: %s", journalPath_,
+              strerror(errno));
+    compactionRequired_ = true;
+    return false;
+  }
+  bool success = true;
+  for (uint16_t address : removed)
+  {
+    RosterRecord record;
+    memset(&record, 0, sizeof(RosterRecord));
+    record.address = address;
+    size_t written =
+      write_journal_record(f, JOURNAL_REMOVE, generation_, record, "", "");
+    journalBytes_ += written;
+    success &= (written != 0);
+  }
+  for (auto &data : updated)
+  {
+    size_t written =
+      write_journal_record(f, JOURNAL_UPSERT, generation_,
+                           encode_record(data, 0, 0), data.name,
+                           data.description);
+    journalBytes_ += written;
+    success &= (written != 0);
+  }
+  success &= (fflush(f) == 0);
+  success &= (fsync(fileno(f)) == 0);
+  fclose(f);
+  if (!success)
+  {
+    // the journal may end with a partial record, rewrite the snapshot.
+    LOG_ERROR("[TrainDB] Unable to write %s: %s", journalPath_,
+              strerror(errno));
+    compactionRequired_ = true;
+  }
+  return success;
+}
+
+bool TrainRosterFile::compact(
+  const std::vector<Esp32PersistentTrainData> &roster)
+{
+  std::string strings;
+  std::vector<RosterRecord> records;
+  records.reserve(roster.size());
+  for (auto &data : roster)
+  {
+    RosterRecord record = encode_record(data, strings.length(),
+                                        strings.length() +
+                                        std::min(data.name.length(),
+                                                 (size_t)UINT8_MAX));
+    strings.append(data.name, 0, record.nameLength);
+    strings.append(data.description, 0, record.descLength);
+    records.push_back(record);
+  }
+
+  SnapshotHeader header;
+  memset(&header, 0, sizeof(SnapshotHeader));
+  header.magic = SNAPSHOT_MAGIC;
+  header.version = SNAPSHOT_VERSION;
+  header.recordSize = sizeof(RosterRecord);
+  header.count = records.size();
+  header.stringsSize = strings.length();
+  header.generation = generation_ + 1;
+
+  // the snapshot is written to a temporary file and renamed so that an
+  // interrupted compaction leaves the previous snapshot and journal intact.
+  std::string temp_path = std::string(snapshotPath_) + ".tmp";
+  FILE *f = fopen(temp_path.c_str(), "wb");
+  if (!f)
+  {
+    LOG_ERROR("[TrainDB] Unable to open %s: %s", temp_path.c_str(),
+              strerror(errno));
+    compactionRequired_ = true;
+    return false;
+  }
+  bool success = fwrite(&header, sizeof(SnapshotHeader), 1, f) == 1;
+  if (success && !strings.empty())
+  {
+    success = fwrite(strings.data(), strings.length(), 1, f) == 1;
+  }
+  if (success && !records.empty())
+  {
+    success =
+      fwrite(records.data(), sizeof(RosterRecord), records.size(), f) ==
+        records.size();
+  }
+  success &= (fflush(f) == 0);
+  success &= (fsync(fileno(f)) == 0);
+  fclose(f);
+  if (!success)
+  {
+    LOG_ERROR("[TrainDB] Unable to write %s: %s", temp_path.c_str(),
+              strerror(errno));
+    unlink(temp_path.c_str());
+    compactionRequired_ = true;
+    return false;
+  }
+
+  // not all filesystems allow renaming over an existing file. If the journal
+  // is not removed below it will contain only records from the previous
+  // generation which are skipped when the roster is loaded.
+  unlink(snapshotPath_);
+  if (rename(temp_path.c_str(), snapshotPath_))
+  {
+    LOG_ERROR("[TrainDB] Unable to rename %s: %s", temp_path.c_str(),
+              strerror(errno));
+    compactionRequired_ = true;
+    return false;
+  }
+  unlink(journalPath_);
+  generation_ = header.generation;
+  snapshotBytes_ = sizeof(SnapshotHeader) + strings.length() +
+                   (records.size() * sizeof(RosterRecord));
+  journalBytes_ = 0;
+  compactionRequired_ = false;
+  LOG(INFO, "[TrainDB] Compacted roster: %zu entries, %zu bytes.",
+      roster.size(), snapshotBytes_);
+  return true;
+}
+
+bool TrainRosterFile::needs_compaction()
+{
+  return compactionRequired_ ||
+         journalBytes_ > std::max(COMPACTION_MIN_JOURNAL_BYTES,
+                                  snapshotBytes_);
+}
+
+} // namespace esp32cs
\ No newline at end of file
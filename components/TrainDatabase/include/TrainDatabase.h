@@ -18,6 +18,7 @@ COPYRIGHT (c) 2019-2021 Mike Dunston
 #ifndef _ESP32_TRAIN_DB_H_
 #define _ESP32_TRAIN_DB_H_
 
+#include <atomic>
 #include <mutex>
 #include <vector>
 
@@ -30,6 +31,8 @@ COPYRIGHT (c) 2019-2021 Mike Dunston
 #include <TrainDb.hxx>
 #include <utils/Uninitialized.hxx>
 
+#include "TrainRosterFile.h"
+
 #include "sdkconfig.h"
 
 #ifndef CONFIG_ROSTER_AUTO_IDLE_NEW_LOCOS
@@ -231,12 +234,83 @@ namespace esp32cs
 
     void persist();
 
+    /// Marks the address and node id indexes as stale, this must be called
+    /// when the address or drive mode of an entry has been modified.
+    void invalidate_index()
+    {
+      indexStale_ = true;
+    }
+
+    /// Notifies the @ref TrainDbListener that the name, address or drive mode
+    /// of an entry has been modified.
+    ///
+    /// @param entry is the entry that has been modified.
+    void entry_modified(Esp32TrainDbEntry *entry);
+
+    /// Records that an address is no longer used by a persistent entry so
+    /// that it will be removed from persistent storage.
+    ///
+    /// @param address is the address that is no longer used.
+    void address_released(uint16_t address);
+
   private:
+    typedef std::vector<std::shared_ptr<Esp32TrainDbEntry>>::iterator
+      TrainIterator;
+
     std::string get_entry_as_json_locked(uint16_t address, bool readable = true);
+
+    /// Locates the first entry with the provided address.
+    ///
+    /// @param address is the address to search for.
+    /// @return iterator for the entry or trains_.end() if not found.
+    ///
+    /// NOTE: mux_ must be held by the caller.
+    TrainIterator find_train(unsigned address);
+
+    /// Locates the first entry with the provided traction node id or address.
+    ///
+    /// @param node_id is the traction node id to search for.
+    /// @param address is the address to search for.
+    /// @return iterator for the entry or trains_.end() if not found.
+    ///
+    /// NOTE: mux_ must be held by the caller.
+    TrainIterator find_train(openlcb::NodeID node_id, unsigned address);
+
+    /// Adds the entry at the end of trains_ to the indexes.
+    ///
+    /// NOTE: mux_ must be held by the caller.
+    void add_to_index();
+
+    /// Rebuilds the indexes from trains_ if they are stale.
+    ///
+    /// NOTE: mux_ must be held by the caller.
+    void refresh_index();
+
     openlcb::SimpleStackBase *stack_;
-    bool entryDeleted_{false};
-    OSMutex mux_;
+
+    /// Addresses that have been removed (or changed) since the roster was
+    /// last persisted.
+    std::vector<uint16_t> removedAddresses_;
+
+    /// Persistent storage for the roster.
+    TrainRosterFile rosterFile_;
+
+    /// Lock protecting trains_ and the indexes, this is recursive since the
+    /// entries call back into the database when they are modified.
+    OSMutex mux_{true};
     std::vector<std::shared_ptr<Esp32TrainDbEntry>> trains_;
+
+    /// Index of trains_ sorted by address, each entry holds the address and
+    /// the position in trains_.
+    std::vector<std::pair<uint16_t, size_t>> addressIndex_;
+
+    /// Index of trains_ sorted by traction node id, each entry holds the node
+    /// id and the position in trains_.
+    std::vector<std::pair<openlcb::NodeID, size_t>> nodeIndex_;
+
+    /// Set when an entry key has been modified outside of the database, the
+    /// indexes will be rebuilt on the next lookup.
+    std::atomic<bool> indexStale_{false};
     uninitialized<openlcb::ROFileMemorySpace> trainCdiFile_;
     uninitialized<openlcb::ROFileMemorySpace> tempTrainCdiFile_;
     uninitialized<AutoPersistFlow> persistFlow_;
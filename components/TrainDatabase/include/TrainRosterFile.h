@@ -0,0 +1,113 @@
+/**********************************************************************
+ESP32 COMMAND STATION
+
+COPYRIGHT (c) 2021 Mike Dunston
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see http://www.gnu.org/licenses
+**********************************************************************/
+
+#ifndef _ESP32_TRAIN_ROSTER_FILE_H_
+#define _ESP32_TRAIN_ROSTER_FILE_H_
+
+#include <functional>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+namespace esp32cs
+{
+  struct Esp32PersistentTrainData;
+
+  /// Binary persistent storage for the locomotive roster.
+  ///
+  /// The roster is stored as a snapshot and an append-only journal. The
+  /// snapshot holds a header, a string table with the names and descriptions
+  /// and a fixed-size record for each entry. The journal holds a record for
+  /// each entry that has been added, modified or removed since the snapshot
+  /// was written. Each journal record carries a checksum so that a partially
+  /// written record is detected and discarded.
+  ///
+  /// Once the journal grows larger than the snapshot, the snapshot is
+  /// rewritten from the current roster and the journal is discarded. The
+  /// snapshot carries a generation number which is recorded in each journal
+  /// record, records from an older generation are skipped when loading so
+  /// that a journal left behind by an interrupted compaction is not replayed
+  /// over the newer snapshot.
+  class TrainRosterFile
+  {
+  public:
+    /// Callback invoked for each entry that is loaded.
+    typedef std::function<void(Esp32PersistentTrainData &&)> UpsertCallback;
+
+    /// Callback invoked for each address that has been removed.
+    typedef std::function<void(uint16_t)> RemoveCallback;
+
+    /// Constructor.
+    ///
+    /// @param snapshot is the path of the snapshot file.
+    /// @param journal is the path of the journal file.
+    TrainRosterFile(const char *snapshot, const char *journal)
+      : snapshotPath_(snapshot), journalPath_(journal)
+    {
+    }
+
+    /// Loads the roster by streaming the snapshot and then the journal.
+    ///
+    /// @param upsert is called for each entry, an entry with the same address
+    /// as a previously loaded entry replaces it.
+    /// @param remove is called for each address that has been removed.
+    /// @return false if neither the snapshot nor the journal exist.
+    bool load(UpsertCallback upsert, RemoveCallback remove);
+
+    /// Appends changes to the journal.
+    ///
+    /// @param removed are the addresses that have been removed.
+    /// @param updated are the entries that have been added or modified.
+    /// @return true if the changes have been written.
+    bool append(const std::vector<uint16_t> &removed,
+                const std::vector<Esp32PersistentTrainData> &updated);
+
+    /// Replaces the snapshot with the provided roster and discards the
+    /// journal.
+    ///
+    /// @param roster is the complete roster to persist.
+    /// @return true if the snapshot has been written.
+    bool compact(const std::vector<Esp32PersistentTrainData> &roster);
+
+    /// @return true if the snapshot should be rewritten, either because the
+    /// journal has grown too large or it contains an invalid record.
+    bool needs_compaction();
+
+  private:
+    /// Path of the snapshot file.
+    const char *snapshotPath_;
+
+    /// Path of the journal file.
+    const char *journalPath_;
+
+    /// Size of the snapshot file.
+    size_t snapshotBytes_{0};
+
+    /// Size of the valid records in the journal file.
+    size_t journalBytes_{0};
+
+    /// Generation of the current snapshot.
+    uint32_t generation_{0};
+
+    /// Set when the snapshot or journal could not be read or written, the
+    /// snapshot will be rewritten on the next compaction check.
+    bool compactionRequired_{false};
+  };
+
+} // namespace esp32cs
+
+#endif // _ESP32_TRAIN_ROSTER_FILE_H_
\ No newline at end of file
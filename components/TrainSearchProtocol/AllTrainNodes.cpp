@@ -36,7 +36,9 @@
 
 #include "FdiXmlGenerator.hxx"
 #include "FindProtocolServer.hxx"
+#include "SeqLockHashMap.hxx"
 #include "TrainDb.hxx"
+#include "TrainSearchIndex.hxx"
 #include <dcc/Loco.hxx>
 #include <functional>
 #include <openlcb/EventHandlerTemplates.hxx>
@@ -49,6 +51,7 @@
 #include <utils/format_utils.hxx>
 
 #include <algorithm>
+#include <atomic>
 
 namespace commandstation
 {
@@ -88,7 +91,9 @@ public:
   DelayedInitTrainNode(TrainService *service, size_t id, DccMode mode,
                        uint16_t address)
     : DefaultTrainNode(service, nullptr), id_(id), mode_(mode),
-    address_(address)
+    address_(address),
+    nodeId_(TractionDefs::train_node_id_from_legacy(
+      dcc_mode_to_address_type(mode, address), address))
   {
     service->register_train(this);
   }
@@ -102,8 +107,7 @@ public:
 
   NodeID node_id() override
   {
-    return TractionDefs::train_node_id_from_legacy(
-      dcc_mode_to_address_type(mode_, address_), address_);
+    return nodeId_;
   }
 
   uint16_t address()
@@ -182,27 +186,176 @@ private:
   size_t id_;
   DccMode mode_;
   uint16_t address_;
+  /// Cached node id, the mode and address can not be changed.
+  NodeID nodeId_;
 };
 
-void AllTrainNodes::remove_train_impl(int address)
+class AllTrainNodes::TrainNodeIndex
 {
-  OSMutexLock l(&trainsLock_);
-  auto ent = std::find_if(trains_.begin(), trains_.end(),
-    [address](const auto &impl)
+public:
+  /// Identifier used for train nodes that do not have a @ref TrainDb entry.
+  static constexpr size_t INVALID_TRAIN_ID = (size_t)-1;
+
+  /// Adds a train node to the index.
+  /// @param impl is the train node to add.
+  ///
+  /// NOTE: trainsLock_ must be held by the caller.
+  void add(DelayedInitTrainNode *impl)
+  {
+    byNodeId_.insert(impl->node_id(), impl);
+    byAddress_.insert(impl->address(), impl);
+    if (impl->id() != INVALID_TRAIN_ID)
+    {
+      byTrainId_.insert(impl->id(), impl);
+    }
+  }
+
+  /// Removes a train node from the index.
+  /// @param impl is the train node to remove.
+  /// @param trains are the remaining train nodes, if one of these has the same
+  /// key as @param impl it will take its place in the index.
+  ///
+  /// NOTE: trainsLock_ must be held by the caller.
+  void remove(DelayedInitTrainNode *impl,
+              const std::vector<DelayedInitTrainNode *> &trains)
+  {
+    replace(byNodeId_, impl, trains, [](DelayedInitTrainNode *t)
     {
-      return impl->address() == address;
+      return t->node_id();
     });
-  if (ent != trains_.end())
+    replace(byAddress_, impl, trains, [](DelayedInitTrainNode *t)
+    {
+      return t->address();
+    });
+    remove_train_id(impl, trains);
+  }
+
+  /// Removes the train id of a train node from the index.
+  /// @param impl is the train node to remove.
+  /// @param trains are the remaining train nodes.
+  ///
+  /// NOTE: trainsLock_ must be held by the caller.
+  void remove_train_id(DelayedInitTrainNode *impl,
+                       const std::vector<DelayedInitTrainNode *> &trains)
+  {
+    if (impl->id() != INVALID_TRAIN_ID)
+    {
+      replace(byTrainId_, impl, trains, [](DelayedInitTrainNode *t)
+      {
+        return t->id();
+      });
+    }
+  }
+
+  /// Marks the duration of a lookup, train nodes that are removed while a
+  /// lookup is in progress will not be freed until it has completed.
+  class ReadGuard
+  {
+  public:
+    /// Constructor.
+    /// @param index is the index that will be read.
+    ReadGuard(TrainNodeIndex *index) : index_(index)
+    {
+      index_->readers_.fetch_add(1);
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+    }
+
+    /// Destructor.
+    ~ReadGuard()
+    {
+      index_->readers_.fetch_sub(1, std::memory_order_release);
+    }
+
+  private:
+    /// Index being read.
+    TrainNodeIndex *index_;
+  };
+
+  /// Destructor.
+  ~TrainNodeIndex()
+  {
+    for (auto *t : retired_)
+    {
+      delete t;
+    }
+  }
+
+  /// Frees a train node that has been removed from the index once no lookup
+  /// can still be using it.
+  /// @param impl is the train node to free.
+  ///
+  /// NOTE: trainsLock_ must be held by the caller.
+  void retire(DelayedInitTrainNode *impl)
+  {
+    retired_.push_back(impl);
+    // a lookup that starts after this point can not find any of the retired
+    // train nodes, once there are no lookups in progress they can be freed.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (readers_.load(std::memory_order_acquire) == 0)
+    {
+      for (auto *t : retired_)
+      {
+        delete t;
+      }
+      retired_.clear();
+    }
+  }
+
+  /// Train nodes by node id.
+  SeqLockHashMap<DelayedInitTrainNode> byNodeId_;
+
+  /// Train nodes by legacy address, when multiple train nodes share the same
+  /// address only the first is present.
+  SeqLockHashMap<DelayedInitTrainNode> byAddress_;
+
+  /// Train nodes by @ref TrainDb identifier, when multiple train nodes share
+  /// the same identifier only the first is present.
+  SeqLockHashMap<DelayedInitTrainNode> byTrainId_;
+
+private:
+  /// Number of lookups in progress.
+  std::atomic<uint32_t> readers_{0};
+
+  /// Train nodes that have been removed but not yet freed.
+  std::vector<DelayedInitTrainNode *> retired_;
+
+  /// Removes a train node from one of the lookup tables and adds the first
+  /// remaining train node with the same key in its place.
+  template <typename KeyFn>
+  void replace(SeqLockHashMap<DelayedInitTrainNode> &map,
+               DelayedInitTrainNode *impl,
+               const std::vector<DelayedInitTrainNode *> &trains, KeyFn key)
+  {
+    if (map.erase(key(impl), impl))
+    {
+      for (auto *t : trains)
+      {
+        if (t != impl && key(t) == key(impl))
+        {
+          map.insert(key(t), t);
+          break;
+        }
+      }
+    }
+  }
+};
+
+void AllTrainNodes::remove_train_impl(int address)
+{
+  OSMutexLock l(&trainsLock_);
+  DelayedInitTrainNode *impl = index_->byAddress_.find(address);
+  if (impl)
   {
-    DelayedInitTrainNode *impl = (*ent);
+    trains_.erase(std::find(trains_.begin(), trains_.end(), impl));
+    index_->remove(impl, trains_);
     impl->iface()->delete_local_node(impl);
-    delete impl;
-    trains_.erase(ent);
+    index_->retire(impl);
   }
 }
 
 openlcb::TrainImpl* AllTrainNodes::get_train_impl(openlcb::NodeID id, bool allocate)
 {
+  TrainNodeIndex::ReadGuard guard(index_.get());
   auto ent = find_node(id, allocate);
   if (ent)
   {
@@ -216,17 +369,11 @@ openlcb::TrainImpl* AllTrainNodes::get_train_impl(openlcb::NodeID id, bool alloc
 
 openlcb::TrainImpl* AllTrainNodes::get_train_impl(DccMode drive_type, int address)
 {
+  TrainNodeIndex::ReadGuard guard(index_.get());
+  DelayedInitTrainNode *ent = index_->byAddress_.find(address);
+  if (ent)
   {
-    OSMutexLock l(&trainsLock_);
-    auto ent = std::find_if(trains_.begin(), trains_.end(),
-      [address](const auto &train)
-      {
-        return train->address() == address;
-      });
-    if (ent != trains_.end())
-    {
-      return (*ent)->train();
-    }
+    return ent->train();
   }
   // no active train was found with the drive type and address, attempt to
   // create a new one.
@@ -240,16 +387,12 @@ openlcb::TrainImpl* AllTrainNodes::get_train_impl(DccMode drive_type, int addres
 
 AllTrainNodes::DelayedInitTrainNode* AllTrainNodes::find_node(openlcb::Node* node) 
 {
+  if (node)
   {
-    OSMutexLock l(&trainsLock_);
-    auto ent = std::find_if(trains_.begin(), trains_.end(),
-      [node](const auto &train)
-      {
-        return train == node;
-      });
-    if (ent != trains_.end())
+    DelayedInitTrainNode *ent = index_->byNodeId_.find(node->node_id());
+    if (ent == node)
     {
-      return *ent;
+      return ent;
     }
   }
   // no active train was found with the provided node reference, try to find
@@ -263,17 +406,10 @@ AllTrainNodes::DelayedInitTrainNode* AllTrainNodes::find_node(openlcb::Node* nod
 
 AllTrainNodes::DelayedInitTrainNode* AllTrainNodes::find_node(openlcb::NodeID node_id, bool allocate)
 {
+  DelayedInitTrainNode *ent = index_->byNodeId_.find(node_id);
+  if (ent)
   {
-    OSMutexLock l(&trainsLock_);
-    auto ent = std::find_if(trains_.begin(), trains_.end(),
-      [node_id](const auto &train)
-      {
-        return train->node_id() == node_id;
-      });
-    if (ent != trains_.end())
-    {
-      return *ent;
-    }
+    return ent;
   }
   if (!allocate)
   {
@@ -320,16 +456,13 @@ shared_ptr<TrainDbEntry> AllTrainNodes::get_traindb_entry(size_t id, Notifiable*
 /// Returns a node id or 0 if the id is not known to be a train.
 NodeID AllTrainNodes::get_train_node_id(size_t id)
 {
+  if (id != TrainNodeIndex::INVALID_TRAIN_ID)
   {
-    OSMutexLock l(&trainsLock_);
-    auto ent = std::find_if(trains_.begin(), trains_.end(),
-    [id](const auto &train)
-    {
-      return train->id() == id;
-    });
-    if (ent != trains_.end())
+    TrainNodeIndex::ReadGuard guard(index_.get());
+    DelayedInitTrainNode *ent = index_->byTrainId_.find(id);
+    if (ent)
     {
-      return (*ent)->node_id();
+      return ent->node_id();
     }
   }
 
@@ -858,10 +991,13 @@ AllTrainNodes::AllTrainNodes(TrainDb* db,
       ro_train_cdi_(ro_train_cdi),
       ro_tmp_train_cdi_(ro_tmp_train_cdi),
       infoFlow_(info_flow),
+      index_(new TrainNodeIndex()),
+      searchIndex_(new TrainSearchIndex(db)),
       findProtocolServer_(this)
 {
   HASSERT(ro_train_cdi_->read_only());
   HASSERT(ro_tmp_train_cdi_->read_only());
+  db_->set_listener(searchIndex_.get());
 }
 
 AllTrainNodes::DelayedInitTrainNode* AllTrainNodes::create_impl(
@@ -879,10 +1015,22 @@ AllTrainNodes::DelayedInitTrainNode* AllTrainNodes::create_impl(
   {
     OSMutexLock l(&trainsLock_);
     trains_.push_back(impl);
+    index_->add(impl);
   }
   return impl;
 }
 
+void AllTrainNodes::set_train_id(DelayedInitTrainNode* impl, size_t train_id)
+{
+  OSMutexLock l(&trainsLock_);
+  index_->remove_train_id(impl, trains_);
+  impl->set_id(train_id);
+  if (train_id != TrainNodeIndex::INVALID_TRAIN_ID)
+  {
+    index_->byTrainId_.insert(train_id, impl);
+  }
+}
+
 size_t AllTrainNodes::size()
 {
   return std::max(trains_.size(), db_->size());
@@ -907,12 +1055,18 @@ NodeID AllTrainNodes::allocate_node(DccMode drive_type, unsigned address)
 {
   DelayedInitTrainNode* impl = create_impl(-1, drive_type, address);
   if (!impl) return 0; // failed.
-  impl->set_id(db_->add_dynamic_entry(address, drive_type));
+  set_train_id(impl, db_->add_dynamic_entry(address, drive_type));
   return impl->node_id();
 }
 
+TrainSearchIndex* AllTrainNodes::search_index()
+{
+  return searchIndex_.get();
+}
+
 AllTrainNodes::~AllTrainNodes()
 {
+  db_->set_listener(nullptr);
   OSMutexLock l(&trainsLock_);
   for (auto* t : trains_)
   {
@@ -959,4 +1113,25 @@ void AllTrainNodes::configure(bool enabled)
   findProtocolServer_.configure(enabled);
 }
 
+bool AllTrainNodes::get_railcom_state(DccMode mode, unsigned address,
+                                      RailComDecoderState *state)
+{
+  if (!railcomState_)
+  {
+    return false;
+  }
+  switch (dcc_mode_to_address_type(mode, address))
+  {
+    case dcc::TrainAddressType::DCC_SHORT_ADDRESS:
+      return railcomState_->get_state(address, false, state);
+    case dcc::TrainAddressType::DCC_LONG_ADDRESS:
+      return railcomState_->get_state(address, true, state);
+    case dcc::TrainAddressType::UNSPECIFIED:
+      return railcomState_->get_state(address, address >= 128, state);
+    default:
+      // RailCom is only supported by DCC decoders.
+      return false;
+  }
+}
+
 }  // namespace commandstation
\ No newline at end of file
@@ -0,0 +1,285 @@
+/**********************************************************************
+ESP32 COMMAND STATION
+
+COPYRIGHT (c) 2021 Mike Dunston
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see http://www.gnu.org/licenses
+**********************************************************************/
+
+#include "TrainSearchIndex.hxx"
+#include "FindProtocolDefs.hxx"
+
+#include <algorithm>
+#include <openlcb/TractionDefs.hxx>
+#include <StringUtils.hxx>
+#include <utils/logging.h>
+
+#include "sdkconfig.h"
+
+namespace commandstation
+{
+
+/// @return true if the character is a digit.
+static inline bool is_digit(char c)
+{
+  return ('0' <= c) && (c <= '9');
+}
+
+void TrainSearchIndex::search(openlcb::EventId event,
+                              std::vector<unsigned> *results)
+{
+  results->clear();
+  refresh();
+
+  // collect the digits of the query, the same as query_to_address() but
+  // retaining the number of digits so that leading zeros are significant
+  // for the name search.
+  uint32_t digits = 0;
+  uint32_t digit_count = 0;
+  for (int shift = FindProtocolDefs::TRAIN_FIND_MASK - 4;
+       shift >= FindProtocolDefs::TRAIN_FIND_MASK_LOW; shift -= 4)
+  {
+    uint8_t nibble = (event >> shift) & 0xf;
+    if (nibble <= 9)
+    {
+      digits = (digits * 10) + nibble;
+      digit_count++;
+    }
+  }
+  DccMode mode = dcc_mode_to_protocol(
+    static_cast<DccMode>(event & DCCMODE_PROTOCOL_MASK));
+
+  OSMutexLock l(&lock_);
+  std::vector<unsigned> candidates;
+  if (event == openlcb::TractionDefs::IS_TRAIN_EVENT ||
+      (!digit_count && mode == DCCMODE_DEFAULT))
+  {
+    // every entry is a candidate.
+    for (unsigned train_id = 0; train_id < records_.size(); train_id++)
+    {
+      if (records_[train_id].valid)
+      {
+        candidates.push_back(train_id);
+      }
+    }
+  }
+  else if (digit_count)
+  {
+    // a match requires the digits to be the address (or a prefix of it) or
+    // the start of a number in the name.
+    probe(KEY_ADDRESS | digits, &candidates);
+    probe(KEY_NAME | (digit_count << 24) | digits, &candidates);
+    std::sort(candidates.begin(), candidates.end());
+    candidates.erase(std::unique(candidates.begin(), candidates.end()),
+                     candidates.end());
+  }
+  else
+  {
+    // entries without a drive mode match any drive mode.
+    probe(KEY_PROTOCOL | mode, &candidates);
+    probe(KEY_PROTOCOL | DCCMODE_DEFAULT, &candidates);
+    std::sort(candidates.begin(), candidates.end());
+  }
+
+  for (unsigned train_id : candidates)
+  {
+    const Record &record = records_[train_id];
+    if (FindProtocolDefs::match_query_to_train(event, record.digits,
+                                               record.address, record.mode))
+    {
+      results->push_back(train_id);
+    }
+  }
+  LOG(CONFIG_TSP_LOGGING_LEVEL,
+      "[TrainSearch] %zu candidate(s), %zu match(es) for %s",
+      candidates.size(), results->size(),
+      esp32cs::event_id_to_string(event).c_str());
+}
+
+void TrainSearchIndex::entry_updated(unsigned train_id, TrainDbEntry *entry)
+{
+  OSMutexLock l(&lock_);
+  generation_++;
+  if (stale_)
+  {
+    // the index will be rebuilt before the next search.
+    return;
+  }
+  if (train_id >= records_.size())
+  {
+    records_.resize(train_id + 1);
+  }
+  if (records_[train_id].valid)
+  {
+    update_postings(train_id, false);
+  }
+  load_record(entry, &records_[train_id]);
+  update_postings(train_id, true);
+}
+
+void TrainSearchIndex::entries_reset()
+{
+  OSMutexLock l(&lock_);
+  generation_++;
+  stale_ = true;
+}
+
+void TrainSearchIndex::refresh()
+{
+  while (stale_)
+  {
+    uint32_t generation;
+    {
+      OSMutexLock l(&lock_);
+      generation = generation_;
+    }
+    // the entries are read without holding lock_ since the TrainDb may be
+    // notifying a modification while holding its own lock.
+    std::vector<Record> records(db_->size());
+    for (unsigned train_id = 0; train_id < records.size(); train_id++)
+    {
+      auto entry = db_->get_entry(train_id);
+      if (entry)
+      {
+        load_record(entry.get(), &records[train_id]);
+      }
+    }
+    std::vector<std::pair<uint32_t, unsigned>> postings;
+    std::vector<uint32_t> keys;
+    for (unsigned train_id = 0; train_id < records.size(); train_id++)
+    {
+      if (records[train_id].valid)
+      {
+        record_keys(records[train_id], &keys);
+        for (uint32_t key : keys)
+        {
+          postings.emplace_back(key, train_id);
+        }
+      }
+    }
+    std::sort(postings.begin(), postings.end());
+
+    OSMutexLock l(&lock_);
+    if (generation != generation_)
+    {
+      // the TrainDb was modified while reading the entries, try again.
+      continue;
+    }
+    LOG(CONFIG_TSP_LOGGING_LEVEL,
+        "[TrainSearch] Rebuilt search index (%zu entries, %zu keys)",
+        records.size(), postings.size());
+    records_.swap(records);
+    postings_.swap(postings);
+    stale_ = false;
+  }
+}
+
+void TrainSearchIndex::load_record(TrainDbEntry *entry, Record *record)
+{
+  std::string name = entry->get_train_name();
+  record->digits.clear();
+  bool separator = false;
+  for (char c : name)
+  {
+    if (is_digit(c))
+    {
+      if (separator && !record->digits.empty())
+      {
+        record->digits.push_back(' ');
+      }
+      record->digits.push_back(c);
+      separator = false;
+    }
+    else
+    {
+      separator = true;
+    }
+  }
+  record->address = entry->get_legacy_address();
+  record->mode = entry->get_legacy_drive_mode();
+  record->valid = true;
+}
+
+void TrainSearchIndex::record_keys(const Record &record,
+                                   std::vector<uint32_t> *keys)
+{
+  keys->clear();
+
+  // the address and each of its decimal prefixes.
+  uint32_t address = record.address;
+  keys->push_back(KEY_ADDRESS | address);
+  while ((address /= 10))
+  {
+    keys->push_back(KEY_ADDRESS | address);
+  }
+
+  // digit sequences starting at each number in the name, a query may span
+  // multiple numbers in the name.
+  const std::string &digits = record.digits;
+  for (size_t start = 0; start < digits.size(); start++)
+  {
+    if (!is_digit(digits[start]) || (start && is_digit(digits[start - 1])))
+    {
+      continue;
+    }
+    uint32_t value = 0;
+    uint32_t count = 0;
+    for (size_t pos = start; pos < digits.size() && count < MAX_QUERY_DIGITS;
+         pos++)
+    {
+      if (is_digit(digits[pos]))
+      {
+        value = (value * 10) + (digits[pos] - '0');
+        count++;
+        keys->push_back(KEY_NAME | (count << 24) | value);
+      }
+    }
+  }
+
+  keys->push_back(KEY_PROTOCOL | dcc_mode_to_protocol(record.mode));
+
+  std::sort(keys->begin(), keys->end());
+  keys->erase(std::unique(keys->begin(), keys->end()), keys->end());
+}
+
+void TrainSearchIndex::update_postings(unsigned train_id, bool add)
+{
+  std::vector<uint32_t> keys;
+  record_keys(records_[train_id], &keys);
+  for (uint32_t key : keys)
+  {
+    auto posting = std::make_pair(key, train_id);
+    auto ent = std::lower_bound(postings_.begin(), postings_.end(), posting);
+    bool found = (ent != postings_.end() && *ent == posting);
+    if (add && !found)
+    {
+      postings_.insert(ent, posting);
+    }
+    else if (!add && found)
+    {
+      postings_.erase(ent);
+    }
+  }
+}
+
+void TrainSearchIndex::probe(uint32_t key, std::vector<unsigned> *candidates)
+{
+  auto ent = std::lower_bound(postings_.begin(), postings_.end(),
+                              std::make_pair(key, 0U));
+  while (ent != postings_.end() && ent->first == key)
+  {
+    candidates->push_back(ent->second);
+    ++ent;
+  }
+}
+
+} // namespace commandstation
\ No newline at end of file
@@ -43,6 +43,7 @@
 
 #include "AllTrainNodesInterface.hxx"
 #include "FindProtocolServer.hxx"
+#include "RailComStateInterface.hxx"
 #include "TrainDb.hxx"
 
 namespace openlcb
@@ -90,6 +91,9 @@ class AllTrainNodes : public AllTrainNodesInterface
   /// @return 0 if the allocation fails (invalid arguments)
   openlcb::NodeID allocate_node(DccMode drive_type, unsigned address) override;
 
+  /// @return the search index for the train database entries.
+  TrainSearchIndex* search_index() override;
+
   /// Return the number of known locomotives or those being serviced.
   size_t size();
 
@@ -109,6 +113,24 @@ class AllTrainNodes : public AllTrainNodesInterface
   /// respond to OpenLCB Events related to train search.
   void configure(bool enabled);
 
+  /// Sets the source of RailCom feedback for locomotives.
+  ///
+  /// @param railcom is the @ref RailComStateInterface to use for retrieving
+  /// the RailCom feedback.
+  void set_railcom_state(RailComStateInterface *railcom)
+  {
+    railcomState_ = railcom;
+  }
+
+  /// Retrieves the most recent RailCom feedback for a locomotive.
+  ///
+  /// @param mode is the drive mode of the locomotive.
+  /// @param address is the legacy address of the locomotive.
+  /// @param state will receive the RailCom feedback.
+  /// @return true if RailCom feedback has been received from the locomotive.
+  bool get_railcom_state(DccMode mode, unsigned address,
+                         RailComDecoderState *state);
+
  private:
   // ==== Interface for children ====
   class DelayedInitTrainNode;
@@ -126,6 +148,11 @@ class AllTrainNodes : public AllTrainNodesInterface
   /// trains_.
   DelayedInitTrainNode* create_impl(int train_id, DccMode mode, int address);
 
+  /// Updates the @ref TrainDb identifier of a train node.
+  /// @param impl is the train node to update.
+  /// @param train_id is the new identifier.
+  void set_train_id(DelayedInitTrainNode* impl, size_t train_id);
+
   // Externally owned.
   TrainDb* db_;
   openlcb::MemoryConfigHandler* memoryConfigService_;
@@ -136,12 +163,26 @@ class AllTrainNodes : public AllTrainNodesInterface
   /// All train nodes that we know about.
   std::vector<DelayedInitTrainNode *> trains_;
   
-  /// Lock to protect trains_.
+  /// Lock to protect trains_, this is only required for modifications of
+  /// trains_ and the index.
   OSMutex trainsLock_;
 
+  /// Lookup tables for the train nodes in trains_ by node id, address and
+  /// train id. Lookups do not require trainsLock_, removed train nodes are
+  /// freed once no lookup is in progress.
+  class TrainNodeIndex;
+  std::unique_ptr<TrainNodeIndex> index_;
+
+  /// Search index for the train database entries, this is registered as the
+  /// listener of db_.
+  std::unique_ptr<TrainSearchIndex> searchIndex_;
+
   friend class FindProtocolServer;
   FindProtocolServer findProtocolServer_;
 
+  /// Source of RailCom feedback, may be null if RailCom is not enabled.
+  RailComStateInterface *railcomState_{nullptr};
+
   // Implementation objects that we carry for various protocols.
   class TrainSnipHandler;
   friend class TrainSnipHandler;
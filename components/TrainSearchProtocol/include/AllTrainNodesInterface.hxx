@@ -52,6 +52,7 @@ class TrainService;
 namespace commandstation
 {
 class TrainDbEntry;
+class TrainSearchIndex;
 
 /// Abstract class for the AllTrainNodes that prevents pulling in transitive
 /// dependencies.
@@ -101,6 +102,14 @@ public:
   /// @return the openlcb train node ID, or 0 if the arguments are not valid.
   virtual openlcb::NodeID allocate_node(DccMode mode, unsigned address) = 0;
 
+  /// @return the search index for the train database entries, or nullptr if
+  /// the entries have to be searched individually. When present the train
+  /// identifiers returned by the index are valid for get_train_node_id().
+  virtual TrainSearchIndex* search_index()
+  {
+    return nullptr;
+  }
+
  protected:
   /// Pointer to the traction service instance. Externally owned.
   openlcb::TrainService* trainService_;
@@ -38,10 +38,13 @@
 #include "FindProtocolDefs.hxx"
 #include "AllTrainNodesInterface.hxx"
 #include "TrainDb.hxx"
+#include "TrainSearchIndex.hxx"
 #include <openlcb/EventHandlerTemplates.hxx>
 #include <openlcb/TractionTrain.hxx>
 #include <StringUtils.hxx>
 
+#include "sdkconfig.h"
+
 namespace commandstation
 {
 
@@ -227,15 +230,57 @@ public:
       LOG(CONFIG_TSP_LOGGING_LEVEL, "starting iteration");
       nextTrainId_ = 0;
       hasMatches_ = false;
+      useIndex_ = false;
+      rangeSent_ = false;
+      if (isGlobal_)
+      {
+        // replies for a global query are not waited for individually, the
+        // barrier completes when all replies have been delivered.
+        bn_.reset(this);
+      }
+      auto *index = nodes()->search_index();
+      if (!isGlobal_ && index)
+      {
+        // The index provides all matches up front, only the matches need to
+        // be visited.
+        index->search(eventId_, &matches_);
+        nextMatch_ = 0;
+        useIndex_ = true;
+        return call_immediately(STATE(iterate_matches));
+      }
       return call_immediately(STATE(iterate));
     }
 
+    /// Sends a response for each of the matches provided by the search index.
+    Action iterate_matches()
+    {
+      if (nextMatch_ >= matches_.size())
+      {
+        LOG(CONFIG_TSP_LOGGING_LEVEL, "iterate_matches: finished (%zu)",
+            matches_.size());
+        matches_.clear();
+        return call_immediately(STATE(iteration_done));
+      }
+      nextTrainId_ = matches_[nextMatch_];
+      LOG(CONFIG_TSP_LOGGING_LEVEL, "iterate_matches: MATCH: %d",
+          nextTrainId_);
+      hasMatches_ = true;
+      return allocate_and_call(iface()->global_message_write_flow(),
+                               STATE(send_response));
+    }
+
     Action iterate()
     {
       LOG(CONFIG_TSP_LOGGING_LEVEL, "iterate: %d", nextTrainId_);
       if (nextTrainId_ >= nodes()->size())
       {
         LOG(CONFIG_TSP_LOGGING_LEVEL, "iterate: finished");
+        if (isGlobal_)
+        {
+          // wait for all in-flight replies to be delivered.
+          bn_.notify();
+          return wait_and_call(STATE(iteration_done));
+        }
         return call_immediately(STATE(iteration_done));
       }
       if (isGlobal_)
@@ -258,10 +303,18 @@ public:
           parent_->pendingIsTrain_ = false;
           return again();
         }
-        LOG(CONFIG_TSP_LOGGING_LEVEL, "iterate: send_response %d: %s",
+        replyNodeId_ = nodes()->get_train_node_id(nextTrainId_);
+        if (!replyNodeId_)
+        {
+          LOG(CONFIG_TSP_LOGGING_LEVEL, "iterate: no node for %d",
+              nextTrainId_);
+          return yield_and_call(STATE(next_iterate));
+        }
+        LOG(CONFIG_TSP_LOGGING_LEVEL, "iterate: send_global_reply %d: %s",
             nextTrainId_, esp32cs::event_id_to_string(eventId_).c_str());
         return allocate_and_call(iface()->global_message_write_flow(),
-                                 STATE(send_response));
+                                 STATE(send_global_reply),
+                                 &parent_->replyPool_);
       }
       LOG(CONFIG_TSP_LOGGING_LEVEL, "iterate: try_traindb_lookup");
       return call_immediately(STATE(try_traindb_lookup));
@@ -299,40 +352,56 @@ public:
     {
       auto *b = get_allocation_result(iface()->global_message_write_flow());
       b->set_done(bn_.reset(this));
-      if (eventId_ == REQUEST_GLOBAL_IDENTIFY)
+      b->data()->reset(openlcb::Defs::MTI_PRODUCER_IDENTIFIED_VALID,
+                       nodes()->get_train_node_id(nextTrainId_),
+                       openlcb::eventid_to_buffer(eventId_));
+      b->data()->set_flag_dst(openlcb::GenMessage::WAIT_FOR_LOCAL_LOOPBACK);
+      iface()->global_message_write_flow()->send(b);
+
+      return wait_and_call(STATE(next_iterate));
+    }
+
+    /// Sends one reply for a global query without waiting for it to be
+    /// delivered. The number of replies in-flight is limited by the size of
+    /// the reply pool, the allocation will not complete until an earlier
+    /// reply has been delivered.
+    Action send_global_reply()
+    {
+      auto *b = get_allocation_result(iface()->global_message_write_flow());
+      if (eventId_ == REQUEST_GLOBAL_IDENTIFY && !rangeSent_)
       {
-        auto node_id = nodes()->get_train_node_id(nextTrainId_);
         b->data()->reset(
-            openlcb::Defs::MTI_PRODUCER_IDENTIFIED_RANGE, node_id,
+            openlcb::Defs::MTI_PRODUCER_IDENTIFIED_RANGE, replyNodeId_,
             openlcb::eventid_to_buffer(FindProtocolDefs::TRAIN_FIND_BASE));
-        // send is_train event too.
-        auto *bb = iface()->global_message_write_flow()->alloc();
-        bb->data()->reset(openlcb::Defs::MTI_PRODUCER_IDENTIFIED_UNKNOWN,
-                          node_id, openlcb::eventid_to_buffer(IS_TRAIN_EVENT));
-        bb->set_done(bn_.new_child());
-        bb->data()->set_flag_dst(openlcb::GenMessage::WAIT_FOR_LOCAL_LOOPBACK);
-        iface()->global_message_write_flow()->send(bb);
-      }
-      else if (eventId_ == IS_TRAIN_EVENT)
-      {
-        b->data()->reset(openlcb::Defs::MTI_PRODUCER_IDENTIFIED_UNKNOWN,
-                         nodes()->get_train_node_id(nextTrainId_),
-                         openlcb::eventid_to_buffer(eventId_));
+        rangeSent_ = true;
       }
       else
       {
-        b->data()->reset(openlcb::Defs::MTI_PRODUCER_IDENTIFIED_VALID,
-                         nodes()->get_train_node_id(nextTrainId_),
-                         openlcb::eventid_to_buffer(eventId_));
+        b->data()->reset(openlcb::Defs::MTI_PRODUCER_IDENTIFIED_UNKNOWN,
+                         replyNodeId_,
+                         openlcb::eventid_to_buffer(IS_TRAIN_EVENT));
+        rangeSent_ = false;
       }
+      b->set_done(bn_.new_child());
       b->data()->set_flag_dst(openlcb::GenMessage::WAIT_FOR_LOCAL_LOOPBACK);
       iface()->global_message_write_flow()->send(b);
-
-      return wait_and_call(STATE(next_iterate));
+      if (rangeSent_)
+      {
+        // send is_train event too.
+        return allocate_and_call(iface()->global_message_write_flow(),
+                                 STATE(send_global_reply),
+                                 &parent_->replyPool_);
+      }
+      return call_immediately(STATE(next_iterate));
     }
 
     Action next_iterate()
     {
+      if (useIndex_)
+      {
+        ++nextMatch_;
+        return call_immediately(STATE(iterate_matches));
+      }
       ++nextTrainId_;
       return call_immediately(STATE(iterate));
     }
@@ -411,10 +480,21 @@ public:
       openlcb::NodeID newNodeId_;
     };
     BarrierNotifiable bn_;
+    /// Node ID of the train being replied for during a global query.
+    openlcb::NodeID replyNodeId_;
+    /// Train identifiers that matched the query when using the search index.
+    std::vector<unsigned> matches_;
+    /// Index of the next entry in matches_ to respond with.
+    size_t nextMatch_;
     /// True if we found any matches during the iteration.
     bool hasMatches_ : 1;
     /// True if the current iteration has to touch every node.
     bool isGlobal_ : 1;
+    /// True if the current iteration uses the search index.
+    bool useIndex_ : 1;
+    /// True if the range reply for a global identify has been sent for the
+    /// current train.
+    bool rangeSent_ : 1;
     StateFlowTimer timer_{this};
   };
 
@@ -448,6 +528,14 @@ public:
   /// Same as pendingGlobalIdentify_ for the IS_TRAIN event producer.
   uint8_t pendingIsTrain_{false};
 
+  /// Number of in-flight replies for global queries.
+  static constexpr size_t REPLY_WINDOW = CONFIG_TSP_IDENTIFY_REPLY_WINDOW;
+
+  /// Buffers used for the replies to global queries, this bounds the number
+  /// of replies that are in-flight and keeps a large roster from exhausting
+  /// the main buffer pool.
+  FixedPool replyPool_{sizeof(Buffer<openlcb::GenMessage>), REPLY_WINDOW};
+
   FindProtocolFlow flow_{this};
 };
 
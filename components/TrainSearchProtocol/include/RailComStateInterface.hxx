@@ -0,0 +1,80 @@
+/**********************************************************************
+ESP32 COMMAND STATION
+
+COPYRIGHT (c) 2021 Mike Dunston
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see http://www.gnu.org/licenses
+**********************************************************************/
+
+#ifndef RAILCOM_STATE_INTERFACE_HXX_
+#define RAILCOM_STATE_INTERFACE_HXX_
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace commandstation
+{
+
+/// Most recent RailCom feedback received from a single decoder.
+struct RailComDecoderState
+{
+  /// Value used for fields that have not been reported by the decoder.
+  static constexpr uint16_t UNKNOWN_VALUE = UINT16_MAX;
+
+  /// DCC address of the decoder.
+  uint16_t address;
+
+  /// True when @ref address is a long (14-bit) address.
+  bool long_address;
+
+  /// Time (msec since startup) the decoder was last detected.
+  uint32_t last_seen_msec;
+
+  /// Speed reported by the decoder in km/h or @ref UNKNOWN_VALUE.
+  uint16_t speed_kmh;
+
+  /// CV number of the most recent POM read-back or @ref UNKNOWN_VALUE.
+  uint16_t pom_cv;
+
+  /// Value of the most recent POM read-back.
+  uint8_t pom_value;
+
+  /// Time (msec since startup) the POM read-back was received.
+  uint32_t pom_msec;
+};
+
+/// Abstract interface for retrieving decoded RailCom feedback, this prevents
+/// pulling in the DCC signal generation dependencies.
+class RailComStateInterface
+{
+public:
+  /// Retrieves the RailCom feedback for a single decoder.
+  ///
+  /// @param address is the DCC address of the decoder.
+  /// @param long_address should be true when @param address is a long
+  /// address.
+  /// @param state will receive the feedback for the decoder.
+  /// @return true if feedback has been received from the decoder.
+  virtual bool get_state(uint16_t address, bool long_address,
+                         RailComDecoderState *state) = 0;
+
+  /// Retrieves the RailCom feedback for all known decoders.
+  ///
+  /// @param states will receive the feedback for each decoder.
+  /// @param max is the number of entries available in @param states.
+  /// @return the number of entries populated in @param states.
+  virtual size_t get_states(RailComDecoderState *states, size_t max) = 0;
+};
+
+} // namespace commandstation
+
+#endif // RAILCOM_STATE_INTERFACE_HXX_
\ No newline at end of file
@@ -101,6 +101,23 @@ public:
   virtual void start_read_functions() = 0;
 };
 
+/// Receives notifications when the entries of a @ref TrainDb are modified.
+class TrainDbListener
+{
+public:
+  virtual ~TrainDbListener() {}
+
+  /// Invoked when an entry has been added, or when the name, legacy address
+  /// or drive mode of an entry has been modified.
+  /// @param train_id is the train identifier of the entry.
+  /// @param entry is the entry that has been added or modified.
+  virtual void entry_updated(unsigned train_id, TrainDbEntry *entry) = 0;
+
+  /// Invoked when an entry has been removed, the train identifiers of the
+  /// remaining entries may have changed.
+  virtual void entries_reset() = 0;
+};
+
 class TrainDb
 {
  public:
@@ -131,6 +148,43 @@ class TrainDb
   /// @param mode the operating mode for the new locomotive.
   /// @returns the new train_id for the given entry.
   virtual unsigned add_dynamic_entry(uint16_t address, DccMode mode) = 0;
+
+  /// Registers the listener to notify when entries are modified, only one
+  /// listener is supported.
+  /// @param listener is the listener to notify, nullptr to remove it.
+  void set_listener(TrainDbListener *listener)
+  {
+    listener_ = listener;
+    if (listener_)
+    {
+      listener_->entries_reset();
+    }
+  }
+
+ protected:
+  /// Notifies the listener (if any) that an entry has been added or modified.
+  /// @param train_id is the train identifier of the entry.
+  /// @param entry is the entry that has been added or modified.
+  void notify_entry_updated(unsigned train_id, TrainDbEntry *entry)
+  {
+    if (listener_)
+    {
+      listener_->entry_updated(train_id, entry);
+    }
+  }
+
+  /// Notifies the listener (if any) that an entry has been removed.
+  void notify_entries_reset()
+  {
+    if (listener_)
+    {
+      listener_->entries_reset();
+    }
+  }
+
+ private:
+  /// Listener to notify when entries are modified. Externally owned.
+  TrainDbListener *listener_{nullptr};
 };
 
 }  // namespace commandstation
@@ -0,0 +1,151 @@
+/**********************************************************************
+ESP32 COMMAND STATION
+
+COPYRIGHT (c) 2021 Mike Dunston
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see http://www.gnu.org/licenses
+**********************************************************************/
+
+#ifndef TRAIN_SEARCH_INDEX_HXX_
+#define TRAIN_SEARCH_INDEX_HXX_
+
+#include <atomic>
+#include <os/OS.hxx>
+#include <stdint.h>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "TrainDb.hxx"
+
+namespace commandstation
+{
+
+/// Search index for the entries of a @ref TrainDb used to answer train search
+/// queries without visiting every entry.
+///
+/// Each entry is indexed by all decimal prefixes of its legacy address, by
+/// the digit sequences starting at each number in its name and by the
+/// protocol of its drive mode. A query is answered by probing the index for
+/// the digits of the query (or the drive mode when the query has no digits)
+/// and verifying the candidates against a cached copy of the searchable
+/// fields of the entry.
+///
+/// The index is updated incrementally as entries are added or modified, when
+/// an entry is removed the index is rebuilt on the next search.
+class TrainSearchIndex : public TrainDbListener
+{
+public:
+  /// Constructor.
+  ///
+  /// @param db is the @ref TrainDb to index.
+  TrainSearchIndex(TrainDb *db) : db_(db)
+  {
+  }
+
+  /// Searches for the entries that match a train search query.
+  ///
+  /// @param event is the train search query, see @ref FindProtocolDefs.
+  /// @param results will receive the train identifiers of the matching
+  /// entries in ascending order.
+  void search(openlcb::EventId event, std::vector<unsigned> *results);
+
+  void entry_updated(unsigned train_id, TrainDbEntry *entry) override;
+
+  void entries_reset() override;
+
+private:
+  /// Searchable fields of an entry.
+  struct Record
+  {
+    /// Digits in the name of the entry, each number in the name is separated
+    /// by a single space. This matches the same queries as the full name.
+    std::string digits;
+
+    /// Legacy address of the entry.
+    uint16_t address{0};
+
+    /// Drive mode of the entry.
+    DccMode mode{DCCMODE_DEFAULT};
+
+    /// True if the record holds an entry.
+    bool valid{false};
+  };
+
+  /// Maximum number of digits in a query.
+  static constexpr size_t MAX_QUERY_DIGITS = 6;
+
+  /// Key types, stored in the upper bits of the index keys.
+  enum KeyType : uint32_t
+  {
+    /// Decimal prefix of the legacy address.
+    KEY_ADDRESS = 1 << 28,
+    /// Digit sequence in the name.
+    KEY_NAME = 2 << 28,
+    /// Protocol of the drive mode.
+    KEY_PROTOCOL = 3 << 28
+  };
+
+  /// @ref TrainDb being indexed.
+  TrainDb *db_;
+
+  /// Lock protecting @ref records_, @ref postings_ and @ref generation_.
+  OSMutex lock_;
+
+  /// Searchable fields of each entry, indexed by train identifier.
+  std::vector<Record> records_;
+
+  /// Sorted index entries, each holds a key and a train identifier.
+  std::vector<std::pair<uint32_t, unsigned>> postings_;
+
+  /// Incremented on every modification, used to detect modifications while
+  /// the index is being rebuilt.
+  uint32_t generation_{0};
+
+  /// Set when the index must be rebuilt before the next search.
+  std::atomic<bool> stale_{true};
+
+  /// Rebuilds the index from @ref db_ if it is stale.
+  void refresh();
+
+  /// Populates a record from a @ref TrainDbEntry.
+  ///
+  /// @param entry is the entry to read.
+  /// @param record will receive the searchable fields of @param entry.
+  static void load_record(TrainDbEntry *entry, Record *record);
+
+  /// Calculates the index keys for a record.
+  ///
+  /// @param record is the record to calculate the keys for.
+  /// @param keys will receive the unique keys for @param record.
+  static void record_keys(const Record &record, std::vector<uint32_t> *keys);
+
+  /// Adds or removes the index entries for a record.
+  ///
+  /// @param train_id is the train identifier of the record.
+  /// @param add is true to add the index entries, false to remove them.
+  ///
+  /// NOTE: lock_ must be held by the caller.
+  void update_postings(unsigned train_id, bool add);
+
+  /// Adds the train identifiers for a key to a list of candidates.
+  ///
+  /// @param key is the key to search for.
+  /// @param candidates will receive the train identifiers.
+  ///
+  /// NOTE: lock_ must be held by the caller.
+  void probe(uint32_t key, std::vector<unsigned> *candidates);
+};
+
+} // namespace commandstation
+
+#endif // TRAIN_SEARCH_INDEX_HXX_
\ No newline at end of file
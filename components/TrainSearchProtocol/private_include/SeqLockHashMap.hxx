@@ -0,0 +1,310 @@
+/**********************************************************************
+ESP32 COMMAND STATION
+
+COPYRIGHT (c) 2021 Mike Dunston
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see http://www.gnu.org/licenses
+**********************************************************************/
+
+#ifndef SEQLOCK_HASH_MAP_HXX_
+#define SEQLOCK_HASH_MAP_HXX_
+
+#include <atomic>
+#include <memory>
+#include <stdint.h>
+#include <utils/Atomic.hxx>
+#include <vector>
+
+namespace commandstation
+{
+
+/// Open addressing (linear probing) hash map from a 64-bit key to a pointer.
+///
+/// Lookups do not take any lock, they are protected by a sequence counter
+/// and will be retried if a modification happened while the lookup was in
+/// progress. Modifications are performed within a short critical section so
+/// that a lookup can not preempt a modification on the same core.
+///
+/// When the table is grown the previous table is retained until the map is
+/// destroyed since a concurrent lookup may still be probing it.
+///
+/// NOTE: Modifications must be serialized by the caller.
+template <class T> class SeqLockHashMap
+{
+public:
+  /// Constructor.
+  ///
+  /// @param capacity is the initial number of slots, must be a power of two.
+  SeqLockHashMap(size_t capacity = 32)
+  {
+    tables_.emplace_back(new Table(capacity));
+    table_.store(tables_.back().get());
+  }
+
+  /// Locates the value for a key.
+  ///
+  /// @param key is the key to search for.
+  /// @return the value for @param key or nullptr if not found.
+  ///
+  /// NOTE: This does not block.
+  T *find(uint64_t key) const
+  {
+    T *value;
+    uint32_t seq;
+    do
+    {
+      seq = seq_.load(std::memory_order_acquire);
+      value = (seq & 1) ? nullptr : table_.load(std::memory_order_relaxed)->find(key);
+      std::atomic_thread_fence(std::memory_order_acquire);
+    } while ((seq & 1) || seq != seq_.load(std::memory_order_relaxed));
+    return value;
+  }
+
+  /// Adds a value to the map, if the key is already present it will not be
+  /// modified.
+  ///
+  /// @param key is the key to add.
+  /// @param value is the value to add, must not be nullptr.
+  /// @return true if the value was added.
+  bool insert(uint64_t key, T *value)
+  {
+    Table *table = table_.load(std::memory_order_relaxed);
+    if (table->find(key))
+    {
+      return false;
+    }
+    if ((table->count_ + 1) * 2 > table->capacity_)
+    {
+      // grow the table outside of the critical section, it is not visible to
+      // lookups until it has been published.
+      Table *grown = new Table(table->capacity_ * 2);
+      table->for_each([grown](uint64_t k, T *v)
+      {
+        grown->insert(k, v);
+      });
+      grown->insert(key, value);
+      tables_.emplace_back(grown);
+      AtomicHolder h(&lock_);
+      begin_write();
+      table_.store(grown, std::memory_order_relaxed);
+      end_write();
+      return true;
+    }
+    AtomicHolder h(&lock_);
+    begin_write();
+    table->insert(key, value);
+    end_write();
+    return true;
+  }
+
+  /// Removes a key from the map.
+  ///
+  /// @param key is the key to remove.
+  /// @param value is the expected value for @param key, the key will only be
+  /// removed if it maps to this value.
+  /// @return true if the key was removed.
+  bool erase(uint64_t key, T *value)
+  {
+    Table *table = table_.load(std::memory_order_relaxed);
+    if (table->find(key) != value)
+    {
+      return false;
+    }
+    AtomicHolder h(&lock_);
+    begin_write();
+    table->erase(key);
+    end_write();
+    return true;
+  }
+
+private:
+  /// Hash table storage.
+  struct Table
+  {
+    /// Hash table slot, the key is split into two 32-bit halves so that it
+    /// can be accessed atomically on all targets.
+    struct Slot
+    {
+      /// Low 32 bits of the key.
+      std::atomic<uint32_t> keyLow{0};
+
+      /// High 32 bits of the key.
+      std::atomic<uint32_t> keyHigh{0};
+
+      /// Value for the key, nullptr if the slot is empty.
+      std::atomic<T *> value{nullptr};
+    };
+
+    /// Constructor.
+    ///
+    /// @param capacity is the number of slots, must be a power of two.
+    Table(size_t capacity)
+      : capacity_(capacity), mask_(capacity - 1), slots_(new Slot[capacity])
+    {
+    }
+
+    /// Number of slots.
+    const size_t capacity_;
+
+    /// Mask applied to slot indexes.
+    const size_t mask_;
+
+    /// Number of occupied slots.
+    size_t count_{0};
+
+    /// Slots in the table.
+    std::unique_ptr<Slot[]> slots_;
+
+    /// @return the preferred slot index for a key.
+    size_t home(uint64_t key) const
+    {
+      return (size_t)((key * 0x9E3779B97F4A7C15ULL) >> 32) & mask_;
+    }
+
+    /// @return the key stored in a slot.
+    static uint64_t key(const Slot &slot)
+    {
+      return ((uint64_t)slot.keyHigh.load(std::memory_order_relaxed) << 32) |
+        slot.keyLow.load(std::memory_order_relaxed);
+    }
+
+    /// Copies a slot.
+    static void copy(Slot &dst, const Slot &src)
+    {
+      dst.keyLow.store(src.keyLow.load(std::memory_order_relaxed),
+                       std::memory_order_relaxed);
+      dst.keyHigh.store(src.keyHigh.load(std::memory_order_relaxed),
+                        std::memory_order_relaxed);
+      dst.value.store(src.value.load(std::memory_order_relaxed),
+                      std::memory_order_relaxed);
+    }
+
+    /// @return the slot index for a key or @ref capacity_ if not found.
+    size_t index_of(uint64_t k) const
+    {
+      // the probe is bounded by the capacity since a concurrent modification
+      // may leave the table without an empty slot from the point of view of
+      // the reader.
+      for (size_t probe = 0, idx = home(k); probe < capacity_;
+           probe++, idx = (idx + 1) & mask_)
+      {
+        if (!slots_[idx].value.load(std::memory_order_relaxed))
+        {
+          break;
+        }
+        if (key(slots_[idx]) == k)
+        {
+          return idx;
+        }
+      }
+      return capacity_;
+    }
+
+    /// @return the value for a key or nullptr if not found.
+    T *find(uint64_t k) const
+    {
+      size_t idx = index_of(k);
+      return idx < capacity_ ?
+        slots_[idx].value.load(std::memory_order_relaxed) : nullptr;
+    }
+
+    /// Adds a key to the table, the key must not be present.
+    void insert(uint64_t k, T *v)
+    {
+      size_t idx = home(k);
+      while (slots_[idx].value.load(std::memory_order_relaxed))
+      {
+        idx = (idx + 1) & mask_;
+      }
+      slots_[idx].keyLow.store((uint32_t)k, std::memory_order_relaxed);
+      slots_[idx].keyHigh.store((uint32_t)(k >> 32),
+                                std::memory_order_relaxed);
+      slots_[idx].value.store(v, std::memory_order_relaxed);
+      count_++;
+    }
+
+    /// Removes a key from the table using backward shift deletion so that no
+    /// tombstones are required.
+    void erase(uint64_t k)
+    {
+      size_t idx = index_of(k);
+      if (idx >= capacity_)
+      {
+        return;
+      }
+      size_t next = idx;
+      while (true)
+      {
+        next = (next + 1) & mask_;
+        if (!slots_[next].value.load(std::memory_order_relaxed))
+        {
+          break;
+        }
+        // move the entry into the hole unless its preferred slot is
+        // cyclically between the hole and its current slot.
+        size_t preferred = home(key(slots_[next]));
+        if (((next - preferred) & mask_) >= ((next - idx) & mask_))
+        {
+          copy(slots_[idx], slots_[next]);
+          idx = next;
+        }
+      }
+      slots_[idx].value.store(nullptr, std::memory_order_relaxed);
+      count_--;
+    }
+
+    /// Invokes a callback for each entry in the table.
+    template <typename Fn> void for_each(Fn callback) const
+    {
+      for (size_t idx = 0; idx < capacity_; idx++)
+      {
+        T *v = slots_[idx].value.load(std::memory_order_relaxed);
+        if (v)
+        {
+          callback(key(slots_[idx]), v);
+        }
+      }
+    }
+  };
+
+  /// Starts a modification, @ref lock_ must be held.
+  void begin_write()
+  {
+    seq_.store(seq_.load(std::memory_order_relaxed) + 1,
+               std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+  }
+
+  /// Completes a modification, @ref lock_ must be held.
+  void end_write()
+  {
+    seq_.store(seq_.load(std::memory_order_relaxed) + 1,
+               std::memory_order_release);
+  }
+
+  /// Sequence counter, odd while a modification is in progress.
+  std::atomic<uint32_t> seq_{0};
+
+  /// Active table.
+  std::atomic<Table *> table_;
+
+  /// All tables that have been allocated, the last entry is the active
+  /// table.
+  std::vector<std::unique_ptr<Table>> tables_;
+
+  /// Critical section used while modifying the active table.
+  Atomic lock_;
+};
+
+} // namespace commandstation
+
+#endif // SEQLOCK_HASH_MAP_HXX_
\ No newline at end of file
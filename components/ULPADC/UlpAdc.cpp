@@ -16,14 +16,22 @@ COPYRIGHT (c) 2021 Mike Dunston
 **********************************************************************/
 
 #include "UlpAdc.hxx"
+#include "CurrentSenseModel.hxx"
+#include "NvsManager.hxx"
 #include "sdkconfig.h"
 #include "ulp_adc_ops.h"
+#include <algorithm>
+#include <atomic>
 #include <dcc/ProgrammingTrackBackend.hxx>
 #include <driver/rtc_cntl.h>
+#include <driver/rtc_io.h>
+#include <esp_adc_cal.h>
 #include <esp32/ulp.h>
 #include <hardware.hxx>
+#include <inttypes.h>
+#include <memory>
 #include <soc/rtc_cntl_reg.h>
-#include <utils/Fixed16.hxx>
+#include <string.h>
 #include <utils/logging.h>
 #include <utils/Singleton.hxx>
 
@@ -42,6 +50,51 @@ extern const uint8_t ulp_code_end[]   asm("_binary_ulp_adc_ops_bin_end");
 
 static bool ulp_running = false;
 
+/// Callback to invoke when the ULP detects an OPS short.
+static ops_short_callback_t ops_short_callback = nullptr;
+
+/// Argument for @ref ops_short_callback.
+static void *ops_short_callback_arg = nullptr;
+
+/// Callback to invoke when the ULP detects an OPS load level change.
+static ops_level_callback_t ops_level_callback = nullptr;
+
+/// Argument for @ref ops_level_callback.
+static void *ops_level_callback_arg = nullptr;
+
+#if CONFIG_OPS_TRACK_ENABLED
+/// Last value of the ULP OPS load level that was reported.
+static uint16_t last_ops_level = 0;
+#endif // CONFIG_OPS_TRACK_ENABLED
+
+/// OPS track reading that triggered the most recent short.
+static uint16_t last_ops_short_reading = 0;
+
+#if CONFIG_OPS_TRACK_ENABLED
+/// Last value of the ULP OPS short counter that was reported.
+static uint16_t last_ops_short_count = 0;
+#endif // CONFIG_OPS_TRACK_ENABLED
+
+/// OPS track short clear threshold.
+static uint16_t ops_short_clear_threshold = 4095;
+
+/// Current ULP wakeup period in microseconds.
+static uint32_t sample_period_usec = CONFIG_ULP_ADC_SAMPLE_PERIOD_USEC;
+
+#if CONFIG_PROG_TRACK_ENABLED
+/// Number of readings discarded before the PROG baseline is measured, this
+/// must match prog_baseline_settle_samples in adc_ops.S.
+static constexpr uint16_t PROG_BASELINE_SETTLE_SAMPLES =
+  10000 / CONFIG_PROG_ACK_SAMPLE_PERIOD_USEC;
+
+/// Number of readings averaged for the PROG baseline, this must match
+/// prog_baseline_count in adc_ops.S.
+static constexpr uint16_t PROG_BASELINE_SAMPLES = 16;
+
+/// Last value of the ULP ACK counter that was reported.
+static uint16_t last_prog_ack_count = 0;
+#endif // CONFIG_PROG_TRACK_ENABLED
+
 /// ULP wake-up callback
 ///
 /// @param param unused.
@@ -50,10 +103,31 @@ static bool ulp_running = false;
 static void ulp_adc_wakeup(void *param)
 {
 #if CONFIG_OPS_TRACK_ENABLED
-  if (ULP_VAR(ulp_ops_last_reading) > ULP_VAR(ulp_ops_short_threshold))
+  bool level_changed = false;
+  // the ULP has already cut off the OPS output when the short counter
+  // changes, this is checked instead of the last reading since the ULP may
+  // have taken another sample before this wake up was processed.
+  uint16_t short_count = ULP_VAR(ulp_ops_short_count);
+  if (short_count != last_ops_short_count)
   {
     ets_printf("[ULP-ADC] OPS short detected!\n");
+    last_ops_short_count = short_count;
+    last_ops_short_reading = ULP_VAR(ulp_ops_short_reading);
     DccHwDefs::InternalBoosterOutput::set_disable_reason(DccOutput::DisableReason::SHORTED);
+    if (ops_short_callback)
+    {
+      ops_short_callback(ops_short_callback_arg);
+    }
+    level_changed = true;
+  }
+  if (ULP_VAR(ulp_ops_level) != last_ops_level)
+  {
+    last_ops_level = ULP_VAR(ulp_ops_level);
+    level_changed = true;
+  }
+  if (level_changed && ops_level_callback)
+  {
+    ops_level_callback(ops_level_callback_arg);
   }
 #endif
 #if CONFIG_PROG_TRACK_ENABLED
@@ -66,6 +140,17 @@ static void ulp_adc_wakeup(void *param)
       ets_printf("[ULP-ADC] PROG short detected!\n");
       Singleton<ProgrammingTrackBackend>::instance()->notify_service_mode_short();
     }
+    else if (ULP_VAR(ulp_prog_ack_mode))
+    {
+      // the ULP has validated the width of the ACK pulse, only report it
+      // once.
+      uint16_t ack_count = ULP_VAR(ulp_prog_ack_count);
+      if (ack_count != last_prog_ack_count)
+      {
+        last_prog_ack_count = ack_count;
+        Singleton<ProgrammingTrackBackend>::instance()->notify_service_mode_ack();
+      }
+    }
     else if (ULP_VAR(ulp_prog_last_reading) > ULP_VAR(ulp_prog_ack_threshold))
     {
       //ets_printf("[ULP-ADC] PROG ACK!\n");
@@ -103,19 +188,268 @@ void ulp_watchdog(void *param)
 }
 
 #if CONFIG_CURRENTSENSE_SHUNT_20
-/// Approximate number of mA per ADC step.
-static constexpr float mAPerADCStep = 8.0566f;
+/// Gain (V/V) of the current sense amplifier.
+static constexpr uint32_t SHUNT_GAIN = 20;
 #elif CONFIG_CURRENTSENSE_SHUNT_50
-/// Approximate number of mA per ADC step.
-static constexpr float mAPerADCStep = 3.2226f;
+/// Gain (V/V) of the current sense amplifier.
+static constexpr uint32_t SHUNT_GAIN = 50;
 #elif CONFIG_CURRENTSENSE_SHUNT_100
-/// Approximate number of mA per ADC step.
-static constexpr float mAPerADCStep = 1.6129f;
+/// Gain (V/V) of the current sense amplifier.
+static constexpr uint32_t SHUNT_GAIN = 100;
 #elif CONFIG_CURRENTSENSE_SHUNT_200
-/// Approximate number of mA per ADC step.
-static constexpr float mAPerADCStep = 0.8056f;
+/// Gain (V/V) of the current sense amplifier.
+static constexpr uint32_t SHUNT_GAIN = 200;
 #endif
 
+/// Default ADC voltage reference (mV), used when the eFuse does not contain
+/// calibration data.
+static constexpr uint32_t DEFAULT_ADC_VREF = 1100;
+
+/// Voltage (mV) that corresponds to the maximum H-Bridge current when the
+/// current sense output is read directly.
+static constexpr uint32_t HBRIDGE_FULL_SCALE_MV = 3300;
+
+/// Minimum number of ADC counts between the two user calibration points.
+static constexpr uint16_t MIN_CALIBRATION_SPAN = 64;
+
+/// ADC calibration from the eFuse.
+static esp_adc_cal_characteristics_t adc_calibration;
+
+/// Converts a current sense voltage to the nominal current based on the
+/// hardware configuration.
+///
+/// @param millivolts is the voltage on the current sense pin.
+/// @param hbridge_max_milliamps is the maximum current of the H-Bridge.
+/// @return the nominal current in mA.
+static inline uint32_t nominal_milliamps(uint32_t millivolts,
+                                         uint32_t hbridge_max_milliamps)
+{
+#if CONFIG_CURRENTSENSE_USE_SHUNT
+  // The shunt is 5mOhm, one mV at the amplifier output is 200/gain mA.
+  return (millivolts * 200) / SHUNT_GAIN;
+#else // no shunt
+  return ((uint64_t)millivolts * hbridge_max_milliamps) / HBRIDGE_FULL_SCALE_MV;
+#endif // CONFIG_CURRENTSENSE_USE_SHUNT
+}
+
+/// Builds a model using the nominal current for the hardware configuration.
+///
+/// @param model is the model to build.
+/// @param hbridge_max_milliamps is the maximum current of the H-Bridge.
+///
+/// NOTE: At 11dB attenuation the calibrated voltage for a reading of zero is
+/// well above 0mV, the model is built relative to it so that a reading of
+/// zero is 0mA.
+static void build_nominal_model(CurrentSenseModel *model,
+                                uint32_t hbridge_max_milliamps)
+{
+  const uint32_t zero_mv = esp_adc_cal_raw_to_voltage(0, &adc_calibration);
+  model->build([zero_mv, hbridge_max_milliamps](uint32_t reading)
+  {
+    const uint32_t mv = esp_adc_cal_raw_to_voltage(reading, &adc_calibration);
+    return (int32_t)nominal_milliamps(mv > zero_mv ? mv - zero_mv : 0,
+                                      hbridge_max_milliamps);
+  });
+}
+
+#if CONFIG_OPS_TRACK_ENABLED
+/// Two-point user calibration for the OPS track current sense.
+struct OpsCalibration : public CurrentSenseCalibration
+{
+  /// @return true if both calibration points are usable.
+  bool valid() const
+  {
+    return reading[1] >= reading[0] + MIN_CALIBRATION_SPAN &&
+           milliamps[1] > milliamps[0];
+  }
+};
+
+/// User calibration for the OPS track, persisted in NVS.
+static OpsCalibration ops_calibration;
+
+/// Double buffered OPS track models, a new model is built in the inactive
+/// buffer before being published via @ref ops_model.
+static CurrentSenseModel ops_models[2];
+
+/// Active OPS track model.
+static std::atomic<const CurrentSenseModel *> ops_model{&ops_models[0]};
+
+/// Converts an OPS track ADC reading to mA.
+///
+/// @param reading is the ADC reading to convert.
+/// @return the approximate current in mA.
+static inline uint32_t ops_reading_to_milliamps(uint16_t reading)
+{
+  return ops_model.load(std::memory_order_acquire)->to_milliamps(reading);
+}
+
+/// Builds the OPS track model from the eFuse calibration and (when valid)
+/// the user calibration and publishes it.
+static void build_ops_model()
+{
+  const CurrentSenseModel *active = ops_model.load();
+  CurrentSenseModel *model =
+    active == &ops_models[0] ? &ops_models[1] : &ops_models[0];
+  if (ops_calibration.valid())
+  {
+    // the user calibration is applied to the calibrated voltage so that the
+    // ADC non-linearity remains corrected between the calibration points.
+    const int64_t mv_low =
+      esp_adc_cal_raw_to_voltage(ops_calibration.reading[0], &adc_calibration);
+    const int64_t mv_high =
+      esp_adc_cal_raw_to_voltage(ops_calibration.reading[1], &adc_calibration);
+    const int64_t ma_low = ops_calibration.milliamps[0];
+    const int64_t ma_high = ops_calibration.milliamps[1];
+    model->build([&](uint32_t reading)
+    {
+      const int64_t mv = esp_adc_cal_raw_to_voltage(reading, &adc_calibration);
+      return (int32_t)(ma_low +
+        ((mv - mv_low) * (ma_high - ma_low)) / std::max<int64_t>(mv_high - mv_low, 1));
+    });
+  }
+  else
+  {
+    build_nominal_model(model, CONFIG_OPS_HBRIDGE_MAX_MILLIAMPS);
+  }
+  ops_model.store(model, std::memory_order_release);
+}
+
+/// Loads the OPS track user calibration from NVS.
+static void load_ops_calibration()
+{
+  static_cast<CurrentSenseCalibration &>(ops_calibration) =
+    Singleton<NvsManager>::instance()->ops_calibration();
+  if (ops_calibration.valid())
+  {
+    LOG(INFO,
+        "[ULP-ADC] OPS calibration: %d/4095 = %" PRIu32 " mA, "
+        "%d/4095 = %" PRIu32 " mA", ops_calibration.reading[0],
+        ops_calibration.milliamps[0], ops_calibration.reading[1],
+        ops_calibration.milliamps[1]);
+  }
+}
+
+/// Persists the OPS track user calibration to NVS.
+///
+/// @return ESP_OK if the calibration has been persisted, otherwise the error
+/// from NVS.
+static esp_err_t save_ops_calibration()
+{
+  esp_err_t res =
+    Singleton<NvsManager>::instance()->ops_calibration(ops_calibration);
+  if (res != ESP_OK)
+  {
+    LOG_ERROR("[ULP-ADC] Unable to persist OPS calibration: %s",
+              esp_err_to_name(res));
+  }
+  return res;
+}
+
+/// Configures the OPS track ULP thresholds from the active model.
+static void configure_ops_thresholds()
+{
+  const CurrentSenseModel *model = ops_model.load();
+#if CONFIG_CURRENTSENSE_USE_SHUNT
+  const uint32_t short_ma = CONFIG_OPS_HBRIDGE_LIMIT_MILLIAMPS;
+#else
+  // Configure the short threshold to around 90% of the configured limit.
+  const uint32_t short_ma = (CONFIG_OPS_HBRIDGE_LIMIT_MILLIAMPS * 9) / 10;
+#endif // CONFIG_CURRENTSENSE_USE_SHUNT
+  const uint32_t warning_ma = (short_ma * CONFIG_OPS_WARNING_PERCENT) / 100;
+  const uint32_t warning_clear_ma =
+    (warning_ma * (100 - CONFIG_OPS_WARNING_HYSTERESIS_PERCENT)) / 100;
+  const uint16_t short_threshold = model->to_reading(short_ma);
+  const uint16_t warning_threshold = model->to_reading(warning_ma);
+  if ((!short_threshold || !warning_threshold) && ops_calibration.valid())
+  {
+    // the user calibration reports a current above the thresholds with no
+    // load, revert to the nominal model rather than reporting a short.
+    LOG_ERROR("[ULP-ADC] OPS calibration is not usable, removing it");
+    memset(&ops_calibration, 0, sizeof(OpsCalibration));
+    // the nominal model is used even if this fails, the calibration will be
+    // removed again on the next startup.
+    save_ops_calibration();
+    build_ops_model();
+    configure_ops_thresholds();
+    return;
+  }
+  HASSERT(short_threshold > 0);
+  HASSERT(warning_threshold > 0);
+  ulp_ops_short_threshold = short_threshold;
+  ulp_ops_warning_threshold = warning_threshold;
+  ulp_ops_warning_clear_threshold = model->to_reading(warning_clear_ma);
+  ops_short_clear_threshold =
+    model->to_reading((short_ma * CONFIG_OPS_SHORT_CLEAR_PERCENT) / 100);
+  // Configure the shutdown limit to near maximum value of the ADC.
+  ulp_ops_shutdown_threshold = 4090;
+  LOG(INFO,
+      "[ULP-ADC] OPS Short threshold: %d/4095 (%" PRIu32 " mA), "
+      "Warning threshold: %d/4095 (%" PRIu32 " mA), "
+      "Shutdown threshold: %d/4095 (%" PRIu32 " mA)",
+      ULP_VAR(ulp_ops_short_threshold),
+      model->to_milliamps(ULP_VAR(ulp_ops_short_threshold)),
+      ULP_VAR(ulp_ops_warning_threshold),
+      model->to_milliamps(ULP_VAR(ulp_ops_warning_threshold)),
+      ULP_VAR(ulp_ops_shutdown_threshold),
+      model->to_milliamps(ULP_VAR(ulp_ops_shutdown_threshold)));
+  LOG(INFO,
+      "[ULP-ADC] OPS Warning clear threshold: %d/4095 (%" PRIu32 " mA), "
+      "Short clear threshold: %d/4095 (%" PRIu32 " mA)",
+      ULP_VAR(ulp_ops_warning_clear_threshold),
+      model->to_milliamps(ULP_VAR(ulp_ops_warning_clear_threshold)),
+      ops_short_clear_threshold,
+      model->to_milliamps(ops_short_clear_threshold));
+}
+#endif // CONFIG_OPS_TRACK_ENABLED
+
+#if CONFIG_ULP_ADC_CAPTURE
+/// Number of readings in the ULP capture ring.
+static constexpr uint16_t OPS_CAPTURE_SIZE = CONFIG_ULP_ADC_CAPTURE_SAMPLES;
+
+/// Mask used to wrap indexes into the ULP capture ring.
+static constexpr uint16_t OPS_CAPTURE_MASK = OPS_CAPTURE_SIZE - 1;
+
+static_assert((OPS_CAPTURE_SIZE & OPS_CAPTURE_MASK) == 0,
+              "ULP capture size must be a power of two");
+
+/// Number of bytes of ULP reserved memory used by the ULP program and its
+/// variables, excluding the capture ring.
+static constexpr uint32_t ULP_PROGRAM_RESERVE_BYTES = 1024;
+
+static_assert(CONFIG_ESP32_ULP_COPROC_RESERVE_MEM >=
+              ULP_PROGRAM_RESERVE_BYTES + (OPS_CAPTURE_SIZE * 8),
+              "ESP32_ULP_COPROC_RESERVE_MEM is too small for the ULP capture "
+              "ring, increase it by 8 bytes per captured reading");
+
+/// Calculates the integer square root of a value.
+///
+/// @param value is the value to calculate the square root of.
+/// @return the largest integer whose square is not larger than @param value.
+static uint32_t isqrt(uint64_t value)
+{
+  uint64_t result = 0;
+  uint64_t bit = 1ULL << 62;
+  while (bit > value)
+  {
+    bit >>= 2;
+  }
+  while (bit)
+  {
+    if (value >= result + bit)
+    {
+      value -= result + bit;
+      result = (result >> 1) + bit;
+    }
+    else
+    {
+      result >>= 1;
+    }
+    bit >>= 2;
+  }
+  return result;
+}
+#endif // CONFIG_ULP_ADC_CAPTURE
+
 /// Initialize and start the ULP co-processor for monitoring current sense ADC
 /// inputs. When thresholds are breached the ULP will raise an interrupt to the
 /// ESP32 SoC. When the interrupt is triggered the ESP32 SoC will evaluate the
@@ -141,83 +475,73 @@ void initialize_ulp_adc()
 
   // Initialize the execution count
   ulp_exec_count = 0;
+#if CONFIG_ULP_ADC_CAPTURE
+  ulp_ops_capture_head = 0;
+  ulp_ops_capture_count = 0;
+  LOG(INFO, "[ULP-ADC] Capturing %d OPS readings every %dus",
+      OPS_CAPTURE_SIZE, CONFIG_ULP_ADC_SAMPLE_PERIOD_USEC);
+#endif // CONFIG_ULP_ADC_CAPTURE
+
+  esp_adc_cal_value_t calibration_type =
+    esp_adc_cal_characterize(ADC_UNIT_1, ADC_ATTEN_DB_11, ADC_WIDTH_BIT_12,
+                             DEFAULT_ADC_VREF, &adc_calibration);
+  LOG(INFO, "[ULP-ADC] Using vRef: %s (%" PRIu32 " mV)",
+      calibration_type == ESP_ADC_CAL_VAL_EFUSE_VREF ? "eFuse" :
+      calibration_type == ESP_ADC_CAL_VAL_EFUSE_TP ? "two-point" : "default",
+      adc_calibration.vref);
 
 #if CONFIG_OPS_TRACK_ENABLED
-#if CONFIG_CURRENTSENSE_USE_SHUNT
-  Fixed16 ops_threshold =
-    (float)CONFIG_OPS_HBRIDGE_LIMIT_MILLIAMPS / mAPerADCStep;
-  ulp_ops_short_threshold = ops_threshold.round();
-#else
-  // Configure the short threshold to around 90% of the configured limit.
-  ulp_ops_short_threshold =
-    (((((CONFIG_OPS_HBRIDGE_LIMIT_MILLIAMPS << 3) +
-         CONFIG_OPS_HBRIDGE_LIMIT_MILLIAMPS) / 10) << 12) /
-         CONFIG_OPS_HBRIDGE_MAX_MILLIAMPS);
-#endif // CONFIG_CURRENTSENSE_USE_SHUNT
-  // Configure the warning limit to around 75% of the short limit.
-  ulp_ops_warning_threshold =
-    ((ULP_VAR(ulp_ops_short_threshold) << 1) +
-      ULP_VAR(ulp_ops_short_threshold)) >> 2;
-  // Configure the shutdown limit to near maximum value of the ADC.
-  ulp_ops_shutdown_threshold = 4090;
-#if CONFIG_CURRENTSENSE_USE_SHUNT
-  LOG(INFO,
-      "[ULP-ADC] OPS Short threshold: %d/4095 (%6.2f mA), "
-      "Warning threshold: %d/4095 (%6.2f mA), "
-      "Shutdown threshold: %d/4095 (%6.2f mA)",
-      ULP_VAR(ulp_ops_short_threshold),
-      (ULP_VAR(ulp_ops_short_threshold) * mAPerADCStep),
-      ULP_VAR(ulp_ops_warning_threshold),
-      (ULP_VAR(ulp_ops_warning_threshold) * mAPerADCStep),
-      ULP_VAR(ulp_ops_shutdown_threshold),
-      (ULP_VAR(ulp_ops_shutdown_threshold) * mAPerADCStep));
-#else
-  LOG(INFO,
-      "[ULP-ADC] OPS Short threshold: %d/4095 (%6.2f mA), "
-      "Warning threshold: %d/4095 (%6.2f mA), "
-      "Shutdown threshold: %d/4095 (%6.2f mA)",
-      ULP_VAR(ulp_ops_short_threshold),
-      ((ULP_VAR(ulp_ops_short_threshold) * CONFIG_OPS_HBRIDGE_LIMIT_MILLIAMPS) / 4096.0f),
-      ULP_VAR(ulp_ops_warning_threshold),
-      ((ULP_VAR(ulp_ops_warning_threshold) * CONFIG_OPS_HBRIDGE_LIMIT_MILLIAMPS) / 4096.0f),
-      ULP_VAR(ulp_ops_shutdown_threshold),
-      ((ULP_VAR(ulp_ops_shutdown_threshold) * CONFIG_OPS_HBRIDGE_LIMIT_MILLIAMPS) / 4096.0f));
-#endif // CONFIG_CURRENTSENSE_USE_SHUNT
+  ulp_ops_short_count = 0;
+  ulp_ops_short_reading = 0;
+  last_ops_short_count = 0;
+  ulp_ops_level = 0;
+  last_ops_level = 0;
+#if defined(CONFIG_OPS_SHORT_CUTOFF_PIN) && CONFIG_OPS_SHORT_CUTOFF_PIN >= 0
+  // the ULP drives the cut-off pin HIGH when a short is detected, it must be
+  // configured as an RTC output before the ULP is started.
+  LOG(INFO, "[ULP-ADC] OPS short cut-off pin: %d", CONFIG_OPS_SHORT_CUTOFF_PIN);
+  ESP_ERROR_CHECK(rtc_gpio_init((gpio_num_t)CONFIG_OPS_SHORT_CUTOFF_PIN));
+  ESP_ERROR_CHECK(
+    rtc_gpio_set_direction((gpio_num_t)CONFIG_OPS_SHORT_CUTOFF_PIN,
+                           RTC_GPIO_MODE_OUTPUT_ONLY));
+  ESP_ERROR_CHECK(
+    rtc_gpio_set_level((gpio_num_t)CONFIG_OPS_SHORT_CUTOFF_PIN, 0));
+#endif // CONFIG_OPS_SHORT_CUTOFF_PIN >= 0
+  load_ops_calibration();
+  build_ops_model();
+  configure_ops_thresholds();
 #endif // CONFIG_OPS_TRACK_ENABLED
 #if CONFIG_PROG_TRACK_ENABLED
-#if CONFIG_CURRENTSENSE_USE_SHUNT
-  Fixed16 prog_threshold = 60.0f / mAPerADCStep;
-  // Configure the PROG track ACK limit to ~60mA
-  ulp_prog_ack_threshold = prog_threshold.round();
-  prog_threshold = 250.0f / mAPerADCStep;
-  // Configure the PROG track short limit to ~250mA
-  ulp_prog_short_threshold = prog_threshold.round();
-  LOG(INFO,
-      "[ULP-ADC] PROG Ack threshold: %u/4095 (%6.2f mA), "
-      "Short threshold: %u/4095 (%6.2f mA)",
-      ULP_VAR(ulp_prog_ack_threshold),
-      ULP_VAR(ulp_prog_ack_threshold) * mAPerADCStep,
-      ULP_VAR(ulp_prog_short_threshold),
-      ULP_VAR(ulp_prog_short_threshold) * mAPerADCStep);
-#else
-  // Configure the PROG track ACK limit to ~60mA
-  ulp_prog_ack_threshold = (60 << 12) / CONFIG_PROG_HBRIDGE_MAX_MILLIAMPS;
-  // Configure the PROG track short limit to ~250mA
-  ulp_prog_short_threshold = (250 << 12) / CONFIG_PROG_HBRIDGE_MAX_MILLIAMPS;
-  LOG(INFO,
-      "[ULP-ADC] PROG Ack threshold: %u/4095 (%6.2f mA), "
-      "Short threshold: %u/4095 (%6.2f mA)",
-      ULP_VAR(ulp_prog_ack_threshold),
-      ((ULP_VAR(ulp_prog_ack_threshold) * CONFIG_PROG_HBRIDGE_MAX_MILLIAMPS) / 4096.0f),
-      ULP_VAR(ulp_prog_short_threshold),
-      ((ULP_VAR(ulp_prog_short_threshold) * CONFIG_PROG_HBRIDGE_MAX_MILLIAMPS) / 4096.0f));
-#endif // CONFIG_CURRENTSENSE_USE_SHUNT
+  {
+    CurrentSenseModel prog_model;
+    build_nominal_model(&prog_model, CONFIG_PROG_HBRIDGE_MAX_MILLIAMPS);
+    // Configure the PROG track ACK limit to ~60mA and the short limit to
+    // ~250mA.
+    ulp_prog_ack_threshold = prog_model.to_reading(60);
+    ulp_prog_short_threshold = prog_model.to_reading(250);
+    // the ACK pulse must exceed the baseline by the same ~60mA, this is a
+    // difference in readings since the conversion is not linear.
+    ulp_prog_ack_delta =
+      prog_model.to_reading(60) - prog_model.to_reading(0);
+    HASSERT(ULP_VAR(ulp_prog_ack_threshold) > 0);
+    HASSERT(ULP_VAR(ulp_prog_short_threshold) > 0);
+    HASSERT(ULP_VAR(ulp_prog_ack_delta) > 0);
+    LOG(INFO,
+        "[ULP-ADC] PROG Ack threshold: %u/4095 (%" PRIu32 " mA), "
+        "Short threshold: %u/4095 (%" PRIu32 " mA)",
+        ULP_VAR(ulp_prog_ack_threshold),
+        prog_model.to_milliamps(ULP_VAR(ulp_prog_ack_threshold)),
+        ULP_VAR(ulp_prog_short_threshold),
+        prog_model.to_milliamps(ULP_VAR(ulp_prog_short_threshold)));
+  }
+  ulp_prog_ack_mode = 0;
 #endif // CONFIG_PROG_TRACK_ENABLED
   // Enable ULP access to ADC1
   adc1_ulp_enable();
 
-  // Default wakeup for ULP of ~2.5ms
-  ESP_ERROR_CHECK(ulp_set_wakeup_period(0, 2500UL));
+  // Configure the ULP wakeup period, default is ~2.5ms
+  sample_period_usec = CONFIG_ULP_ADC_SAMPLE_PERIOD_USEC;
+  ESP_ERROR_CHECK(ulp_set_wakeup_period(0, sample_period_usec));
 
   LOG(INFO, "[ULP-ADC] Starting the ULP FSM");
   // Start the ULP monitoring of the ADCs
@@ -259,15 +583,215 @@ uint16_t get_last_ops_reading()
 uint32_t get_ops_load()
 {
 #if CONFIG_OPS_TRACK_ENABLED
-#if CONFIG_CURRENTSENSE_USE_SHUNT
-  return get_last_ops_reading() * mAPerADCStep;
-#else // no shunt
-  return (get_last_ops_reading() * CONFIG_OPS_HBRIDGE_MAX_MILLIAMPS) / 4096;
-#endif // CONFIG_CURRENTSENSE_USE_SHUNT
+  return ops_reading_to_milliamps(get_last_ops_reading());
 #endif // CONFIG_OPS_TRACK_ENABLED
   return -1;
 }
 
+void set_ops_short_callback(ops_short_callback_t callback, void *arg)
+{
+  portDISABLE_INTERRUPTS();
+  ops_short_callback_arg = arg;
+  ops_short_callback = callback;
+  portENABLE_INTERRUPTS();
+}
+
+void set_ops_level_callback(ops_level_callback_t callback, void *arg)
+{
+  portDISABLE_INTERRUPTS();
+  ops_level_callback_arg = arg;
+  ops_level_callback = callback;
+  portENABLE_INTERRUPTS();
+}
+
+uint16_t get_last_ops_short_reading()
+{
+  return last_ops_short_reading;
+}
+
+uint16_t get_ops_short_clear_threshold()
+{
+  return ops_short_clear_threshold;
+}
+
+bool is_ops_warning_active()
+{
+#if CONFIG_OPS_TRACK_ENABLED
+  return ULP_VAR(ulp_ops_level);
+#endif // CONFIG_OPS_TRACK_ENABLED
+  return false;
+}
+
+uint32_t get_ops_short_count()
+{
+#if CONFIG_OPS_TRACK_ENABLED
+  return ULP_VAR(ulp_ops_short_count);
+#endif // CONFIG_OPS_TRACK_ENABLED
+  return 0;
+}
+
+void release_ops_short_cutoff()
+{
+#if CONFIG_OPS_TRACK_ENABLED && defined(CONFIG_OPS_SHORT_CUTOFF_PIN) && CONFIG_OPS_SHORT_CUTOFF_PIN >= 0
+  rtc_gpio_set_level((gpio_num_t)CONFIG_OPS_SHORT_CUTOFF_PIN, 0);
+#endif // CONFIG_OPS_TRACK_ENABLED && CONFIG_OPS_SHORT_CUTOFF_PIN >= 0
+}
+
+esp_err_t set_ops_calibration_point(bool high, uint32_t milliamps)
+{
+#if CONFIG_OPS_TRACK_ENABLED
+  const uint8_t point = high ? 1 : 0;
+  const OpsCalibration previous = ops_calibration;
+  ops_calibration.reading[point] = get_last_ops_reading();
+  ops_calibration.milliamps[point] = milliamps;
+  LOG(INFO, "[ULP-ADC] OPS calibration %s point: %d/4095 = %" PRIu32 " mA",
+      high ? "high" : "low", ops_calibration.reading[point], milliamps);
+  esp_err_t res = save_ops_calibration();
+  if (res != ESP_OK)
+  {
+    ops_calibration = previous;
+    return res;
+  }
+  if (ops_calibration.valid())
+  {
+    build_ops_model();
+    configure_ops_thresholds();
+  }
+  return ESP_OK;
+#endif // CONFIG_OPS_TRACK_ENABLED
+  return ESP_ERR_NOT_SUPPORTED;
+}
+
+esp_err_t reset_ops_calibration()
+{
+#if CONFIG_OPS_TRACK_ENABLED
+  LOG(INFO, "[ULP-ADC] Removing OPS calibration");
+  const OpsCalibration previous = ops_calibration;
+  memset(&ops_calibration, 0, sizeof(OpsCalibration));
+  esp_err_t res = save_ops_calibration();
+  if (res != ESP_OK)
+  {
+    ops_calibration = previous;
+    return res;
+  }
+  build_ops_model();
+  configure_ops_thresholds();
+  return ESP_OK;
+#endif // CONFIG_OPS_TRACK_ENABLED
+  return ESP_ERR_NOT_SUPPORTED;
+}
+
+bool is_ops_calibrated()
+{
+#if CONFIG_OPS_TRACK_ENABLED
+  return ops_calibration.valid();
+#endif // CONFIG_OPS_TRACK_ENABLED
+  return false;
+}
+
+size_t get_ops_capture_size()
+{
+#if CONFIG_ULP_ADC_CAPTURE
+  // the entry at the head index is never returned as it may be in the
+  // process of being written by the ULP.
+  return OPS_CAPTURE_SIZE - 1;
+#endif // CONFIG_ULP_ADC_CAPTURE
+  return 0;
+}
+
+size_t get_ops_capture(uint16_t *readings_ma, uint16_t *sequence, size_t max)
+{
+#if CONFIG_ULP_ADC_CAPTURE
+  if (!ulp_running || !max)
+  {
+    return 0;
+  }
+  volatile uint32_t *readings = &ulp_ops_capture_readings;
+  volatile uint32_t *samples = &ulp_ops_capture_sequence;
+  uint16_t sample_buf[OPS_CAPTURE_SIZE];
+  // the written entry count is read before the head index, it is updated by
+  // the ULP after the head index so it never includes an unwritten entry.
+  size_t written = ULP_VAR(ulp_ops_capture_count);
+  size_t count = std::min(std::min(max, get_ops_capture_size()), written);
+  if (!count)
+  {
+    return 0;
+  }
+  uint16_t head = ULP_VAR(ulp_ops_capture_head);
+  uint16_t start = (head - count) & OPS_CAPTURE_MASK;
+  for (size_t idx = 0; idx < count; idx++)
+  {
+    uint16_t entry = (start + idx) & OPS_CAPTURE_MASK;
+    readings_ma[idx] = ULP_VAR(readings[entry]);
+    sample_buf[idx] = ULP_VAR(samples[entry]);
+  }
+  // the ULP may have written (or be writing) entries after the head index
+  // while the ring was being copied, discard any of those that wrapped around
+  // into the oldest copied entries.
+  uint16_t advanced = (ULP_VAR(ulp_ops_capture_head) - head) & OPS_CAPTURE_MASK;
+  size_t skip = 0;
+  if (advanced + 1 > OPS_CAPTURE_SIZE - count)
+  {
+    skip = advanced + 1 - (OPS_CAPTURE_SIZE - count);
+  }
+  if (skip >= count)
+  {
+    return 0;
+  }
+  // only return the entries with consecutive sample numbers ending at the
+  // newest entry. The sample numbers are the 16-bit ULP execution count which
+  // wraps, the comparison is done modulo 2^16 so that the entries on both
+  // sides of the wrap are kept in order.
+  size_t first = count - 1;
+  while (first > skip &&
+         (uint16_t)(sample_buf[first] - sample_buf[first - 1]) == 1)
+  {
+    first--;
+  }
+  size_t valid = count - first;
+  for (size_t idx = 0; idx < valid; idx++)
+  {
+    readings_ma[idx] = ops_reading_to_milliamps(readings_ma[first + idx]);
+    if (sequence)
+    {
+      sequence[idx] = sample_buf[first + idx];
+    }
+  }
+  return valid;
+#else
+  return 0;
+#endif // CONFIG_ULP_ADC_CAPTURE
+}
+
+bool get_ops_current_stats(OpsCurrentStats *stats)
+{
+#if CONFIG_ULP_ADC_CAPTURE
+  std::unique_ptr<uint16_t[]> readings(new uint16_t[OPS_CAPTURE_SIZE]);
+  size_t count = get_ops_capture(readings.get(), nullptr, OPS_CAPTURE_SIZE);
+  if (!count)
+  {
+    return false;
+  }
+  uint32_t peak = 0;
+  uint64_t total = 0;
+  uint64_t squares = 0;
+  for (size_t idx = 0; idx < count; idx++)
+  {
+    peak = std::max<uint32_t>(peak, readings[idx]);
+    total += readings[idx];
+    squares += (uint32_t)readings[idx] * readings[idx];
+  }
+  stats->samples = count;
+  stats->period_usec = sample_period_usec;
+  stats->peak_ma = peak;
+  stats->average_ma = total / count;
+  stats->rms_ma = isqrt(squares / count);
+  return true;
+#else
+  return false;
+#endif // CONFIG_ULP_ADC_CAPTURE
+}
+
 uint16_t get_ops_short_threshold()
 {
 #if CONFIG_OPS_TRACK_ENABLED
@@ -292,6 +816,43 @@ uint16_t get_ops_warning_threshold()
   return 4095;
 }
 
+void start_prog_ack_detection()
+{
+#if CONFIG_PROG_TRACK_ENABLED
+  if (!ulp_running)
+  {
+    return;
+  }
+  // disable the pulse detection while the state is reset.
+  ulp_prog_ack_mode = 0;
+  ulp_prog_pulse_length = 0;
+  ulp_prog_baseline_sum = 0;
+  ulp_prog_ack_count = 0;
+  last_prog_ack_count = 0;
+  ulp_prog_baseline_remaining =
+    PROG_BASELINE_SETTLE_SAMPLES + PROG_BASELINE_SAMPLES;
+  ulp_prog_ack_mode = 1;
+  sample_period_usec = CONFIG_PROG_ACK_SAMPLE_PERIOD_USEC;
+  ESP_ERROR_CHECK(ulp_set_wakeup_period(0, sample_period_usec));
+#endif // CONFIG_PROG_TRACK_ENABLED
+}
+
+void stop_prog_ack_detection()
+{
+#if CONFIG_PROG_TRACK_ENABLED
+  if (!ulp_running || !ULP_VAR(ulp_prog_ack_mode))
+  {
+    return;
+  }
+  ulp_prog_ack_mode = 0;
+  sample_period_usec = CONFIG_ULP_ADC_SAMPLE_PERIOD_USEC;
+  ESP_ERROR_CHECK(ulp_set_wakeup_period(0, sample_period_usec));
+  LOG(VERBOSE, "[ULP-ADC] PROG baseline: %d/4095, ACK: %d, rejected: %d",
+      ULP_VAR(ulp_prog_baseline), ULP_VAR(ulp_prog_ack_count),
+      ULP_VAR(ulp_prog_ack_rejected));
+#endif // CONFIG_PROG_TRACK_ENABLED
+}
+
 uint16_t get_last_prog_reading()
 {
 #if CONFIG_PROG_TRACK_ENABLED
@@ -59,6 +59,76 @@ uint16_t get_ops_warning_threshold()
   return 4095;
 }
 
+uint16_t get_ops_short_clear_threshold()
+{
+  return 4095;
+}
+
+bool is_ops_warning_active()
+{
+  return false;
+}
+
+void set_ops_level_callback(ops_level_callback_t callback, void *arg)
+{
+}
+
+uint16_t get_last_ops_short_reading()
+{
+  return 0;
+}
+
+void set_ops_short_callback(ops_short_callback_t callback, void *arg)
+{
+}
+
+uint32_t get_ops_short_count()
+{
+  return 0;
+}
+
+void release_ops_short_cutoff()
+{
+}
+
+esp_err_t set_ops_calibration_point(bool high, uint32_t milliamps)
+{
+  return ESP_ERR_NOT_SUPPORTED;
+}
+
+esp_err_t reset_ops_calibration()
+{
+  return ESP_ERR_NOT_SUPPORTED;
+}
+
+bool is_ops_calibrated()
+{
+  return false;
+}
+
+size_t get_ops_capture_size()
+{
+  return 0;
+}
+
+size_t get_ops_capture(uint16_t *readings_ma, uint16_t *sequence, size_t max)
+{
+  return 0;
+}
+
+bool get_ops_current_stats(OpsCurrentStats *stats)
+{
+  return false;
+}
+
+void start_prog_ack_detection()
+{
+}
+
+void stop_prog_ack_detection()
+{
+}
+
 uint16_t get_last_prog_reading()
 {
   return 4095;
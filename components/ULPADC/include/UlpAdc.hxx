@@ -15,6 +15,8 @@ COPYRIGHT (c) 2021 Mike Dunston
   along with this program.  If not, see http://www.gnu.org/licenses
 **********************************************************************/
 
+#include <esp_err.h>
+#include <stddef.h>
 #include <stdint.h>
 
 namespace esp32cs
@@ -50,6 +52,130 @@ uint16_t get_ops_shutdown_threshold();
 /// disabled.
 uint16_t get_ops_warning_threshold();
 
+/// @return the OPS track short clear threshold, after a short the current
+/// must drop below this value before the short is considered cleared. Will
+/// return 4095 if OPS track is disabled.
+uint16_t get_ops_short_clear_threshold();
+
+/// @return true if the OPS track load has exceeded the warning threshold and
+/// has not yet dropped below the warning clear threshold.
+bool is_ops_warning_active();
+
+/// Callback invoked when the ULP has detected a change in the OPS track load
+/// level (short or warning).
+///
+/// NOTE: This is called from an ISR context!
+typedef void (*ops_level_callback_t)(void *arg);
+
+/// Registers a callback to be invoked when the ULP detects a short on the
+/// OPS track or the OPS track load crosses the warning thresholds.
+///
+/// @param callback is the function to invoke, nullptr to remove.
+/// @param arg is passed to @param callback.
+void set_ops_level_callback(ops_level_callback_t callback, void *arg);
+
+/// @return the OPS track reading that triggered the most recent short.
+uint16_t get_last_ops_short_reading();
+
+/// Callback invoked when the ULP has detected a short on the OPS track.
+///
+/// NOTE: This is called from an ISR context!
+typedef void (*ops_short_callback_t)(void *arg);
+
+/// Registers a callback to be invoked when the ULP detects a short on the
+/// OPS track.
+///
+/// @param callback is the function to invoke, nullptr to remove.
+/// @param arg is passed to @param callback.
+void set_ops_short_callback(ops_short_callback_t callback, void *arg);
+
+/// @return the number of OPS track shorts detected by the ULP.
+uint32_t get_ops_short_count();
+
+/// Releases the OPS short cut-off pin after the ULP has driven it HIGH. This
+/// has no effect when the short cut-off pin is not configured.
+void release_ops_short_cutoff();
+
+/// Records a calibration point for the OPS track current sense using the
+/// current ADC reading. Both calibration points must be recorded before the
+/// calibration is applied, until then the nominal conversion based on the
+/// eFuse ADC characterization is used.
+///
+/// @param high should be true for the high calibration point, false for the
+/// low calibration point.
+/// @param milliamps is the current (in mA) measured by an external meter.
+/// @return ESP_OK if the calibration point has been persisted, otherwise the
+/// error from NVS in which case the calibration is not modified. Use
+/// @ref is_ops_calibrated to check if the calibration has been applied.
+///
+/// NOTE: The OPS track thresholds will be recalculated when the calibration
+/// has been applied.
+esp_err_t set_ops_calibration_point(bool high, uint32_t milliamps);
+
+/// Removes the OPS track current sense calibration and reverts to the nominal
+/// conversion.
+///
+/// @return ESP_OK if the calibration has been removed, otherwise the error
+/// from NVS in which case the calibration is not modified.
+esp_err_t reset_ops_calibration();
+
+/// @return true if the OPS track current sense calibration is applied.
+bool is_ops_calibrated();
+
+/// Statistics for the OPS track current waveform captured by the ULP.
+struct OpsCurrentStats
+{
+  /// Number of readings used for the statistics.
+  uint16_t samples;
+
+  /// Number of microseconds between readings.
+  uint32_t period_usec;
+
+  /// Peak current (mA).
+  uint32_t peak_ma;
+
+  /// Average current (mA).
+  uint32_t average_ma;
+
+  /// RMS current (mA).
+  uint32_t rms_ma;
+};
+
+/// @return the number of OPS track readings retained by the ULP, this will be
+/// zero when the waveform capture is disabled.
+size_t get_ops_capture_size();
+
+/// Copies the most recent OPS track readings retained by the ULP.
+///
+/// @param readings_ma will receive the readings (in mA), oldest first.
+/// @param sequence will receive the ULP sample number for each reading, this
+/// is a 16-bit counter which wraps and can be nullptr if not required.
+/// @param max is the maximum number of readings to copy.
+/// @return number of readings copied.
+///
+/// NOTE: This does not block the ULP, readings that are overwritten by the
+/// ULP while being copied are discarded.
+size_t get_ops_capture(uint16_t *readings_ma, uint16_t *sequence, size_t max);
+
+/// Calculates statistics for the OPS track readings retained by the ULP.
+///
+/// @param stats will receive the statistics.
+/// @return true if the statistics were calculated, false if the waveform
+/// capture is disabled or no readings are available.
+bool get_ops_current_stats(OpsCurrentStats *stats);
+
+/// Starts the PROG track ACK pulse detection. The ULP sampling rate will be
+/// increased and the PROG track baseline current will be measured, an ACK
+/// will only be reported when the current rises above the baseline for
+/// 6ms (+/- 1ms).
+///
+/// NOTE: This should be called each time the PROG track is enabled.
+void start_prog_ack_detection();
+
+/// Stops the PROG track ACK pulse detection and restores the ULP sampling
+/// rate.
+void stop_prog_ack_detection();
+
 /// @return the last reading from the PROG track ADC pin. May return 4095 if no
 /// reading is available.
 uint16_t get_last_prog_reading();
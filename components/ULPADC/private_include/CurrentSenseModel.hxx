@@ -0,0 +1,107 @@
+/**********************************************************************
+ESP32 COMMAND STATION
+
+COPYRIGHT (c) 2021 Mike Dunston
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see http://www.gnu.org/licenses
+**********************************************************************/
+
+#ifndef CURRENT_SENSE_MODEL_HXX_
+#define CURRENT_SENSE_MODEL_HXX_
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace esp32cs
+{
+
+/// Converts between current sense ADC readings and mA using a piecewise
+/// linear lookup table. The table is built once from a (potentially
+/// expensive) conversion function, all subsequent conversions use integer
+/// math only.
+class CurrentSenseModel
+{
+public:
+  /// Maximum ADC reading.
+  static constexpr uint16_t ADC_MAX = 4095;
+
+  /// Number of ADC counts between lookup table entries (log2).
+  static constexpr uint8_t SEGMENT_SHIFT = 8;
+
+  /// Number of entries in the lookup table.
+  static constexpr size_t TABLE_SIZE = ((ADC_MAX + 1) >> SEGMENT_SHIFT) + 1;
+
+  /// Builds the lookup table.
+  ///
+  /// @param convert is called with each ADC reading at a lookup table entry
+  /// (0 to 4096 inclusive) and must return the current in mA.
+  template <typename Fn> void build(Fn convert)
+  {
+    for (size_t idx = 0; idx < TABLE_SIZE; idx++)
+    {
+      table_[idx] = convert(idx << SEGMENT_SHIFT);
+    }
+  }
+
+  /// Converts an ADC reading to mA.
+  ///
+  /// @param reading is the ADC reading to convert.
+  /// @return the current in mA.
+  uint32_t to_milliamps(uint16_t reading) const
+  {
+    if (reading > ADC_MAX)
+    {
+      reading = ADC_MAX;
+    }
+    const size_t idx = reading >> SEGMENT_SHIFT;
+    const int32_t offset = reading & ((1 << SEGMENT_SHIFT) - 1);
+    const int32_t low = table_[idx];
+    const int32_t high = table_[idx + 1];
+    const int32_t result = low + (((high - low) * offset) >> SEGMENT_SHIFT);
+    return result > 0 ? result : 0;
+  }
+
+  /// Converts a current in mA to the lowest ADC reading that corresponds to
+  /// it.
+  ///
+  /// @param milliamps is the current to convert.
+  /// @return the ADC reading, @ref ADC_MAX if the current is outside of the
+  /// measurable range.
+  uint16_t to_reading(uint32_t milliamps) const
+  {
+    const int32_t target = milliamps;
+    for (size_t idx = 0; idx < TABLE_SIZE - 1; idx++)
+    {
+      const int32_t low = table_[idx];
+      const int32_t high = table_[idx + 1];
+      if (high >= target && high > low)
+      {
+        uint32_t reading = idx << SEGMENT_SHIFT;
+        if (target > low)
+        {
+          reading += ((target - low) << SEGMENT_SHIFT) / (high - low);
+        }
+        return reading < ADC_MAX ? reading : ADC_MAX;
+      }
+    }
+    return ADC_MAX;
+  }
+
+private:
+  /// Current (mA) at each lookup table entry, these may be negative when a
+  /// calibration offset is applied.
+  int32_t table_[TABLE_SIZE];
+};
+
+} // namespace esp32cs
+
+#endif // CURRENT_SENSE_MODEL_HXX_
\ No newline at end of file
@@ -21,7 +21,9 @@ COPYRIGHT (c) 2017-2021 Mike Dunston
 #include <esp_log.h>
 #include <executor/Service.hxx>
 #include <executor/StateFlow.hxx>
+#include <functional>
 #include <utils/logging.h>
+#include <vector>
 
 #include "sdkconfig.h"
 
@@ -48,6 +50,15 @@ public:
         set_terminated();
         timer_.ensure_triggered();
     }
+
+    /// Registers a callback that will be invoked after the general health has
+    /// been reported, this can be used to report additional metrics.
+    ///
+    /// @param reporter is the callback to invoke.
+    void register_reporter(std::function<void()> reporter)
+    {
+        reporters_.push_back(reporter);
+    }
 private:
     /// @ref StateFlowTimer used for periodic wakeup.
     StateFlowTimer timer_{this};
@@ -58,6 +69,9 @@ private:
     /// Internal flag to track if a shutdown request has been requested.
     bool shutdown_{false};
 
+    /// Callbacks to invoke when reporting the general health.
+    std::vector<std::function<void()>> reporters_;
+
     /// Wakes up and blinks the heartbeat LED and prints general health when
     /// the required count of wakeups has expired.
     Action update()
@@ -85,6 +99,10 @@ private:
             heap_caps_get_largest_free_block(MALLOC_CAP_SPIRAM) / 1024.0f,
 #endif // CONFIG_SPIRAM
             mainBufferPool->total_size() / 1024.0f);
+        for (auto &reporter : reporters_)
+        {
+            reporter();
+        }
         return sleep_and_call(&timer_, reportInterval_, STATE(update));
     }
 };
@@ -0,0 +1,153 @@
+/**********************************************************************
+ESP32 COMMAND STATION
+
+COPYRIGHT (c) 2021 Mike Dunston
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see http://www.gnu.org/licenses
+**********************************************************************/
+
+#ifndef SPSC_RING_HXX_
+#define SPSC_RING_HXX_
+
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+
+namespace esp32cs
+{
+
+/// Lock-free single-producer / single-consumer ring of fixed size slots.
+///
+/// The producer fills a slot in place via @ref reserve and publishes it with
+/// @ref commit. The consumer reads the oldest slot in place via @ref front and
+/// releases it with @ref pop. Neither side blocks or enters a critical
+/// section so the consumer side can be used from an ISR.
+///
+/// NOTE: Only one task may act as the producer and only one task (or ISR) may
+/// act as the consumer.
+///
+/// @param T is the type of entry stored in each slot.
+/// @param N is the number of entries that can be held in the ring.
+template <class T, size_t N>
+class SpscRing
+{
+public:
+  /// Producer: retrieves the next free slot without publishing it.
+  ///
+  /// @return pointer to the slot to fill or nullptr if the ring is full.
+  T *reserve()
+  {
+    uint32_t head = head_.load(std::memory_order_relaxed);
+    if (advance(head) == tail_.load(std::memory_order_acquire))
+    {
+      return nullptr;
+    }
+    return &slots_[head];
+  }
+
+  /// Producer: publishes the slot previously returned by @ref reserve to the
+  /// consumer.
+  void commit()
+  {
+    head_.store(advance(head_.load(std::memory_order_relaxed)),
+                std::memory_order_release);
+  }
+
+  /// Consumer: retrieves the oldest published slot without releasing it.
+  ///
+  /// @return pointer to the oldest slot or nullptr if the ring is empty.
+  T *front()
+  {
+    uint32_t tail = tail_.load(std::memory_order_relaxed);
+    if (tail == head_.load(std::memory_order_acquire))
+    {
+      return nullptr;
+    }
+    return &slots_[tail];
+  }
+
+  /// Consumer: retrieves a published slot without releasing it.
+  ///
+  /// @param offset is the number of slots after the oldest slot to retrieve,
+  /// zero is the same as @ref front.
+  /// @return pointer to the slot or nullptr if there are not enough published
+  /// slots.
+  ///
+  /// NOTE: the producer will not modify a slot once it has been published so
+  /// the consumer may also update the slot contents.
+  T *peek(uint32_t offset)
+  {
+    uint32_t tail = tail_.load(std::memory_order_relaxed);
+    uint32_t head = head_.load(std::memory_order_acquire);
+    uint32_t count = (head >= tail) ? head - tail : head + SLOT_COUNT - tail;
+    if (offset >= count)
+    {
+      return nullptr;
+    }
+    uint32_t index = tail + offset;
+    if (index >= SLOT_COUNT)
+    {
+      index -= SLOT_COUNT;
+    }
+    return &slots_[index];
+  }
+
+  /// Consumer: releases the slot previously returned by @ref front so it can
+  /// be reused by the producer.
+  void pop()
+  {
+    tail_.store(advance(tail_.load(std::memory_order_relaxed)),
+                std::memory_order_release);
+  }
+
+  /// @return true if there are no free slots in the ring.
+  bool full() const
+  {
+    return advance(head_.load(std::memory_order_acquire)) ==
+           tail_.load(std::memory_order_acquire);
+  }
+
+  /// @return true if there are no published slots in the ring.
+  bool empty() const
+  {
+    return head_.load(std::memory_order_acquire) ==
+           tail_.load(std::memory_order_acquire);
+  }
+
+private:
+  /// Number of slots allocated, one slot is always left unused to
+  /// differentiate between the full and empty states.
+  static constexpr uint32_t SLOT_COUNT = N + 1;
+
+  /// Alignment used to keep the producer and consumer indexes on separate
+  /// cache lines.
+  static constexpr size_t CACHE_LINE_SIZE = 32;
+
+  /// @return the slot index following @param index.
+  static uint32_t advance(uint32_t index)
+  {
+    return (index + 1 == SLOT_COUNT) ? 0 : index + 1;
+  }
+
+  /// Index of the next slot to be filled, only modified by the producer.
+  alignas(CACHE_LINE_SIZE) std::atomic<uint32_t> head_{0};
+
+  /// Index of the next slot to be consumed, only modified by the consumer.
+  alignas(CACHE_LINE_SIZE) std::atomic<uint32_t> tail_{0};
+
+  /// Storage for the ring entries.
+  alignas(CACHE_LINE_SIZE) T slots_[SLOT_COUNT];
+};
+
+} // namespace esp32cs
+
+#endif // SPSC_RING_HXX_
\ No newline at end of file
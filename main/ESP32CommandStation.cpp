@@ -49,6 +49,7 @@ COPYRIGHT (c) 2017-2021 Mike Dunston
 #include <openlcb/SimpleStack.hxx>
 #include <StatusDisplay.hxx>
 #include <StatusLED.hxx>
+#include <TrackUtilization.hxx>
 #include <TrainDatabase.h>
 #include <UlpAdc.hxx>
 #include <utils/AutoSyncFileFlow.hxx>
@@ -325,6 +326,13 @@ void app_main()
                                                 stack.node(),
                                                 cfg.seg().thermal());
     esp32cs::init_dcc(stack.node(), stack.service(), cfg.seg().track());
+    health_monitor.register_reporter(
+      []()
+      {
+        Singleton<esp32cs::TrackUtilization>::instance()->log_usage();
+        esp32cs::log_railcom_timing();
+        esp32cs::log_signal_diagnostics();
+      });
     nvs.register_virtual_memory_spaces(&stack);
     nvs.register_clocks(stack.node(), &wifi_manager);
 
@@ -17,7 +17,9 @@ COPYRIGHT (c) 2017-2021 Mike Dunston
 
 #include "sdkconfig.h"
 
+#include <algorithm>
 #include <AllTrainNodes.hxx>
+#include <BatchCvReader.hxx>
 #include <CDIClient.hxx>
 #include <CDIDownloader.hxx>
 #include <cJSON.h>
@@ -28,20 +30,25 @@ COPYRIGHT (c) 2017-2021 Mike Dunston
 #include <DelayRebootHelper.hxx>
 #include <esp_log.h>
 #include <esp_ota_ops.h>
+#include <esp_timer.h>
 #include <EventBroadcastHelper.hxx>
 #include <executor/Service.hxx>
 #include <Httpd.h>
+#include <map>
 #include <mutex>
 #include <NvsManager.hxx>
 #include <OTAWatcher.hxx>
+#include <RailComDecoder.hxx>
 #include <StatusLED.hxx>
 #include <StringUtils.hxx>
+#include <TrackUtilization.hxx>
 #include <TrainDatabase.h>
 #include <AccessoryDecoderDatabase.hxx>
 #include <UlpAdc.hxx>
 #include <utils/FileUtils.hxx>
 #include <utils/SocketClientParams.hxx>
 #include <utils/StringPrintf.hxx>
+#include <vector>
 
 using commandstation::AllTrainNodes;
 using commandstation::DccMode;
@@ -53,6 +60,7 @@ using esp32cs::EventBroadcastHelper;
 using esp32cs::NvsManager;
 using esp32cs::OTAWatcherFlow;
 using esp32cs::StatusLED;
+using esp32cs::TrackUtilization;
 using http::AbstractHttpResponse;
 using http::HTTP_ENCODING_GZIP;
 using http::HTTP_ENCODING_NONE;
@@ -127,8 +135,86 @@ extern const size_t cdiJsGz_size asm("cdi_js_gz_length");
       ([&]()                                                                   \
        { Singleton<AllTrainNodes>::instance()->remove_train_impl(addr); }));
 
+/// Periodically sends the DCC track utilization to subscribed websockets.
+///
+/// NOTE: This flow must use the same @ref Service as the @ref Httpd so that
+/// the subscriber list is only accessed from a single thread.
+class UtilizationStreamFlow : public StateFlowBase
+{
+public:
+  /// Constructor.
+  ///
+  /// @param service is the @ref Service to attach this flow to.
+  UtilizationStreamFlow(Service *service) : StateFlowBase(service)
+  {
+    start_flow(STATE(report));
+  }
+
+  /// Adds a websocket to receive track utilization updates.
+  ///
+  /// @param socket is the @ref WebSocketFlow to send updates to.
+  void subscribe(WebSocketFlow *socket)
+  {
+    if (std::find(subscribers_.begin(), subscribers_.end(), socket) ==
+        subscribers_.end())
+    {
+      subscribers_.push_back(socket);
+    }
+  }
+
+  /// Removes a websocket from receiving track utilization updates.
+  ///
+  /// @param socket is the @ref WebSocketFlow to stop sending updates to.
+  void unsubscribe(WebSocketFlow *socket)
+  {
+    subscribers_.erase(
+      std::remove(subscribers_.begin(), subscribers_.end(), socket),
+      subscribers_.end());
+  }
+
+private:
+  /// @ref StateFlowTimer used for periodic wakeup.
+  StateFlowTimer timer_{this};
+
+  /// Websockets that will receive track utilization updates.
+  std::vector<WebSocketFlow *> subscribers_;
+
+  /// Sends the track utilization to all subscribed websockets.
+  Action report()
+  {
+    if (!subscribers_.empty())
+    {
+      string update =
+        StringPrintf(R"!^!({"res":"utilization","data":%s})!^!",
+                     Singleton<TrackUtilization>::instance()->to_json().c_str());
+      for (auto socket : subscribers_)
+      {
+        socket->send_text(update);
+      }
+    }
+    return sleep_and_call(&timer_, SEC_TO_NSEC(1), STATE(report));
+  }
+};
+
 uninitialized<CDIClient> cdi_client;
 uninitialized<CDIDownloadHandler> cdi_downloader;
+uninitialized<UtilizationStreamFlow> utilization_stream;
+static Service *web_service;
+/// Websockets that have requested a CV read, keyed by an id that is unique to
+/// each websocket connection. Progress updates carry the id rather than the
+/// websocket so that updates for websockets that have disconnected are
+/// discarded.
+///
+/// NOTE: This must only be accessed from the @ref Httpd thread.
+static std::map<uint32_t, WebSocketFlow *> cv_read_sockets;
+
+/// Id to assign to the next websocket that requests a CV read.
+///
+/// NOTE: This must only be accessed from the @ref Httpd thread.
+static uint32_t next_cv_read_socket_id = 0;
+
+/// Highest CV number that can be read.
+static constexpr int MAX_CV_NUMBER = 1024;
 static NodeHandle cs_node_handle;
 static NvsManager *nvs;
 static Esp32TrainDatabase *traindb;
@@ -153,6 +239,8 @@ void init_webserver(Service *service, NvsManager *nvs_mgr, openlcb::Node *node,
   cs_node_handle = NodeHandle(nvs->node_id());
   cdi_client.emplace(service, node, mem_cfg);
   cdi_downloader.emplace(service, node, mem_cfg);
+  utilization_stream.emplace(service);
+  web_service = service;
   httpd->captive_portal(
       StringPrintf(CAPTIVE_PORTAL_HTML, esp_ota_get_app_description()->version));
   httpd->static_uri("/", indexHtmlGz, indexHtmlGz_size, MIME_TYPE_TEXT_HTML, HTTP_ENCODING_GZIP, false);
@@ -540,24 +628,276 @@ WEBSOCKET_STREAM_HANDLER_IMPL(process_ws, socket, event, data, len)
       LOG(VERBOSE, "[WS:%d] STATUS received", req_id->valueint);
       auto track = get_dcc_output(DccOutput::Type::TRACK);
       uint8_t track_status = track->get_disable_output_reasons();
+      string utilization =
+        Singleton<TrackUtilization>::instance()->to_json();
+      string signal = esp32cs::signal_diagnostics_json();
       if (track_status & (uint8_t)DccOutput::DisableReason::SHORTED ||
           track_status & (uint8_t)DccOutput::DisableReason::THERMAL)
       {
         response =
-            StringPrintf(R"!^!({"res":"status","id":%d,"track":"Fault"})!^!",
-                         req_id->valueint);
+            StringPrintf(R"!^!({"res":"status","id":%d,"track":"Fault","dcc":%s,"signal":%s})!^!",
+                         req_id->valueint, utilization.c_str(),
+                         signal.c_str());
       }
       else if (track_status != 0)
       {
         response =
-            StringPrintf(R"!^!({"res":"status","id":%d,"track":"Off"})!^!",
+            StringPrintf(R"!^!({"res":"status","id":%d,"track":"Off","dcc":%s,"signal":%s})!^!",
+                         req_id->valueint, utilization.c_str(),
+                         signal.c_str());
+      }
+      else
+      {
+        response =
+            StringPrintf(R"!^!({"res":"status","id":%d,"track":"On","usage":%d,"dcc":%s,"signal":%s})!^!",
+                         req_id->valueint, esp32cs::get_ops_load(),
+                         utilization.c_str(), signal.c_str());
+      }
+    }
+    else if (!strcmp(req_type->valuestring, "utilization"))
+    {
+      cJSON *sub = cJSON_GetObjectItem(root, "sub");
+      LOG(VERBOSE, "[WS:%d] utilization received", req_id->valueint);
+      if (sub && cJSON_IsFalse(sub))
+      {
+        utilization_stream->unsubscribe(socket);
+      }
+      else
+      {
+        utilization_stream->subscribe(socket);
+      }
+      response =
+          StringPrintf(R"!^!({"res":"utilization","id":%d,"data":%s})!^!",
+                       req_id->valueint,
+                       Singleton<TrackUtilization>::instance()->to_json().c_str());
+    }
+    else if (!strcmp(req_type->valuestring, "current"))
+    {
+      cJSON *count = cJSON_GetObjectItem(root, "count");
+      LOG(VERBOSE, "[WS:%d] current received", req_id->valueint);
+      esp32cs::OpsCurrentStats stats;
+      if (esp32cs::get_ops_current_stats(&stats))
+      {
+        size_t max_samples = esp32cs::get_ops_capture_size();
+        if (count && cJSON_IsNumber(count) && count->valueint >= 0)
+        {
+          max_samples = std::min(max_samples, (size_t)count->valueint);
+        }
+        std::vector<uint16_t> samples(max_samples);
+        size_t captured =
+          esp32cs::get_ops_capture(samples.data(), nullptr, max_samples);
+        response =
+          StringPrintf(R"!^!({"res":"current","id":%d,"period":%u,"peak":%u,"avg":%u,"rms":%u,"samples":[)!^!",
+                       req_id->valueint, (unsigned)stats.period_usec,
+                       (unsigned)stats.peak_ma, (unsigned)stats.average_ma,
+                       (unsigned)stats.rms_ma);
+        for (size_t idx = 0; idx < captured; idx++)
+        {
+          if (idx)
+          {
+            response += ",";
+          }
+          response += std::to_string(samples[idx]);
+        }
+        response += "]}";
+      }
+      else
+      {
+        response =
+          StringPrintf(R"!^!({"res":"current","id":%d,"load":%u})!^!",
+                       req_id->valueint, (unsigned)esp32cs::get_ops_load());
+      }
+    }
+    else if (!strcmp(req_type->valuestring, "calibrate"))
+    {
+      cJSON *point = cJSON_GetObjectItem(root, "point");
+      cJSON *milliamps = cJSON_GetObjectItem(root, "ma");
+      LOG(VERBOSE, "[WS:%d] calibrate received", req_id->valueint);
+      bool valid = true;
+      esp_err_t res = ESP_OK;
+      if (point && cJSON_IsString(point) &&
+          !strcmp(point->valuestring, "reset"))
+      {
+        res = esp32cs::reset_ops_calibration();
+      }
+      else if (point && cJSON_IsString(point) &&
+               (!strcmp(point->valuestring, "low") ||
+                !strcmp(point->valuestring, "high")) &&
+               milliamps && cJSON_IsNumber(milliamps) &&
+               milliamps->valueint >= 0)
+      {
+        res = esp32cs::set_ops_calibration_point(
+          !strcmp(point->valuestring, "high"), milliamps->valueint);
+      }
+      else
+      {
+        valid = false;
+      }
+      if (valid && res != ESP_OK)
+      {
+        response =
+            StringPrintf(R"!^!({"res":"error","error":"Unable to store calibration: %s","id":%d})!^!",
+                         esp_err_to_name(res), req_id->valueint);
+      }
+      else if (valid)
+      {
+        response =
+            StringPrintf(R"!^!({"res":"calibrate","id":%d,"calibrated":%s,"load":%u,"short":%d,"warning":%d})!^!",
+                         req_id->valueint,
+                         esp32cs::is_ops_calibrated() ? "true" : "false",
+                         (unsigned)esp32cs::get_ops_load(),
+                         esp32cs::get_ops_short_threshold(),
+                         esp32cs::get_ops_warning_threshold());
+      }
+      else
+      {
+        response =
+            StringPrintf(R"!^!({"res":"error","error":"One (or more) required fields are missing.","id":%d})!^!",
+                         req_id->valueint);
+      }
+    }
+    else if (!strcmp(req_type->valuestring, "railcom"))
+    {
+      LOG(VERBOSE, "[WS:%d] railcom received", req_id->valueint);
+      string railcom = "{}";
+      if (Singleton<esp32cs::RailComDecoder>::exists())
+      {
+        railcom = Singleton<esp32cs::RailComDecoder>::instance()->to_json();
+      }
+      response =
+          StringPrintf(R"!^!({"res":"railcom","id":%d,"data":%s})!^!",
+                       req_id->valueint, railcom.c_str());
+    }
+    else if (!strcmp(req_type->valuestring, "cv-read"))
+    {
+      cJSON *cvs = cJSON_GetObjectItem(root, "cvs");
+      cJSON *start = cJSON_GetObjectItem(root, "start");
+      cJSON *end = cJSON_GetObjectItem(root, "end");
+      cJSON *guess = cJSON_GetObjectItem(root, "guess");
+      std::vector<uint16_t> cv_list;
+      std::map<uint16_t, uint8_t> guesses;
+      bool invalid_cv = false;
+      bool invalid_guess = false;
+      LOG(VERBOSE, "[WS:%d] cv-read received", req_id->valueint);
+      if (cJSON_IsArray(cvs))
+      {
+        cJSON *cv;
+        cJSON_ArrayForEach(cv, cvs)
+        {
+          if (!cJSON_IsNumber(cv) || cv->valueint < 1 ||
+              cv->valueint > MAX_CV_NUMBER)
+          {
+            invalid_cv = true;
+            break;
+          }
+          cv_list.push_back(cv->valueint);
+        }
+      }
+      else if (cJSON_IsNumber(start) && cJSON_IsNumber(end) &&
+               start->valueint > 0 && end->valueint >= start->valueint &&
+               end->valueint <= MAX_CV_NUMBER)
+      {
+        for (int cv = start->valueint; cv <= end->valueint; cv++)
+        {
+          cv_list.push_back(cv);
+        }
+      }
+      if (cJSON_IsObject(guess))
+      {
+        cJSON *value;
+        cJSON_ArrayForEach(value, guess)
+        {
+          char *cv_end = nullptr;
+          long cv = strtol(value->string, &cv_end, 10);
+          if (cv_end == value->string || *cv_end != '\0' || cv < 1 ||
+              cv > MAX_CV_NUMBER || !cJSON_IsNumber(value) ||
+              value->valueint < 0 || value->valueint > UINT8_MAX)
+          {
+            invalid_guess = true;
+            break;
+          }
+          guesses[cv] = value->valueint;
+        }
+      }
+      if (!Singleton<esp32cs::BatchCvReader>::exists())
+      {
+        response =
+            StringPrintf(R"!^!({"res":"error","error":"PROG track is not available.","id":%d})!^!",
+                         req_id->valueint);
+      }
+      else if (invalid_cv)
+      {
+        LOG_ERROR("[WS:%d] Invalid CV number: %s", req_id->valueint,
+                  req.c_str());
+        response =
+            StringPrintf(R"!^!({"res":"error","error":"CV numbers must be between 1 and %d.","id":%d})!^!",
+                         MAX_CV_NUMBER, req_id->valueint);
+      }
+      else if (invalid_guess)
+      {
+        LOG_ERROR("[WS:%d] Invalid CV guess: %s", req_id->valueint,
+                  req.c_str());
+        response =
+            StringPrintf(R"!^!({"res":"error","error":"CV guesses must map a CV number between 1 and %d to a value between 0 and 255.","id":%d})!^!",
+                         MAX_CV_NUMBER, req_id->valueint);
+      }
+      else if (cv_list.empty())
+      {
+        LOG_ERROR("[WS:%d] One or more required parameters are missing: %s",
+                  req_id->valueint, req.c_str());
+        response =
+            StringPrintf(R"!^!({"res":"error","error":"One (or more) required fields are missing.","id":%d})!^!",
                          req_id->valueint);
       }
       else
       {
+        auto entry = std::find_if(cv_read_sockets.begin(),
+                                  cv_read_sockets.end(),
+          [socket](const std::pair<const uint32_t, WebSocketFlow *> &reader)
+          {
+            return reader.second == socket;
+          });
+        uint32_t socket_id;
+        if (entry == cv_read_sockets.end())
+        {
+          socket_id = next_cv_read_socket_id++;
+          cv_read_sockets[socket_id] = socket;
+        }
+        else
+        {
+          socket_id = entry->first;
+        }
+        int id = req_id->valueint;
+        size_t total = cv_list.size();
+        auto reader = Singleton<esp32cs::BatchCvReader>::instance();
+        BufferPtr<esp32cs::BatchCvReadRequest> b(reader->alloc());
+        b->data()->reset(std::move(cv_list), std::move(guesses),
+          [socket_id, id](esp32cs::BatchCvReadRequest *request, size_t index)
+          {
+            string update =
+              StringPrintf(R"!^!({"res":"cv-read","id":%d,"cv":%d,"value":%d,"done":%u,"total":%u,"ops":%u})!^!",
+                           id, request->cvs[index], request->values[index],
+                           (unsigned)(index + 1),
+                           (unsigned)request->cvs.size(),
+                           (unsigned)request->operations);
+            // the reader executes on the DCC service, look up the socket on
+            // the Httpd thread so the update is only sent if the socket is
+            // still connected.
+            web_service->executor()->add(new CallbackExecutable(
+              [socket_id, update]()
+              {
+                auto cv_socket = cv_read_sockets.find(socket_id);
+                if (cv_socket != cv_read_sockets.end())
+                {
+                  cv_socket->second->send_text(update);
+                }
+              }));
+          });
+        b->data()->done.reset(EmptyNotifiable::DefaultInstance());
+        reader->send(b->ref());
         response =
-            StringPrintf(R"!^!({"res":"status","id":%d,"track":"On","usage":%d})!^!",
-                         req_id->valueint, esp32cs::get_ops_load());
+            StringPrintf(R"!^!({"res":"cv-read","id":%d,"status":"queued","total":%u})!^!",
+                         id, (unsigned)total);
       }
     }
     else if (!strcmp(req_type->valuestring, "statusled"))
@@ -576,6 +916,21 @@ WEBSOCKET_STREAM_HANDLER_IMPL(process_ws, socket, event, data, len)
     LOG(VERBOSE, "[Web] WS: %s -> %s", req.c_str(), response.c_str());
     socket->send_text(response);
   }
+  else if (event == WebSocketEvent::WS_EVENT_DISCONNECT)
+  {
+    utilization_stream->unsubscribe(socket);
+    for (auto entry = cv_read_sockets.begin(); entry != cv_read_sockets.end();)
+    {
+      if (entry->second == socket)
+      {
+        entry = cv_read_sockets.erase(entry);
+      }
+      else
+      {
+        ++entry;
+      }
+    }
+  }
 }
 
 esp_ota_handle_t otaHandle;
@@ -762,7 +1117,24 @@ string convert_loco_to_json(openlcb::TrainImpl *t)
     res += StringPrintf(R"!^!({"id":%d,"state":%d})!^!", funcID,
                         t->get_fn(funcID));
   }
-  res += "]}";
+  res += "]";
+  commandstation::RailComDecoderState railcom;
+  DccMode mode =
+    t->legacy_address_type() == dcc::TrainAddressType::DCC_LONG_ADDRESS ?
+      DCC_DEFAULT_LONG_ADDRESS : DCC_DEFAULT;
+  if (Singleton<AllTrainNodes>::instance()->get_railcom_state(
+        mode, t->legacy_address(), &railcom))
+  {
+    uint32_t now = esp_timer_get_time() / 1000ULL;
+    res += StringPrintf(R"!^!(,"railcom":{"age":%u)!^!",
+                        (unsigned)(now - railcom.last_seen_msec));
+    if (railcom.speed_kmh != commandstation::RailComDecoderState::UNKNOWN_VALUE)
+    {
+      res += StringPrintf(R"!^!(,"kmh":%d)!^!", railcom.speed_kmh);
+    }
+    res += "}";
+  }
+  res += "}";
   return res;
 }
 
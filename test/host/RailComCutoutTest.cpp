@@ -0,0 +1,404 @@
+/**********************************************************************
+ESP32 COMMAND STATION
+
+COPYRIGHT (c) 2021 Mike Dunston
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see http://www.gnu.org/licenses
+**********************************************************************/
+
+#include "RailComCutout.hxx"
+
+#include <algorithm>
+#include <gtest/gtest.h>
+#include <random>
+#include <string>
+#include <vector>
+
+using esp32cs::RailComCutout;
+using esp32cs::RailComTimingLimits;
+
+/// Mirrors the cut-out timing of the RailComHwDefs in hardware.hxx.
+struct TestRailComHwDefs
+{
+  static constexpr uint32_t RAILCOM_START_PHASE1_DELAY_USEC = 1;
+  static constexpr uint32_t RAILCOM_START_PHASE2_DELAY_USEC = 1;
+  static constexpr uint32_t RAILCOM_STOP_DELAY_USEC = 1;
+  static constexpr uint32_t RAILCOM_MAX_READ_DELAY_CH_1 =
+    177 - RAILCOM_START_PHASE1_DELAY_USEC - RAILCOM_START_PHASE2_DELAY_USEC;
+  static constexpr uint32_t RAILCOM_MAX_READ_DELAY_CH_2 =
+    454 - RAILCOM_START_PHASE1_DELAY_USEC - RAILCOM_START_PHASE2_DELAY_USEC -
+    RAILCOM_MAX_READ_DELAY_CH_1;
+};
+
+// Definitions for the constants that are passed by reference to the gtest
+// macros, these are required with C++14.
+constexpr uint32_t esp32cs::RailComTimingLimits::CH1_END_USEC;
+constexpr uint32_t esp32cs::RailComTimingLimits::CH2_END_USEC;
+constexpr uint32_t esp32cs::RailComTimingLimits::CUTOUT_END_USEC;
+constexpr uint32_t TestRailComHwDefs::RAILCOM_START_PHASE1_DELAY_USEC;
+constexpr uint32_t TestRailComHwDefs::RAILCOM_STOP_DELAY_USEC;
+
+static_assert(RailComTimingLimits::valid<TestRailComHwDefs>(),
+              "hardware.hxx cut-out timing is outside of the limits");
+
+/// Cut-out timing which keeps the channel 2 window open for too long.
+struct LateRailComHwDefs : public TestRailComHwDefs
+{
+  static constexpr uint32_t RAILCOM_MAX_READ_DELAY_CH_2 =
+    TestRailComHwDefs::RAILCOM_MAX_READ_DELAY_CH_2 + 1;
+};
+
+static_assert(!RailComTimingLimits::valid<LateRailComHwDefs>(),
+              "late channel 2 window end was not rejected");
+
+/// Fake @ref RailComCutout HAL with a simulated microsecond clock. Each
+/// expiry of the simulated timer is delayed by a latency to replay the
+/// interrupt latency seen on the hardware.
+class FakeHal
+{
+public:
+  typedef RailComCutout<FakeHal> Cutout;
+
+  /// Constructor.
+  ///
+  /// @param start_delay is the delay returned by @ref cutout_start_phase1.
+  /// @param detector_delay is the delay returned by
+  /// @ref cutout_start_phase2.
+  /// @param stop_delay is the delay returned by @ref cutout_stop_phase1.
+  FakeHal(uint32_t start_delay = TestRailComHwDefs::RAILCOM_START_PHASE1_DELAY_USEC,
+          uint32_t detector_delay = TestRailComHwDefs::RAILCOM_START_PHASE2_DELAY_USEC,
+          uint32_t stop_delay = TestRailComHwDefs::RAILCOM_STOP_DELAY_USEC)
+    : startDelay_(start_delay), detectorDelay_(detector_delay),
+      stopDelay_(stop_delay)
+  {
+  }
+
+  uint32_t cutout_start_phase1()
+  {
+    calls_.push_back("start1");
+    return startDelay_;
+  }
+
+  uint32_t cutout_start_phase2()
+  {
+    calls_.push_back("start2");
+    return detectorDelay_;
+  }
+
+  uint32_t cutout_stop_phase1()
+  {
+    calls_.push_back("stop1");
+    return stopDelay_;
+  }
+
+  void cutout_stop_phase2()
+  {
+    calls_.push_back("stop2");
+  }
+
+  void receive_start()
+  {
+    calls_.push_back("rx-start");
+  }
+
+  void receive_middle()
+  {
+    calls_.push_back("rx-middle");
+  }
+
+  void receive_end()
+  {
+    calls_.push_back("rx-end");
+  }
+
+  void timer_start(uint32_t usec)
+  {
+    EXPECT_FALSE(timerActive_) << "timer restarted while active";
+    timerActive_ = true;
+    timerDeadline_ = now_ + usec;
+  }
+
+  uint32_t timestamp()
+  {
+    return now_;
+  }
+
+  /// Advances the simulated clock until the timer expires and calls
+  /// @ref RailComCutout::tick.
+  ///
+  /// @param latency is the number of microseconds between the timer expiry
+  /// and the call to tick.
+  /// @return false if the timer was not active.
+  bool expire_timer(uint32_t latency = 0)
+  {
+    if (!timerActive_)
+    {
+      return false;
+    }
+    timerActive_ = false;
+    now_ = timerDeadline_ + latency;
+    cutout_.tick();
+    return true;
+  }
+
+  /// Advances the simulated clock.
+  ///
+  /// @param usec is the number of microseconds to advance.
+  void advance(uint32_t usec)
+  {
+    now_ += usec;
+  }
+
+  Cutout &cutout()
+  {
+    return cutout_;
+  }
+
+  std::vector<std::string> &calls()
+  {
+    return calls_;
+  }
+
+private:
+  const uint32_t startDelay_;
+  const uint32_t detectorDelay_;
+  const uint32_t stopDelay_;
+  uint32_t now_{1000};
+  bool timerActive_{false};
+  uint32_t timerDeadline_{0};
+  std::vector<std::string> calls_;
+  Cutout cutout_{this, TestRailComHwDefs::RAILCOM_MAX_READ_DELAY_CH_1,
+                 TestRailComHwDefs::RAILCOM_MAX_READ_DELAY_CH_2};
+};
+
+typedef FakeHal::Cutout Cutout;
+
+/// Runs a complete cut-out using the provided timer latencies.
+///
+/// @param hal is the @ref FakeHal to run the cut-out on.
+/// @param latency is the timer latency for each timer expiry, the last entry
+/// is reused when there are more timer expiries than entries.
+/// @return number of timer expiries.
+static size_t run_cutout(FakeHal &hal, const std::vector<uint32_t> &latency)
+{
+  EXPECT_TRUE(hal.cutout().start());
+  size_t expiries = 0;
+  while (hal.expire_timer(
+    latency.empty() ? 0 : latency[std::min(expiries, latency.size() - 1)]))
+  {
+    expiries++;
+  }
+  EXPECT_EQ(Cutout::Phase::PRE_CUTOUT, hal.cutout().phase());
+  return expiries;
+}
+
+TEST(RailComCutoutTest, phase_sequence)
+{
+  FakeHal hal;
+  EXPECT_EQ(Cutout::Phase::PRE_CUTOUT, hal.cutout().phase());
+  EXPECT_TRUE(hal.cutout().start());
+  EXPECT_EQ(Cutout::Phase::CUTOUT_START, hal.cutout().phase());
+  EXPECT_TRUE(hal.expire_timer());
+  EXPECT_EQ(Cutout::Phase::CUTOUT_PHASE1, hal.cutout().phase());
+  EXPECT_TRUE(hal.expire_timer());
+  EXPECT_EQ(Cutout::Phase::CUTOUT_PHASE2, hal.cutout().phase());
+  EXPECT_TRUE(hal.expire_timer());
+  EXPECT_EQ(Cutout::Phase::CUTOUT_STOP, hal.cutout().phase());
+  EXPECT_TRUE(hal.expire_timer());
+  EXPECT_EQ(Cutout::Phase::PRE_CUTOUT, hal.cutout().phase());
+  EXPECT_FALSE(hal.expire_timer());
+
+  std::vector<std::string> expected =
+  {
+    "start1", "rx-start", "start2", "rx-middle", "rx-end", "stop1", "stop2"
+  };
+  EXPECT_EQ(expected, hal.calls());
+}
+
+TEST(RailComCutoutTest, nominal_timing_within_limits)
+{
+  FakeHal hal;
+  EXPECT_EQ(4u, run_cutout(hal, {}));
+
+  auto &cutout = hal.cutout();
+  EXPECT_EQ(TestRailComHwDefs::RAILCOM_START_PHASE1_DELAY_USEC,
+            cutout.timing(Cutout::CH1_START).last);
+  EXPECT_EQ(RailComTimingLimits::CH1_END_USEC,
+            cutout.timing(Cutout::CH1_END).last);
+  EXPECT_EQ(RailComTimingLimits::CH2_END_USEC,
+            cutout.timing(Cutout::CH2_END).last);
+  EXPECT_EQ(RailComTimingLimits::CH2_END_USEC +
+            TestRailComHwDefs::RAILCOM_STOP_DELAY_USEC,
+            cutout.timing(Cutout::CUTOUT_END).last);
+  EXPECT_LE(cutout.timing(Cutout::CUTOUT_END).last,
+            RailComTimingLimits::CUTOUT_END_USEC);
+  for (uint8_t idx = 0; idx < Cutout::BOUNDARY_COUNT; idx++)
+  {
+    auto &timing = cutout.timing((Cutout::Boundary)idx);
+    EXPECT_EQ(1u, timing.count);
+    EXPECT_EQ(timing.last, timing.min);
+    EXPECT_EQ(timing.last, timing.max);
+    EXPECT_EQ(timing.last, timing.total);
+  }
+}
+
+TEST(RailComCutoutTest, zero_delay_runs_inline)
+{
+  FakeHal hal(0, 0, 0);
+  EXPECT_TRUE(hal.cutout().start());
+  // with no HAL delays the only timer is for the channel 1 window.
+  EXPECT_EQ(Cutout::Phase::CUTOUT_PHASE1, hal.cutout().phase());
+  EXPECT_EQ(0u, hal.cutout().timing(Cutout::CH1_START).last);
+  EXPECT_TRUE(hal.expire_timer());
+  EXPECT_TRUE(hal.expire_timer());
+  // the stop phase has no delay so the cut-out ends with the channel 2
+  // window.
+  EXPECT_EQ(Cutout::Phase::PRE_CUTOUT, hal.cutout().phase());
+  EXPECT_EQ(hal.cutout().timing(Cutout::CH2_END).last,
+            hal.cutout().timing(Cutout::CUTOUT_END).last);
+  EXPECT_FALSE(hal.expire_timer());
+}
+
+TEST(RailComCutoutTest, overlapping_start_is_skipped)
+{
+  FakeHal hal;
+  EXPECT_TRUE(hal.cutout().start());
+  EXPECT_TRUE(hal.expire_timer());
+  EXPECT_FALSE(hal.cutout().start());
+  EXPECT_FALSE(hal.cutout().start());
+  EXPECT_EQ(2u, hal.cutout().skipped());
+  EXPECT_EQ(Cutout::Phase::CUTOUT_PHASE1, hal.cutout().phase());
+  while (hal.expire_timer())
+  {
+  }
+  EXPECT_EQ(2u, hal.cutout().skipped());
+  EXPECT_EQ(1u, hal.cutout().timing(Cutout::CUTOUT_END).count);
+  EXPECT_EQ(4u, run_cutout(hal, {}));
+  EXPECT_EQ(2u, hal.cutout().skipped());
+}
+
+TEST(RailComCutoutTest, replay_latency)
+{
+  // Timer latencies (usec) for the start, channel 1, channel 2 and stop
+  // timer expiries of consecutive cut-outs.
+  static const std::vector<std::vector<uint32_t>> REPLAY =
+  {
+    {0, 0, 0, 0},
+    {2, 1, 3, 0},
+    {5, 0, 0, 7},
+    {1, 4, 2, 1},
+    {0, 9, 0, 0},
+  };
+  FakeHal hal;
+  uint32_t expected_max[Cutout::BOUNDARY_COUNT] = {0};
+  uint32_t expected_min[Cutout::BOUNDARY_COUNT] =
+  {
+    UINT32_MAX, UINT32_MAX, UINT32_MAX, UINT32_MAX
+  };
+  uint64_t expected_total[Cutout::BOUNDARY_COUNT] = {0};
+  for (auto &latency : REPLAY)
+  {
+    EXPECT_EQ(4u, run_cutout(hal, latency));
+    // each boundary is delayed by the latency of every timer expiry before
+    // it, the delays are relative to the expiry so the latency accumulates.
+    uint32_t expected[Cutout::BOUNDARY_COUNT];
+    expected[Cutout::CH1_START] = 1 + latency[0];
+    expected[Cutout::CH1_END] = expected[Cutout::CH1_START] + 1 +
+      TestRailComHwDefs::RAILCOM_MAX_READ_DELAY_CH_1 + latency[1];
+    expected[Cutout::CH2_END] = expected[Cutout::CH1_END] +
+      TestRailComHwDefs::RAILCOM_MAX_READ_DELAY_CH_2 + latency[2];
+    expected[Cutout::CUTOUT_END] = expected[Cutout::CH2_END] + 1 +
+      latency[3];
+    for (uint8_t idx = 0; idx < Cutout::BOUNDARY_COUNT; idx++)
+    {
+      auto &timing = hal.cutout().timing((Cutout::Boundary)idx);
+      EXPECT_EQ(expected[idx], timing.last) << "boundary " << (int)idx;
+      expected_min[idx] = std::min(expected_min[idx], expected[idx]);
+      expected_max[idx] = std::max(expected_max[idx], expected[idx]);
+      expected_total[idx] += expected[idx];
+    }
+    hal.advance(5000);
+  }
+  for (uint8_t idx = 0; idx < Cutout::BOUNDARY_COUNT; idx++)
+  {
+    auto &timing = hal.cutout().timing((Cutout::Boundary)idx);
+    EXPECT_EQ(REPLAY.size(), timing.count);
+    EXPECT_EQ(expected_min[idx], timing.min);
+    EXPECT_EQ(expected_max[idx], timing.max);
+    EXPECT_EQ(expected_total[idx], timing.total);
+  }
+
+  hal.cutout().reset_timing();
+  for (uint8_t idx = 0; idx < Cutout::BOUNDARY_COUNT; idx++)
+  {
+    auto &timing = hal.cutout().timing((Cutout::Boundary)idx);
+    EXPECT_EQ(0u, timing.count);
+    EXPECT_EQ(0u, timing.max);
+    EXPECT_EQ(UINT32_MAX, timing.min);
+    EXPECT_EQ(0u, timing.total);
+  }
+}
+
+TEST(RailComCutoutTest, jitter_simulation)
+{
+  static constexpr uint32_t MAX_JITTER_USEC = 8;
+  static constexpr size_t CUTOUTS = 20000;
+  std::mt19937 rng(0x52434F4D);
+  std::uniform_int_distribution<uint32_t> jitter(0, MAX_JITTER_USEC);
+  FakeHal hal;
+  for (size_t count = 0; count < CUTOUTS; count++)
+  {
+    // occasionally request a new cut-out while the previous one is still
+    // active, as happens when the next packet completes early.
+    if (count % 1000 == 999)
+    {
+      EXPECT_TRUE(hal.cutout().start());
+      EXPECT_FALSE(hal.cutout().start());
+      while (hal.expire_timer(jitter(rng)))
+      {
+      }
+    }
+    else
+    {
+      run_cutout(hal, {jitter(rng), jitter(rng), jitter(rng), jitter(rng)});
+    }
+    // the simulated clock is 32-bit, let it wrap during the simulation.
+    hal.advance(jitter(rng) + 1000000);
+  }
+  auto &cutout = hal.cutout();
+  EXPECT_EQ(CUTOUTS / 1000, cutout.skipped());
+
+  // nominal boundary time and number of timer expiries before it.
+  const uint32_t nominal[Cutout::BOUNDARY_COUNT] =
+  {
+    TestRailComHwDefs::RAILCOM_START_PHASE1_DELAY_USEC,
+    RailComTimingLimits::CH1_END_USEC, RailComTimingLimits::CH2_END_USEC,
+    RailComTimingLimits::CH2_END_USEC +
+      TestRailComHwDefs::RAILCOM_STOP_DELAY_USEC
+  };
+  for (uint8_t idx = 0; idx < Cutout::BOUNDARY_COUNT; idx++)
+  {
+    auto &timing = cutout.timing((Cutout::Boundary)idx);
+    const uint32_t expiries = idx + 1;
+    EXPECT_EQ(CUTOUTS, timing.count);
+    EXPECT_GE(timing.min, nominal[idx]) << "boundary " << (int)idx;
+    EXPECT_LE(timing.max, nominal[idx] + expiries * MAX_JITTER_USEC)
+      << "boundary " << (int)idx;
+    uint64_t avg = timing.total / timing.count;
+    EXPECT_GE(avg, timing.min);
+    EXPECT_LE(avg, timing.max);
+  }
+  // the accumulated jitter must not push the end of the cut-out past the
+  // S-9.3.2 limit.
+  EXPECT_LE(cutout.timing(Cutout::CUTOUT_END).max,
+            RailComTimingLimits::CUTOUT_END_USEC);
+}
\ No newline at end of file
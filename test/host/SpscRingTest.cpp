@@ -0,0 +1,182 @@
+/**********************************************************************
+ESP32 COMMAND STATION
+
+COPYRIGHT (c) 2021 Mike Dunston
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see http://www.gnu.org/licenses
+**********************************************************************/
+
+#include "SpscRing.hxx"
+
+#include <gtest/gtest.h>
+#include <thread>
+
+using esp32cs::SpscRing;
+
+/// Ring entry with a payload derived from the sequence number so that torn
+/// or stale reads can be detected by the consumer.
+struct Entry
+{
+  uint32_t sequence;
+  uint32_t payload[7];
+};
+
+/// Fills an @ref Entry for a sequence number.
+///
+/// @param entry is the @ref Entry to fill.
+/// @param sequence is the sequence number to store.
+static void fill(Entry *entry, uint32_t sequence)
+{
+  entry->sequence = sequence;
+  for (size_t idx = 0; idx < sizeof(entry->payload) / sizeof(uint32_t); idx++)
+  {
+    entry->payload[idx] = sequence * 2654435761u + idx;
+  }
+}
+
+/// @return true if the payload of the @ref Entry matches its sequence number.
+///
+/// @param entry is the @ref Entry to check.
+static bool valid(const Entry *entry)
+{
+  for (size_t idx = 0; idx < sizeof(entry->payload) / sizeof(uint32_t); idx++)
+  {
+    if (entry->payload[idx] != entry->sequence * 2654435761u + idx)
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+TEST(SpscRingTest, empty_and_full)
+{
+  SpscRing<uint32_t, 4> ring;
+  EXPECT_TRUE(ring.empty());
+  EXPECT_FALSE(ring.full());
+  EXPECT_EQ(nullptr, ring.front());
+  EXPECT_EQ(nullptr, ring.peek(0));
+
+  for (uint32_t idx = 0; idx < 4; idx++)
+  {
+    uint32_t *slot = ring.reserve();
+    ASSERT_NE(nullptr, slot);
+    *slot = idx;
+    // a reserved slot is not visible until it has been committed.
+    EXPECT_EQ(nullptr, ring.peek(idx));
+    ring.commit();
+  }
+  EXPECT_TRUE(ring.full());
+  EXPECT_FALSE(ring.empty());
+  EXPECT_EQ(nullptr, ring.reserve());
+
+  for (uint32_t idx = 0; idx < 4; idx++)
+  {
+    ASSERT_NE(nullptr, ring.peek(idx));
+    EXPECT_EQ(idx, *ring.peek(idx));
+  }
+  EXPECT_EQ(nullptr, ring.peek(4));
+
+  for (uint32_t idx = 0; idx < 4; idx++)
+  {
+    ASSERT_NE(nullptr, ring.front());
+    EXPECT_EQ(idx, *ring.front());
+    ring.pop();
+    EXPECT_FALSE(ring.full());
+  }
+  EXPECT_TRUE(ring.empty());
+  EXPECT_EQ(nullptr, ring.front());
+}
+
+TEST(SpscRingTest, wrap_around)
+{
+  SpscRing<uint32_t, 3> ring;
+  uint32_t produced = 0;
+  uint32_t consumed = 0;
+  // keep the ring partially filled so that the indexes wrap with entries in
+  // the ring, peek must follow the wrap.
+  for (uint32_t round = 0; round < 100; round++)
+  {
+    while (uint32_t *slot = ring.reserve())
+    {
+      *slot = produced++;
+      ring.commit();
+    }
+    EXPECT_TRUE(ring.full());
+    for (uint32_t offset = 0; offset < 3; offset++)
+    {
+      ASSERT_NE(nullptr, ring.peek(offset));
+      EXPECT_EQ(consumed + offset, *ring.peek(offset));
+    }
+    for (uint32_t count = 0; count < (round % 3) + 1; count++)
+    {
+      ASSERT_NE(nullptr, ring.front());
+      EXPECT_EQ(consumed++, *ring.front());
+      ring.pop();
+    }
+  }
+}
+
+TEST(SpscRingTest, producer_consumer_stress)
+{
+  static constexpr uint32_t ENTRY_COUNT = 2000000;
+  SpscRing<Entry, 8> ring;
+  uint32_t full_count = 0;
+
+  std::thread producer([&]()
+  {
+    for (uint32_t sequence = 0; sequence < ENTRY_COUNT; sequence++)
+    {
+      Entry *slot;
+      while ((slot = ring.reserve()) == nullptr)
+      {
+        full_count++;
+        std::this_thread::yield();
+      }
+      fill(slot, sequence);
+      ring.commit();
+    }
+  });
+
+  uint32_t expected = 0;
+  uint32_t errors = 0;
+  while (expected < ENTRY_COUNT)
+  {
+    Entry *entry = ring.front();
+    if (entry == nullptr)
+    {
+      std::this_thread::yield();
+      continue;
+    }
+    // the consumer may look ahead at any published slot, as the DCC packet
+    // queue does when merging packets.
+    for (uint32_t offset = 1; Entry *next = ring.peek(offset); offset++)
+    {
+      if (next->sequence != expected + offset || !valid(next))
+      {
+        errors++;
+      }
+    }
+    if (entry->sequence != expected || !valid(entry))
+    {
+      errors++;
+    }
+    expected++;
+    ring.pop();
+  }
+  producer.join();
+
+  EXPECT_EQ(0u, errors);
+  EXPECT_EQ(ENTRY_COUNT, expected);
+  EXPECT_TRUE(ring.empty());
+  RecordProperty("full_count", full_count);
+}
\ No newline at end of file